@@ -47,6 +47,22 @@
 #define MUTEX pthread_mutex_t
 #endif
 
+/*
+ * Statically initialized mutex for lazy initialization of shared state, which
+ * can not depend on a prior call to mutex_init()
+ */
+#ifdef _WIN32
+#define STATIC_MUTEX SRWLOCK
+#define STATIC_MUTEX_INITIALIZER SRWLOCK_INIT
+#define static_mutex_lock(m) AcquireSRWLockExclusive(m)
+#define static_mutex_unlock(m) ReleaseSRWLockExclusive(m)
+#else
+#define STATIC_MUTEX pthread_mutex_t
+#define STATIC_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define static_mutex_lock(m) pthread_mutex_lock(m)
+#define static_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+
 int mutex_init(MUTEX *mutex);
 int mutex_lock(MUTEX *mutex);
 int mutex_unlock(MUTEX *mutex);
@@ -49,6 +49,10 @@
 /**
  * Process a APDU using the CCID APDU transfer mode
  *
+ * With extended APDU level exchange, command and response are transferred in blocks of up to
+ * dwMaxCCIDMessageLength, so that a large APDU only takes a few USB round trips. With short APDU level
+ * exchange the command must fit into a single block.
+ *
  * @param ctx Reader context
  * @param lc Length of command APDU
  * @param cmd Command APDU
@@ -63,21 +67,37 @@ static int ccidAPDUProcess (struct scr *ctx,
 				   unsigned char *rsp)
 {
 	int rc,r,maxlr;
-	unsigned int len;
-	unsigned char buf[BUFFMAX],*po,status,error,chain;
+	unsigned int len, blen;
+	unsigned char *buf,*po,status,error,chain;
 	unsigned short level = 0;
 
+	blen = BUFFMAX;
+	if (RDR_ExchangeLevel(ctx) == FEATURE_EXTENDED_APDU) {
+		blen = RDR_MaxDataLength(ctx);
+	} else if (lc > BUFFMAX) {
+#ifdef DEBUG
+		ctccid_debug("Extended APDU not supported by reader with short APDU level exchange\n");
+#endif
+		return -1;
+	}
+
+	buf = malloc(blen);
+	if (buf == NULL) {
+		return -1;
+	}
+
+	r = -1;
 	maxlr = *lr;
 	*lr = 0;
 	po = cmd;
 	while (lc > 0) {
 		len = lc;
-		if (lc > BUFFMAX) {
+		if (lc > blen) {
 			if (level)
 				level = 3;			// Intermediate extended command
 			else
 				level = 1;			// First extended command
-			len = BUFFMAX;
+			len = blen;
 		} else {
 			if (level)
 				level = 2;			// Final extended command
@@ -85,18 +105,16 @@ static int ccidAPDUProcess (struct scr *ctx,
 
 		rc = PC_to_RDR_XfrBlock(ctx, len, po, level);
 		if (rc < 0) {
-			memset_s(buf, sizeof(buf), 0, sizeof(buf));
-			return -1;
+			goto out;
 		}
 
 		lc -= len;
 		po += len;
 
-		len = BUFFMAX;
+		len = blen;
 		rc = RDR_to_PC_DataBlock(ctx, &len, buf, &status, &error, &chain);
 		if (rc < 0) {
-			memset_s(buf, sizeof(buf), 0, sizeof(buf));
-			return -1;
+			goto out;
 		}
 	}
 
@@ -115,21 +133,23 @@ static int ccidAPDUProcess (struct scr *ctx,
 		if ((chain == 1) || (chain == 3)) {
 			rc = PC_to_RDR_XfrBlock(ctx, 0, NULL, 0x10);
 			if (rc < 0) {
-				memset_s(buf, sizeof(buf), 0, sizeof(buf));
-				return -1;
+				r = -1;
+				goto out;
 			}
-			len = BUFFMAX;
+			len = blen;
 			rc = RDR_to_PC_DataBlock(ctx, &len, buf, &status, &error, &chain);
 			if (rc < 0) {
-				memset_s(buf, sizeof(buf), 0, sizeof(buf));
-				return -1;
+				r = -1;
+				goto out;
 			}
 			continue;
 		}
 		break;
 	}
 
-	memset_s(buf, sizeof(buf), 0, sizeof(buf));
+out:
+	memset_s(buf, blen, 0, blen);
+	free(buf);
 	return r;
 }
 
@@ -52,7 +52,7 @@
  */
 void ccidT1InitProtocol(scr_t *ctx)
 {
-	ctx->t1->BlockWaitTime = 200 + (1 << ctx->BWI) * 100 + 11000 / ctx->Baud;
+	ctx->t1->BlockWaitTime = RDR_BlockWaitTime(ctx);
 	ctx->t1->WorkBWT = ctx->t1->BlockWaitTime;
 	ctx->t1->IFSC = ctx->IFSC;
 	ctx->t1->SSequenz = 0;
@@ -322,7 +322,7 @@ int ccidT1AbortChain(scr_t *ctx, int SrcNode, int DestNode)
 
 
 /**
- * Select IFSD
+ * Select IFSD of 254 bytes, so that the card can send responses in as few blocks as possible
  *
  * @param ctx Reader context
  * @param SrcNode Source node
@@ -347,7 +347,10 @@ int ccidT1SetIFSD(scr_t *ctx, int SrcNode, int DestNode)
 
 	ret = ccidT1ReceiveBlock(ctx);
 
-	if (!ret && ISSBLOCK(ctx->t1->Pcb) && (SBLOCKFUNC(ctx->t1->Pcb) == IFSREQ)) {
+	if (!ret && ISSBLOCK(ctx->t1->Pcb) && (SBLOCKFUNC(ctx->t1->Pcb) == IFSRES)) {
+#ifdef DEBUG
+		ctccid_debug("IFSD set to %d bytes\n", (int)blk[0]);
+#endif
 		return 0;
 	}
 
@@ -374,6 +377,9 @@ int ccidT1GetBlock(scr_t *ctx, int SrcNode, int DestNode)
 	while (TRUE) {
 		ret = ccidT1ReceiveBlock(ctx);
 
+		/* A time extension only applies to the block following the S(WTX response) */
+		ctx->WTX = 0;
+
 		if (ret < 0) {
 			if (!retry) {
 				return -1;
@@ -431,13 +437,17 @@ int ccidT1GetBlock(scr_t *ctx, int SrcNode, int DestNode)
 				break;
 
 			case WTXREQ :                   /* Request to extend timeout         */
+				/* The multiplier is passed to the reader with the response and */
+				/* extends the timeout for the next block on both sides         */
+				ctx->WTX = ctx->t1->InBuff[0];
+
 				ccidT1SendBlock(ctx,
 								CODENAD(SrcNode, DestNode),
 								CODESBLOCK(WTXRES),
 								ctx->t1->InBuff,
 								1);
 				ctx->t1->WorkBWT = ctx->t1->BlockWaitTime *
-								   (int)ctx->t1->InBuff[0];
+								   (ctx->WTX ? ctx->WTX : 1);
 
 #ifdef DEBUG
 				ctccid_debug("New BWT value %ld ms.\n",ctx->t1->WorkBWT);
@@ -735,11 +745,23 @@ int ccidT1Process (struct scr *ctx,
 int ccidT1Init (struct scr *ctx)
 {
 	int rc;
-	ctx->t1 = calloc(1, sizeof(ccidT1_t));
+
+	if (ctx->t1 == NULL) {
+		ctx->t1 = calloc(1, sizeof(ccidT1_t));
+
+		if (ctx->t1 == NULL) {
+			return -1;
+		}
+	}
 
 	ctx->CTModFunc = (CTModFunc_t) ccidT1Process;
 
 	ccidT1InitProtocol(ctx);
+
+	/*
+	 * Negotiate the largest IFSD right after power on. The card keeps sending blocks
+	 * of at most 32 bytes, if the request fails
+	 */
 	rc = ccidT1SetIFSD(ctx, 0, 0);
 
 	return rc;
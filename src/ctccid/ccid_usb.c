@@ -33,6 +33,7 @@
  */
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef DEBUG
@@ -46,6 +47,9 @@
 int FTable[]  = { 372, 372, 558, 744, 1116, 1488, 1860, -1, -1, 512, 768, 1024, 1536, 2048, -1, -1};
 int DTable[]  = { -1, 1, 2, 4, 8, 16, 32, -1, 12, 20, -1, -1, -1, -1, -1, -1};
 
+/* DI values ordered by decreasing D */
+static const unsigned char DOrder[] = { 6, 9, 5, 8, 4, 3, 2, 1 };
+
 #ifdef DEBUG
 
 /**
@@ -107,19 +111,27 @@ unsigned int RDR_Features(scr_t *ctx)
 
 
 
+/**
+ * Perform a PPS exchange with the FI and DI values in the reader context
+ *
+ * @param ctx Reader context
+ * @return 0 if the card confirmed the values, negative value otherwise
+ */
 int PerformPPS(scr_t *ctx)
 {
-        unsigned char msg[17];
+        unsigned char msg[17], pps[4];
         int rc;
         unsigned int len = 0;
 
+        pps[0] = 0xFF;
+        pps[1] = 0x11;
+        pps[2] = (ctx->FI << 4) | (ctx->DI & 0x0F);
+        pps[3] = pps[0] ^ pps[1] ^ pps[2];
+
         memset(msg, 0, 17);
         msg[0] = MSG_TYPE_PC_to_RDR_XfrBlock;
         msg[1] = 0x04;
-        msg[10] = 0xFF;
-        msg[11] = 0x11;
-        msg[12] = (ctx->FI << 4) | (ctx->DI & 0x0F);
-        msg[13] = msg[10] ^ msg[11] ^ msg[12];
+        memcpy(msg + 10, pps, 4);
 
 #ifdef DEBUG
         CCIDDump(msg, 14);
@@ -142,24 +154,151 @@ int PerformPPS(scr_t *ctx)
         CCIDDump(msg, len);
 #endif
 
+        /* A successful PPS is echoed by the card */
+        if ((len != 14) || (msg[0] != MSG_TYPE_RDR_to_PC_DataBlock) || (msg[7] & 0xC0) || memcmp(msg + 10, pps, 4)) {
+                return -1;
+        }
+
         return 0;
 }
 
 
 
 /**
- * Power on the ICC in the reader and set the ATR and the communication parameters as specified
+ * Return the data rate in bit/s for the given FI and DI at the default clock of the reader
+ *
+ * @param ctx Reader context
+ * @param FI Clock rate conversion integer
+ * @param DI Baud rate adjustment integer
+ * @return The data rate or -1 if FI or DI are invalid
+ */
+long RDR_DataRate(scr_t *ctx, unsigned char FI, unsigned char DI)
+{
+        unsigned char const *desc;
+        int length;
+        long clock = DEFAULT_CLOCK;
+
+        if ((FTable[FI & 0x0F] < 0) || (DTable[DI & 0x0F] < 0)) {
+                return -1;
+        }
+
+        USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+        if (length == 54) {
+                clock = (desc[10] | (desc[11] << 8) | (desc[12] << 16) | (desc[13] << 24)) * 1000L;
+        }
+
+        return clock * DTable[DI & 0x0F] / FTable[FI & 0x0F];
+}
+
+
+
+/**
+ * Check if the reader supports the data rate, either as one of the discrete data rates or within
+ * the range given by dwDataRate and dwMaxDataRate
+ *
+ * @param ctx Reader context
+ * @param rate Data rate in bit/s
+ * @param rates Discrete data rates reported by the reader
+ * @param cnt Number of discrete data rates
+ * @return Non-zero if supported
+ */
+static int RDR_SupportsDataRate(scr_t *ctx, long rate, unsigned int *rates, int cnt)
+{
+        unsigned char const *desc;
+        int length, i;
+        long maxrate;
+
+        USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+        if (length != 54) {
+                return rate <= 9600 + 9600 / 20;
+        }
+
+        maxrate = desc[23] | (desc[24] << 8) | (desc[25] << 16) | (desc[26] << 24);
+
+        if (rate > maxrate + maxrate / 20) {
+                return 0;
+        }
+
+        if (cnt <= 0) {
+                return 1;
+        }
+
+        for (i = 0; i < cnt; i++) {
+                if (MATCH(rate, (long)rates[i])) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+
+
+/**
+ * Determine the DI values supported by both card and reader for the FI from the ATR,
+ * ordered by decreasing data rate
+ *
+ * @param ctx Reader context
+ * @param cand Array receiving the DI values
+ * @param max Size of array
+ * @return Number of candidates
+ */
+static int SelectDataRates(scr_t *ctx, unsigned char *cand, int max)
+{
+        unsigned char const *desc;
+        unsigned int rates[MAX_DATA_RATES];
+        int length, cnt, i, j, di;
+        long rate;
+
+        cnt = 0;
+        USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+        if ((length == 54) && desc[27]) {
+                cnt = desc[27] < MAX_DATA_RATES ? desc[27] : MAX_DATA_RATES;
+                if (USB_GetDataRates(ctx->device, rates, &cnt) < 0) {
+                        cnt = 0;
+                }
+        }
+
+        if ((FTable[ctx->FI] < 0) || (DTable[ctx->DI] < 0)) {
+                return 0;
+        }
+
+        j = 0;
+        for (i = 0; (i < (int)sizeof(DOrder)) && (j < max); i++) {
+                di = DOrder[i];
+
+                if (DTable[di] > DTable[ctx->DI]) {
+                        continue;
+                }
+
+                rate = RDR_DataRate(ctx, ctx->FI, di);
+
+                if (RDR_SupportsDataRate(ctx, rate, rates, cnt)) {
+                        cand[j++] = di;
+                }
+        }
+        return j;
+}
+
+
+
+/**
+ * Power on the ICC and decode the ATR
  *
  * @param ctx Reader context
  * @return 0 on success, negative value otherwise
  */
-int PC_to_RDR_IccPowerOn(scr_t *ctx)
+static int IccPowerOn(scr_t *ctx)
 {
 
         int rc;
         unsigned char msg[10 + MAX_ATR];
         unsigned int atrlen, l = 10 + MAX_ATR;
 
+        ctx->SlotChanges = -1;
+
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOn;
 
@@ -191,26 +330,81 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
 
         atrlen = (msg[4] << 24) + (msg[3] << 16) + (msg[2] << 8) + msg[1];
 
+        if ((atrlen > MAX_ATR) || (atrlen > l - 10)) {
+                return -1;
+        }
+
         memset(ctx->ATR, 0, sizeof(ctx->ATR));
         memcpy(ctx->ATR, (msg + 10), atrlen);
         ctx->LenOfATR = atrlen;
 
-        rc = DecodeATRValues(ctx);
+        return DecodeATRValues(ctx);
+}
+
+
+
+/**
+ * Power on the ICC in the reader and set the ATR and the communication parameters as specified
+ *
+ * The fastest data rate supported by card and reader is selected. If the card rejects the PPS request,
+ * it is reset and the next slower data rate is tried, finally falling back to the default values.
+ *
+ * @param ctx Reader context
+ * @return 0 on success, negative value otherwise
+ */
+int PC_to_RDR_IccPowerOn(scr_t *ctx)
+{
+        unsigned char cand[8], FI;
+        int rc, cnt, i;
+
+        rc = IccPowerOn(ctx);
 
         if (rc < 0) {
                 return rc;
         }
 
-        int features = RDR_Features(ctx);
+        // In specific mode the card already uses the values from TA1
+        if (!ctx->SpecificMode) {
+                cnt = SelectDataRates(ctx, cand, sizeof(cand));
+                FI = ctx->FI;
 
-        if (!(features & FEATURE_AUTO_PPS)) {
-                rc = PerformPPS(ctx);
+                if (RDR_Features(ctx) & FEATURE_AUTO_PPS) {
+                        i = 0;
+                } else {
+                        for (i = 0; i < cnt; i++) {
+                                ctx->FI = FI;
+                                ctx->DI = cand[i];
 
-                if (rc < 0) {
-                        return rc;
+                                if (PerformPPS(ctx) == 0) {
+                                        break;
+                                }
+#ifdef DEBUG
+                                ctccid_debug("PPS with FI=%d, DI=%d failed\n", FI, cand[i]);
+#endif
+                                // The card must be reset after a failed PPS exchange
+                                rc = IccPowerOn(ctx);
+
+                                if (rc < 0) {
+                                        return rc;
+                                }
+                        }
+                }
+
+                if (i < cnt) {
+                        ctx->FI = FI;
+                        ctx->DI = cand[i];
+                } else {
+                        ctx->FI = 1;
+                        ctx->DI = 1;
                 }
         }
 
+        ctx->Baud = RDR_DataRate(ctx, ctx->FI, ctx->DI);
+
+#ifdef DEBUG
+        ctccid_debug("Using FI=%d, DI=%d with %ld bit/s\n", ctx->FI, ctx->DI, ctx->Baud);
+#endif
+
         rc = PC_to_RDR_SetParameters(ctx);
 
         if (rc < 0) {
@@ -271,6 +465,7 @@ int DecodeATRValues(scr_t *ctx)
 
         ctx->FI = 1;
         ctx->DI = 1;
+        ctx->SpecificMode = 0;
 
         ctx->IFSC = 32;              /* T=1: information field size TA(i)*/
         ctx->CWI = 13;               /* T=1: Char waiting time indx TB(i)*/
@@ -296,14 +491,14 @@ int DecodeATRValues(scr_t *ctx)
                 help = (temp >> 4);
 
                 if (help & 1) { /* Get TAx                          */
+                        temp = ctx->ATR[atrp++];
+
                         if (i == 1) { /* TA(1) present ?                */
-                                temp = ctx->ATR[atrp++];
                                 ctx->FI = temp >> 4;
                                 ctx->DI = temp & 0xF;
-                        }
-
-                        if ((i > 2) && (prot != 0x0F)) {
-                                temp = ctx->ATR[atrp++];
+                        } else if (i == 2) { /* TA(2) indicates specific mode */
+                                ctx->SpecificMode = 1;
+                        } else if (prot != 0x0F) {
                                 ctx->IFSC = temp;
                         }
                 }
@@ -339,24 +534,67 @@ int DecodeATRValues(scr_t *ctx)
                 ctx->HCC[i] = ctx->ATR[atrp++];
         }
 
-        ctx->Baud = DetermineBaudrate(FTable[ctx->FI], DTable[ctx->DI]);
+        ctx->Baud = RDR_DataRate(ctx, ctx->FI, ctx->DI);
+
+        if (ctx->Baud < 0) {
+                ctx->FI = 1;
+                ctx->DI = 1;
+                ctx->Baud = RDR_DataRate(ctx, ctx->FI, ctx->DI);
+        }
 
         return 0;
 }
 
 
 
+/**
+ * Determine the level of exchange supported by the reader from dwFeatures
+ *
+ * @param ctx Reader context
+ * @return One of \ref FEATURE_TPDU, \ref FEATURE_SHORT_APDU, \ref FEATURE_EXTENDED_APDU or 0 for character level
+ */
+int RDR_ExchangeLevel(scr_t *ctx)
+{
+	return RDR_Features(ctx) & FEATURE_EXCHANGE_MASK;
+}
+
+
+
+/**
+ * Return true if the reader supports short or extended APDU level exchange
+ *
+ * @param ctx Reader context
+ * @return Non-zero if the reader handles the transmission protocol
+ */
 int RDR_APDUTransferMode(scr_t *ctx)
+{
+	return RDR_ExchangeLevel(ctx) & (FEATURE_SHORT_APDU | FEATURE_EXTENDED_APDU);
+}
+
+
+
+/**
+ * Return the maximum length of the data field in a CCID message, as determined by
+ * dwMaxCCIDMessageLength in the CCID descriptor
+ *
+ * @param ctx Reader context
+ * @return The maximum data length, at least \ref BUFFMAX
+ */
+unsigned int RDR_MaxDataLength(scr_t *ctx)
 {
 	unsigned char const *desc;
-	int length, apdu_transfer = 0;
+	int length;
+	unsigned int max = 0;
 
 	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
 
 	if (length == 54)
-		apdu_transfer = desc[42] & 0x04;
+		max = (desc[44] | (desc[45] << 8) | (desc[46] << 16) | (desc[47] << 24)) - 10;
 
-	return apdu_transfer;
+	if ((max < BUFFMAX) || (max > XFRMAX))
+		max = max < BUFFMAX ? BUFFMAX : XFRMAX;
+
+	return max;
 }
 
 
@@ -416,6 +654,10 @@ int PC_to_RDR_SetParameters(scr_t *ctx)
 /**
  * Get the current state of the reader slot
  *
+ * If the reader sends RDR_to_PC_NotifySlotChange messages on the interrupt endpoint, then the
+ * state is only queried from the reader after a notification was received or the ICC was
+ * powered on or off
+ *
  * @param ctx Reader context
  * @return \ref ICC_PRESENT_AND_INACTIVE, \ref ICC_PRESENT_AND_ACTIVE, \ref NO_ICC_PRESENT or -1 on error
  */
@@ -425,7 +667,13 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
         unsigned char msg[10];
         unsigned char buf[10];
         unsigned int len = 10, slotstatus;
-        int rc;
+        int rc, changes;
+
+        changes = USB_GetSlotChanges(ctx->device);
+
+        if ((changes >= 0) && (changes == ctx->SlotChanges)) {
+                return ctx->SlotStatus;
+        }
 
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_GetSlotStatus;
@@ -455,9 +703,12 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
                 return -1;
         }
 
-        slotstatus = buf[7];
+        slotstatus = buf[7] & ICC_STATUS_MASK;
 
-        return (slotstatus & ICC_STATUS_MASK);
+        ctx->SlotStatus = slotstatus;
+        ctx->SlotChanges = changes;
+
+        return slotstatus;
 }
 
 
@@ -476,6 +727,8 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
         unsigned int len = 10;
         int rc;
 
+        ctx->SlotChanges = -1;
+
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOff;
 
@@ -509,6 +762,50 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
 
 
 
+/**
+ * Determine the block waiting time in milliseconds from BWI and the data rate
+ *
+ * @param ctx Reader context
+ * @return Block waiting time in milliseconds
+ */
+long RDR_BlockWaitTime(scr_t *ctx)
+{
+        long baud = ctx->Baud > 9600 ? ctx->Baud : 9600;
+
+        return 200 + (1L << ctx->BWI) * 100 + 11000 / baud;
+}
+
+
+
+/**
+ * Determine the timeout for the response from the reader. This is the block waiting time,
+ * multiplied by a requested time extension, plus the time required to transfer the response
+ * of up to len bytes with the current data rate
+ *
+ * @param ctx Reader context
+ * @param len Maximum length of response
+ * @param wtx Time extension multiplier or 0
+ * @return Timeout in milliseconds
+ */
+static int ResponseTimeout(scr_t *ctx, unsigned int len, unsigned char wtx)
+{
+        long baud = ctx->Baud > 9600 ? ctx->Baud : 9600;
+        long timeout;
+
+        timeout = RDR_BlockWaitTime(ctx) * (wtx ? wtx : 1) + (long)len * 12000 / baud + ctx->TimeoutMargin;
+
+        if (ctx->MaxTimeout && (timeout > (long)ctx->MaxTimeout)) {
+                timeout = ctx->MaxTimeout;
+        }
+
+#ifdef DEBUG
+        ctccid_debug("Response timeout %ld ms\n", timeout);
+#endif
+        return (int)timeout;
+}
+
+
+
 /**
  * Exchange data block between PC and reader
  *
@@ -522,13 +819,21 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 {
 
         int rc;
-        unsigned char msg[10 + BUFFMAX];
+        unsigned char smsg[10 + BUFFMAX], *msg;
 
+        msg = smsg;
         if (outlen > BUFFMAX) {
+                if (outlen > RDR_MaxDataLength(ctx)) {
 #ifdef DEBUG
-                ctccid_debug("PC_to_RDR_XfrBlock outlen > BUFFMAX\n");
+                        ctccid_debug("PC_to_RDR_XfrBlock outlen > dwMaxCCIDMessageLength\n");
 #endif
-                return -1;
+                        return -1;
+                }
+
+                msg = malloc(10 + outlen);
+                if (msg == NULL) {
+                        return -1;
+                }
         }
 
         memset(msg, 0, 10);
@@ -537,6 +842,7 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
         msg[2] = (outlen >> 8) & 0xFF;
         msg[3] = (outlen >> 16) & 0xFF;
         msg[4] = (outlen >> 24) & 0xFF;
+        msg[7] = ctx->WTX;		/* bBWI extends the block waiting time in the reader */
         msg[8] = level & 0xFF,
         msg[9] = (level >> 8) & 0xFF;
         memcpy(msg + 10, outbuf, outlen);
@@ -546,6 +852,10 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 #endif
         rc = USB_Write(ctx->device, (10 + outlen), msg);
 
+        if (msg != smsg) {
+                free(msg);
+        }
+
         if (rc < 0) {
                 return rc;
         }
@@ -566,24 +876,38 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain)
 {
 
-        unsigned int l;
-        unsigned char msg[10 + BUFFMAX];
+        unsigned int l, max;
+        unsigned char smsg[10 + BUFFMAX], *msg;
+        unsigned char wtx;
         int rc;
 
+        msg = smsg;
+        max = BUFFMAX;
         if (*inlen > BUFFMAX) {
+                max = RDR_MaxDataLength(ctx);
+
+                if (*inlen > max) {
 #ifdef DEBUG
-                ctccid_debug("RDR_to_PC_DataBlock *inlen > BUFFMAX\n");
+                        ctccid_debug("RDR_to_PC_DataBlock *inlen > dwMaxCCIDMessageLength\n");
 #endif
-                return -1;
+                        return -1;
+                }
+
+                msg = malloc(10 + max);
+                if (msg == NULL) {
+                        return -1;
+                }
         }
 
+        wtx = ctx->WTX;
+
         while (1) {
-                l = sizeof(msg);
-                rc = USB_Read(ctx->device, &l, msg);
+                l = 10 + max;
+                rc = USB_ReadTimeout(ctx->device, &l, msg, ResponseTimeout(ctx, *inlen, wtx));
 
                 if (rc < 0) {
                         *inlen = 0;
-                        return rc;
+                        break;
                 }
 
 #ifdef DEBUG
@@ -593,15 +917,27 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
                 /* check length, message type, slot and sequence number */
                 if (l < 10 || msg[0] != MSG_TYPE_RDR_to_PC_DataBlock || msg[5] != 0x00 || msg[6] != 0x00) {
                         *inlen = 0;
-                        return -1;
+                        rc = -1;
+                        break;
                 }
 
                 if (msg[7] & 0x80) {			// Card requests waiting time extension
+                        wtx = msg[8];			// Multiplier for the block waiting time
+#ifdef DEBUG
+                        ctccid_debug("Time extension requested, BWT * %d\n", wtx);
+#endif
                         continue;
                 }
                 break;
         }
 
+        if (rc < 0) {
+                if (msg != smsg) {
+                        free(msg);
+                }
+                return rc;
+        }
+
         if (status)
                 *status = msg[7];
         if (error)
@@ -609,12 +945,24 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
         if (chain)
                 *chain = msg[9];
 #ifdef DEBUG
-        memset(inbuf, 0x00, BUFFMAX);
+        memset(inbuf, 0x00, *inlen);
 #endif
 
+        if (l - 10 > *inlen) {
+                if (msg != smsg) {
+                        free(msg);
+                }
+                *inlen = 0;
+                return -1;
+        }
+
         *inlen = (l - 10);
 
         memcpy(inbuf, msg + 10, *inlen);
 
+        if (msg != smsg) {
+                free(msg);
+        }
+
         return 0;
 }
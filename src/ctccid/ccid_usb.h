@@ -42,6 +42,11 @@
  */
 #define BUFFMAX    261
 
+/**
+ * Maximum size of the data field in a CCID message (extended APDU with 64K data and Le)
+ */
+#define XFRMAX     (4 + 3 + 65535 + 2)
+
 #define ERR_ICC_MUTE				0xFE
 #define ERR_XFR_OVERRUN				0xFC
 #define ERR_HW_ERROR				0xFB
@@ -62,14 +67,34 @@
 
 #define FEATURE_AUTO_PPS			0x80
 
+/* Level of exchange in dwFeatures */
+#define FEATURE_TPDU				0x00010000
+#define FEATURE_SHORT_APDU			0x00020000
+#define FEATURE_EXTENDED_APDU			0x00040000
+#define FEATURE_EXCHANGE_MASK			0x00070000
+
 #define MATCH(x,y) ((x >= (y - y / 20)) && (x <= (y + y / 20)))
 
+/* Clock of 3.58 MHz assumed if the reader has no CCID descriptor */
+#define DEFAULT_CLOCK				3579545L
+
+/* Maximum number of discrete data rates queried from the reader */
+#define MAX_DATA_RATES				32
+
 int PC_to_RDR_IccPowerOn(scr_t *ctx);
 
 int PC_to_RDR_IccPowerOff(scr_t *ctx);
 
+unsigned int RDR_Features(scr_t *ctx);
+
+int RDR_ExchangeLevel(scr_t *ctx);
+
 int RDR_APDUTransferMode(scr_t *ctx);
 
+unsigned int RDR_MaxDataLength(scr_t *ctx);
+
+long RDR_BlockWaitTime(scr_t *ctx);
+
 int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, unsigned char level);
 
 int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain);
@@ -78,6 +103,10 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx);
 
 int DetermineBaudrate(int F, int D);
 
+long RDR_DataRate(scr_t *ctx, unsigned char FI, unsigned char DI);
+
+int PerformPPS(scr_t *ctx);
+
 int DecodeATRValues(scr_t *ctx);
 
 int PC_to_RDR_SetParameters(scr_t *ctx);
@@ -38,32 +38,109 @@
 #include "ctapi.h"
 #include "ctbcs.h"
 #include "scr.h"
+#include "ccid_usb.h"
 
 extern int ccidT1Term (struct scr *ctx);
 
-static MUTEX globalmutex;
-static int mutexInitialized = 0;
+/*
+ * Protects the reader table and the reference counters of the readers. The lock is only held
+ * to look up a reader, so commands to different readers run in parallel. USB_Open() is called
+ * outside the lock, so a reader being attached does not block card terminals already in use
+ */
+static STATIC_MUTEX globalmutex = STATIC_MUTEX_INITIALIZER;
+
+/*
+ * Table of active readers, indexed by card terminal number and grown on demand
+ */
+struct readerTable {
+	int size;
+	scr_t *entry[1];
+};
+
+static struct readerTable *readerTable = NULL;
+static int readerCount = 0;
 
-/* Handle up to 32 USB CCID readers */
 
-scr_t *readerTable[MAX_READER] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
-		NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
 
 /*
- * Locate matching card terminal number in table of active readers.
+ * Locate matching card terminal in table of active readers and take a reference,
+ * which must be returned with ReleaseReader().
  *
  */
-static int LookupReader(unsigned short ctn)
+static scr_t *LookupReader(unsigned short ctn)
 {
-	int i;
+	scr_t *ctx = NULL;
+
+	static_mutex_lock(&globalmutex);
 
-	for (i = 0; i < MAX_READER; i++) {
-		if (readerTable[i] && (readerTable[i]->ctn == ctn)) {
-			return i;
+	if (readerTable && (ctn < readerTable->size)) {
+		ctx = readerTable->entry[ctn];
+		if (ctx) {
+			ctx->refcnt++;
 		}
 	}
 
-	return -1;
+	static_mutex_unlock(&globalmutex);
+	return ctx;
+}
+
+
+
+/*
+ * Return a reference obtained with LookupReader(). The reader is released with the last reference,
+ * which is either held by a call still in progress or by the reader table until CT_close()
+ */
+static void ReleaseReader(scr_t *ctx)
+{
+	int refcnt;
+
+	static_mutex_lock(&globalmutex);
+	refcnt = --ctx->refcnt;
+	static_mutex_unlock(&globalmutex);
+
+	if (refcnt == 0) {
+		mutex_destroy(&ctx->mutex);
+		free(ctx);
+	}
+}
+
+
+
+/*
+ * Make sure the reader table can hold an entry for ctn. Must be called with globalmutex held
+ */
+static int GrowReaderTable(unsigned short ctn)
+{
+	struct readerTable *nt;
+	int size, oldsize;
+
+	oldsize = readerTable ? readerTable->size : 0;
+
+	if (ctn < oldsize) {
+		return 0;
+	}
+
+	size = oldsize ? oldsize : MAX_READER;
+
+	while (size <= ctn) {
+		size <<= 1;
+	}
+
+	nt = (struct readerTable *)calloc(1, sizeof(struct readerTable) + (size - 1) * sizeof(scr_t *));
+
+	if (!nt) {
+		return -1;
+	}
+
+	nt->size = size;
+
+	if (readerTable) {
+		memcpy(nt->entry, readerTable->entry, oldsize * sizeof(scr_t *));
+		free(readerTable);
+	}
+
+	readerTable = nt;
+	return 0;
 }
 
 
@@ -103,6 +180,47 @@ signed char CT_list(unsigned char *readers, unsigned short *lr, unsigned short o
 
 
 
+/**
+ * Wait for a card being inserted or removed in one of the readers or for a reader
+ * being attached or removed
+ *
+ * Card presence is reported by readers sending RDR_to_PC_NotifySlotChange messages on the
+ * interrupt endpoint. Start with *event set to 0 and pass the updated value in each call,
+ * so that no event is lost between calls. After a return with OK, use CT_data with GET STATUS
+ * to determine the readers that changed
+ *
+ * @param event Event counter from the last call, updated on return
+ * @param timeout Timeout in milliseconds or 0 to wait without timeout
+ * @return Status code \ref OK, \ref CT_NO_EVENT, \ref ERR_INVALID
+ */
+signed char CT_wait(unsigned int *event, unsigned int timeout)
+{
+	if (event == NULL) {
+		return ERR_INVALID;
+	}
+
+	if (USB_WaitForEvent(event, (int)timeout) == ERR_TIMEOUT) {
+		return CT_NO_EVENT;
+	}
+
+	return OK;
+}
+
+
+
+/**
+ * Wake up all threads waiting in CT_wait, e.g. to terminate a thread waiting without timeout
+ *
+ * @return Status code \ref OK
+ */
+signed char CT_signal(void)
+{
+	USB_SignalEvent();
+	return OK;
+}
+
+
+
 /**
  * Initialize the interface to the card reader ctn attached
  * to the port number specified in pn
@@ -113,147 +231,214 @@ signed char CT_list(unsigned char *readers, unsigned short *lr, unsigned short o
  */
 signed char CT_init(unsigned short ctn, unsigned short pn)
 {
-	int rc, indx;
+	int rc;
 	scr_t *ctx;
 
-	if (!mutexInitialized) {
-		if (mutex_init(&globalmutex) != 0) {
+	ctx = LookupReader(ctn);
+
+	if (ctx) {
+		ReleaseReader(ctx);
+		return OK;
+	}
+
+	ctx = (scr_t *)calloc(1, sizeof(scr_t));
+
+	if (!ctx) {
+		return ERR_MEMORY;
+	}
+
+	/*
+	 * No active reader yet - try to find one
+	 */
+	rc = USB_Open(pn, &(ctx->device));
+
+	if (rc != USB_OK) {
+		free(ctx);
+
+		if (rc == ERR_NO_READER) {
 			return ERR_CT;
-		};
+		} else {
+			return ERR_HOST; /* USB transmission error */
+		}
 	}
 
-	mutexInitialized++;
+	ctx->ctn = ctn;
+	ctx->pn = pn;
+	ctx->SlotChanges = -1;
+	ctx->TimeoutMargin = TIMEOUT_MARGIN;
+	ctx->MaxTimeout = MAX_TIMEOUT;
+	ctx->refcnt = 1;		/* Reference held by the reader table */
 
-	if (mutex_lock(&globalmutex) != 0) {
+	if (mutex_init(&ctx->mutex) != 0) {
+		USB_Close(&ctx->device);
+		free(ctx);
 		return ERR_CT;
 	}
 
-	rc = LookupReader(ctn);
+	static_mutex_lock(&globalmutex);
 
-	if (rc < 0) {
+	if (GrowReaderTable(ctn) < 0) {
+		rc = ERR_MEMORY;
+	} else if (readerTable->entry[ctn]) {
+		rc = OK;	/* Initialized concurrently by another thread */
+	} else {
+		readerTable->entry[ctn] = ctx;
+		readerCount++;
+		ctx = NULL;
+		rc = OK;
+	}
 
-		/*
-		 * Determine next free position in reader list
-		 */
-		for (indx = 0; (indx < MAX_READER) && readerTable[indx]; indx++) {
-			;
-		}
+	static_mutex_unlock(&globalmutex);
 
-		if (indx == MAX_READER) {
-			mutexInitialized--;
-			mutex_unlock(&globalmutex);
-			if (!mutexInitialized) {
-				mutex_destroy(&globalmutex);
-			}
-			return ERR_MEMORY;
-		}
+	if (ctx) {
+		mutex_destroy(&ctx->mutex);
+		USB_Close(&ctx->device);
+		free(ctx);
+	}
 
-		ctx = (scr_t *)calloc(1, sizeof(scr_t));
+	return rc;
+}
 
-		if (!ctx) {
-			mutexInitialized--;
-			mutex_unlock(&globalmutex);
-			if (!mutexInitialized) {
-				mutex_destroy(&globalmutex);
-			}
-			return ERR_MEMORY;
-		}
 
-		/*
-		 * No active reader yet - try to find one
-		 */
-		rc = USB_Open(pn, &(ctx->device));
-
-		if (rc != USB_OK) {
-			free(ctx);
-
-			if (rc == ERR_NO_READER) {
-				mutexInitialized--;
-				mutex_unlock(&globalmutex);
-				if (!mutexInitialized) {
-					mutex_destroy(&globalmutex);
-				}
-				return ERR_CT;
-			} else {
-				mutexInitialized--;
-				mutex_unlock(&globalmutex);
-				if (!mutexInitialized) {
-					mutex_destroy(&globalmutex);
-				}
-				return ERR_HOST; /* USB transmission error */
-			}
-		}
 
-		ctx->ctn = ctn;
-		ctx->pn = pn;
+/**
+ * Close the interface and free all allocated resources
+ *
+ * @param ctn Card terminal number
+ * @return Status code \ref OK, \ref ERR_INVALID, \ref ERR_CT, \ref ERR_TRANS, \ref ERR_MEMORY, \ref ERR_HOST, \ref ERR_HTSI
+ */
+signed char CT_close(unsigned short ctn)
+{
+	scr_t *ctx = NULL;
+
+	static_mutex_lock(&globalmutex);
 
-		if (mutex_init(&ctx->mutex) != 0) {
-			free(ctx);
-			return ERR_CT;
+	if (readerTable && (ctn < readerTable->size)) {
+		ctx = readerTable->entry[ctn];
+		readerTable->entry[ctn] = NULL;
+	}
+
+	if (ctx) {
+		readerCount--;
+		if (readerCount == 0) {
+			free(readerTable);
+			readerTable = NULL;
 		}
+	}
 
-		readerTable[indx] = ctx;
+	static_mutex_unlock(&globalmutex);
+
+	if (!ctx) {
+		return ERR_CT;
 	}
 
-	if (mutex_unlock(&globalmutex) != 0) {
+	/*
+	 * Wait for a command still in progress. Calls waiting for the mutex find the device closed
+	 */
+	if (mutex_lock(&ctx->mutex) != 0) {
+		ReleaseReader(ctx);
 		return ERR_CT;
 	}
 
+	if (ctx->t1) {
+		ccidT1Term(ctx);
+	}
+
+	USB_Close(&ctx->device);
+	ctx->device = NULL;
+
+	mutex_unlock(&ctx->mutex);
+
+	ReleaseReader(ctx);
+
 	return OK;
 }
 
 
 
 /**
- * Close the interface and free all allocated resources
+ * Get the timeouts for responses from the card terminal
  *
  * @param ctn Card terminal number
- * @return Status code \ref OK, \ref ERR_INVALID, \ref ERR_CT, \ref ERR_TRANS, \ref ERR_MEMORY, \ref ERR_HOST, \ref ERR_HTSI
+ * @param timeouts Structure receiving the current settings
+ * @return Status code \ref OK, \ref ERR_INVALID, \ref ERR_CT
  */
-signed char CT_close(unsigned short ctn)
+signed char CT_getTimeouts(unsigned short ctn, CT_TIMEOUTS *timeouts)
 {
-
-	int rc;
 	scr_t *ctx;
 
-	if (mutex_lock(&globalmutex) != 0) {
-		return ERR_CT;
+	if (timeouts == NULL) {
+		return ERR_INVALID;
 	}
 
-	rc = LookupReader(ctn);
+	ctx = LookupReader(ctn);
 
-	if (rc < 0) {
-		mutex_unlock(&globalmutex);
+	if (!ctx) {
 		return ERR_CT;
 	}
 
-	ctx = readerTable[rc];
-
-	if (!ctx) {
-		mutex_unlock(&globalmutex);
+	if (mutex_lock(&ctx->mutex) != 0) {
+		ReleaseReader(ctx);
 		return ERR_CT;
 	}
 
-	if (ctx->t1) {
-		ccidT1Term(ctx);
+	if (!ctx->device) {		/* Closed concurrently */
+		mutex_unlock(&ctx->mutex);
+		ReleaseReader(ctx);
+		return ERR_CT;
 	}
 
-	USB_Close(&ctx->device);
+	timeouts->bwt = (unsigned int)RDR_BlockWaitTime(ctx);
+	timeouts->margin = ctx->TimeoutMargin;
+	timeouts->maximum = ctx->MaxTimeout;
+
+	mutex_unlock(&ctx->mutex);
+	ReleaseReader(ctx);
+
+	return OK;
+}
+
 
-	mutex_destroy(&ctx->mutex);
 
-	free(ctx);
-	readerTable[rc] = NULL;
+/**
+ * Set the timeouts for responses from the card terminal. A margin of 0 selects the default
+ * \ref TIMEOUT_MARGIN, a maximum of 0 removes the upper limit
+ *
+ * @param ctn Card terminal number
+ * @param timeouts New settings
+ * @return Status code \ref OK, \ref ERR_INVALID, \ref ERR_CT
+ */
+signed char CT_setTimeouts(unsigned short ctn, CT_TIMEOUTS *timeouts)
+{
+	scr_t *ctx;
 
-	if (mutex_unlock(&globalmutex) != 0) {
+	if (timeouts == NULL) {
+		return ERR_INVALID;
+	}
+
+	ctx = LookupReader(ctn);
+
+	if (!ctx) {
+		return ERR_CT;
+	}
+
+	if (mutex_lock(&ctx->mutex) != 0) {
+		ReleaseReader(ctx);
 		return ERR_CT;
 	}
 
-	mutexInitialized--;
-	if (!mutexInitialized) {
-		mutex_destroy(&globalmutex);
+	if (!ctx->device) {		/* Closed concurrently */
+		mutex_unlock(&ctx->mutex);
+		ReleaseReader(ctx);
+		return ERR_CT;
 	}
 
+	ctx->TimeoutMargin = timeouts->margin ? timeouts->margin : TIMEOUT_MARGIN;
+	ctx->MaxTimeout = timeouts->maximum;
+
+	mutex_unlock(&ctx->mutex);
+	ReleaseReader(ctx);
+
 	return OK;
 }
 
@@ -280,13 +465,7 @@ signed char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 	unsigned int ilr;
 	scr_t *ctx;
 
-	rc = LookupReader(ctn);
-
-	if (rc < 0) {
-		return ERR_CT;
-	}
-
-	ctx = readerTable[rc];
+	ctx = LookupReader(ctn);
 
 	if (!ctx) {
 		return ERR_CT;
@@ -297,6 +476,13 @@ signed char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 	rc = 0;
 
 	if (mutex_lock(&ctx->mutex) != 0) {
+		ReleaseReader(ctx);
+		return ERR_CT;
+	}
+
+	if (!ctx->device) {		/* Closed concurrently */
+		mutex_unlock(&ctx->mutex);
+		ReleaseReader(ctx);
 		return ERR_CT;
 	}
 
@@ -371,8 +557,10 @@ signed char CT_data(unsigned short ctn, unsigned char *dad, unsigned char *sad,
 	*lr = ilr;
 
 	if (mutex_unlock(&ctx->mutex) != 0) {
-		return ERR_CT;
+		rc = ERR_CT;
 	}
 
+	ReleaseReader(ctx);
+
 	return rc;
 }
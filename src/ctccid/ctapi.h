@@ -50,6 +50,41 @@ signed char CT_list (
 	unsigned short options		/* Options                           */
 );
 
+/* CT_wait is a proprietary extension to the CT-API standard. It returns   */
+/* OK after a card was inserted or removed or a reader was attached or     */
+/* removed and CT_NO_EVENT if the timeout expired                          */
+signed char CT_wait (
+	unsigned int   *event,		/* Event counter, updated on return  */
+	unsigned int   timeout		/* Timeout in ms or 0 for no timeout */
+);
+
+/* CT_signal is a proprietary extension to the CT-API standard. It wakes up */
+/* all threads waiting in CT_wait, which return OK                          */
+signed char CT_signal (void);
+
+/* Response timeouts of a card terminal. The timeout for a response is the  */
+/* block waiting time, extended by a time extension requested by the card,  */
+/* plus the transmission time of the response and the margin                */
+typedef struct CT_TIMEOUTS {
+	unsigned int bwt;		/* Block waiting time in ms from BWI */
+					/* of the ATR, ignored when set      */
+	unsigned int margin;		/* Added for reader and USB latency  */
+	unsigned int maximum;		/* Upper limit for a single wait in  */
+					/* ms, including time extensions     */
+} CT_TIMEOUTS;
+
+/* CT_getTimeouts and CT_setTimeouts are proprietary extensions to the      */
+/* CT-API standard                                                          */
+signed char CT_getTimeouts (
+	unsigned short ctn,		/* Number assigned to terminal       */
+	CT_TIMEOUTS    *timeouts	/* Current settings                  */
+);
+
+signed char CT_setTimeouts (
+	unsigned short ctn,		/* Number assigned to terminal       */
+	CT_TIMEOUTS    *timeouts	/* New settings                      */
+);
+
 signed char CT_init (
 	unsigned short ctn,		/* Number assigned to terminal       */
 	unsigned short pn		/* Port allocated for terminal       */
@@ -72,6 +107,7 @@ signed char CT_data(
 /* CTAPI - response codes                                                    */
 
 #define OK		0		/** Successful completion            */
+#define CT_NO_EVENT	1		/** No event in CT_wait              */
 #define ERR_INVALID	-1		/** Invalid parameter or value       */
 #define ERR_CT		-8		/** Cardterminal error               */
 #define ERR_TRANS	-10		/** Transmission error               */
@@ -123,6 +123,7 @@ int ResetCard(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 		return OK;
 	}
 
+	// Prefer short or extended APDU level exchange, where the reader handles T=1
 	if (RDR_APDUTransferMode(ctx))
 		ccidAPDUInit(ctx);
 	else
@@ -45,10 +45,20 @@
 #include "usb_device.h"
 
 /**
- * Maximum number of readers
+ * Initial size of the reader table, which grows as required
  */
 #define MAX_READER  32
 
+/**
+ * Default time in milliseconds added to the block waiting time to cover reader and USB latency
+ */
+#define TIMEOUT_MARGIN  500
+
+/**
+ * Default upper limit in milliseconds for a single wait for a response, including time extensions
+ */
+#define MAX_TIMEOUT     (10 * 60 * 1000)
+
 /**
  * Maximum size of ATR
  */
@@ -85,6 +95,9 @@ struct scr {
 	/** Context structure for USB device */
 	struct usb_device	*device;
 
+	/** References held by the reader table and calls in progress */
+	int refcnt;
+
 	/** Last ATR received from the card    */
 	unsigned char     ATR[MAX_ATR];
 	/** Length of ATR                      */
@@ -105,8 +118,20 @@ struct scr {
 	unsigned char     EXTRA_GUARD_TIME;
 	/** Maximum length of INF field        */
 	unsigned char     IFSC;
+	/** Card in specific mode (TA2 present) */
+	unsigned char     SpecificMode;
 	/** Current baudrate                   */
-	int               Baud;
+	long              Baud;
+	/** Time extension multiplier for the next block or 0 */
+	unsigned char     WTX;
+	/** Added to response timeouts in ms   */
+	unsigned int      TimeoutMargin;
+	/** Upper limit for response timeouts in ms */
+	unsigned int      MaxTimeout;
+	/** Slot status from last query        */
+	int               SlotStatus;
+	/** Slot change notifications at last query or -1 */
+	int               SlotChanges;
 
 	CTModFunc_t       CTModFunc; /* response */
 
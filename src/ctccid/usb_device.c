@@ -32,13 +32,32 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
 
 #include <libusb-1.0/libusb.h>
 
+#include <common/mutex.h>
+
 #include "usb_device.h"
 
+/*
+ * Hotplug notification is available with libusb 1.0.16 and later
+ */
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+#define USB_HOTPLUG
+#endif
+
 #ifdef DEBUG
 
 #include "ctccid_debug.h"
@@ -96,17 +115,839 @@ static char* libusb_error_to_string(const int error) {
 	return strError;
 }
 
-#endif
+#endif
+
+/*
+ * Context for libusb/libusbx
+ */
+static libusb_context *context = NULL;
+
+int isSupported(struct libusb_device_descriptor *desc);
+
+/*
+ * Reference counter for context
+ */
+static int refcnt = 0;
+
+/*
+ * Serializes creation and release of the context, as readers may be opened concurrently
+ */
+static STATIC_MUTEX contextLock = STATIC_MUTEX_INITIALIZER;
+
+/*
+ * Thread handling libusb events of the shared context. It completes the asynchronous transfers
+ * of all open devices and delivers hotplug notifications. Completion only signals the thread
+ * waiting for the transfer, so transfers to different readers never wait for each other.
+ */
+struct usb_event_handler {
+	libusb_context *context;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+	int running;
+	volatile int stop;
+};
+
+static struct usb_event_handler sharedEvents;
+
+/*
+ * Supported devices reported by the hotplug callback, ordered by port. While the context exists
+ * the list replaces the enumeration of the bus in USB_Enumerate() and USB_Open()
+ */
+struct usb_cached_device {
+	struct usb_cached_device *next;
+	libusb_device *dev;
+	unsigned short port;
+	int seriallen;			/* -1 until the serial number was read */
+	unsigned char serial[64];
+};
+
+static STATIC_MUTEX cacheLock = STATIC_MUTEX_INITIALIZER;
+static struct usb_cached_device *deviceCache = NULL;
+static int hotplugRegistered = 0;
+#ifdef USB_HOTPLUG
+static libusb_hotplug_callback_handle hotplugHandle;
+#endif
+
+/*
+ * Counter of slot change notifications and reader arrivals or removals over all devices,
+ * used to wake up threads in USB_WaitForEvent()
+ */
+static volatile unsigned int slotEvents = 0;
+#ifdef _WIN32
+static SRWLOCK slotEventLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE slotEventSignal = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t slotEventLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slotEventSignal = PTHREAD_COND_INITIALIZER;
+#endif
+
+/*
+ * Completion state of the asynchronous transfers of a device. The bulk in transfer
+ * is submitted while the device is open, so that a response is received as soon as the reader
+ * sends it. Completion is signaled by the event thread to the thread waiting in USB_Read()
+ * or USB_Write().
+ */
+struct usb_transfer_state {
+	struct libusb_transfer *in;
+	struct libusb_transfer *out;
+	unsigned char *inbuff;
+	int inbuffsize;
+	int insubmitted;
+	volatile int indone;
+	volatile int outdone;
+	struct libusb_transfer *intr;		/* Interrupt in transfer for RDR_to_PC_NotifySlotChange */
+	unsigned char intrbuff[USB_INTERRUPT_LENGTH];
+	int intrsubmitted;
+	volatile int intrdone;
+	volatile unsigned int slotchanges;
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE completed;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t completed;
+#endif
+};
+
+
+
+#ifdef _WIN32
+static unsigned __stdcall eventHandler(void *arg)
+#else
+static void *eventHandler(void *arg)
+#endif
+{
+	struct usb_event_handler *eh = (struct usb_event_handler *)arg;
+	struct timeval tv;
+
+	while (!eh->stop) {
+		tv.tv_sec = 0;
+		tv.tv_usec = USB_EVENT_INTERVAL * 1000;
+		libusb_handle_events_timeout_completed(eh->context, &tv, NULL);
+	}
+	return 0;
+}
+
+
+
+static void freeSupportedDevices(libusb_device **list);
+
+
+
+/**
+ * Wake up all threads waiting in USB_WaitForEvent()
+ */
+static void signalSlotEvent(void)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(&slotEventLock);
+	slotEvents++;
+	WakeAllConditionVariable(&slotEventSignal);
+	ReleaseSRWLockExclusive(&slotEventLock);
+#else
+	pthread_mutex_lock(&slotEventLock);
+	slotEvents++;
+	pthread_cond_broadcast(&slotEventSignal);
+	pthread_mutex_unlock(&slotEventLock);
+#endif
+}
+
+
+
+static unsigned short getPort(libusb_device *dev)
+{
+	return libusb_get_bus_number(dev) << 8 | libusb_get_device_address(dev);
+}
+
+
+
+#ifdef USB_HOTPLUG
+static int LIBUSB_CALL hotplugEvent(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	struct usb_cached_device *cd, **pcd;
+	unsigned short port;
+
+	if ((libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS) || !isSupported(&desc)) {
+		return 0;
+	}
+
+	port = getPort(dev);
+
+	static_mutex_lock(&cacheLock);
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		for (pcd = &deviceCache; *pcd && ((*pcd)->port < port); pcd = &(*pcd)->next);
+
+		cd = calloc(1, sizeof(struct usb_cached_device));
+		if (cd != NULL) {
+			cd->dev = libusb_ref_device(dev);
+			cd->port = port;
+			cd->seriallen = -1;
+			cd->next = *pcd;
+			*pcd = cd;
+		}
+#ifdef DEBUG
+		ctccid_debug("Reader arrived at port %04x\n", port);
+#endif
+	} else {
+		for (pcd = &deviceCache; *pcd && ((*pcd)->dev != dev); pcd = &(*pcd)->next);
+
+		if (*pcd) {
+			cd = *pcd;
+			*pcd = cd->next;
+			libusb_unref_device(cd->dev);
+			free(cd);
+		}
+#ifdef DEBUG
+		ctccid_debug("Reader left port %04x\n", port);
+#endif
+	}
+
+	static_mutex_unlock(&cacheLock);
+
+	signalSlotEvent();
+	return 0;
+}
+#endif
+
+
+
+/**
+ * Start the event thread for the context
+ *
+ * @param eh Event handler with context
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+static int startEventThread(struct usb_event_handler *eh)
+{
+	eh->stop = 0;
+#ifdef _WIN32
+	eh->thread = (HANDLE)_beginthreadex(NULL, 0, eventHandler, eh, 0, NULL);
+	eh->running = (eh->thread != 0);
+#else
+	eh->running = (pthread_create(&eh->thread, NULL, eventHandler, eh) == 0);
+#endif
+
+	if (!eh->running) {
+#ifdef DEBUG
+		ctccid_debug("Could not start USB event thread\n");
+#endif
+		return ERR_USB;
+	}
+	return USB_OK;
+}
+
+
+
+/**
+ * Stop the event thread, if running
+ *
+ * @param eh Event handler with context
+ */
+static void stopEventThread(struct usb_event_handler *eh)
+{
+	if (!eh->running) {
+		return;
+	}
+
+	eh->stop = 1;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	libusb_interrupt_event_handler(eh->context);
+#endif
+#ifdef _WIN32
+	WaitForSingleObject(eh->thread, INFINITE);
+	CloseHandle(eh->thread);
+#else
+	pthread_join(eh->thread, NULL);
+#endif
+	eh->running = 0;
+}
+
+
+
+/**
+ * Release context, event thread and device cache. Must be called with the context lock held
+ */
+static void exitContext(void)
+{
+	struct usb_cached_device *cd;
+
+#ifdef USB_HOTPLUG
+	if (hotplugRegistered) {
+		libusb_hotplug_deregister_callback(context, hotplugHandle);
+	}
+#endif
+
+	stopEventThread(&sharedEvents);
+
+	static_mutex_lock(&cacheLock);
+	hotplugRegistered = 0;
+	while (deviceCache) {
+		cd = deviceCache;
+		deviceCache = cd->next;
+		libusb_unref_device(cd->dev);
+		free(cd);
+	}
+	static_mutex_unlock(&cacheLock);
+
+	libusb_exit(context);
+	context = NULL;
+}
+
+
+
+/**
+ * Acquire a reference to the shared context used for enumeration, creating it together with
+ * the hotplug registration and the event thread delivering hotplug notifications if required
+ *
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+static int acquireContext(void)
+{
+	int rc;
+
+	static_mutex_lock(&contextLock);
+
+	/*
+	 * We implement our own context handling to avoid a bug in the default context implementation
+	 * of the libusbx library version <= 1.0.15
+	 *
+	 * See https://github.com/libusbx/libusbx/commit/ce75e9af3f9242ec328b0dc2336b69ff24287a3c#libusb/core.c
+	 */
+	if (!context) {
+		rc = libusb_init(&context);
+
+		if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+			ctccid_debug("libusb_init failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+			context = NULL;
+			static_mutex_unlock(&contextLock);
+			return ERR_USB;
+		}
+
+#ifdef DEBUG
+		libusb_set_debug(context, 3);
+#endif
+
+#ifdef USB_HOTPLUG
+		if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+			// Already attached devices are reported before the call returns
+			rc = libusb_hotplug_register_callback(context,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+					LIBUSB_HOTPLUG_MATCH_ANY, hotplugEvent, NULL, &hotplugHandle);
+
+			static_mutex_lock(&cacheLock);
+			hotplugRegistered = (rc == LIBUSB_SUCCESS);
+			static_mutex_unlock(&cacheLock);
+		}
+#endif
+
+		sharedEvents.context = context;
+
+		if (startEventThread(&sharedEvents) != USB_OK) {
+			exitContext();
+			static_mutex_unlock(&contextLock);
+			return ERR_USB;
+		}
+	}
+
+	refcnt++;
+
+	static_mutex_unlock(&contextLock);
+	return USB_OK;
+}
+
+
+
+/**
+ * Release a reference to the shared context. The event thread is stopped and the context
+ * released after the last reference is gone
+ */
+static void releaseContext(void)
+{
+	static_mutex_lock(&contextLock);
+
+	refcnt--;
+	if (refcnt == 0) {
+		exitContext();
+	}
+
+	static_mutex_unlock(&contextLock);
+}
+
+
+
+static int comparePort(const void *a, const void *b)
+{
+	return (int)getPort(*(libusb_device **)a) - (int)getPort(*(libusb_device **)b);
+}
+
+
+
+/**
+ * Determine the supported devices ordered by port, either from the cache maintained by the
+ * hotplug callback or by enumerating the bus
+ *
+ * @param list Variable receiving the NULL terminated list of referenced devices
+ * @return Number of devices or \ref ERR_NO_READER
+ */
+static int getSupportedDevices(libusb_device ***list)
+{
+	struct libusb_device_descriptor desc;
+	struct usb_cached_device *cd;
+	libusb_device **devs, **sel;
+	int cnt, i;
+
+	static_mutex_lock(&cacheLock);
+
+	if (hotplugRegistered) {
+		for (cnt = 0, cd = deviceCache; cd; cd = cd->next, cnt++);
+
+		sel = calloc(cnt + 1, sizeof(libusb_device *));
+
+		for (i = 0, cd = deviceCache; sel && cd; cd = cd->next) {
+			sel[i++] = libusb_ref_device(cd->dev);
+		}
+
+		static_mutex_unlock(&cacheLock);
+
+		if (sel == NULL) {
+			return ERR_NO_READER;
+		}
+
+		*list = sel;
+		return cnt;
+	}
+
+	static_mutex_unlock(&cacheLock);
+
+	cnt = libusb_get_device_list(context, &devs);
+
+	if (cnt < 0) {
+		return ERR_NO_READER;
+	}
+
+	sel = calloc(cnt + 1, sizeof(libusb_device *));
+
+	if (sel == NULL) {
+		freeSupportedDevices(devs);
+		return ERR_NO_READER;
+	}
+
+	for (i = 0, cnt = 0; devs[i] != NULL; i++) {
+		if ((libusb_get_device_descriptor(devs[i], &desc) == LIBUSB_SUCCESS) && isSupported(&desc)) {
+			sel[cnt++] = libusb_ref_device(devs[i]);
+		}
+	}
+
+	freeSupportedDevices(devs);
+
+	qsort(sel, cnt, sizeof(libusb_device *), comparePort);
+
+	*list = sel;
+	return cnt;
+}
+
+
+
+static void freeSupportedDevices(libusb_device **list)
+{
+	int i;
+
+	for (i = 0; list[i] != NULL; i++) {
+		libusb_unref_device(list[i]);
+	}
+	free(list);
+}
+
+
+
+/**
+ * Read the serial number of the device, using the value cached for the port if available
+ *
+ * @param dev The device
+ * @param desc The device descriptor
+ * @param serial Buffer receiving the serial number
+ * @param len Size of buffer
+ * @return Length of serial number or negative libusb error code
+ */
+static int getSerialNumber(libusb_device *dev, struct libusb_device_descriptor *desc, unsigned char *serial, int len)
+{
+	struct libusb_device_handle *handle;
+	struct usb_cached_device *cd;
+	int rc;
+
+	static_mutex_lock(&cacheLock);
+	for (cd = deviceCache; cd && (cd->dev != dev); cd = cd->next);
+
+	if (cd && (cd->seriallen >= 0) && (cd->seriallen <= len)) {
+		memcpy(serial, cd->serial, cd->seriallen);
+		rc = cd->seriallen;
+		static_mutex_unlock(&cacheLock);
+		return rc;
+	}
+	static_mutex_unlock(&cacheLock);
+
+	rc = libusb_open(dev, &handle);
+
+	if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("libusb_open failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		return rc;
+	}
+
+	rc = libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, serial, len);
+	libusb_close(handle);
+
+	if (rc < 0) {
+#ifdef DEBUG
+		ctccid_debug("libusb_get_string_descriptor_ascii failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		return rc;
+	}
+
+	static_mutex_lock(&cacheLock);
+	for (cd = deviceCache; cd && (cd->dev != dev); cd = cd->next);
+
+	if (cd && (rc <= (int)sizeof(cd->serial))) {
+		memcpy(cd->serial, serial, rc);
+		cd->seriallen = rc;
+	}
+	static_mutex_unlock(&cacheLock);
+
+	return rc;
+}
+
+
+
+static void LIBUSB_CALL transferCompleted(struct libusb_transfer *transfer)
+{
+	struct usb_transfer_state *xs = (struct usb_transfer_state *)transfer->user_data;
+
+#ifdef _WIN32
+	EnterCriticalSection(&xs->lock);
+#else
+	pthread_mutex_lock(&xs->lock);
+#endif
+
+	if (transfer == xs->in) {
+		xs->indone = 1;
+	} else {
+		xs->outdone = 1;
+	}
+
+#ifdef _WIN32
+	WakeAllConditionVariable(&xs->completed);
+	LeaveCriticalSection(&xs->lock);
+#else
+	pthread_cond_broadcast(&xs->completed);
+	pthread_mutex_unlock(&xs->lock);
+#endif
+}
+
+
+
+/**
+ * Wait until the event thread signals completion of a transfer. Must be called with the lock held
+ *
+ * @param xs Transfer state
+ * @param done Completion flag to wait for
+ * @param timeout Timeout in milliseconds or 0 to wait until completed
+ * @return 0 if completed, -1 if the timeout expired
+ */
+static int waitForCompletion(struct usb_transfer_state *xs, volatile int *done, int timeout)
+{
+#ifdef _WIN32
+	DWORD start = GetTickCount(), elapsed;
+
+	while (!*done) {
+		if (timeout == 0) {
+			SleepConditionVariableCS(&xs->completed, &xs->lock, INFINITE);
+			continue;
+		}
+		elapsed = GetTickCount() - start;
+		if (elapsed >= (DWORD)timeout) {
+			return -1;
+		}
+		SleepConditionVariableCS(&xs->completed, &xs->lock, timeout - elapsed);
+	}
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	while (!*done) {
+		if (timeout == 0) {
+			pthread_cond_wait(&xs->completed, &xs->lock);
+		} else if (pthread_cond_timedwait(&xs->completed, &xs->lock, &ts) == ETIMEDOUT) {
+			return *done ? 0 : -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+
+
+static void lockTransfers(struct usb_transfer_state *xs)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&xs->lock);
+#else
+	pthread_mutex_lock(&xs->lock);
+#endif
+}
+
+
+
+static void unlockTransfers(struct usb_transfer_state *xs)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&xs->lock);
+#else
+	pthread_mutex_unlock(&xs->lock);
+#endif
+}
+
+
+
+/**
+ * Submit the interrupt in transfer, so that it can receive the next notification from the reader
+ *
+ * @param xs Transfer state
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+static int submitInterruptIn(struct usb_transfer_state *xs)
+{
+	int rc;
+
+	xs->intrdone = 0;
+
+	rc = libusb_submit_transfer(xs->intr);
+
+	if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("libusb_submit_transfer (interrupt) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		xs->intrsubmitted = 0;
+		return ERR_USB;
+	}
+
+	xs->intrsubmitted = 1;
+	return USB_OK;
+}
+
+
+
+/**
+ * Count RDR_to_PC_NotifySlotChange and RDR_to_PC_HardwareError messages and the removal of the device,
+ * then wait for the next notification
+ */
+static void LIBUSB_CALL interruptCompleted(struct libusb_transfer *transfer)
+{
+	struct usb_transfer_state *xs = (struct usb_transfer_state *)transfer->user_data;
+	int changed = 0;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+#ifdef DEBUG
+		ctccid_debug("Interrupt message %02x %02x\n", xs->intrbuff[0], xs->intrbuff[1]);
+#endif
+		changed = (transfer->actual_length >= 2) &&
+				((xs->intrbuff[0] == USB_MSG_NOTIFY_SLOT_CHANGE) || (xs->intrbuff[0] == USB_MSG_HARDWARE_ERROR));
+	} else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		changed = 1;
+	}
+
+	lockTransfers(xs);
+
+	if (changed) {
+		xs->slotchanges++;
+	}
+
+	if ((transfer->status == LIBUSB_TRANSFER_CANCELLED) || (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) ||
+			(submitInterruptIn(xs) != USB_OK)) {
+		xs->intrsubmitted = 0;
+		xs->intrdone = 1;
+#ifdef _WIN32
+		WakeAllConditionVariable(&xs->completed);
+#else
+		pthread_cond_broadcast(&xs->completed);
+#endif
+	}
+
+	unlockTransfers(xs);
+
+	if (changed) {
+		signalSlotEvent();
+	}
+}
+
+
+
+/**
+ * Submit the bulk in transfer, so that it can receive the next message from the reader
+ *
+ * @param device Device specific data
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+static int submitBulkIn(usb_device_t *device)
+{
+	struct usb_transfer_state *xs = device->xfer;
+	int rc;
+
+	libusb_fill_bulk_transfer(xs->in, device->handle, device->bulk_in, xs->inbuff, xs->inbuffsize, transferCompleted, xs, 0);
+	xs->indone = 0;
+
+	rc = libusb_submit_transfer(xs->in);
+
+	if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("libusb_submit_transfer (read) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		xs->insubmitted = 0;
+		return ERR_USB;
+	}
+
+	xs->insubmitted = 1;
+	return USB_OK;
+}
+
+
+
+/**
+ * Determine the size of the buffer for the bulk in transfer from dwMaxCCIDMessageLength
+ *
+ * @param device Device specific data
+ * @return Buffer size
+ */
+static int getMaxMessageLength(usb_device_t *device)
+{
+	unsigned char const *desc;
+	int length, size;
+
+	USB_GetCCIDDescriptor(device, &desc, &length);
+
+	size = USB_MIN_MESSAGE_LENGTH;
+	if (length == 54) {
+		size = desc[44] | (desc[45] << 8) | (desc[46] << 16) | (desc[47] << 24);
+		if ((size < USB_MIN_MESSAGE_LENGTH) || (size > USB_MAX_MESSAGE_LENGTH)) {
+			size = size < USB_MIN_MESSAGE_LENGTH ? USB_MIN_MESSAGE_LENGTH : USB_MAX_MESSAGE_LENGTH;
+		}
+	}
+	return size;
+}
+
 
-/*
- * Context for libusb/libusbx
+
+/**
+ * Allocate the transfers for the device and submit the bulk in transfer
+ *
+ * @param device Device specific data
+ * @return Status code \ref USB_OK, \ref ERR_USB
  */
-static libusb_context *context = NULL;
+static int initTransfers(usb_device_t *device)
+{
+	struct usb_transfer_state *xs;
 
-/*
- * Reference counter for context
+	xs = calloc(1, sizeof(struct usb_transfer_state));
+
+	if (xs == NULL) {
+		return ERR_USB;
+	}
+
+	xs->inbuffsize = getMaxMessageLength(device);
+	xs->inbuff = malloc(xs->inbuffsize);
+	xs->in = libusb_alloc_transfer(0);
+	xs->out = libusb_alloc_transfer(0);
+	xs->intr = device->interrupt_in ? libusb_alloc_transfer(0) : NULL;
+
+	if ((xs->inbuff == NULL) || (xs->in == NULL) || (xs->out == NULL) || (device->interrupt_in && (xs->intr == NULL))) {
+		libusb_free_transfer(xs->in);
+		libusb_free_transfer(xs->out);
+		libusb_free_transfer(xs->intr);
+		free(xs->inbuff);
+		free(xs);
+		return ERR_USB;
+	}
+
+#ifdef _WIN32
+	InitializeCriticalSection(&xs->lock);
+	InitializeConditionVariable(&xs->completed);
+#else
+	pthread_mutex_init(&xs->lock, NULL);
+	pthread_cond_init(&xs->completed, NULL);
+#endif
+
+	device->xfer = xs;
+
+	if (xs->intr) {
+		libusb_fill_interrupt_transfer(xs->intr, device->handle, device->interrupt_in, xs->intrbuff, sizeof(xs->intrbuff), interruptCompleted, xs, 0);
+
+		if (submitInterruptIn(xs) != USB_OK) {
+			libusb_free_transfer(xs->intr);
+			xs->intr = NULL;
+		}
+	}
+
+	return submitBulkIn(device);
+}
+
+
+
+/**
+ * Cancel pending transfers and release the transfer state
+ *
+ * @param device Device specific data
  */
-static int refcnt = 0;
+static void freeTransfers(usb_device_t *device)
+{
+	struct usb_transfer_state *xs = device->xfer;
+
+	if (xs == NULL) {
+		return;
+	}
+
+	lockTransfers(xs);
+	if (xs->insubmitted && !xs->indone) {
+		if (libusb_cancel_transfer(xs->in) == LIBUSB_SUCCESS) {
+			waitForCompletion(xs, &xs->indone, 0);
+		}
+	}
+	if (xs->intrsubmitted) {
+		if (libusb_cancel_transfer(xs->intr) == LIBUSB_SUCCESS) {
+			waitForCompletion(xs, &xs->intrdone, 0);
+		}
+	}
+	unlockTransfers(xs);
+
+	libusb_free_transfer(xs->in);
+	libusb_free_transfer(xs->out);
+	libusb_free_transfer(xs->intr);
+	free(xs->inbuff);
+
+#ifdef _WIN32
+	DeleteCriticalSection(&xs->lock);
+#else
+	pthread_cond_destroy(&xs->completed);
+	pthread_mutex_destroy(&xs->lock);
+#endif
+
+	free(xs);
+	device->xfer = NULL;
+}
 
 
 
@@ -141,37 +982,16 @@ int USB_Enumerate(unsigned char *readers, int *len, int options)
 	unsigned char param[128];
 	libusb_device **devs, *dev;
 
-	/*
-	 * We implement our own context handling to avoid a bug in the default context implementation
-	 * of the libusbx library version <= 1.0.15
-	 *
-	 * See https://github.com/libusbx/libusbx/commit/ce75e9af3f9242ec328b0dc2336b69ff24287a3c#libusb/core.c
-	 */
-	if (!context) {
-		rc = libusb_init(&context);
-
-		if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-			ctccid_debug("libusb_init failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-			return ERR_USB;
-		}
+	if (acquireContext() != USB_OK) {
+		return ERR_USB;
 	}
 
-	refcnt++;
-
-#ifdef DEBUG
-	libusb_set_debug(context, 3);
-#endif
-
-	cnt = libusb_get_device_list(context, &devs);
-
-	if (cnt < 0) {
-		refcnt--;
+	if (getSupportedDevices(&devs) < 0) {
+		releaseContext();
 		return ERR_NO_READER;
 	}
 
-	/* Iterate through all devices to find a reader */
+	/* Iterate through all supported devices */
 	i = 0;
 	cnt = 0;
 	po = readers;
@@ -179,86 +999,59 @@ int USB_Enumerate(unsigned char *readers, int *len, int options)
 
 	while ((dev = devs[i++]) != NULL ) {
 		struct libusb_device_descriptor desc;
-		struct libusb_device_handle *handle;
+		uint8_t bus = libusb_get_bus_number(dev);
+		uint8_t addr = libusb_get_device_address(dev);
 
-		rc = libusb_get_device_descriptor(dev, &desc);
+		libusb_get_device_descriptor(dev, &desc);
 
-		if (rc < 0) {
-#ifdef DEBUG
-			ctccid_debug("libusb_get_device_descriptor failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-			/* error */
-			continue;
+		if (*len - cnt < 3) {
+			rc = ERR_ARG;
+			break;
 		}
 
-		if (isSupported(&desc)) {
-			uint8_t bus = libusb_get_bus_number(dev);
-			uint8_t addr = libusb_get_device_address(dev);
-
-			if (*len - cnt < 3) {
-				rc = ERR_ARG;
-				break;
-			}
-
-			*po++ = bus;
-			*po++ = addr;
-			cnt += 2;
+		*po++ = bus;
+		*po++ = addr;
+		cnt += 2;
 
-			if (!(options & NO_READER_NAME)) {
-				if (desc.iSerialNumber) {
-					rc = libusb_open(dev, &handle);
-
-					if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-						ctccid_debug("libusb_open failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-						rc = ERR_USB;
-						break;
-					}
-					rc = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, param, sizeof(param));
-					if (rc < 0) {
-#ifdef DEBUG
-						ctccid_debug("libusb_get_string_descriptor_ascii failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-						rc = ERR_USB;
-						break;
-					}
-					libusb_close(handle);
-				} else {
-					rc = snprintf((char *)param, sizeof(param), "%04x", (bus << 8 | addr));
-				}
+		if (!(options & NO_READER_NAME)) {
+			if (desc.iSerialNumber) {
+				rc = getSerialNumber(dev, &desc, param, sizeof(param));
 
-				if (*len - cnt < (15 + rc + 1 + 1)) {	// "SmartCard-HSM (" + serial + ")"
-					rc = ERR_ARG;
+				if (rc < 0) {
+					rc = ERR_USB;
 					break;
 				}
+			} else {
+				rc = snprintf((char *)param, sizeof(param), "%04x", (bus << 8 | addr));
+			}
 
-				memcpy(po, "SmartCard-HSM (", 15);
-				po += 15;
-				cnt += 15;
-				memcpy(po, param, rc);
-				po += rc;
-				cnt += rc;
-				*po++ = ')';
-				cnt++;
+			if (*len - cnt < (15 + rc + 1 + 1)) {	// "SmartCard-HSM (" + serial + ")"
+				rc = ERR_ARG;
+				break;
 			}
 
-			*po++ = 0;
+			memcpy(po, "SmartCard-HSM (", 15);
+			po += 15;
+			cnt += 15;
+			memcpy(po, param, rc);
+			po += rc;
+			cnt += rc;
+			*po++ = ')';
 			cnt++;
+			rc = USB_OK;
 		}
+
+		*po++ = 0;
+		cnt++;
 	}
 
 	if (rc == USB_OK) {
 		*len = cnt;
 	}
 
-	libusb_free_device_list(devs, 1);
+	freeSupportedDevices(devs);
 
-	refcnt--;
-	if (refcnt == 0) {
-		libusb_exit(context);
-		context = NULL;
-	}
+	releaseContext();
 
 	return rc;
 }
@@ -278,87 +1071,59 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 	int rc, cnt, i;
 	libusb_device **devs, *dev;
 
-	/*
-	 * We implement our own context handling to avoid a bug in the default context implementation
-	 * of the libusbx library version <= 1.0.15
-	 *
-	 * See https://github.com/libusbx/libusbx/commit/ce75e9af3f9242ec328b0dc2336b69ff24287a3c#libusb/core.c
-	 */
-	if (!context) {
-		rc = libusb_init(&context);
-
-		if (rc != LIBUSB_SUCCESS) {
-#ifdef DEBUG
-			ctccid_debug("libusb_init failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
-			return ERR_USB;
-		}
+	if (acquireContext() != USB_OK) {
+		return ERR_USB;
 	}
 
-	refcnt++;
-
-#ifdef DEBUG
-	libusb_set_debug(context, 3);
-#endif
-
-	cnt = libusb_get_device_list(context, &devs);
-
-	if (cnt < 0) {
-		refcnt--;
+	if (getSupportedDevices(&devs) < 0) {
+		releaseContext();
 		return ERR_NO_READER;
 	}
 
-	/* Iterate through all devices to find a reader */
+	/* Iterate through all supported devices to find the reader */
 	i = 0;
 	cnt = 0;
 
 	while ((dev = devs[i++]) != NULL ) {
-		struct libusb_device_descriptor desc;
+		unsigned short port = getPort(dev);
 
-		rc = libusb_get_device_descriptor(dev, &desc);
-
-		if (rc < 0) {
-			/* error */
-			continue;
-		}
-
-		if (isSupported(&desc)) {
-			uint8_t bus = libusb_get_bus_number(dev);
-			uint8_t address = libusb_get_device_address(dev);
-			unsigned short port = bus << 8 | address;
-
-			/*
-			 * Found the desired reader?
-			 */
-			if ((cnt == pn) || (port == pn)) {
+		/*
+		 * Found the desired reader?
+		 */
+		if ((cnt == pn) || (port == pn)) {
 #ifdef DEBUG
-				ctccid_debug("Reader index (%i) and requested port number (%i) match.\n", cnt, pn);
+			ctccid_debug("Reader index (%i) and requested port number (%i) match.\n", cnt, pn);
 #endif
-				*device = calloc(1, sizeof(usb_device_t));
-				break;
-			} else {
+			*device = calloc(1, sizeof(usb_device_t));
+			break;
+		} else {
 #ifdef DEBUG
-				ctccid_debug("Reader index (%i) and requested port number (%i) do not match.\n", cnt, pn);
+			ctccid_debug("Reader index (%i) and requested port number (%i) do not match.\n", cnt, pn);
 #endif
-				cnt++;
-			}
+			cnt++;
 		}
 	}
 
+	if ((dev != NULL) && (*device == NULL)) {
+		freeSupportedDevices(devs);
+		releaseContext();
+		return ERR_USB;
+	}
+
 	if (dev != NULL ) { /* reader found */
+		libusb_ref_device(dev);
+		freeSupportedDevices(devs);
+
 		rc = libusb_open(dev, &((*device)->handle));
 
 		if (rc != LIBUSB_SUCCESS) {
 #ifdef DEBUG
 			ctccid_debug("libusb_open failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
 #endif
+			libusb_unref_device(dev);
 			free(*device);
-			libusb_free_device_list(devs, 1);
-			refcnt--;
-			if (refcnt == 0) {
-				libusb_exit(context);
-				context = NULL;
-			}
+			*device = NULL;
+			releaseContext();
 			return ERR_USB;
 		}
 
@@ -369,13 +1134,10 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 			ctccid_debug("libusb_get_active_config_descriptor failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
 #endif
 			libusb_close((*device)->handle);
+			libusb_unref_device(dev);
 			free(*device);
-			libusb_free_device_list(devs, 1);
-			refcnt--;
-			if (refcnt == 0) {
-				libusb_exit(context);
-				context = NULL;
-			}
+			*device = NULL;
+			releaseContext();
 			return ERR_USB;
 		}
 
@@ -393,13 +1155,10 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 			ctccid_debug("libusb_claim_interface failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
 #endif
 			libusb_close((*device)->handle);
+			libusb_unref_device(dev);
 			free(*device);
-			libusb_free_device_list(devs, 1);
-			refcnt--;
-			if (refcnt == 0) {
-				libusb_exit(context);
-				context = NULL;
-			}
+			*device = NULL;
+			releaseContext();
 			return ERR_USB;
 		}
 
@@ -412,11 +1171,16 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 
 			uint8_t bEndpointAddress;
 
+			bEndpointAddress = (*device)->configuration_descriptor->interface[ifidx].altsetting->endpoint[i].bEndpointAddress;
+
 			if ((*device)->configuration_descriptor->interface[ifidx].altsetting->endpoint[i].bmAttributes
 					== LIBUSB_TRANSFER_TYPE_INTERRUPT) {
 				/*
-				 * Ignore the interrupt endpoint
+				 * Interrupt endpoint for slot change notifications
 				 */
+				if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+					(*device)->interrupt_in = bEndpointAddress;
+				}
 				continue;
 			}
 
@@ -428,8 +1192,6 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 				continue;
 			}
 
-			bEndpointAddress = (*device)->configuration_descriptor->interface[ifidx].altsetting->endpoint[i].bEndpointAddress;
-
 			if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
 				(*device)->bulk_in = bEndpointAddress;
 			}
@@ -439,20 +1201,29 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 			}
 		}
 
-		rc = USB_OK;
+		rc = initTransfers(*device);
+
+		if (rc != USB_OK) {
+			freeTransfers(*device);
+			libusb_release_interface((*device)->handle, (*device)->configuration_descriptor->interface[ifidx].altsetting->bInterfaceNumber);
+			libusb_free_config_descriptor((*device)->configuration_descriptor);
+			libusb_close((*device)->handle);
+			libusb_unref_device(dev);
+			free(*device);
+			*device = NULL;
+			releaseContext();
+			return ERR_USB;
+		}
+
+		libusb_unref_device(dev);
 
 	} else { /* no reader found */
+		freeSupportedDevices(devs);
 		rc = ERR_NO_READER;
 	}
 
-	libusb_free_device_list(devs, 1);
-
 	if (rc == ERR_NO_READER) {
-		refcnt--;
-		if (refcnt == 0) {
-			libusb_exit(context);
-			context = NULL;
-		}
+		releaseContext();
 	}
 
 	return rc;
@@ -476,6 +1247,49 @@ void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int
 
 
 
+/**
+ * Query the discrete data rates supported by the reader with the class specific
+ * GET_DATA_RATES request
+ *
+ * @param device Device specific data
+ * @param rates Array receiving the data rates in bit/s
+ * @param count Size of array on input, number of data rates on output
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_GetDataRates(usb_device_t *device, unsigned int *rates, int *count)
+{
+	unsigned char buf[4 * 256];
+	int rc, i;
+
+	if (*count > 256) {
+		*count = 256;
+	}
+
+	rc = libusb_control_transfer(device->handle,
+				     LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+				     0x03,
+				     0,
+				     device->configuration_descriptor->interface[device->ifidx].altsetting->bInterfaceNumber,
+				     buf, 4 * *count, USB_READ_TIMEOUT);
+
+	if (rc < 0) {
+#ifdef DEBUG
+		ctccid_debug("libusb_control_transfer (GET_DATA_RATES) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		*count = 0;
+		return ERR_USB;
+	}
+
+	*count = rc / 4;
+	for (i = 0; i < *count; i++) {
+		rates[i] = buf[i * 4] | (buf[i * 4 + 1] << 8) | (buf[i * 4 + 2] << 16) | ((unsigned int)buf[i * 4 + 3] << 24);
+	}
+
+	return USB_OK;
+}
+
+
+
 /**
  * Close USB device and free allocated resources
  *
@@ -487,6 +1301,8 @@ int USB_Close(usb_device_t **device)
 
 	int rc;
 
+	freeTransfers(*device);
+
 	rc = libusb_release_interface((*device)->handle,
 								  (*device)->configuration_descriptor->interface[(*device)->ifidx].altsetting->bInterfaceNumber);
 
@@ -502,11 +1318,9 @@ int USB_Close(usb_device_t **device)
 	free(*device);
 	*device = NULL;
 
-	refcnt--;
-	if (refcnt == 0) {
-		libusb_exit(context);
-		context = NULL;
-	}
+	releaseContext();
+
+	signalSlotEvent();
 
 	return USB_OK;
 }
@@ -523,14 +1337,24 @@ int USB_Close(usb_device_t **device)
  */
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
 {
+	struct usb_transfer_state *xs = device->xfer;
 	int rc;
-	int send;
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_out, buffer, length, &send, USB_WRITE_TIMEOUT);
+	libusb_fill_bulk_transfer(xs->out, device->handle, device->bulk_out, buffer, length, transferCompleted, xs, USB_WRITE_TIMEOUT);
+
+	lockTransfers(xs);
+	xs->outdone = 0;
+
+	rc = libusb_submit_transfer(xs->out);
+
+	if (rc == LIBUSB_SUCCESS) {
+		waitForCompletion(xs, &xs->outdone, 0);
+	}
+	unlockTransfers(xs);
 
-	if (rc != LIBUSB_SUCCESS || (send != length)) {
+	if ((rc != LIBUSB_SUCCESS) || (xs->out->status != LIBUSB_TRANSFER_COMPLETED) || (xs->out->actual_length != length)) {
 #ifdef DEBUG
-		ctccid_debug("libusb_bulk_transfer (write) failed. rc = %i (%s), send=%i, length=%i\n", rc, libusb_error_to_string(rc), send, length);
+		ctccid_debug("libusb_submit_transfer (write) failed. rc = %i (%s), status=%i, send=%i, length=%i\n", rc, libusb_error_to_string(rc), xs->out->status, xs->out->actual_length, length);
 #endif
 		return ERR_USB;
 	}
@@ -541,7 +1365,7 @@ int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
 
 
 /**
- * Read data block from specified USB device using bulk transfer
+ * Read data block from specified USB device with the default timeout \ref USB_READ_TIMEOUT
  *
  * @param device Device specific data
  * @param length Length of data buffer
@@ -550,20 +1374,153 @@ int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
  */
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer)
 {
-	int rc;
-	int read;
+	return USB_ReadTimeout(device, length, buffer, USB_READ_TIMEOUT);
+}
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_in, buffer, *length, &read, USB_READ_TIMEOUT);
 
-	if (rc != LIBUSB_SUCCESS) {
+
+/**
+ * Read data block from specified USB device. The data is received by the bulk in transfer
+ * submitted in advance, so this call only waits for its completion
+ *
+ * @param device Device specific data
+ * @param length Length of data buffer
+ * @param buffer Data buffer
+ * @param timeout Timeout in milliseconds
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, int timeout)
+{
+	struct usb_transfer_state *xs = device->xfer;
+	int rc, status, read;
+
+	lockTransfers(xs);
+
+	if (!xs->insubmitted && (submitBulkIn(device) != USB_OK)) {
+		unlockTransfers(xs);
 		*length = 0;
+		return ERR_USB;
+	}
+
+	if (waitForCompletion(xs, &xs->indone, timeout) < 0) {
+		/*
+		 * Cancel like a synchronous transfer would do, so that a late response is not
+		 * taken as the response to the next command
+		 */
+		if (libusb_cancel_transfer(xs->in) == LIBUSB_SUCCESS) {
+			waitForCompletion(xs, &xs->indone, 0);
+		}
+	}
+
+	status = xs->in->status;
+	read = xs->in->actual_length;
+	rc = USB_OK;
+
+	if ((status != LIBUSB_TRANSFER_COMPLETED) || ((unsigned int)read > *length)) {
 #ifdef DEBUG
-		ctccid_debug("libusb_bulk_transfer (read) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+		ctccid_debug("libusb bulk transfer (read) failed. status = %i, read=%i, length=%i\n", status, read, *length);
 #endif
-		return ERR_USB;
+		rc = ERR_USB;
+		read = 0;
 	}
 
+	memcpy(buffer, xs->inbuff, read);
 	*length = read;
 
-	return USB_OK;
+	if (status != LIBUSB_TRANSFER_NO_DEVICE) {
+		submitBulkIn(device);
+	} else {
+		xs->insubmitted = 0;
+	}
+
+	unlockTransfers(xs);
+
+	return rc;
+}
+
+
+
+/**
+ * Return the number of slot change notifications received from the reader on the interrupt endpoint.
+ * The slot status only needs to be queried again if the value changed
+ *
+ * @param device Structure with device specific data
+ * @return Number of notifications or -1 if the reader does not send notifications
+ */
+int USB_GetSlotChanges(usb_device_t *device)
+{
+	struct usb_transfer_state *xs = device->xfer;
+	int changes;
+
+	if ((xs == NULL) || (xs->intr == NULL)) {
+		return -1;
+	}
+
+	lockTransfers(xs);
+	changes = xs->intrsubmitted ? (int)(xs->slotchanges & 0x7FFFFFFF) : -1;
+	unlockTransfers(xs);
+
+	return changes;
+}
+
+
+
+/**
+ * Wait for a slot change notification, the arrival or removal of a reader
+ *
+ * @param event Event counter returned by the last call, which is updated on return
+ * @param timeout Timeout in milliseconds or 0 to wait without timeout
+ * @return Status code \ref USB_OK, \ref ERR_TIMEOUT
+ */
+int USB_WaitForEvent(unsigned int *event, int timeout)
+{
+	int rc = USB_OK;
+#ifdef _WIN32
+	AcquireSRWLockExclusive(&slotEventLock);
+
+	while (*event == slotEvents) {
+		if (!SleepConditionVariableSRW(&slotEventSignal, &slotEventLock, timeout ? timeout : INFINITE, 0)) {
+			rc = (*event == slotEvents) ? ERR_TIMEOUT : USB_OK;
+			break;
+		}
+	}
+
+	*event = slotEvents;
+	ReleaseSRWLockExclusive(&slotEventLock);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&slotEventLock);
+
+	while (*event == slotEvents) {
+		if (timeout == 0) {
+			pthread_cond_wait(&slotEventSignal, &slotEventLock);
+		} else if (pthread_cond_timedwait(&slotEventSignal, &slotEventLock, &ts) == ETIMEDOUT) {
+			rc = (*event == slotEvents) ? ERR_TIMEOUT : USB_OK;
+			break;
+		}
+	}
+
+	*event = slotEvents;
+	pthread_mutex_unlock(&slotEventLock);
+#endif
+	return rc;
+}
+
+
+
+/**
+ * Wake up all threads waiting in USB_WaitForEvent(), e.g. if the caller shuts down
+ */
+void USB_SignalEvent(void)
+{
+	signalSlotEvent();
 }
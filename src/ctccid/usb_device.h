@@ -64,14 +64,33 @@
 #define USB_WRITE_TIMEOUT (5 * 1000)
 
 /**
- * Timeout value for reading data
+ * Timeout value for reading data, if no timeout is derived from the protocol parameter
  */
 #define USB_READ_TIMEOUT  (3 * 1000)
 
+/**
+ * Interval in milliseconds at which the event thread checks for termination
+ */
+#define USB_EVENT_INTERVAL  100
+
+/**
+ * Bounds for the size of the bulk in transfer buffer, which is taken from dwMaxCCIDMessageLength
+ */
+#define USB_MIN_MESSAGE_LENGTH  (10 + 261)
+#define USB_MAX_MESSAGE_LENGTH  (10 + 65544)
+
+/**
+ * Messages received on the interrupt endpoint
+ */
+#define USB_MSG_NOTIFY_SLOT_CHANGE  0x50
+#define USB_MSG_HARDWARE_ERROR      0x51
+#define USB_INTERRUPT_LENGTH        8
+
 #define USB_OK               0             /* Successful completion           */
 #define ERR_NO_READER       -1             /* Reader not found                */
 #define ERR_USB             -2             /* USB error                       */
 #define ERR_ARG             -3             /* Invalid parameter or value      */
+#define ERR_TIMEOUT         -4             /* No event before timeout         */
 
 /**
  * Data structure encapsulating all information necessary
@@ -105,6 +124,16 @@ typedef struct usb_device {
          */
         uint8_t bulk_out;
 
+        /**
+         * ID of interrupt in or 0 if the reader has none
+         */
+        uint8_t interrupt_in;
+
+        /**
+         * Asynchronous transfers and their completion state
+         */
+        struct usb_transfer_state *xfer;
+
 } usb_device_t;
 
 int USB_Enumerate(unsigned char *readers, int *len, int options);
@@ -113,6 +142,11 @@ int USB_Close(usb_device_t **device);
 void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length);
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer);
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer);
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, int timeout);
+int USB_GetDataRates(usb_device_t *device, unsigned int *rates, int *count);
+int USB_GetSlotChanges(usb_device_t *device);
+int USB_WaitForEvent(unsigned int *event, int timeout);
+void USB_SignalEvent(void);
 
 #endif
 
@@ -0,0 +1,951 @@
+/**
+ * CT-API for CCID Driver
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file usb_mock.c
+ * @brief Software CCID reader with an emulated T=1 card behind the USB abstraction layer
+ *
+ * The mock replaces usb_device.c to run the CCID, T=1 and CT-API layers without reader hardware,
+ * e.g. for throughput measurements and regression tests on a build machine. It is configured with
+ * environment variables, which are read once:
+ *
+ * CTCCID_MOCK_READERS   Number of readers, default 1
+ * CTCCID_MOCK_LEVEL     Exchange level "tpdu", "short" or "extended", default "tpdu"
+ * CTCCID_MOCK_MAXMSG    dwMaxCCIDMessageLength, default 271 or 1034 for the extended APDU level
+ * CTCCID_MOCK_DELAY     Latency of a bulk transfer in microseconds, default 0. A read with a shorter
+ *                       timeout fails after the timeout
+ * CTCCID_MOCK_RATE      Data rate between reader and card in bit/s, 0 (default) for no delay
+ * CTCCID_MOCK_WTX       Request a time extension for every n-th APDU, 0 (default) for never
+ * CTCCID_MOCK_ERRORS    Reject or corrupt one in n T=1 blocks at random, 0 (default) for never
+ *
+ * The card answers GET CHALLENGE with random bytes and all other commands with 9000.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include <common/mutex.h>
+
+#include "usb_device.h"
+#include "ccid_usb.h"
+#include "ccidT1.h"
+
+#ifdef DEBUG
+#include "ctccid_debug.h"
+#endif
+
+#define MOCK_BUS		1
+#define MOCK_MAX_APDU		(4 + 3 + 65535 + 3)
+#define MOCK_MAX_RESPONSE	(65536 + 2)
+
+/*
+ * ATR of the SmartCard-HSM: TA1=18, T=1 with IFSC=254, BWI=4 and CWI=5
+ */
+static unsigned char mockATR[] = {
+	0x3B,0xFE,0x18,0x00,0x00,0x81,0x31,0xFE,0x45,0x80,0x31,0x81,0x54,0x48,0x53,0x4D,
+	0x31,0x73,0x80,0x21,0x40,0x81,0x07,0xFA
+};
+
+struct mock_config {
+	int readers;
+	unsigned int features;
+	unsigned int maxmsg;
+	long delay;
+	long rate;
+	unsigned int wtx;
+	unsigned int errors;
+};
+
+static struct mock_config config;
+static int configured = 0;
+static STATIC_MUTEX configLock = STATIC_MUTEX_INITIALIZER;
+
+/*
+ * Counter of reader removals, used to wake up threads in USB_WaitForEvent()
+ */
+static volatile unsigned int slotEvents = 0;
+#ifdef _WIN32
+static SRWLOCK slotEventLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE slotEventSignal = CONDITION_VARIABLE_INIT;
+#else
+static pthread_mutex_t slotEventLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slotEventSignal = PTHREAD_COND_INITIALIZER;
+#endif
+
+/*
+ * Emulated reader and card. Calls for a device are serialized by the caller, so the state
+ * is not locked
+ */
+struct mock_device {
+	usb_device_t device;			/* Must be first, as the mock is passed as usb_device_t */
+	unsigned short port;
+	unsigned char desc[54];
+	unsigned int maxdata;			/* Maximum data in a CCID message                       */
+	int powered;
+	int pps;				/* PPS request possible after power on                  */
+	unsigned int seed;			/* State of the generator for random data and errors    */
+
+	int ns;					/* Send sequence number of the card                     */
+	int nr;					/* Expected sequence number of the next host I-block    */
+	int ifsd;				/* Maximum INF size of blocks sent to the host          */
+	unsigned char lastblk[4 + 254];		/* Last block sent, for retransmission                  */
+	int lastlen;
+
+	unsigned int apdus;			/* Number of APDUs processed                            */
+	unsigned char *cmd;			/* Command APDU, assembled from chained blocks          */
+	unsigned int cmdlen;
+	unsigned char *rsp;			/* Response APDU, sent in chained blocks                */
+	unsigned int rsplen;
+	unsigned int rspofs;
+
+	unsigned char *out;			/* CCID response message returned by the next USB_Read  */
+	unsigned int outlen;
+	int timeext;				/* Time extension messages to send before the response  */
+};
+
+
+
+static int getIntValue(const char *name, int def)
+{
+	char *po = getenv(name);
+
+	return po ? atoi(po) : def;
+}
+
+
+
+static void configure(void)
+{
+	char *po;
+
+	static_mutex_lock(&configLock);
+
+	if (!configured) {
+		config.readers = getIntValue("CTCCID_MOCK_READERS", 1);
+
+		config.features = 0x000000BA;		/* Automatic parameters, voltage, clock and baud rate */
+		config.maxmsg = 10 + BUFFMAX;
+
+		po = getenv("CTCCID_MOCK_LEVEL");
+		if (po && !strcmp(po, "extended")) {
+			config.features |= FEATURE_EXTENDED_APDU;
+			config.maxmsg = 10 + 1024;
+		} else if (po && !strcmp(po, "short")) {
+			config.features |= FEATURE_SHORT_APDU;
+		} else {
+			config.features |= FEATURE_TPDU;
+		}
+
+		config.maxmsg = getIntValue("CTCCID_MOCK_MAXMSG", config.maxmsg);
+		if (config.maxmsg < USB_MIN_MESSAGE_LENGTH) {
+			config.maxmsg = USB_MIN_MESSAGE_LENGTH;
+		}
+		if (config.maxmsg > 10 + XFRMAX) {
+			config.maxmsg = 10 + XFRMAX;
+		}
+
+		config.delay = getIntValue("CTCCID_MOCK_DELAY", 0);
+		config.rate = getIntValue("CTCCID_MOCK_RATE", 0);
+		config.wtx = getIntValue("CTCCID_MOCK_WTX", 0);
+		config.errors = getIntValue("CTCCID_MOCK_ERRORS", 0);
+
+#ifdef DEBUG
+		ctccid_debug("Mock with %d readers, features %08x, dwMaxCCIDMessageLength %u\n", config.readers, config.features, config.maxmsg);
+#endif
+		configured = 1;
+	}
+
+	static_mutex_unlock(&configLock);
+}
+
+
+
+/**
+ * Suspend the calling thread to emulate the latency of the USB link or the card
+ */
+static void delay(long us)
+{
+	if (us <= 0) {
+		return;
+	}
+
+#ifdef _WIN32
+	Sleep((us + 999) / 1000);
+#else
+	{
+		struct timespec ts;
+
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = (us % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+
+
+/**
+ * Return the time in microseconds to transmit len bytes between reader and card
+ */
+static long cardTime(unsigned int len)
+{
+	if (config.rate <= 0) {
+		return 0;
+	}
+	return (long)((len * 10LL * 1000000LL) / config.rate);
+}
+
+
+
+static void signalSlotEvent(void)
+{
+#ifdef _WIN32
+	AcquireSRWLockExclusive(&slotEventLock);
+	slotEvents++;
+	WakeAllConditionVariable(&slotEventSignal);
+	ReleaseSRWLockExclusive(&slotEventLock);
+#else
+	pthread_mutex_lock(&slotEventLock);
+	slotEvents++;
+	pthread_cond_broadcast(&slotEventSignal);
+	pthread_mutex_unlock(&slotEventLock);
+#endif
+}
+
+
+
+static void putLong(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+}
+
+
+
+static void buildDescriptor(struct mock_device *md)
+{
+	unsigned char *d = md->desc;
+
+	memset(d, 0, sizeof(md->desc));
+	d[0] = sizeof(md->desc);		/* bLength                                  */
+	d[1] = 0x21;				/* bDescriptorType                          */
+	d[2] = 0x10;				/* bcdCCID 1.10                             */
+	d[3] = 0x01;
+	d[5] = 0x07;				/* bVoltageSupport 5V, 3V and 1.8V          */
+	putLong(d + 6, 0x00000002);		/* dwProtocols T=1                          */
+	putLong(d + 10, 4000);			/* dwDefaultClock 4 MHz                     */
+	putLong(d + 14, 4000);			/* dwMaximumClock                           */
+	putLong(d + 19, 10752);			/* dwDataRate                               */
+	putLong(d + 23, 344086);		/* dwMaxDataRate                            */
+	putLong(d + 28, 254);			/* dwMaxIFSD                                */
+	putLong(d + 40, config.features);	/* dwFeatures                               */
+	putLong(d + 44, config.maxmsg);		/* dwMaxCCIDMessageLength                   */
+	d[48] = 0xFF;				/* bClassGetResponse                        */
+	d[49] = 0xFF;				/* bClassEnvelope                           */
+	d[53] = 0x01;				/* bMaxCCIDBusySlots                        */
+}
+
+
+
+/**
+ * Prepare the CCID response message returned by the next call to USB_Read()
+ */
+static void setResponse(struct mock_device *md, unsigned char type, unsigned char *seq, unsigned char status,
+			unsigned char error, unsigned char chain, unsigned char *data, unsigned int len)
+{
+	unsigned char *msg = md->out;
+
+	memset(msg, 0, 10);
+	msg[0] = type;
+	putLong(msg + 1, len);
+	msg[5] = 0;
+	msg[6] = *seq;
+	msg[7] = status;
+	msg[8] = error;
+	msg[9] = chain;
+	if (len > 0) {
+		memcpy(msg + 10, data, len);
+	}
+	md->outlen = 10 + len;
+}
+
+
+
+static void slotStatus(struct mock_device *md, unsigned char *req, unsigned char type)
+{
+	setResponse(md, type, req + 6, md->powered ? ICC_PRESENT_AND_ACTIVE : ICC_PRESENT_AND_INACTIVE, 0, 0, NULL, 0);
+}
+
+
+
+static unsigned char nextRandom(struct mock_device *md)
+{
+	md->seed ^= md->seed << 13;
+	md->seed ^= md->seed >> 17;
+	md->seed ^= md->seed << 5;
+	return (unsigned char)md->seed;
+}
+
+
+
+/**
+ * Decide if a transmission error is emulated for the next block. Errors are not periodic, as
+ * a fixed period could coincide with the retransmission pattern and never let a block pass
+ */
+static int injectError(struct mock_device *md)
+{
+	if (!config.errors) {
+		return 0;
+	}
+	nextRandom(md);
+	return (md->seed % config.errors) == 0;
+}
+
+
+
+/**
+ * Process the command APDU in md->cmd and place the response APDU in md->rsp
+ */
+static void processAPDU(struct mock_device *md)
+{
+	unsigned char *apdu = md->cmd;
+	unsigned int le, i;
+
+	md->apdus++;
+	md->rspofs = 0;
+	md->rsplen = 0;
+
+	if (md->cmdlen < 4) {
+		md->rsp[md->rsplen++] = 0x67;
+		md->rsp[md->rsplen++] = 0x00;
+		return;
+	}
+
+	if (apdu[1] == 0x84) {				/* GET CHALLENGE */
+		if (md->cmdlen == 5) {
+			le = apdu[4] ? apdu[4] : 256;
+		} else if ((md->cmdlen == 7) && (apdu[4] == 0) && !(config.features & FEATURE_SHORT_APDU)) {
+			le = (apdu[5] << 8) | apdu[6];
+			le = le ? le : 65536;
+		} else {
+			md->rsp[md->rsplen++] = 0x67;
+			md->rsp[md->rsplen++] = 0x00;
+			return;
+		}
+
+		for (i = 0; i < le; i++) {
+			md->rsp[md->rsplen++] = nextRandom(md);
+		}
+	}
+
+	md->rsp[md->rsplen++] = 0x90;
+	md->rsp[md->rsplen++] = 0x00;
+}
+
+
+
+/**
+ * Send a T=1 block from the card, with a corrupted LRC if a transmission error is emulated
+ */
+static void sendBlock(struct mock_device *md, unsigned char *req, unsigned char pcb, unsigned char *inf, int len)
+{
+	unsigned char *blk = md->lastblk;
+	unsigned char lrc = 0;
+	int i;
+
+	blk[0] = 0;
+	blk[1] = pcb;
+	blk[2] = (unsigned char)len;
+	if (len > 0) {
+		memcpy(blk + 3, inf, len);
+	}
+
+	for (i = 0; i < len + 3; i++) {
+		lrc ^= blk[i];
+	}
+	blk[len + 3] = lrc;
+	md->lastlen = len + 4;
+
+	setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0, 0, 0, blk, md->lastlen);
+
+	if (injectError(md)) {
+		md->out[10 + md->lastlen - 1] ^= 0xFF;
+#ifdef DEBUG
+		ctccid_debug("Mock corrupts block with PCB %02x\n", pcb);
+#endif
+	}
+}
+
+
+
+/**
+ * Send the next I-block of the response APDU
+ */
+static void sendNextIBlock(struct mock_device *md, unsigned char *req)
+{
+	unsigned int len = md->rsplen - md->rspofs;
+	int more = 0;
+
+	if (len > (unsigned int)md->ifsd) {
+		len = md->ifsd;
+		more = 1;
+	}
+
+	sendBlock(md, req, CODEIBLOCK(md->ns, more), md->rsp + md->rspofs, len);
+	md->rspofs += len;
+	md->ns = 1 - md->ns;
+}
+
+
+
+/**
+ * Process a T=1 block received from the host and prepare the block sent in response
+ */
+static void receiveBlock(struct mock_device *md, unsigned char *req, unsigned char *blk, unsigned int len)
+{
+	unsigned char lrc = 0, pcb;
+	unsigned int i;
+
+	for (i = 0; i + 1 < len; i++) {
+		lrc ^= blk[i];
+	}
+
+	if ((len < 4) || (len != (unsigned int)blk[2] + 4) || (lrc != blk[len - 1]) ||
+	    injectError(md)) {
+#ifdef DEBUG
+		ctccid_debug("Mock rejects block\n");
+#endif
+		sendBlock(md, req, CODERBLOCK(md->nr, RERR_EDC), NULL, 0);
+		return;
+	}
+
+	pcb = blk[1];
+
+	if (ISIBLOCK(pcb)) {
+		if ((NS(pcb) != md->nr) || (md->cmdlen + blk[2] > MOCK_MAX_APDU)) {
+			sendBlock(md, req, CODERBLOCK(md->nr, RERR_OTHER), NULL, 0);
+			return;
+		}
+
+		memcpy(md->cmd + md->cmdlen, blk + 3, blk[2]);
+		md->cmdlen += blk[2];
+		md->nr = 1 - md->nr;
+
+		if (MORE(pcb)) {
+			sendBlock(md, req, CODERBLOCK(md->nr, RERR_NONE), NULL, 0);
+			return;
+		}
+
+		processAPDU(md);
+		md->cmdlen = 0;
+
+		if (config.wtx && !(md->apdus % config.wtx)) {
+			unsigned char mult = 1;
+
+			sendBlock(md, req, CODESBLOCK(WTXREQ), &mult, 1);
+			return;
+		}
+
+		sendNextIBlock(md, req);
+		return;
+	}
+
+	if (ISRBLOCK(pcb)) {
+		if (!RERR(pcb) && (NR(pcb) == md->ns) && (md->rspofs < md->rsplen)) {
+			sendNextIBlock(md, req);
+		} else if (md->lastlen == 0) {
+			sendBlock(md, req, CODERBLOCK(md->nr, RERR_OTHER), NULL, 0);
+		} else {
+			setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0, 0, 0, md->lastblk, md->lastlen);
+		}
+		return;
+	}
+
+	switch(SBLOCKFUNC(pcb)) {
+	case RESYNCHREQ:
+		md->ns = 0;
+		md->nr = 0;
+		md->ifsd = 32;
+		md->cmdlen = 0;
+		md->rsplen = md->rspofs = 0;
+		sendBlock(md, req, CODESBLOCK(RESYNCHRES), NULL, 0);
+		break;
+	case IFSREQ:
+		if (blk[2] == 1) {
+			md->ifsd = blk[3];
+		}
+		sendBlock(md, req, CODESBLOCK(IFSRES), blk + 3, blk[2]);
+		break;
+	case ABORTREQ:
+		md->cmdlen = 0;
+		md->rsplen = md->rspofs = 0;
+		sendBlock(md, req, CODESBLOCK(ABORTRES), NULL, 0);
+		break;
+	case WTXRES:
+		sendNextIBlock(md, req);
+		break;
+	default:
+		sendBlock(md, req, CODERBLOCK(md->nr, RERR_OTHER), NULL, 0);
+		break;
+	}
+}
+
+
+
+/**
+ * Send the next part of the response APDU in a RDR_to_PC_DataBlock with APDU level exchange
+ */
+static void sendAPDUResponse(struct mock_device *md, unsigned char *req)
+{
+	unsigned int len = md->rsplen - md->rspofs;
+	unsigned char chain;
+
+	if (len > md->maxdata) {
+		len = md->maxdata;
+		chain = md->rspofs ? 3 : 1;
+	} else {
+		chain = md->rspofs ? 2 : 0;
+	}
+
+	setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0, 0, chain, md->rsp + md->rspofs, len);
+	md->rspofs += len;
+}
+
+
+
+/**
+ * Process a PC_to_RDR_XfrBlock with short or extended APDU level exchange
+ */
+static void xfrAPDU(struct mock_device *md, unsigned char *req, unsigned char *data, unsigned int len)
+{
+	unsigned short level = req[8] | (req[9] << 8);
+
+	if (level == 0x10) {
+		sendAPDUResponse(md, req);
+		return;
+	}
+
+	if ((level == 0) || (level == 1)) {
+		md->cmdlen = 0;
+	}
+
+	if (md->cmdlen + len > MOCK_MAX_APDU) {
+		md->cmdlen = 0;
+		setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0x40, ERR_XFR_OVERRUN, 0, NULL, 0);
+		return;
+	}
+
+	memcpy(md->cmd + md->cmdlen, data, len);
+	md->cmdlen += len;
+
+	if ((level == 1) || (level == 3)) {
+		setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0, 0, 0x10, NULL, 0);
+		return;
+	}
+
+	processAPDU(md);
+	md->cmdlen = 0;
+
+	if (config.wtx && !(md->apdus % config.wtx)) {
+		md->timeext = 1;
+	}
+
+	sendAPDUResponse(md, req);
+}
+
+
+
+/**
+ * Process a PC_to_RDR_XfrBlock
+ */
+static void xfrBlock(struct mock_device *md, unsigned char *req, unsigned char *data, unsigned int len)
+{
+	if (!md->powered) {
+		setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0x40 | ICC_PRESENT_AND_INACTIVE, ERR_ICC_MUTE, 0, NULL, 0);
+		return;
+	}
+
+	if (md->pps && (len == 4) && (data[0] == 0xFF)) {		/* PPS request is echoed */
+		setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0, 0, 0, data, len);
+		return;
+	}
+	md->pps = 0;
+
+	if (config.features & (FEATURE_SHORT_APDU | FEATURE_EXTENDED_APDU)) {
+		xfrAPDU(md, req, data, len);
+	} else {
+		receiveBlock(md, req, data, len);
+	}
+}
+
+
+
+static void powerOn(struct mock_device *md, unsigned char *req)
+{
+	md->powered = 1;
+	md->pps = 1;
+	md->ns = 0;
+	md->nr = 0;
+	md->ifsd = 32;
+	md->lastlen = 0;
+	md->cmdlen = 0;
+	md->rsplen = md->rspofs = 0;
+	setResponse(md, MSG_TYPE_RDR_to_PC_DataBlock, req + 6, 0, 0, 0, mockATR, sizeof(mockATR));
+}
+
+
+
+int USB_Enumerate(unsigned char *readers, int *len, int options)
+{
+	int i, cnt, l;
+	unsigned char *po;
+	char name[32];
+
+	configure();
+
+	cnt = 0;
+	po = readers;
+
+	for (i = 0; i < config.readers; i++) {
+		if (*len - cnt < 3) {
+			return ERR_ARG;
+		}
+
+		*po++ = MOCK_BUS;
+		*po++ = (unsigned char)(i + 1);
+		cnt += 2;
+
+		if (!(options & NO_READER_NAME)) {
+			l = snprintf(name, sizeof(name), "SmartCard-HSM (MOCK%04d)", i + 1);
+
+			if (*len - cnt < l + 1) {
+				return ERR_ARG;
+			}
+
+			memcpy(po, name, l);
+			po += l;
+			cnt += l;
+		}
+
+		*po++ = 0;
+		cnt++;
+	}
+
+	*len = cnt;
+	return USB_OK;
+}
+
+
+
+/**
+ * Open the mock reader with the index or port number pn
+ *
+ * @param pn Port number
+ * @param device Structure holding device specific data
+ * @return Status code \ref USB_OK, \ref ERR_NO_READER, \ref ERR_USB
+ */
+int USB_Open(unsigned short pn, usb_device_t **device)
+{
+	struct mock_device *md;
+	int i;
+
+	configure();
+
+	for (i = 0; i < config.readers; i++) {
+		if ((pn == i) || (pn == ((MOCK_BUS << 8) | (i + 1)))) {
+			break;
+		}
+	}
+
+	if (i >= config.readers) {
+		return ERR_NO_READER;
+	}
+
+	md = calloc(1, sizeof(struct mock_device));
+	if (md == NULL) {
+		return ERR_USB;
+	}
+
+	md->port = (MOCK_BUS << 8) | (i + 1);
+	md->maxdata = config.maxmsg - 10;
+	md->seed = 0x2545F491 ^ md->port;
+	buildDescriptor(md);
+
+	md->cmd = malloc(MOCK_MAX_APDU);
+	md->rsp = malloc(MOCK_MAX_RESPONSE);
+	md->out = malloc(10 + XFRMAX);
+
+	if ((md->cmd == NULL) || (md->rsp == NULL) || (md->out == NULL)) {
+		free(md->cmd);
+		free(md->rsp);
+		free(md->out);
+		free(md);
+		return ERR_USB;
+	}
+
+	*device = &md->device;
+	return USB_OK;
+}
+
+
+
+/**
+ * Return the 54 byte CCID Descriptor of the mock reader
+ */
+void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length)
+{
+	struct mock_device *md = (struct mock_device *)device;
+
+	if (length)
+		*length = sizeof(md->desc);
+	if (desc)
+		*desc = md->desc;
+}
+
+
+
+int USB_GetDataRates(usb_device_t *device, unsigned int *rates, int *count)
+{
+	*count = 0;
+	return USB_OK;
+}
+
+
+
+int USB_Close(usb_device_t **device)
+{
+	struct mock_device *md = (struct mock_device *)*device;
+
+	free(md->cmd);
+	free(md->rsp);
+	free(md->out);
+	free(md);
+	*device = NULL;
+
+	signalSlotEvent();
+
+	return USB_OK;
+}
+
+
+
+/**
+ * Process a CCID command message and prepare the response for the next USB_Read()
+ *
+ * @param device Device specific data
+ * @param length Length of data to write
+ * @param buffer Data buffer
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
+{
+	struct mock_device *md = (struct mock_device *)device;
+	unsigned int len;
+
+	if ((length < 10) || (length > config.maxmsg)) {
+		return ERR_USB;
+	}
+
+	len = buffer[1] | (buffer[2] << 8) | (buffer[3] << 16) | ((unsigned int)buffer[4] << 24);
+	if (len != length - 10) {
+		return ERR_USB;
+	}
+
+	delay(config.delay);
+
+	md->outlen = 0;
+	md->timeext = 0;
+
+	switch(buffer[0]) {
+	case MSG_TYPE_PC_to_RDR_IccPowerOn:
+		powerOn(md, buffer);
+		break;
+	case MSG_TYPE_PC_to_RDR_IccPowerOff:
+		md->powered = 0;
+		slotStatus(md, buffer, MSG_TYPE_RDR_to_PC_SlotStatus);
+		break;
+	case MSG_TYPE_PC_to_RDR_GetSlotStatus:
+		slotStatus(md, buffer, MSG_TYPE_RDR_to_PC_SlotStatus);
+		break;
+	case MSG_TYPE_PC_to_RDR_SetParameters:
+		setResponse(md, MSG_TYPE_RDR_to_PC_Parameters, buffer + 6, md->powered ? 0 : 1, 0, 1, buffer + 10, len);
+		break;
+	case MSG_TYPE_PC_to_RDR_XfrBlock:
+		xfrBlock(md, buffer, buffer + 10, len);
+		delay(cardTime(len + md->outlen - 10));
+		break;
+	default:
+		setResponse(md, MSG_TYPE_RDR_to_PC_SlotStatus, buffer + 6, 0x40, 0, 0, NULL, 0);
+		break;
+	}
+
+	return USB_OK;
+}
+
+
+
+int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer)
+{
+	return USB_ReadTimeout(device, length, buffer, USB_READ_TIMEOUT);
+}
+
+
+
+/**
+ * Return the response prepared by the last USB_Write(), preceded by a time extension if configured
+ *
+ * @param device Device specific data
+ * @param length Length of data buffer
+ * @param buffer Data buffer
+ * @param timeout Timeout in milliseconds
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_ReadTimeout(usb_device_t *device, unsigned int *length, unsigned char *buffer, int timeout)
+{
+	struct mock_device *md = (struct mock_device *)device;
+
+	if ((timeout > 0) && (config.delay > timeout * 1000L)) {
+		delay(timeout * 1000L);		/* Response arrives after the timeout */
+		*length = 0;
+		return ERR_USB;
+	}
+
+	delay(config.delay);
+
+	if (md->timeext) {
+		md->timeext--;
+
+		if (*length < 10) {
+			*length = 0;
+			return ERR_USB;
+		}
+
+		memcpy(buffer, md->out, 10);
+		memset(buffer + 1, 0, 4);
+		buffer[7] = 0x80;			/* Time extension requested       */
+		buffer[8] = 1;				/* Multiplier for BWT             */
+		buffer[9] = 0;
+		*length = 10;
+		return USB_OK;
+	}
+
+	if ((md->outlen == 0) || (md->outlen > *length)) {
+#ifdef DEBUG
+		ctccid_debug("Mock read without response, outlen=%u, length=%u\n", md->outlen, *length);
+#endif
+		*length = 0;
+		return ERR_USB;
+	}
+
+	memcpy(buffer, md->out, md->outlen);
+	*length = md->outlen;
+	md->outlen = 0;
+
+	return USB_OK;
+}
+
+
+
+/**
+ * The mock reader never changes the slot state by itself
+ */
+int USB_GetSlotChanges(usb_device_t *device)
+{
+	return 0;
+}
+
+
+
+/**
+ * Wait for the removal of a mock reader
+ *
+ * @param event Event counter returned by the last call, which is updated on return
+ * @param timeout Timeout in milliseconds or 0 to wait without timeout
+ * @return Status code \ref USB_OK, \ref ERR_TIMEOUT
+ */
+int USB_WaitForEvent(unsigned int *event, int timeout)
+{
+	int rc = USB_OK;
+#ifdef _WIN32
+	AcquireSRWLockExclusive(&slotEventLock);
+
+	while (*event == slotEvents) {
+		if (!SleepConditionVariableSRW(&slotEventSignal, &slotEventLock, timeout ? timeout : INFINITE, 0)) {
+			rc = (*event == slotEvents) ? ERR_TIMEOUT : USB_OK;
+			break;
+		}
+	}
+
+	*event = slotEvents;
+	ReleaseSRWLockExclusive(&slotEventLock);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&slotEventLock);
+
+	while (*event == slotEvents) {
+		if (timeout == 0) {
+			pthread_cond_wait(&slotEventSignal, &slotEventLock);
+		} else if (pthread_cond_timedwait(&slotEventSignal, &slotEventLock, &ts) != 0) {
+			rc = (*event == slotEvents) ? ERR_TIMEOUT : USB_OK;
+			break;
+		}
+	}
+
+	*event = slotEvents;
+	pthread_mutex_unlock(&slotEventLock);
+#endif
+	return rc;
+}
+
+
+
+/**
+ * Wake up all threads waiting in USB_WaitForEvent(), e.g. if the caller shuts down
+ */
+void USB_SignalEvent(void)
+{
+	signalSlotEvent();
+}
@@ -1191,7 +1191,7 @@ static DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 		}
 	}
 
-	rc = p11prikey->C_DecryptInit(p11prikey, &mech);
+	rc = p11prikey->C_DecryptInit(p11prikey, NULL, &mech);
 
 	if (rc != CKR_OK) {
 		dwret = mapError(rc);
@@ -1201,7 +1201,7 @@ static DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	copyInverted(cryptogram, pInfo->pbData, pInfo->cbData);
 	plainlen = sizeof(plain);
 
-	rc = p11prikey->C_Decrypt(p11prikey, &mech, cryptogram, pInfo->cbData, plain, &plainlen);
+	rc = p11prikey->C_Decrypt(p11prikey, NULL, &mech, cryptogram, pInfo->cbData, plain, &plainlen);
 
 	if (rc != CKR_OK) {
 		dwret = mapError(rc);
@@ -31,15 +31,21 @@
  * @brief   Public key crypto implementation using OpenSSLs libcrypto
  */
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 // #include <openssl/ssl.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 #include <openssl/ec.h>
+#include <openssl/sha.h>
 // #include <openssl/conf.h>
 #include <openssl/err.h>
 
 #include <common/asn1.h>
 #include <common/cvc.h>
+#include <common/mutex.h>
 #include <pkcs11/session.h>
 #include <pkcs11/crypto.h>
 
@@ -61,12 +67,69 @@
 #define FUNC_CRYPTOFAILVIAOUT(msg) do { rv = translateError(); goto out; } while (0)
 #endif
 
+#if (OPENSSL_VERSION_NUMBER < 0x10100000)
+#define EVP_PKEY_up_ref(k) CRYPTO_add(&(k)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
+
+
+/**
+ * Lock protecting the public keys cached in objects. This is an OS lock, as the cache
+ * is also used by the worker threads of cryptoVerifyBatch()
+ */
+static MUTEX keyCacheMutex;
+static int keyCacheMutexValid = 0;
+
+static void stopVerifyPool();
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+/**
+ * Hash implementations fetched once from the default provider. Using the predefined
+ * EVP_sha*() objects would repeat the provider lookup for every digest operation.
+ */
+static const char *hashNames[] = { "SHA1", "SHA224", "SHA256", "SHA384", "SHA512" };
+static EVP_MD *fetchedHashes[5];
+#endif
+
+
+
+static void lockKeyCache()
+{
+	if (keyCacheMutexValid) {
+		mutex_lock(&keyCacheMutex);
+	}
+}
+
+
+
+static void unlockKeyCache()
+{
+	if (keyCacheMutexValid) {
+		mutex_unlock(&keyCacheMutex);
+	}
+}
+
 
 
 void cryptoInitialize()
 {
 #ifdef DEBUG
 	ERR_load_crypto_strings();
+#endif
+	if (!keyCacheMutexValid && (mutex_init(&keyCacheMutex) == 0)) {
+		keyCacheMutexValid = 1;
+	}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+	{
+		int i;
+
+		for (i = 0; i < 5; i++) {
+			if (fetchedHashes[i] == NULL) {
+				fetchedHashes[i] = EVP_MD_fetch(NULL, hashNames[i], NULL);
+			}
+		}
+	}
 #endif
 }
 
@@ -74,6 +137,24 @@ void cryptoInitialize()
 
 void cryptoFinalize()
 {
+	stopVerifyPool();
+
+	if (keyCacheMutexValid) {
+		keyCacheMutexValid = 0;
+		mutex_destroy(&keyCacheMutex);
+	}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+	{
+		int i;
+
+		for (i = 0; i < 5; i++) {
+			EVP_MD_free(fetchedHashes[i]);
+			fetchedHashes[i] = NULL;
+		}
+	}
+#endif
+
 #ifdef DEBUG_OPENSSL
 	ERR_free_strings();
 
@@ -117,17 +198,84 @@ static CK_RV translateError()
 
 
 /**
- * Digest input and verify signature
+ * Take the cached key context from the object or create a new context if the cached
+ * context is in use by another thread.
  */
-static CK_RV digestVerify(EVP_PKEY *key, const EVP_MD *hash, int padding, const unsigned char *data, int data_len, unsigned char *signature, int signature_len)
+static EVP_PKEY_CTX *takeKeyContext(struct p11Object_t *obj, EVP_PKEY *pkey)
+{
+	EVP_PKEY_CTX *pkey_ctx = NULL;
+
+	lockKeyCache();
+	if ((obj->publicKeyContext != NULL) && (EVP_PKEY_CTX_get0_pkey((EVP_PKEY_CTX *)obj->publicKeyContext) == pkey)) {
+		pkey_ctx = (EVP_PKEY_CTX *)obj->publicKeyContext;
+		obj->publicKeyContext = NULL;
+	}
+	unlockKeyCache();
+
+	if (pkey_ctx == NULL) {
+		pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	}
+
+	return pkey_ctx;
+}
+
+
+
+/**
+ * Return the key context to the object for the next operation. The context is discarded
+ * if the slot is occupied or if the cached key was invalidated in the meantime.
+ */
+static void returnKeyContext(struct p11Object_t *obj, EVP_PKEY_CTX *pkey_ctx)
+{
+	lockKeyCache();
+	if ((obj->publicKeyContext == NULL) && (obj->publicKey != NULL) && (EVP_PKEY_CTX_get0_pkey(pkey_ctx) == obj->publicKey)) {
+		obj->publicKeyContext = pkey_ctx;
+		pkey_ctx = NULL;
+	}
+	unlockKeyCache();
+
+	if (pkey_ctx != NULL) {
+		EVP_PKEY_CTX_free(pkey_ctx);
+	}
+}
+
+
+
+/**
+ * Release the key and key context cached in the object
+ *
+ * @param obj       the object
+ */
+void cryptoReleaseKey(struct p11Object_t *obj)
 {
-	EVP_MD_CTX *md_ctx;
 	EVP_PKEY_CTX *pkey_ctx;
-	CK_RV rv;
-	int rc;
+	EVP_PKEY *pkey;
 
-	md_ctx = EVP_MD_CTX_create();
-	EVP_MD_CTX_init(md_ctx);
+	lockKeyCache();
+	pkey = (EVP_PKEY *)obj->publicKey;
+	pkey_ctx = (EVP_PKEY_CTX *)obj->publicKeyContext;
+	obj->publicKey = NULL;
+	obj->publicKeyContext = NULL;
+	unlockKeyCache();
+
+	if (pkey_ctx != NULL) {
+		EVP_PKEY_CTX_free(pkey_ctx);
+	}
+
+	if (pkey != NULL) {
+		EVP_PKEY_free(pkey);
+	}
+}
+
+
+
+/**
+ * Prepare a message digest context for signature verification
+ */
+static CK_RV digestVerifyInit(EVP_MD_CTX *md_ctx, EVP_PKEY *key, const EVP_MD *hash, int padding)
+{
+	EVP_PKEY_CTX *pkey_ctx;
+	CK_RV rv = CKR_OK;
 
 	if (!EVP_DigestVerifyInit(md_ctx, &pkey_ctx, hash, NULL, key)) {
 		FUNC_CRYPTOFAILVIAOUT("EVP_DigestVerifyInit() failed");
@@ -145,22 +293,8 @@ static CK_RV digestVerify(EVP_PKEY *key, const EVP_MD *hash, int padding, const
 		}
 	}
 
-	if (!EVP_DigestVerifyUpdate(md_ctx, data, data_len)) {
-		FUNC_CRYPTOFAILVIAOUT("EVP_DigestVerifyUpdate() failed");
-	}
-
-	rc = EVP_DigestVerifyFinal(md_ctx, signature, signature_len);
-
-	if (rc < 0) {
-		FUNC_CRYPTOFAILVIAOUT("EVP_DigestVerifyFinal() failed");
-	}
-
-	rv = rc == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
-
 out:
-	EVP_MD_CTX_destroy(md_ctx);
-
-	FUNC_RETURNS(rv);
+	return rv;
 }
 
 
@@ -168,13 +302,17 @@ out:
 /**
  * Verify signature with provided hash value
  */
-static CK_RV verifyHash(EVP_PKEY *key, const EVP_MD *hash, int padding, const unsigned char *data, int data_len, unsigned char *signature, int signature_len)
+static CK_RV verifyHash(struct p11Object_t *obj, EVP_PKEY *key, const EVP_MD *hash, int padding, const unsigned char *data, int data_len, unsigned char *signature, int signature_len)
 {
 	EVP_PKEY_CTX *pkey_ctx;
 	CK_RV rv;
 	int rc;
 
-	pkey_ctx = EVP_PKEY_CTX_new(key, NULL);
+	pkey_ctx = takeKeyContext(obj, key);
+
+	if (pkey_ctx == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
 
 	if (!EVP_PKEY_verify_init(pkey_ctx)) {
 		FUNC_CRYPTOFAILVIAOUT("EVP_PKEY_verify_init() failed");
@@ -204,8 +342,33 @@ static CK_RV verifyHash(EVP_PKEY *key, const EVP_MD *hash, int padding, const un
 	rv = rc == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
 
 out:
-	EVP_PKEY_CTX_free(pkey_ctx);
+	returnKeyContext(obj, pkey_ctx);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Digest input and verify signature
+ *
+ * The input is hashed in one call and the hash is verified with the key context cached
+ * in the object, which is what EVP_DigestVerifyFinal() does internally. A separate
+ * EVP_DigestVerify context would need a new key context for every call.
+ */
+static CK_RV digestVerify(struct p11Object_t *obj, EVP_PKEY *key, const EVP_MD *hash, int padding, const unsigned char *data, int data_len, unsigned char *signature, int signature_len)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdlen;
+	CK_RV rv;
+
+	if (!EVP_Digest(data, data_len, md, &mdlen, hash, NULL)) {
+		FUNC_CRYPTOFAILVIAOUT("EVP_Digest() failed");
+	}
+
+	rv = verifyHash(obj, key, hash, padding, md, (int)mdlen, signature, signature_len);
 
+out:
 	FUNC_RETURNS(rv);
 }
 
@@ -261,13 +424,12 @@ static const EVP_MD *getHashForHashLen(int len) {
 
 
 /**
- * Verify with RSA key
+ * Create RSA public key from the CKA_MODULUS and CKA_PUBLIC_EXPONENT attributes
  */
-static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
+static CK_RV getRSAPublicKey(struct p11Object_t *obj, EVP_PKEY **ppkey)
 {
 	struct p11Attribute_t *modulus;
 	struct p11Attribute_t *public_exponent;
-	const EVP_MD *md = NULL;
 	RSA *rsa;
 	EVP_PKEY *pkey;
 	CK_RV rv;
@@ -279,9 +441,6 @@ static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_
 	if (rv == -1)
 		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_MODULUS not found");
 
-	if (modulus->attrData.ulValueLen != signature_len)
-		FUNC_FAILS(CKR_SIGNATURE_LEN_RANGE, "Length of modulus does not match signature length");
-
 	rv = findAttribute(obj, CKA_PUBLIC_EXPONENT, &public_exponent);
 
 	if (rv == -1)
@@ -302,89 +461,26 @@ static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_
 	pkey = EVP_PKEY_new();
 	EVP_PKEY_assign_RSA(pkey, rsa);
 
-	switch (mech) {
-		case CKM_SHA1_RSA_PKCS:
-			rv = digestVerify(pkey, EVP_sha1(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA224_RSA_PKCS:
-			rv = digestVerify(pkey, EVP_sha224(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA256_RSA_PKCS:
-			rv = digestVerify(pkey, EVP_sha256(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA384_RSA_PKCS:
-			rv = digestVerify(pkey, EVP_sha384(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA512_RSA_PKCS:
-			rv = digestVerify(pkey, EVP_sha512(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA1_RSA_PKCS_PSS:
-			rv = digestVerify(pkey, EVP_sha1(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA224_RSA_PKCS_PSS:
-			rv = digestVerify(pkey, EVP_sha224(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA256_RSA_PKCS_PSS:
-			rv = digestVerify(pkey, EVP_sha256(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA384_RSA_PKCS_PSS:
-			rv = digestVerify(pkey, EVP_sha384(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SHA512_RSA_PKCS_PSS:
-			rv = digestVerify(pkey, EVP_sha512(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_RSA_PKCS:
-			rv = verifyDigestInfo(rsa, in, in_len, signature, signature_len);
-			break;
-		case CKM_SC_HSM_PSS_SHA1:
-			rv = verifyHash(pkey, EVP_sha1(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SC_HSM_PSS_SHA224:
-			rv = verifyHash(pkey, EVP_sha224(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_RSA_PKCS_PSS:
-			md = getHashForHashLen(in_len);
-			if (md == NULL) {
-				FUNC_FAILS(CKR_DATA_LEN_RANGE, "getHashForHashLen() failed matching hash algorithm for provided input length");
-			}
-			rv = verifyHash(pkey, md, RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SC_HSM_PSS_SHA256:
-			rv = verifyHash(pkey, EVP_sha256(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SC_HSM_PSS_SHA384:
-			rv = verifyHash(pkey, EVP_sha384(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		case CKM_SC_HSM_PSS_SHA512:
-			rv = verifyHash(pkey, EVP_sha512(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
-			break;
-		default:
-			rv = CKR_MECHANISM_INVALID;
-			break;
-	}
-
-	EVP_PKEY_free(pkey);
+	*ppkey = pkey;
 
-	FUNC_RETURNS(rv);
+	FUNC_RETURNS(CKR_OK);
 }
 
 
 
 /**
- * Verify with ECDSA key
+ * Create EC public key from the CKA_EC_PARAMS and CKA_EC_POINT attributes
  */
-static CK_RV verifyECDSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
+static CK_RV getECPublicKey(struct p11Object_t *obj, EVP_PKEY **ppkey)
 {
 	struct p11Attribute_t *ecparam;
 	struct p11Attribute_t *ecpoint;
 	const unsigned char *po;
 	unsigned char *ppo;
-	unsigned char wrappedSig[140];
 	EC_GROUP *ecg = NULL;
 	EC_POINT *ecp = NULL;
 	EC_KEY *ec = NULL;
 	EVP_PKEY *pkey = NULL;
-	const EVP_MD *md = NULL;
 	CK_RV rv;
 	int rc, len;
 
@@ -444,32 +540,10 @@ static CK_RV verifyECDSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYT
 		FUNC_FAILVIAOUT(CKR_GENERAL_ERROR, "EVP_PKEY_assign_EC_KEY() failed");
 	}
 
-	len = sizeof(wrappedSig);
-	if (cvcWrapECDSASignature(signature, signature_len, wrappedSig, &len) < 0) {
-		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
-	}
-
-	switch (mech) {
-		case CKM_ECDSA_SHA1:
-			rv = digestVerify(pkey, EVP_sha1(), 0, in, in_len, wrappedSig, len);
-			break;
-		case CKM_SC_HSM_ECDSA_SHA224:
-			rv = digestVerify(pkey, EVP_sha224(), 0, in, in_len, wrappedSig, len);
-			break;
-		case CKM_SC_HSM_ECDSA_SHA256:
-			rv = digestVerify(pkey, EVP_sha256(), 0, in, in_len, wrappedSig, len);
-			break;
-		case CKM_ECDSA:
-			md = getHashForHashLen(in_len);
-			if (md == NULL) {
-				FUNC_FAILVIAOUT(CKR_DATA_LEN_RANGE, "getHashForHashLen() failed matching hash algorithm for provided input length");
-			}
-			rv = verifyHash(pkey, md, 0, in, in_len, wrappedSig, len);
-			break;
-		default:
-			FUNC_FAILVIAOUT(CKR_MECHANISM_INVALID, "Invalid mechanism for ECDSA");
-			break;
-	}
+	ec = NULL;
+	*ppkey = pkey;
+	pkey = NULL;
+	rv = CKR_OK;
 
 out:
 	if (ecg != NULL)
@@ -478,6 +552,9 @@ out:
 	if (ecp != NULL)
 		EC_POINT_free(ecp);
 
+	if (ec != NULL)
+		EC_KEY_free(ec);
+
 	if (pkey != NULL)
 		EVP_PKEY_free(pkey);
 
@@ -486,25 +563,61 @@ out:
 
 
 
-CK_RV stripOAEPPadding(unsigned char *raw, int rawlen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+/**
+ * Return the public key of the object. The key is created from the attributes on first use and
+ * cached in the object until the object is freed or an attribute changes.
+ *
+ * @param obj       the public key object
+ * @param ppkey     the key with a reference for the caller, which must be released with EVP_PKEY_free()
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static CK_RV getPublicKey(struct p11Object_t *obj, EVP_PKEY **ppkey)
 {
+	struct p11Attribute_t *keytype;
+	EVP_PKEY *pkey;
 	CK_RV rv;
 	int rc;
 
 	FUNC_CALLED();
 
-#if (OPENSSL_VERSION_NUMBER >= 0x10002000)
-	rc = RSA_padding_check_PKCS1_OAEP_mgf1(pData, (int)*pulDataLen, raw, rawlen, rawlen, NULL, 0, EVP_sha256(), NULL);
-	if (rc < 0) {
-		rv = translateError();
-		FUNC_FAILS(rv, "RSA_padding_check_PKCS1_OAEP_mgf1() failed");
+	lockKeyCache();
+	if (obj->publicKey != NULL) {
+		pkey = (EVP_PKEY *)obj->publicKey;
+		EVP_PKEY_up_ref(pkey);
+		unlockKeyCache();
+		*ppkey = pkey;
+		FUNC_RETURNS(CKR_OK);
 	}
+	unlockKeyCache();
 
-	*pulDataLen = (CK_ULONG)rc;
-	rv = CKR_OK;
-#else
-	rv = CKR_FUNCTION_NOT_SUPPORTED;
-#endif
+	rc = findAttribute(obj, CKA_KEY_TYPE, &keytype);
+
+	if (rc == -1)
+		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_KEY_TYPE not found");
+
+	switch (*(CK_KEY_TYPE *)keytype->attrData.pValue) {
+	case CKK_RSA:
+		rv = getRSAPublicKey(obj, &pkey);
+		break;
+	case CKK_EC:
+		rv = getECPublicKey(obj, &pkey);
+		break;
+	default:
+		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "CKA_KEY_TYPE is neither CKK_RSA nor CKK_EC");
+	}
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Creating public key failed");
+	}
+
+	lockKeyCache();
+	if (obj->publicKey == NULL) {
+		EVP_PKEY_up_ref(pkey);
+		obj->publicKey = pkey;
+	}
+	unlockKeyCache();
+
+	*ppkey = pkey;
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -512,52 +625,225 @@ CK_RV stripOAEPPadding(unsigned char *raw, int rawlen, CK_BYTE_PTR pData, CK_ULO
 
 
 /**
- * Encrypt with RSA
+ * Verify with RSA key
  */
-static CK_RV encryptRSA(struct p11Object_t *obj, int padding, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+static CK_RV verifyRSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
 {
-	struct p11Attribute_t *modulus;
-	struct p11Attribute_t *public_exponent;
-	unsigned char raw[512];
+	const EVP_MD *md = NULL;
 	RSA *rsa;
-	CK_RV rv = 0;
-	int rc;
+	EVP_PKEY *pkey;
+	CK_RV rv;
 
 	FUNC_CALLED();
 
-	rc = findAttribute(obj, CKA_MODULUS, &modulus);
-
-	if (rc == -1)
-		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_MODULUS not found");
-
-	if (out == NULL) {
-		*out_len = modulus->attrData.ulValueLen;
-		FUNC_RETURNS(CKR_OK);
+	rv = getPublicKey(obj, &pkey);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "getPublicKey() failed");
 	}
 
-	if (modulus->attrData.ulValueLen > *out_len) {
-		*out_len = modulus->attrData.ulValueLen;
-		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Length of output buffer too small");
+	if ((CK_ULONG)EVP_PKEY_size(pkey) != signature_len) {
+		EVP_PKEY_free(pkey);
+		FUNC_FAILS(CKR_SIGNATURE_LEN_RANGE, "Length of modulus does not match signature length");
 	}
 
-	rc = findAttribute(obj, CKA_PUBLIC_EXPONENT, &public_exponent);
+	rsa = EVP_PKEY_get1_RSA(pkey);
 
-	if (rc == -1)
-		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_EXPONENT not found");
+	switch (mech) {
+		case CKM_SHA1_RSA_PKCS:
+			rv = digestVerify(obj, pkey, EVP_sha1(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA224_RSA_PKCS:
+			rv = digestVerify(obj, pkey, EVP_sha224(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA256_RSA_PKCS:
+			rv = digestVerify(obj, pkey, EVP_sha256(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA384_RSA_PKCS:
+			rv = digestVerify(obj, pkey, EVP_sha384(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA512_RSA_PKCS:
+			rv = digestVerify(obj, pkey, EVP_sha512(), RSA_PKCS1_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA1_RSA_PKCS_PSS:
+			rv = digestVerify(obj, pkey, EVP_sha1(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA224_RSA_PKCS_PSS:
+			rv = digestVerify(obj, pkey, EVP_sha224(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA256_RSA_PKCS_PSS:
+			rv = digestVerify(obj, pkey, EVP_sha256(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA384_RSA_PKCS_PSS:
+			rv = digestVerify(obj, pkey, EVP_sha384(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SHA512_RSA_PKCS_PSS:
+			rv = digestVerify(obj, pkey, EVP_sha512(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_RSA_PKCS:
+			rv = verifyDigestInfo(rsa, in, in_len, signature, signature_len);
+			break;
+		case CKM_SC_HSM_PSS_SHA1:
+			rv = verifyHash(obj, pkey, EVP_sha1(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SC_HSM_PSS_SHA224:
+			rv = verifyHash(obj, pkey, EVP_sha224(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_RSA_PKCS_PSS:
+			md = getHashForHashLen(in_len);
+			if (md == NULL) {
+				rv = CKR_DATA_LEN_RANGE;
+				break;
+			}
+			rv = verifyHash(obj, pkey, md, RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SC_HSM_PSS_SHA256:
+			rv = verifyHash(obj, pkey, EVP_sha256(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SC_HSM_PSS_SHA384:
+			rv = verifyHash(obj, pkey, EVP_sha384(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		case CKM_SC_HSM_PSS_SHA512:
+			rv = verifyHash(obj, pkey, EVP_sha512(), RSA_PKCS1_PSS_PADDING, in, in_len, signature, signature_len);
+			break;
+		default:
+			rv = CKR_MECHANISM_INVALID;
+			break;
+	}
 
-	rsa = RSA_new();
+	RSA_free(rsa);
+	EVP_PKEY_free(pkey);
 
-	#if (OPENSSL_VERSION_NUMBER < 0x10100000)
-	rsa->n = BN_bin2bn(modulus->attrData.pValue, modulus->attrData.ulValueLen, NULL);
-	rsa->e = BN_bin2bn(public_exponent->attrData.pValue, public_exponent->attrData.ulValueLen, NULL);
-	#else
-	BIGNUM *new_n = BN_bin2bn(modulus->attrData.pValue, modulus->attrData.ulValueLen, NULL);
-	BIGNUM *new_e = BN_bin2bn(public_exponent->attrData.pValue, public_exponent->attrData.ulValueLen, NULL);
+	FUNC_RETURNS(rv);
+}
 
-	RSA_set0_key(rsa, new_n, new_e, NULL);
-	#endif
 
 
+/**
+ * Verify with ECDSA key
+ */
+static CK_RV verifyECDSA(struct p11Object_t *obj, CK_MECHANISM_TYPE mech, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR signature, CK_ULONG signature_len)
+{
+	unsigned char wrappedSig[140];
+	EVP_PKEY *pkey = NULL;
+	const EVP_MD *md = NULL;
+	CK_RV rv;
+	int len;
+
+	FUNC_CALLED();
+
+	rv = getPublicKey(obj, &pkey);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "getPublicKey() failed");
+	}
+
+	len = sizeof(wrappedSig);
+	if (cvcWrapECDSASignature(signature, signature_len, wrappedSig, &len) < 0) {
+		FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	switch (mech) {
+		case CKM_ECDSA_SHA1:
+			rv = digestVerify(obj, pkey, EVP_sha1(), 0, in, in_len, wrappedSig, len);
+			break;
+		case CKM_SC_HSM_ECDSA_SHA224:
+			rv = digestVerify(obj, pkey, EVP_sha224(), 0, in, in_len, wrappedSig, len);
+			break;
+		case CKM_SC_HSM_ECDSA_SHA256:
+			rv = digestVerify(obj, pkey, EVP_sha256(), 0, in, in_len, wrappedSig, len);
+			break;
+		case CKM_ECDSA_SHA384:
+			rv = digestVerify(obj, pkey, EVP_sha384(), 0, in, in_len, wrappedSig, len);
+			break;
+		case CKM_ECDSA_SHA512:
+			rv = digestVerify(obj, pkey, EVP_sha512(), 0, in, in_len, wrappedSig, len);
+			break;
+		case CKM_ECDSA:
+			md = getHashForHashLen(in_len);
+			if (md == NULL) {
+				FUNC_FAILVIAOUT(CKR_DATA_LEN_RANGE, "getHashForHashLen() failed matching hash algorithm for provided input length");
+			}
+			rv = verifyHash(obj, pkey, md, 0, in, in_len, wrappedSig, len);
+			break;
+		default:
+			FUNC_FAILVIAOUT(CKR_MECHANISM_INVALID, "Invalid mechanism for ECDSA");
+			break;
+	}
+
+out:
+	if (pkey != NULL)
+		EVP_PKEY_free(pkey);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_RV stripOAEPPadding(unsigned char *raw, int rawlen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	CK_RV rv;
+	int rc;
+
+	FUNC_CALLED();
+
+#if (OPENSSL_VERSION_NUMBER >= 0x10002000)
+	rc = RSA_padding_check_PKCS1_OAEP_mgf1(pData, (int)*pulDataLen, raw, rawlen, rawlen, NULL, 0, EVP_sha256(), NULL);
+	if (rc < 0) {
+		rv = translateError();
+		FUNC_FAILS(rv, "RSA_padding_check_PKCS1_OAEP_mgf1() failed");
+	}
+
+	*pulDataLen = (CK_ULONG)rc;
+	rv = CKR_OK;
+#else
+	rv = CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Encrypt with RSA
+ */
+static CK_RV encryptRSA(struct p11Object_t *obj, int padding, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	struct p11Attribute_t *modulus;
+	unsigned char raw[512];
+	EVP_PKEY *pkey;
+	RSA *rsa;
+	CK_RV rv = 0;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = findAttribute(obj, CKA_MODULUS, &modulus);
+
+	if (rc == -1)
+		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_MODULUS not found");
+
+	if (out == NULL) {
+		*out_len = modulus->attrData.ulValueLen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (modulus->attrData.ulValueLen > *out_len) {
+		*out_len = modulus->attrData.ulValueLen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Length of output buffer too small");
+	}
+
+	rv = getPublicKey(obj, &pkey);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "getPublicKey() failed");
+	}
+
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	EVP_PKEY_free(pkey);
+
+	if (rsa == NULL) {
+		FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Key is not an RSA key");
+	}
+
 	if (padding == RSA_PKCS1_OAEP_PADDING) {
 #if (OPENSSL_VERSION_NUMBER >= 0x10002000)
 		rc = RSA_padding_add_PKCS1_OAEP_mgf1(raw, modulus->attrData.ulValueLen, in, in_len, NULL, 0, EVP_sha256(), NULL);
@@ -584,9 +870,118 @@ static CK_RV encryptRSA(struct p11Object_t *obj, int padding, CK_BYTE_PTR in, CK
 
 
 
-CK_RV cryptoVerifyInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+/**
+ * Return the message digest and RSA padding for mechanisms that hash the input on the host.
+ * Returns NULL for mechanisms that require the complete input, like the raw RSA and ECDSA mechanisms.
+ */
+static const EVP_MD *getHashForVerifyMechanism(CK_MECHANISM_TYPE mech, int *padding)
+{
+	*padding = 0;
+
+	switch(mech) {
+	case CKM_SHA1_RSA_PKCS:
+		*padding = RSA_PKCS1_PADDING;
+		return EVP_sha1();
+	case CKM_SHA224_RSA_PKCS:
+		*padding = RSA_PKCS1_PADDING;
+		return EVP_sha224();
+	case CKM_SHA256_RSA_PKCS:
+		*padding = RSA_PKCS1_PADDING;
+		return EVP_sha256();
+	case CKM_SHA384_RSA_PKCS:
+		*padding = RSA_PKCS1_PADDING;
+		return EVP_sha384();
+	case CKM_SHA512_RSA_PKCS:
+		*padding = RSA_PKCS1_PADDING;
+		return EVP_sha512();
+	case CKM_SHA1_RSA_PKCS_PSS:
+		*padding = RSA_PKCS1_PSS_PADDING;
+		return EVP_sha1();
+	case CKM_SHA224_RSA_PKCS_PSS:
+		*padding = RSA_PKCS1_PSS_PADDING;
+		return EVP_sha224();
+	case CKM_SHA256_RSA_PKCS_PSS:
+		*padding = RSA_PKCS1_PSS_PADDING;
+		return EVP_sha256();
+	case CKM_SHA384_RSA_PKCS_PSS:
+		*padding = RSA_PKCS1_PSS_PADDING;
+		return EVP_sha384();
+	case CKM_SHA512_RSA_PKCS_PSS:
+		*padding = RSA_PKCS1_PSS_PADDING;
+		return EVP_sha512();
+	case CKM_ECDSA_SHA1:
+		return EVP_sha1();
+	case CKM_SC_HSM_ECDSA_SHA224:
+		return EVP_sha224();
+	case CKM_SC_HSM_ECDSA_SHA256:
+		return EVP_sha256();
+	case CKM_ECDSA_SHA384:
+		return EVP_sha384();
+	case CKM_ECDSA_SHA512:
+		return EVP_sha512();
+	default:
+		return NULL;
+	}
+}
+
+
+
+/**
+ * Create the verification context for a multi-part operation. Mechanisms
+ * without a host side hash leave the context empty and collect the input in the operation.
+ */
+static CK_RV startVerify(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_TYPE mech)
+{
+	EVP_MD_CTX *md_ctx;
+	EVP_PKEY *pkey;
+	const EVP_MD *md;
+	CK_RV rv;
+	int padding;
+
+	FUNC_CALLED();
+
+	cryptoReleaseContext(op);
+
+	md = getHashForVerifyMechanism(mech, &padding);
+
+	if (md == NULL) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	rv = getPublicKey(pObject, &pkey);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "getPublicKey() failed");
+	}
+
+	md_ctx = EVP_MD_CTX_create();
+
+	if (md_ctx == NULL) {
+		EVP_PKEY_free(pkey);
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rv = digestVerifyInit(md_ctx, pkey, md, padding);
+
+	// The context holds a reference on the key
+	EVP_PKEY_free(pkey);
+
+	if (rv != CKR_OK) {
+		EVP_MD_CTX_destroy(md_ctx);
+		FUNC_FAILS(rv, "digestVerifyInit() failed");
+	}
+
+	op->cryptoContext = md_ctx;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+CK_RV cryptoVerifyInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech)
 {
 	struct p11Attribute_t *keytype;
+	CK_RV rv;
 	int rc;
 
 	FUNC_CALLED();
@@ -626,6 +1021,8 @@ CK_RV cryptoVerifyInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
 		case CKM_ECDSA_SHA1:
 		case CKM_SC_HSM_ECDSA_SHA224:
 		case CKM_SC_HSM_ECDSA_SHA256:
+		case CKM_ECDSA_SHA384:
+		case CKM_ECDSA_SHA512:
 		case CKM_ECDSA:
 			break;
 		default:
@@ -636,7 +1033,9 @@ CK_RV cryptoVerifyInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "CKA_KEY_TYPE is neither CKK_RSA nor CKK_EC");
 	}
 
-	FUNC_RETURNS(CKR_OK);
+	rv = startVerify(pObject, op, mech->mechanism);
+
+	FUNC_RETURNS(rv);
 }
 
 
@@ -670,190 +1069,1245 @@ CK_RV cryptoVerify(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_P
 
 
 
-CK_RV cryptoEncryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+/**
+ * Feed a part of the input into the verification context of the operation.
+ * Input for mechanisms without host side hash is collected in the operation.
+ */
+CK_RV cryptoVerifyUpdate(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
-	struct p11Attribute_t *keytype;
-	int rc;
+	CK_RV rv;
 
 	FUNC_CALLED();
 
-	rc = findAttribute(pObject, CKA_KEY_TYPE, &keytype);
-
-	if (rc == -1)
-		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_KEY_TYPE not found");
-
-	if (*(CK_KEY_TYPE *)keytype->attrData.pValue != CKK_RSA)
-		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "CKA_KEY_TYPE is not CKK_RSA");
+	if (op->cryptoContext == NULL) {
+		FUNC_RETURNS(appendToCryptoBuffer(op, pPart, ulPartLen));
+	}
 
-	switch(mech->mechanism) {
-	case CKM_RSA_X_509:
-	case CKM_RSA_PKCS:
-	case CKM_RSA_PKCS_OAEP:
-		break;
-	default:
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Invalid mechanism for RSA");
+	if (!EVP_DigestVerifyUpdate((EVP_MD_CTX *)op->cryptoContext, pPart, ulPartLen)) {
+		FUNC_CRYPTOFAILVIAOUT("EVP_DigestVerifyUpdate() failed");
 	}
 
-	FUNC_RETURNS(CKR_OK);
+	rv = CKR_OK;
+
+out:
+	FUNC_RETURNS(rv);
 }
 
 
 
-CK_RV cryptoEncrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+/**
+ * Complete a multi-part verification and release the verification context
+ */
+CK_RV cryptoVerifyFinal(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
 {
 	struct p11Attribute_t *keytype;
+	struct p11Attribute_t *modulus;
+	unsigned char wrappedSig[140];
+	EVP_MD_CTX *md_ctx;
 	CK_RV rv;
-	int rc;
+	int rc, len;
 
 	FUNC_CALLED();
 
+	if (op->cryptoContext == NULL) {
+		rv = cryptoVerify(pObject, mech, op->cryptoBuffer, op->cryptoBufferSize, pSignature, ulSignatureLen);
+		FUNC_RETURNS(rv);
+	}
+
+	md_ctx = (EVP_MD_CTX *)op->cryptoContext;
+
 	rc = findAttribute(pObject, CKA_KEY_TYPE, &keytype);
 
 	if (rc == -1)
-		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_KEY_TYPE not found");
+		FUNC_FAILVIAOUT(CKR_TEMPLATE_INCOMPLETE, "CKA_KEY_TYPE not found");
 
-	if (*(CK_KEY_TYPE *)keytype->attrData.pValue != CKK_RSA)
-		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "CKA_KEY_TYPE is not CKK_RSA");
+	if (*(CK_KEY_TYPE *)keytype->attrData.pValue == CKK_EC) {
+		len = sizeof(wrappedSig);
+		if (cvcWrapECDSASignature(pSignature, ulSignatureLen, wrappedSig, &len) < 0) {
+			FUNC_FAILVIAOUT(CKR_HOST_MEMORY, "Out of memory");
+		}
+		rc = EVP_DigestVerifyFinal(md_ctx, wrappedSig, len);
+	} else {
+		rc = findAttribute(pObject, CKA_MODULUS, &modulus);
 
-	switch(mech->mechanism) {
-	case CKM_RSA_X_509:
-		rv = encryptRSA(pObject, RSA_NO_PADDING, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
-		break;
+		if (rc == -1)
+			FUNC_FAILVIAOUT(CKR_TEMPLATE_INCOMPLETE, "CKA_MODULUS not found");
+
+		if (modulus->attrData.ulValueLen != ulSignatureLen)
+			FUNC_FAILVIAOUT(CKR_SIGNATURE_LEN_RANGE, "Length of modulus does not match signature length");
+
+		rc = EVP_DigestVerifyFinal(md_ctx, pSignature, ulSignatureLen);
+	}
+
+	if (rc < 0) {
+		FUNC_CRYPTOFAILVIAOUT("EVP_DigestVerifyFinal() failed");
+	}
+
+	rv = rc == 1 ? CKR_OK : CKR_SIGNATURE_INVALID;
+
+out:
+	cryptoReleaseContext(op);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Maximum number of threads in the verification pool
+ */
+#define VERIFY_MAX_THREADS	64
+
+
+
+/**
+ * A batch of requests queued for the verification pool
+ */
+struct verifyBatch {
+	struct p11Object_t **objects;
+	CK_SC_HSM_VERIFY_REQUEST_PTR requests;
+	CK_RV *results;
+	CK_ULONG count;
+	CK_ULONG nextRequest;			/* Next request not yet taken by a thread */
+	CK_ULONG pending;			/* Requests not yet completed */
+	CK_ULONG threads;			/* Threads working on the batch, including the caller */
+	CK_ULONG maxThreads;			/* Limit for threads or 0 for no limit */
+	struct verifyBatch *next;
+};
+
+
+
+/**
+ * Persistent pool of threads used by cryptoVerifyBatch(). The threads are started on first use
+ * and terminated in cryptoFinalize(). The size is configured with PKCS11_VERIFY_THREADS.
+ */
+static struct verifyPool {
+	int size;				/* Number of threads or -1 if not yet configured */
+	int started;				/* Number of threads running */
+	int stop;				/* Request threads to terminate */
+	struct verifyBatch *queue;		/* Batches with requests not yet taken */
+#ifdef _WIN32
+	HANDLE thread[VERIFY_MAX_THREADS];
+#else
+	pthread_t thread[VERIFY_MAX_THREADS];
+	pid_t pid;				/* Process that started the threads */
+#endif
+} verifyPool = { -1 };
+
+static STATIC_MUTEX verifyPoolLock = STATIC_MUTEX_INITIALIZER;
+#ifdef _WIN32
+static CONDITION_VARIABLE verifyWorkSignal = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE verifyDoneSignal = CONDITION_VARIABLE_INIT;
+#else
+static pthread_cond_t verifyWorkSignal = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t verifyDoneSignal = PTHREAD_COND_INITIALIZER;
+#endif
+
+
+
+#ifdef _WIN32
+#define verifyPoolWait(c) SleepConditionVariableSRW(c, &verifyPoolLock, INFINITE, 0)
+#define verifyPoolSignal(c) WakeAllConditionVariable(c)
+#else
+#define verifyPoolWait(c) pthread_cond_wait(c, &verifyPoolLock)
+#define verifyPoolSignal(c) pthread_cond_broadcast(c)
+#endif
+
+
+
+/**
+ * Return the number of threads in the verification pool, configured with PKCS11_VERIFY_THREADS.
+ * The default is one thread less than the number of processors, as the calling thread
+ * also verifies signatures. 0 disables the pool.
+ */
+static int getVerifyPoolSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+#endif
+	char *po;
+	int size;
+
+	po = getenv("PKCS11_VERIFY_THREADS");
+	if (po != NULL) {
+		size = atoi(po);
+	} else {
+#ifdef _WIN32
+		GetSystemInfo(&si);
+		size = (int)si.dwNumberOfProcessors - 1;
+#else
+		size = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+#endif
+	}
+
+	if (size < 0) {
+		size = 0;
+	}
+
+	if (size > VERIFY_MAX_THREADS) {
+		size = VERIFY_MAX_THREADS;
+	}
+
+#ifdef DEBUG
+	debug("Verification pool with %d threads\n", size);
+#endif
+	return size;
+}
+
+
+
+/**
+ * Process requests of the batch until all requests are taken. Called with the pool locked,
+ * which is released while a signature is verified.
+ */
+static void processVerifyBatch(struct verifyBatch *batch)
+{
+	CK_SC_HSM_VERIFY_REQUEST_PTR req;
+	CK_ULONG i;
+	CK_RV rv;
+
+	while (batch->nextRequest < batch->count) {
+		i = batch->nextRequest++;
+		req = batch->requests + i;
+
+		if (batch->objects[i] != NULL) {	// NULL if rejected by caller
+			static_mutex_unlock(&verifyPoolLock);
+			rv = cryptoVerify(batch->objects[i], req->pMechanism, req->pData, req->ulDataLen, req->pSignature, req->ulSignatureLen);
+			static_mutex_lock(&verifyPoolLock);
+			batch->results[i] = rv;
+		}
+
+		batch->pending--;
+		if (batch->pending == 0) {
+			verifyPoolSignal(&verifyDoneSignal);
+		}
+	}
+
+	ERR_clear_error();
+}
+
+
+
+/**
+ * Return the first queued batch with requests not yet taken that accepts another thread.
+ * Called with the pool locked.
+ */
+static struct verifyBatch *nextVerifyBatch()
+{
+	struct verifyBatch *batch;
+
+	for (batch = verifyPool.queue; batch != NULL; batch = batch->next) {
+		if ((batch->nextRequest < batch->count) &&
+			((batch->maxThreads == 0) || (batch->threads < batch->maxThreads))) {
+			break;
+		}
+	}
+	return batch;
+}
+
+
+
+#ifdef _WIN32
+static unsigned __stdcall verifyPoolWorker(void *arg)
+#else
+static void *verifyPoolWorker(void *arg)
+#endif
+{
+	struct verifyBatch *batch;
+
+	static_mutex_lock(&verifyPoolLock);
+
+	while (!verifyPool.stop) {
+		batch = nextVerifyBatch();
+
+		if (batch == NULL) {
+			verifyPoolWait(&verifyWorkSignal);
+			continue;
+		}
+
+		batch->threads++;
+		processVerifyBatch(batch);
+		batch->threads--;
+	}
+
+	static_mutex_unlock(&verifyPoolLock);
+	return 0;
+}
+
+
+
+/**
+ * Start the threads of the verification pool, if not yet running. Called with the pool locked.
+ */
+static void startVerifyPool()
+{
+	int i;
+
+#ifndef _WIN32
+	// Threads are not inherited by a child process
+	if ((verifyPool.started > 0) && (verifyPool.pid != getpid())) {
+		verifyPool.started = 0;
+		verifyPool.queue = NULL;
+	}
+	verifyPool.pid = getpid();
+#endif
+
+	if (verifyPool.size < 0) {
+		verifyPool.size = getVerifyPoolSize();
+	}
+
+	for (i = verifyPool.started; i < verifyPool.size; i++) {
+#ifdef _WIN32
+		verifyPool.thread[i] = (HANDLE)_beginthreadex(NULL, 0, verifyPoolWorker, NULL, 0, NULL);
+		if (verifyPool.thread[i] == 0) {
+#else
+		if (pthread_create(&verifyPool.thread[i], NULL, verifyPoolWorker, NULL) != 0) {
+#endif
+#ifdef DEBUG
+			debug("Could only start %d of %d verification threads\n", i, verifyPool.size);
+#endif
+			verifyPool.size = i;
+			break;
+		}
+		verifyPool.started++;
+	}
+}
+
+
+
+/**
+ * Terminate the threads of the verification pool. Called from cryptoFinalize()
+ */
+static void stopVerifyPool()
+{
+	int i, started;
+
+	static_mutex_lock(&verifyPoolLock);
+#ifndef _WIN32
+	if (verifyPool.pid != getpid()) {
+		verifyPool.started = 0;
+	}
+#endif
+	verifyPool.stop = 1;
+	started = verifyPool.started;
+	verifyPoolSignal(&verifyWorkSignal);
+	static_mutex_unlock(&verifyPoolLock);
+
+	for (i = 0; i < started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(verifyPool.thread[i], INFINITE);
+		CloseHandle(verifyPool.thread[i]);
+#else
+		pthread_join(verifyPool.thread[i], NULL);
+#endif
+	}
+
+	static_mutex_lock(&verifyPoolLock);
+	verifyPool.started = 0;
+	verifyPool.stop = 0;
+	verifyPool.size = -1;
+	verifyPool.queue = NULL;
+	static_mutex_unlock(&verifyPoolLock);
+}
+
+
+
+/**
+ * Verify a batch of signatures using the threads of the verification pool. The calling
+ * thread verifies signatures as well and returns when all requests are completed.
+ *
+ * @param pObjects      the key object for each request or NULL if the request was rejected
+ * @param pRequests     the requests
+ * @param ulCount       the number of requests
+ * @param ulThreads     the maximum number of threads including the calling thread or 0 for no limit
+ * @param pResults      the result of each request. Entries for rejected requests are left unchanged
+ * @return              CKR_OK
+ */
+CK_RV cryptoVerifyBatch(struct p11Object_t **pObjects, CK_SC_HSM_VERIFY_REQUEST_PTR pRequests, CK_ULONG ulCount, CK_ULONG ulThreads, CK_RV *pResults)
+{
+	struct verifyBatch batch, **pb;
+	int queued = 0;
+
+	FUNC_CALLED();
+
+	memset(&batch, 0, sizeof(batch));
+	batch.objects = pObjects;
+	batch.requests = pRequests;
+	batch.results = pResults;
+	batch.count = ulCount;
+	batch.pending = ulCount;
+	batch.threads = 1;
+	batch.maxThreads = ulThreads;
+
+	static_mutex_lock(&verifyPoolLock);
+
+	if ((ulThreads != 1) && (ulCount > 1)) {
+		startVerifyPool();
+
+		if (verifyPool.started > 0) {
+			for (pb = &verifyPool.queue; *pb != NULL; pb = &(*pb)->next);
+			*pb = &batch;
+			queued = 1;
+			verifyPoolSignal(&verifyWorkSignal);
+		}
+	}
+
+	processVerifyBatch(&batch);
+
+	while (batch.pending > 0) {
+		verifyPoolWait(&verifyDoneSignal);
+	}
+
+	if (queued) {
+		for (pb = &verifyPool.queue; *pb != &batch; pb = &(*pb)->next);
+		*pb = batch.next;
+	}
+
+	static_mutex_unlock(&verifyPoolLock);
+
+#ifdef DEBUG
+	debug("Verified %lu signatures\n", ulCount);
+#endif
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+CK_RV cryptoEncryptInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech)
+{
+	struct p11Attribute_t *keytype;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = findAttribute(pObject, CKA_KEY_TYPE, &keytype);
+
+	if (rc == -1)
+		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_KEY_TYPE not found");
+
+	if (*(CK_KEY_TYPE *)keytype->attrData.pValue != CKK_RSA)
+		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "CKA_KEY_TYPE is not CKK_RSA");
+
+	switch(mech->mechanism) {
+	case CKM_RSA_X_509:
+	case CKM_RSA_PKCS:
+	case CKM_RSA_PKCS_OAEP:
+		break;
+	default:
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Invalid mechanism for RSA");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+CK_RV cryptoEncrypt(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	struct p11Attribute_t *keytype;
+	CK_RV rv;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = findAttribute(pObject, CKA_KEY_TYPE, &keytype);
+
+	if (rc == -1)
+		FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "CKA_KEY_TYPE not found");
+
+	if (*(CK_KEY_TYPE *)keytype->attrData.pValue != CKK_RSA)
+		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "CKA_KEY_TYPE is not CKK_RSA");
+
+	switch(mech->mechanism) {
+	case CKM_RSA_X_509:
+		rv = encryptRSA(pObject, RSA_NO_PADDING, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+		break;
 	case CKM_RSA_PKCS:
 		rv = encryptRSA(pObject, RSA_PKCS1_PADDING, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
 		break;
-	case CKM_RSA_PKCS_OAEP:
-		rv = encryptRSA(pObject, RSA_PKCS1_OAEP_PADDING, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	case CKM_RSA_PKCS_OAEP:
+		rv = encryptRSA(pObject, RSA_PKCS1_OAEP_PADDING, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+		break;
+	default:
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Invalid mechanism for RSA");
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Map a PKCS#11 hash mechanism to the libcrypto message digest
+ */
+static const EVP_MD *getHashForMechanism(CK_MECHANISM_TYPE mech)
+{
+	const EVP_MD *md;
+	int i;
+
+	switch(mech) {
+	case CKM_SHA_1:
+		i = 0; md = EVP_sha1();
+		break;
+	case CKM_SHA224:
+		i = 1; md = EVP_sha224();
+		break;
+	case CKM_SHA256:
+		i = 2; md = EVP_sha256();
+		break;
+	case CKM_SHA384:
+		i = 3; md = EVP_sha384();
+		break;
+	case CKM_SHA512:
+		i = 4; md = EVP_sha512();
+		break;
+	default:
+		return NULL;
+	}
+
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L)
+	if (fetchedHashes[i] != NULL) {
+		md = fetchedHashes[i];
+	}
+#else
+	(void)i;
+#endif
+	return md;
+}
+
+
+
+/**
+ * Release the host side state kept in the operation. This is a hash state, unless the
+ * operation registered a different release function with the context.
+ *
+ * @param op        the operation
+ */
+void cryptoReleaseContext(struct p11Operation_t *op)
+{
+	if (op->cryptoContext != NULL) {
+		if (op->releaseCryptoContext != NULL) {
+			op->releaseCryptoContext(op->cryptoContext);
+		} else {
+			EVP_MD_CTX_destroy((EVP_MD_CTX *)op->cryptoContext);
+		}
+		op->cryptoContext = NULL;
+	}
+	op->releaseCryptoContext = NULL;
+}
+
+
+
+/**
+ * Calculate the hash over the input in a single step
+ *
+ * @param mech          the hash mechanism, one of CKM_SHA_1, CKM_SHA224, CKM_SHA256, CKM_SHA384 or CKM_SHA512
+ * @param pData         the data to hash
+ * @param ulDataLen     the length of the data
+ * @param pDigest       the buffer receiving the hash value
+ * @param pulDigestLen  the size of the buffer, updated with the length of the hash value
+ * @return CKR_OK or any other Cryptoki error code
+ */
+CK_RV cryptoHash(CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+	CK_SC_HSM_DIGEST_REQUEST req;
+
+	req.pData = pData;
+	req.ulDataLen = ulDataLen;
+
+	return cryptoDigestBatch(mech, &req, 1, pDigest, pulDigestLen);
+}
+
+
+
+/**
+ * Calculate the hash for a batch of inputs. All hashes are calculated with the same
+ * context, which avoids allocating and initializing a context per input.
+ *
+ * @param mech          the hash mechanism, one of CKM_SHA_1, CKM_SHA224, CKM_SHA256, CKM_SHA384 or CKM_SHA512
+ * @param pRequests     the inputs
+ * @param ulCount       the number of inputs
+ * @param pDigests      the buffer receiving the concatenated hash values or NULL to query the length
+ * @param pulDigestsLen the size of the buffer, updated with the length of all hash values
+ * @return CKR_OK or any other Cryptoki error code
+ */
+CK_RV cryptoDigestBatch(CK_MECHANISM_TYPE mech, CK_SC_HSM_DIGEST_REQUEST_PTR pRequests, CK_ULONG ulCount, CK_BYTE_PTR pDigests, CK_ULONG_PTR pulDigestsLen)
+{
+	EVP_MD_CTX *md_ctx;
+	const EVP_MD *md;
+	CK_ULONG i, size;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	md = getHashForMechanism(mech);
+
+	if (md == NULL) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Hash not supported");
+	}
+
+	size = (CK_ULONG)EVP_MD_size(md);
+
+	// The length of all hash values must be representable in a CK_ULONG, which is not larger than a size_t
+	if (ulCount > (CK_ULONG)~0 / size) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Too many inputs");
+	}
+
+	if (pDigests == NULL) {
+		*pulDigestsLen = size * ulCount;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulDigestsLen < size * ulCount) {
+		*pulDigestsLen = size * ulCount;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer too small");
+	}
+
+	md_ctx = EVP_MD_CTX_create();
+
+	if (md_ctx == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rv = CKR_OK;
+	for (i = 0; i < ulCount; i++) {
+		if (!EVP_DigestInit_ex(md_ctx, md, NULL) ||
+			!EVP_DigestUpdate(md_ctx, pRequests[i].pData, pRequests[i].ulDataLen) ||
+			!EVP_DigestFinal_ex(md_ctx, pDigests + i * size, NULL)) {
+			FUNC_CRYPTOFAILVIAOUT("Digest operation failed");
+		}
+	}
+
+	*pulDigestsLen = size * ulCount;
+
+out:
+	EVP_MD_CTX_destroy(md_ctx);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * State of a multi-part host side message digest that can be saved with C_GetOperationState().
+ * Digests use an EVP context, unless PKCS11_DIGEST_STATE=1 is set, because the intermediate
+ * state of an EVP context can not be exported.
+ */
+struct digestContext {
+	CK_MECHANISM_TYPE mech;             /**< The hash mechanism                        */
+	union {
+		SHA_CTX sha1;
+		SHA256_CTX sha256;
+		SHA512_CTX sha512;
+	} md;                               /**< The hash state                            */
+};
+
+/** Mechanism, SHA-512 chaining value, message length and a pending block */
+#define DIGEST_STATE_MAX	(4 + 8 * 8 + 2 * 8 + SHA512_CBLOCK)
+
+
+
+/**
+ * Return true if host side digests shall be kept in a form that can be saved
+ */
+static int digestStateEnabled()
+{
+	static int enabled = -1;
+	char *po;
+
+	if (enabled < 0) {
+		po = getenv("PKCS11_DIGEST_STATE");
+		enabled = po && (*po == '1');
+#ifdef DEBUG
+		debug("Saveable digest state %s\n", enabled ? "enabled" : "disabled");
+#endif
+	}
+	return enabled;
+}
+
+
+
+static int getDigestSize(CK_MECHANISM_TYPE mech)
+{
+	switch(mech) {
+	case CKM_SHA_1:
+		return SHA_DIGEST_LENGTH;
+	case CKM_SHA224:
+		return SHA224_DIGEST_LENGTH;
+	case CKM_SHA256:
+		return SHA256_DIGEST_LENGTH;
+	case CKM_SHA384:
+		return SHA384_DIGEST_LENGTH;
+	case CKM_SHA512:
+		return SHA512_DIGEST_LENGTH;
+	}
+	return 0;
+}
+
+
+
+static void releaseDigestContext(void *ctx)
+{
+	OPENSSL_cleanse(ctx, sizeof(struct digestContext));
+	free(ctx);
+}
+
+
+
+/**
+ * Return the saveable digest context of the operation or NULL if the operation uses an EVP context
+ */
+static struct digestContext *getDigestContext(struct p11Operation_t *op)
+{
+	if ((op->cryptoContext == NULL) || (op->releaseCryptoContext != releaseDigestContext)) {
+		return NULL;
+	}
+	return (struct digestContext *)op->cryptoContext;
+}
+
+
+
+static void putDigestWord(unsigned char **p, SHA_LONG64 val, int len)
+{
+	while (len-- > 0) {
+		*(*p)++ = (unsigned char)(val >> (len << 3));
+	}
+}
+
+
+
+static SHA_LONG64 getDigestWord(unsigned char **p, int len)
+{
+	SHA_LONG64 val = 0;
+
+	while (len-- > 0) {
+		val = (val << 8) | *(*p)++;
+	}
+	return val;
+}
+
+
+
+/*
+ * The low level hash functions are deprecated since OpenSSL 3, but they are the only way
+ * to get at the intermediate hash state. They are only used with PKCS11_DIGEST_STATE=1.
+ */
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#elif defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4996)
+#endif
+
+static void digestContextInit(struct digestContext *ctx, CK_MECHANISM_TYPE mech)
+{
+	ctx->mech = mech;
+
+	switch(mech) {
+	case CKM_SHA_1:
+		SHA1_Init(&ctx->md.sha1);
+		break;
+	case CKM_SHA224:
+		SHA224_Init(&ctx->md.sha256);
+		break;
+	case CKM_SHA256:
+		SHA256_Init(&ctx->md.sha256);
+		break;
+	case CKM_SHA384:
+		SHA384_Init(&ctx->md.sha512);
+		break;
+	case CKM_SHA512:
+		SHA512_Init(&ctx->md.sha512);
 		break;
-	default:
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Invalid mechanism for RSA");
 	}
-
-	FUNC_RETURNS(rv);
 }
 
 
 
-CK_RV cryptoDigestInit(struct p11Session_t * session, CK_MECHANISM_PTR mech)
+static void digestContextUpdate(struct digestContext *ctx, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
-	EVP_MD_CTX *md_ctx;
-	const EVP_MD *md;
+	switch(ctx->mech) {
+	case CKM_SHA_1:
+		SHA1_Update(&ctx->md.sha1, pPart, ulPartLen);
+		break;
+	case CKM_SHA224:
+		SHA224_Update(&ctx->md.sha256, pPart, ulPartLen);
+		break;
+	case CKM_SHA256:
+		SHA256_Update(&ctx->md.sha256, pPart, ulPartLen);
+		break;
+	case CKM_SHA384:
+		SHA384_Update(&ctx->md.sha512, pPart, ulPartLen);
+		break;
+	case CKM_SHA512:
+		SHA512_Update(&ctx->md.sha512, pPart, ulPartLen);
+		break;
+	}
+}
 
-	FUNC_CALLED();
 
-	switch(mech->mechanism) {
+
+static void digestContextFinal(struct digestContext *ctx, CK_BYTE_PTR pDigest)
+{
+	switch(ctx->mech) {
 	case CKM_SHA_1:
-		md = EVP_sha1();
+		SHA1_Final(pDigest, &ctx->md.sha1);
 		break;
 	case CKM_SHA224:
-		md = EVP_sha224();
+		SHA224_Final(pDigest, &ctx->md.sha256);
 		break;
 	case CKM_SHA256:
-		md = EVP_sha256();
+		SHA256_Final(pDigest, &ctx->md.sha256);
 		break;
 	case CKM_SHA384:
-		md = EVP_sha384();
+		SHA384_Final(pDigest, &ctx->md.sha512);
+		break;
+	case CKM_SHA512:
+		SHA512_Final(pDigest, &ctx->md.sha512);
+		break;
+	}
+}
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#elif defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+
+
+/**
+ * Encode the hash state as mechanism, chaining value, message length in bits and the
+ * pending input of the incomplete block, all in big endian byte order
+ *
+ * @param ctx       the digest context
+ * @param p         the buffer receiving the encoded state or NULL to query the length
+ * @return the length of the encoded state
+ */
+static CK_ULONG encodeDigestState(struct digestContext *ctx, unsigned char *p)
+{
+	unsigned char buff[DIGEST_STATE_MAX], *po = buff, *data;
+	SHA_CTX *c1;
+	SHA256_CTX *c256;
+	SHA512_CTX *c512;
+	unsigned int num;
+	int i;
+
+	putDigestWord(&po, ctx->mech, 4);
+
+	switch(ctx->mech) {
+	case CKM_SHA_1:
+		c1 = &ctx->md.sha1;
+		putDigestWord(&po, c1->h0, 4);
+		putDigestWord(&po, c1->h1, 4);
+		putDigestWord(&po, c1->h2, 4);
+		putDigestWord(&po, c1->h3, 4);
+		putDigestWord(&po, c1->h4, 4);
+		putDigestWord(&po, c1->Nh, 4);
+		putDigestWord(&po, c1->Nl, 4);
+		data = (unsigned char *)c1->data;
+		num = c1->num;
+		break;
+	case CKM_SHA224:
+	case CKM_SHA256:
+		c256 = &ctx->md.sha256;
+		for (i = 0; i < 8; i++) {
+			putDigestWord(&po, c256->h[i], 4);
+		}
+		putDigestWord(&po, c256->Nh, 4);
+		putDigestWord(&po, c256->Nl, 4);
+		data = (unsigned char *)c256->data;
+		num = c256->num;
+		break;
+	default:
+		c512 = &ctx->md.sha512;
+		for (i = 0; i < 8; i++) {
+			putDigestWord(&po, c512->h[i], 8);
+		}
+		putDigestWord(&po, c512->Nh, 8);
+		putDigestWord(&po, c512->Nl, 8);
+		data = c512->u.p;
+		num = c512->num;
+		break;
+	}
+
+	memcpy(po, data, num);
+	po += num;
+
+	if (p != NULL) {
+		memcpy(p, buff, po - buff);
+	}
+	OPENSSL_cleanse(buff, sizeof(buff));
+
+	return (CK_ULONG)(po - buff);
+}
+
+
+
+/**
+ * Decode a hash state encoded with encodeDigestState(). Every field is checked, so that
+ * a modified state can not corrupt the hash context: The pending input must be shorter
+ * than a block and match the message length.
+ *
+ * @param ctx       the digest context to initialize
+ * @param p         the encoded state
+ * @param len       the length of the encoded state
+ * @return 0 or -1 if the state is invalid
+ */
+static int decodeDigestState(struct digestContext *ctx, unsigned char *p, CK_ULONG len)
+{
+	SHA_CTX *c1;
+	SHA256_CTX *c256;
+	SHA512_CTX *c512;
+	CK_MECHANISM_TYPE mech;
+	CK_ULONG fixed, num;
+	SHA_LONG64 nl;
+	int i;
+
+	if (len < 4) {
+		return -1;
+	}
+
+	mech = (CK_MECHANISM_TYPE)getDigestWord(&p, 4);
+
+	switch(mech) {
+	case CKM_SHA_1:
+		fixed = 4 + 5 * 4 + 2 * 4;
+		break;
+	case CKM_SHA224:
+	case CKM_SHA256:
+		fixed = 4 + 8 * 4 + 2 * 4;
 		break;
+	case CKM_SHA384:
 	case CKM_SHA512:
-		md = EVP_sha512();
+		fixed = 4 + 8 * 8 + 2 * 8;
+		break;
+	default:
+		return -1;
+	}
+
+	if (len < fixed) {
+		return -1;
+	}
+	num = len - fixed;
+
+	digestContextInit(ctx, mech);
+
+	switch(mech) {
+	case CKM_SHA_1:
+		c1 = &ctx->md.sha1;
+		c1->h0 = (SHA_LONG)getDigestWord(&p, 4);
+		c1->h1 = (SHA_LONG)getDigestWord(&p, 4);
+		c1->h2 = (SHA_LONG)getDigestWord(&p, 4);
+		c1->h3 = (SHA_LONG)getDigestWord(&p, 4);
+		c1->h4 = (SHA_LONG)getDigestWord(&p, 4);
+		c1->Nh = (SHA_LONG)getDigestWord(&p, 4);
+		c1->Nl = (SHA_LONG)getDigestWord(&p, 4);
+		nl = c1->Nl;
+		if ((nl & 7) || (num != ((nl >> 3) & (SHA_CBLOCK - 1)))) {
+			return -1;
+		}
+		memcpy(c1->data, p, num);
+		c1->num = (unsigned int)num;
+		break;
+	case CKM_SHA224:
+	case CKM_SHA256:
+		c256 = &ctx->md.sha256;
+		for (i = 0; i < 8; i++) {
+			c256->h[i] = (SHA_LONG)getDigestWord(&p, 4);
+		}
+		c256->Nh = (SHA_LONG)getDigestWord(&p, 4);
+		c256->Nl = (SHA_LONG)getDigestWord(&p, 4);
+		nl = c256->Nl;
+		if ((nl & 7) || (num != ((nl >> 3) & (SHA256_CBLOCK - 1)))) {
+			return -1;
+		}
+		memcpy(c256->data, p, num);
+		c256->num = (unsigned int)num;
 		break;
 	default:
+		c512 = &ctx->md.sha512;
+		for (i = 0; i < 8; i++) {
+			c512->h[i] = getDigestWord(&p, 8);
+		}
+		c512->Nh = getDigestWord(&p, 8);
+		c512->Nl = getDigestWord(&p, 8);
+		nl = c512->Nl;
+		if ((nl & 7) || (num != ((nl >> 3) & (SHA512_CBLOCK - 1)))) {
+			return -1;
+		}
+		memcpy(c512->u.p, p, num);
+		c512->num = (unsigned int)num;
+		break;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Return the size of the digest produced by the host side digest of the operation
+ */
+static CK_ULONG getContextDigestSize(struct p11Operation_t *op)
+{
+	struct digestContext *ctx;
+
+	ctx = getDigestContext(op);
+
+	if (ctx != NULL) {
+		return (CK_ULONG)getDigestSize(ctx->mech);
+	}
+	return (CK_ULONG)EVP_MD_CTX_size((EVP_MD_CTX *)op->cryptoContext);
+}
+
+
+
+static void contextDigestUpdate(struct p11Operation_t *op, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	struct digestContext *ctx;
+
+	ctx = getDigestContext(op);
+
+	if (ctx != NULL) {
+		digestContextUpdate(ctx, pPart, ulPartLen);
+	} else {
+		EVP_DigestUpdate((EVP_MD_CTX *)op->cryptoContext, pPart, ulPartLen);
+	}
+}
+
+
+
+static void contextDigestFinal(struct p11Operation_t *op, CK_BYTE_PTR pDigest)
+{
+	struct digestContext *ctx;
+	unsigned int md_len;
+
+	ctx = getDigestContext(op);
+
+	if (ctx != NULL) {
+		digestContextFinal(ctx, pDigest);
+	} else {
+		EVP_DigestFinal_ex((EVP_MD_CTX *)op->cryptoContext, pDigest, &md_len);
+	}
+}
+
+
+
+CK_RV cryptoDigestInit(struct p11Operation_t *op, CK_MECHANISM_PTR mech)
+{
+	struct digestContext *ctx;
+	EVP_MD_CTX *md_ctx;
+	const EVP_MD *md;
+
+	FUNC_CALLED();
+
+	md = getHashForMechanism(mech->mechanism);
+
+	if (md == NULL) {
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Hash not supported");
 	}
 
+	cryptoReleaseContext(op);
+
+	if (digestStateEnabled()) {
+		ctx = calloc(1, sizeof(struct digestContext));
+
+		if (ctx == NULL) {
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+
+		digestContextInit(ctx, mech->mechanism);
+
+		op->cryptoContext = ctx;
+		op->releaseCryptoContext = releaseDigestContext;
+		FUNC_RETURNS(CKR_OK);
+	}
+
 	md_ctx = EVP_MD_CTX_create();
+
+	if (md_ctx == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
 	EVP_DigestInit_ex(md_ctx, md, NULL);
 
-	session->cryptoBuffer = (CK_BYTE_PTR)md_ctx;
+	op->cryptoContext = md_ctx;
 
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-CK_RV cryptoDigest(struct p11Session_t * session, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+CK_RV cryptoDigest(struct p11Operation_t *op, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
 {
-	EVP_MD_CTX *md_ctx;
-	unsigned int md_len;
+	CK_ULONG size;
 
 	FUNC_CALLED();
 
-	if (session->cryptoBuffer == NULL) {
+	if (op->cryptoContext == NULL) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
-	md_ctx = (EVP_MD_CTX *)session->cryptoBuffer;
+	size = getContextDigestSize(op);
 
 	if (pDigest == NULL) {
-		*pulDigestLen = (CK_ULONG)EVP_MD_CTX_size(md_ctx);
+		*pulDigestLen = size;
 		FUNC_RETURNS(CKR_OK);
 	}
 
-	if (*pulDigestLen < (CK_ULONG)EVP_MD_CTX_size(md_ctx)) {
-		*pulDigestLen = (CK_ULONG)EVP_MD_CTX_size(md_ctx);
+	if (*pulDigestLen < size) {
+		*pulDigestLen = size;
 		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer too small");
 	}
 
-	EVP_DigestUpdate(md_ctx, pData, ulDataLen);
-	EVP_DigestFinal_ex(md_ctx, pDigest, &md_len);
+	contextDigestUpdate(op, pData, ulDataLen);
+	contextDigestFinal(op, pDigest);
 
-	*pulDigestLen = (CK_ULONG)md_len;
+	*pulDigestLen = size;
 
-	EVP_MD_CTX_destroy(md_ctx);
-	session->cryptoBuffer = NULL;
+	cryptoReleaseContext(op);
 
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-CK_RV cryptoDigestUpdate(struct p11Session_t * session, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+CK_RV cryptoDigestUpdate(struct p11Operation_t *op, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
-	EVP_MD_CTX *md_ctx;
 	FUNC_CALLED();
 
-	if (session->cryptoBuffer == NULL) {
+	if (op->cryptoContext == NULL) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
-	md_ctx = (EVP_MD_CTX *)session->cryptoBuffer;
-
-	EVP_DigestUpdate(md_ctx, pPart, ulPartLen);
+	contextDigestUpdate(op, pPart, ulPartLen);
 
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-CK_RV cryptoDigestFinal(struct p11Session_t * session, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+CK_RV cryptoDigestFinal(struct p11Operation_t *op, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
 {
-	EVP_MD_CTX *md_ctx;
-	unsigned int md_len;
+	CK_ULONG size;
 
 	FUNC_CALLED();
 
-	if (session->cryptoBuffer == NULL) {
+	if (op->cryptoContext == NULL) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
-	md_ctx = (EVP_MD_CTX *)session->cryptoBuffer;
+	size = getContextDigestSize(op);
 
 	if (pDigest == NULL) {
-		*pulDigestLen = (CK_ULONG)EVP_MD_CTX_size(md_ctx);
+		*pulDigestLen = size;
 		FUNC_RETURNS(CKR_OK);
 	}
 
-	if (*pulDigestLen < (CK_ULONG)EVP_MD_CTX_size(md_ctx)) {
-		*pulDigestLen = (CK_ULONG)EVP_MD_CTX_size(md_ctx);
+	if (*pulDigestLen < size) {
+		*pulDigestLen = size;
 		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer too small");
 	}
 
-	EVP_DigestFinal_ex(md_ctx, pDigest, &md_len);
+	contextDigestFinal(op, pDigest);
 
-	*pulDigestLen = (CK_ULONG)md_len;
+	*pulDigestLen = size;
 
-	EVP_MD_CTX_destroy(md_ctx);
-	session->cryptoBuffer = NULL;
+	cryptoReleaseContext(op);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Export the host side digest state of an operation
+ *
+ * @param op            the operation
+ * @param pState        the buffer receiving the state or NULL to query the length
+ * @param pulStateLen   the size of the buffer and the length of the state. 0 if the operation has no host side state
+ * @return CKR_OK, CKR_BUFFER_TOO_SMALL or CKR_STATE_UNSAVEABLE if the state is an EVP context
+ */
+CK_RV cryptoGetDigestState(struct p11Operation_t *op, CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen)
+{
+	struct digestContext *ctx;
+	CK_ULONG len;
+
+	FUNC_CALLED();
+
+	if (op->cryptoContext == NULL) {
+		*pulStateLen = 0;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	ctx = getDigestContext(op);
+
+	if (ctx == NULL) {
+		FUNC_FAILS(CKR_STATE_UNSAVEABLE, "Host side state is not a saveable digest state");
+	}
+
+	len = encodeDigestState(ctx, NULL);
+
+	if (pState == NULL) {
+		*pulStateLen = len;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulStateLen < len) {
+		*pulStateLen = len;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer too small");
+	}
+
+	*pulStateLen = encodeDigestState(ctx, pState);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Restore the host side digest state of an operation, as exported with cryptoGetDigestState()
+ *
+ * The restored state does not depend on PKCS11_DIGEST_STATE, so that a state can be
+ * continued in any process.
+ *
+ * @param op            the operation
+ * @param pState        the state
+ * @param ulStateLen    the length of the state
+ * @return CKR_OK, CKR_HOST_MEMORY or CKR_SAVED_STATE_INVALID
+ */
+CK_RV cryptoSetDigestState(struct p11Operation_t *op, CK_BYTE_PTR pState, CK_ULONG ulStateLen)
+{
+	struct digestContext *ctx;
+
+	FUNC_CALLED();
+
+	cryptoReleaseContext(op);
+
+	if (ulStateLen == 0) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (ulStateLen > DIGEST_STATE_MAX) {
+		FUNC_FAILS(CKR_SAVED_STATE_INVALID, "Digest state too long");
+	}
+
+	ctx = calloc(1, sizeof(struct digestContext));
+
+	if (ctx == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	if (decodeDigestState(ctx, pState, ulStateLen) < 0) {
+		releaseDigestContext(ctx);
+		FUNC_FAILS(CKR_SAVED_STATE_INVALID, "Digest state invalid");
+	}
+
+	op->cryptoContext = ctx;
+	op->releaseCryptoContext = releaseDigestContext;
 
 	FUNC_RETURNS(CKR_OK);
 }
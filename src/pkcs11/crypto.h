@@ -41,14 +41,23 @@
 void cryptoInitialize();
 void cryptoFinalize();
 CK_RV stripOAEPPadding(unsigned char *raw, int rawlen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen);
-CK_RV cryptoVerifyInit(struct p11Object_t *, CK_MECHANISM_PTR);
+CK_RV cryptoVerifyInit(struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR);
 CK_RV cryptoVerify(struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG);
-CK_RV cryptoEncryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech);
-CK_RV cryptoEncrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen);
-CK_RV cryptoDigestInit(struct p11Session_t * session, CK_MECHANISM_PTR mech);
-CK_RV cryptoDigest(struct p11Session_t * session, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
-CK_RV cryptoDigestUpdate(struct p11Session_t * session, CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
-CK_RV cryptoDigestFinal(struct p11Session_t * session, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+CK_RV cryptoVerifyBatch(struct p11Object_t **pObjects, CK_SC_HSM_VERIFY_REQUEST_PTR pRequests, CK_ULONG ulCount, CK_ULONG ulThreads, CK_RV *pResults);
+CK_RV cryptoVerifyUpdate(struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
+CK_RV cryptoVerifyFinal(struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
+CK_RV cryptoEncryptInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech);
+CK_RV cryptoEncrypt(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen);
+void cryptoReleaseContext(struct p11Operation_t *op);
+void cryptoReleaseKey(struct p11Object_t *obj);
+CK_RV cryptoHash(CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+CK_RV cryptoDigestBatch(CK_MECHANISM_TYPE mech, CK_SC_HSM_DIGEST_REQUEST_PTR pRequests, CK_ULONG ulCount, CK_BYTE_PTR pDigests, CK_ULONG_PTR pulDigestsLen);
+CK_RV cryptoDigestInit(struct p11Operation_t *op, CK_MECHANISM_PTR mech);
+CK_RV cryptoDigest(struct p11Operation_t *op, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+CK_RV cryptoDigestUpdate(struct p11Operation_t *op, CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
+CK_RV cryptoDigestFinal(struct p11Operation_t *op, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+CK_RV cryptoGetDigestState(struct p11Operation_t *op, CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen);
+CK_RV cryptoSetDigestState(struct p11Operation_t *op, CK_BYTE_PTR pState, CK_ULONG ulStateLen);
 
 
 #endif /* ___CRYPTO_INC___ */
@@ -0,0 +1,632 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2017, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    drbg.c
+ * @brief   Host side deterministic random bit generator seeded from the token
+ *
+ * The HMAC_DRBG with SHA-256 according to NIST SP 800-90A is seeded with entropy obtained from
+ * the token and reseeded from the token after a number of requests. Each thread derives its own
+ * HMAC_DRBG instance from the token instance, so that most requests are served without locking
+ * and without communication with the token. Thread instances are wiped when the thread exits
+ * and in C_Finalize().
+ *
+ * The host DRBG is enabled by setting the environment variable PKCS11_HOST_DRBG=1.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+#include <pkcs11/drbg.h>
+#include <pkcs11/token.h>
+#include <common/mutex.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#ifdef _WIN32
+#define getpid() GetCurrentProcessId()
+#endif
+
+#define DRBG_SEEDLEN			32		// Entropy obtained from the token
+#define DRBG_MAX_REQUEST		65536		// Maximum number of bytes per generate request
+#define DRBG_MAX_INPUT			256		// Longer additional input is hashed first
+#define DRBG_TOKEN_RESEED_INTERVAL	4096		// Requests before the token instance is reseeded from the token
+#define DRBG_THREAD_RESEED_INTERVAL	1024		// Requests before a thread instance is reseeded from the token instance
+
+
+
+struct hmacDRBG {
+	unsigned char K[SHA256_DIGEST_LENGTH];
+	unsigned char V[SHA256_DIGEST_LENGTH];
+	unsigned long reseedCounter;
+};
+
+
+
+/**
+ * DRBG instance of a token
+ */
+struct tokenDRBG {
+	MUTEX mutex;
+	struct hmacDRBG drbg;
+	unsigned long long instance;		// Random identifier of this instance
+	unsigned long generation;		// Incremented whenever the instance is reseeded
+	int refcnt;				// References held by the token and requests in progress
+};
+
+
+
+/**
+ * DRBG instance of a thread, derived from the token instance with matching identifier and generation
+ */
+struct threadDRBG {
+	struct hmacDRBG drbg;
+	unsigned long long instance;
+	unsigned long generation;
+	unsigned long pid;
+	int valid;
+	struct threadDRBG *next;		// List of all thread instances
+};
+
+/*
+ * Protects the reference to the token instance and the list of thread instances
+ */
+static STATIC_MUTEX drbgLock = STATIC_MUTEX_INITIALIZER;
+
+static struct threadDRBG *threadDRBGList = NULL;
+
+/*
+ * Thread local reference to the thread instance, with a destructor that wipes the instance when
+ * the thread exits. The key is created in C_Initialize() and deleted in C_Finalize(), so that no
+ * destructor is left behind when the module is unloaded.
+ */
+#ifdef _WIN32
+static DWORD threadKey = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t threadKey;
+#endif
+static int threadKeyValid = 0;
+
+
+
+static int hmacDRBGUpdate(struct hmacDRBG *d, const unsigned char *provided, size_t providedlen)
+{
+	unsigned char scr[SHA256_DIGEST_LENGTH + 1 + DRBG_MAX_INPUT];
+	unsigned int len;
+	int i;
+
+	memcpy(scr, d->V, sizeof(d->V));
+	if (providedlen > 0) {
+		memcpy(scr + sizeof(d->V) + 1, provided, providedlen);
+	}
+
+	for (i = 0; i < 2; i++) {
+		scr[sizeof(d->V)] = (unsigned char)i;
+
+		if (!HMAC(EVP_sha256(), d->K, sizeof(d->K), scr, sizeof(d->V) + 1 + providedlen, d->K, &len)) {
+			return -1;
+		}
+
+		if (!HMAC(EVP_sha256(), d->K, sizeof(d->K), d->V, sizeof(d->V), d->V, &len)) {
+			return -1;
+		}
+
+		if (providedlen == 0) {
+			break;
+		}
+		memcpy(scr, d->V, sizeof(d->V));
+	}
+
+	memset(scr, 0, sizeof(scr));
+	return 0;
+}
+
+
+
+/**
+ * Instantiate or reseed the DRBG. As defined in SP 800-90A, instantiate and reseed
+ * only differ in the initial value of K and V.
+ */
+static int hmacDRBGSeed(struct hmacDRBG *d, int instantiate, const unsigned char *seed, size_t seedlen)
+{
+	if (instantiate) {
+		memset(d->K, 0x00, sizeof(d->K));
+		memset(d->V, 0x01, sizeof(d->V));
+	}
+
+	if (hmacDRBGUpdate(d, seed, seedlen) < 0) {
+		return -1;
+	}
+
+	d->reseedCounter = 1;
+	return 0;
+}
+
+
+
+static int hmacDRBGGenerate(struct hmacDRBG *d, unsigned char *out, size_t outlen)
+{
+	unsigned int len;
+	size_t chunk;
+
+	while (outlen > 0) {
+		if (!HMAC(EVP_sha256(), d->K, sizeof(d->K), d->V, sizeof(d->V), d->V, &len)) {
+			return -1;
+		}
+
+		chunk = outlen < sizeof(d->V) ? outlen : sizeof(d->V);
+		memcpy(out, d->V, chunk);
+		out += chunk;
+		outlen -= chunk;
+	}
+
+	if (hmacDRBGUpdate(d, NULL, 0) < 0) {
+		return -1;
+	}
+
+	d->reseedCounter++;
+	return 0;
+}
+
+
+
+/**
+ * Return true if the host DRBG is enabled
+ */
+int drbgEnabled()
+{
+	static int enabled = -1;
+	char *po;
+
+	if (enabled < 0) {
+		po = getenv("PKCS11_HOST_DRBG");
+		enabled = po && (*po == '1');
+#ifdef DEBUG
+		debug("Host DRBG %s\n", enabled ? "enabled" : "disabled");
+#endif
+	}
+	return enabled;
+}
+
+
+
+/**
+ * Remove a thread instance from the list, wipe and release it. Instances already released
+ * by drbgFinalize() are ignored
+ */
+#ifdef _WIN32
+static void WINAPI releaseThreadDRBG(void *p)
+#else
+static void releaseThreadDRBG(void *p)
+#endif
+{
+	struct threadDRBG **pt;
+
+	if (p == NULL) {
+		return;
+	}
+
+	static_mutex_lock(&drbgLock);
+
+	for (pt = &threadDRBGList; *pt != NULL; pt = &(*pt)->next) {
+		if (*pt == p) {
+			*pt = (*pt)->next;
+			memset(p, 0, sizeof(struct threadDRBG));
+			free(p);
+			break;
+		}
+	}
+
+	static_mutex_unlock(&drbgLock);
+}
+
+
+
+/**
+ * Return the DRBG instance of the calling thread, allocating it on first use
+ */
+static struct threadDRBG *getThreadDRBG()
+{
+	struct threadDRBG *tdrbg;
+
+	if (!threadKeyValid) {
+		return NULL;
+	}
+
+#ifdef _WIN32
+	tdrbg = (struct threadDRBG *)FlsGetValue(threadKey);
+#else
+	tdrbg = (struct threadDRBG *)pthread_getspecific(threadKey);
+#endif
+
+	if (tdrbg != NULL) {
+		return tdrbg;
+	}
+
+	tdrbg = calloc(1, sizeof(struct threadDRBG));
+
+	if (tdrbg == NULL) {
+		return NULL;
+	}
+
+#ifdef _WIN32
+	if (!FlsSetValue(threadKey, tdrbg)) {
+#else
+	if (pthread_setspecific(threadKey, tdrbg) != 0) {
+#endif
+		free(tdrbg);
+		return NULL;
+	}
+
+	static_mutex_lock(&drbgLock);
+	tdrbg->next = threadDRBGList;
+	threadDRBGList = tdrbg;
+	static_mutex_unlock(&drbgLock);
+
+	return tdrbg;
+}
+
+
+
+/**
+ * Create the thread local storage for thread instances. Called from C_Initialize()
+ */
+void drbgInitialize()
+{
+	if (threadKeyValid) {
+		return;
+	}
+
+#ifdef _WIN32
+	threadKey = FlsAlloc(releaseThreadDRBG);
+	threadKeyValid = (threadKey != FLS_OUT_OF_INDEXES);
+#else
+	threadKeyValid = (pthread_key_create(&threadKey, releaseThreadDRBG) == 0);
+#endif
+}
+
+
+
+/**
+ * Wipe and release the instances of all threads and the thread local storage. Called from C_Finalize()
+ */
+void drbgFinalize()
+{
+	struct threadDRBG *tdrbg;
+
+	if (!threadKeyValid) {
+		return;
+	}
+
+	threadKeyValid = 0;
+
+	static_mutex_lock(&drbgLock);
+
+	while (threadDRBGList != NULL) {
+		tdrbg = threadDRBGList;
+		threadDRBGList = tdrbg->next;
+		memset(tdrbg, 0, sizeof(*tdrbg));
+		free(tdrbg);
+	}
+
+	static_mutex_unlock(&drbgLock);
+
+#ifdef _WIN32
+	FlsFree(threadKey);
+#else
+	pthread_key_delete(threadKey);
+#endif
+}
+
+
+
+/**
+ * Reseed the token instance with fresh entropy from the token. The caller must hold the instance lock.
+ */
+static CK_RV reseedFromToken(struct p11Slot_t *slot, struct tokenDRBG *td, int instantiate, const unsigned char *additional, size_t additionallen)
+{
+	unsigned char seed[DRBG_SEEDLEN + SHA256_DIGEST_LENGTH];
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = slot->token->drv->C_GenerateRandom(slot, seed, DRBG_SEEDLEN);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Obtaining entropy from token failed");
+	}
+
+	if (additionallen > 0) {
+		memcpy(seed + DRBG_SEEDLEN, additional, additionallen);
+	}
+
+	if (hmacDRBGSeed(&td->drbg, instantiate, seed, DRBG_SEEDLEN + additionallen) < 0) {
+		memset(seed, 0, sizeof(seed));
+		FUNC_FAILS(CKR_FUNCTION_FAILED, "Seeding DRBG failed");
+	}
+
+	memset(seed, 0, sizeof(seed));
+
+	if (instantiate) {
+		hmacDRBGGenerate(&td->drbg, (unsigned char *)&td->instance, sizeof(td->instance));
+	}
+	td->generation++;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Return the DRBG instance of the token, allocating it on first use. The caller receives a reference,
+ * which must be returned with releaseTokenDRBG(), so the instance remains valid if the token is removed
+ */
+static struct tokenDRBG *getTokenDRBG(struct p11Token_t *token)
+{
+	struct tokenDRBG *td;
+
+	static_mutex_lock(&drbgLock);
+
+	if (token->drbg == NULL) {
+		td = calloc(1, sizeof(struct tokenDRBG));
+
+		if ((td != NULL) && (mutex_init(&td->mutex) != 0)) {
+			free(td);
+			td = NULL;
+		}
+
+		if (td != NULL) {
+			td->refcnt = 1;		// Reference held by the token
+		}
+		token->drbg = td;
+	}
+
+	td = (struct tokenDRBG *)token->drbg;
+
+	if (td != NULL) {
+		td->refcnt++;
+	}
+
+	static_mutex_unlock(&drbgLock);
+
+	return td;
+}
+
+
+
+/**
+ * Return a reference obtained with getTokenDRBG() and release the instance with the last reference
+ */
+static void releaseTokenDRBG(struct tokenDRBG *td)
+{
+	int refcnt;
+
+	static_mutex_lock(&drbgLock);
+	refcnt = --td->refcnt;
+	static_mutex_unlock(&drbgLock);
+
+	if (refcnt == 0) {
+		mutex_destroy(&td->mutex);
+		memset(td, 0, sizeof(*td));
+		free(td);
+	}
+}
+
+
+
+/**
+ * Derive the thread instance from the token instance
+ */
+static CK_RV seedThreadDRBG(struct p11Slot_t *slot, struct tokenDRBG *td, struct threadDRBG *tdrbg)
+{
+	unsigned char seed[DRBG_SEEDLEN + sizeof(struct threadDRBG *)];
+	CK_RV rv = CKR_OK;
+
+	mutex_lock(&td->mutex);
+
+	if (td->generation == 0) {
+		rv = reseedFromToken(slot, td, 1, NULL, 0);
+	} else if (td->drbg.reseedCounter > DRBG_TOKEN_RESEED_INTERVAL) {
+		rv = reseedFromToken(slot, td, 0, NULL, 0);
+	}
+
+	if (rv == CKR_OK) {
+		if (hmacDRBGGenerate(&td->drbg, seed, DRBG_SEEDLEN) < 0) {
+			rv = CKR_FUNCTION_FAILED;
+		}
+		tdrbg->instance = td->instance;
+		tdrbg->generation = td->generation;
+	}
+
+	mutex_unlock(&td->mutex);
+
+	if (rv != CKR_OK) {
+		tdrbg->valid = 0;
+		return rv;
+	}
+
+	// Personalize with the address of the thread instance, which is unique among the running threads
+	memcpy(seed + DRBG_SEEDLEN, &tdrbg, sizeof(tdrbg));
+
+	if (hmacDRBGSeed(&tdrbg->drbg, 1, seed, sizeof(seed)) < 0) {
+		rv = CKR_FUNCTION_FAILED;
+	}
+
+	memset(seed, 0, sizeof(seed));
+
+	tdrbg->pid = (unsigned long)getpid();
+	tdrbg->valid = (rv == CKR_OK);
+
+	return rv;
+}
+
+
+
+/**
+ * Generate random data using the DRBG of the calling thread, which is seeded from the token
+ *
+ * @param slot          the slot with the token providing entropy
+ * @param pRandomData   the buffer receiving random data
+ * @param ulRandomLen   the requested number of random bytes
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+CK_RV drbgGenerate(struct p11Slot_t *slot, CK_BYTE_PTR pRandomData, CK_ULONG ulRandomLen)
+{
+	struct threadDRBG *tdrbg;
+	struct tokenDRBG *td;
+	CK_ULONG chunk;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (slot->token->drv->C_GenerateRandom == NULL) {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Token has no random number generator");
+	}
+
+	tdrbg = getThreadDRBG();
+
+	if (tdrbg == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	td = getTokenDRBG(slot->token);
+
+	if (td == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rv = CKR_OK;
+
+	while (ulRandomLen > 0) {
+		// The generation of the token instance is read without lock. A stale value only
+		// delays the reseed of the thread instance to the next request
+		if (!tdrbg->valid || (tdrbg->instance != td->instance) || (tdrbg->generation != td->generation) ||
+			(tdrbg->pid != (unsigned long)getpid()) || (tdrbg->drbg.reseedCounter > DRBG_THREAD_RESEED_INTERVAL)) {
+			rv = seedThreadDRBG(slot, td, tdrbg);
+			if (rv != CKR_OK) {
+				break;
+			}
+		}
+
+		chunk = ulRandomLen > DRBG_MAX_REQUEST ? DRBG_MAX_REQUEST : ulRandomLen;
+
+		if (hmacDRBGGenerate(&tdrbg->drbg, pRandomData, chunk) < 0) {
+			tdrbg->valid = 0;
+			rv = CKR_FUNCTION_FAILED;
+			break;
+		}
+
+		pRandomData += chunk;
+		ulRandomLen -= chunk;
+	}
+
+	releaseTokenDRBG(td);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Generating random failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Mix seed material provided by the application into the DRBG of the token. The token
+ * instance is reseeded with fresh entropy from the token and the seed as additional input.
+ * Thread instances are reseeded with their next request.
+ *
+ * @param slot          the slot with the token providing entropy
+ * @param pSeed         the seed material
+ * @param ulSeedLen     the length of the seed material
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+CK_RV drbgSeed(struct p11Slot_t *slot, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	struct tokenDRBG *td;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (slot->token->drv->C_GenerateRandom == NULL) {
+		FUNC_FAILS(CKR_RANDOM_SEED_NOT_SUPPORTED, "Token has no random number generator");
+	}
+
+	td = getTokenDRBG(slot->token);
+
+	if (td == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	SHA256(pSeed, ulSeedLen, md);
+
+	mutex_lock(&td->mutex);
+	rv = reseedFromToken(slot, td, td->generation == 0, md, sizeof(md));
+	mutex_unlock(&td->mutex);
+
+	releaseTokenDRBG(td);
+
+	memset(md, 0, sizeof(md));
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Release the reference of the token to its DRBG instance. The instance is released once
+ * requests still in progress have completed
+ *
+ * @param token         the token
+ */
+void drbgFree(struct p11Token_t *token)
+{
+	struct tokenDRBG *td;
+
+	static_mutex_lock(&drbgLock);
+	td = (struct tokenDRBG *)token->drbg;
+	token->drbg = NULL;
+	static_mutex_unlock(&drbgLock);
+
+	if (td != NULL) {
+		releaseTokenDRBG(td);
+	}
+}
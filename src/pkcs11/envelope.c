@@ -0,0 +1,776 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2017, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    envelope.c
+ * @brief   Host side bulk encryption with data keys derived on the token
+ *
+ * The mechanisms CKM_SC_HSM_ENVELOPE_AES_GCM and CKM_SC_HSM_ENVELOPE_AES_CTR derive a data key from
+ * an AES key on the token with CKM_SC_HSM_SP80056C_DERIVE and then encrypt or decrypt on the host using
+ * libcrypto, which uses the AES instructions of the processor where available. The key encryption key
+ * never leaves the token, while bulk data is processed at memory speed.
+ *
+ * Derived data keys are cached per token in locked memory for PKCS11_ENVELOPE_KEY_TTL seconds
+ * (default 300, 0 disables the cache). Entries are keyed by the key reference and CKA_ID of the key
+ * encryption key and the key context. The cache is cleared when the user logs out or an object is destroyed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <openssl/sha.h>
+
+#include <pkcs11/envelope.h>
+#include <pkcs11/crypto.h>
+#include <pkcs11/object.h>
+#include <common/mutex.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#define ENVELOPE_CACHE_ENTRIES		64		// Data keys cached per token
+#define ENVELOPE_DEFAULT_TTL		300		// Seconds a derived data key remains in the cache
+#define ENVELOPE_MAX_UPDATE		0x40000000	// Maximum input passed to libcrypto in a single call
+
+
+
+struct envelopeCacheEntry {
+	int kek;				// Key reference of the key encryption key, 0 if the entry is empty
+	unsigned char kekid[SHA256_DIGEST_LENGTH];	// Hash of CKA_ID of the key encryption key
+	unsigned char context[SHA256_DIGEST_LENGTH];	// Hash of the derivation parameter
+	unsigned char key[32];
+	int keylen;
+	time_t expires;
+};
+
+
+
+/**
+ * Data key cache of a token, allocated in memory that is locked against paging
+ */
+struct envelopeCache {
+	MUTEX mutex;
+	struct envelopeCacheEntry entries[ENVELOPE_CACHE_ENTRIES];
+};
+
+
+
+/**
+ * State of an envelope operation, kept in the cryptoContext of the operation
+ */
+struct envelopeContext {
+	EVP_CIPHER_CTX *ctx;
+	int encrypt;
+	int gcm;
+	int tagLen;
+	int heldLen;				// Trailing input held back as it may be the GCM tag
+	unsigned char held[16];
+};
+
+
+
+/*
+ * Serializes the allocation and release of the cache of a token and the initialization of the TTL
+ */
+static STATIC_MUTEX cacheLock = STATIC_MUTEX_INITIALIZER;
+
+
+
+static void *allocLocked(size_t size)
+{
+	void *p;
+
+#ifdef _WIN32
+	p = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if ((p != NULL) && !VirtualLock(p, size)) {
+#ifdef DEBUG
+		debug("VirtualLock() failed, data key cache may be paged\n");
+#endif
+	}
+#else
+	p = calloc(1, size);
+	if ((p != NULL) && mlock(p, size)) {
+#ifdef DEBUG
+		debug("mlock() failed, data key cache may be paged\n");
+#endif
+	}
+#endif
+	return p;
+}
+
+
+
+static void freeLocked(void *p, size_t size)
+{
+	OPENSSL_cleanse(p, size);
+#ifdef _WIN32
+	VirtualUnlock(p, size);
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munlock(p, size);
+	free(p);
+#endif
+}
+
+
+
+static int getKeyTTL()
+{
+	static int ttl = -1;
+	char *po;
+	int result;
+
+	static_mutex_lock(&cacheLock);
+
+	if (ttl < 0) {
+		po = getenv("PKCS11_ENVELOPE_KEY_TTL");
+		ttl = po ? atoi(po) : ENVELOPE_DEFAULT_TTL;
+		if (ttl < 0) {
+			ttl = 0;
+		}
+#ifdef DEBUG
+		debug("Envelope data key TTL %d seconds\n", ttl);
+#endif
+	}
+
+	result = ttl;
+
+	static_mutex_unlock(&cacheLock);
+
+	return result;
+}
+
+
+
+/**
+ * Return the data key cache of the token, allocating it on first use
+ */
+static struct envelopeCache *getCache(struct p11Token_t *token)
+{
+	struct envelopeCache *ec;
+
+	static_mutex_lock(&cacheLock);
+
+	if (token->envelopeCache == NULL) {
+		ec = allocLocked(sizeof(struct envelopeCache));
+
+		if ((ec != NULL) && (mutex_init(&ec->mutex) != 0)) {
+			freeLocked(ec, sizeof(struct envelopeCache));
+			ec = NULL;
+		}
+		token->envelopeCache = ec;
+	}
+
+	ec = (struct envelopeCache *)token->envelopeCache;
+
+	static_mutex_unlock(&cacheLock);
+
+	return ec;
+}
+
+
+
+/**
+ * Look up the data key in the cache of the token. Expired entries are cleared on the way.
+ *
+ * @return 1 if the key was found, 0 otherwise
+ */
+static int lookupDataKey(struct envelopeCache *ec, int kek, unsigned char *kekid, unsigned char *context, unsigned char *key, int *keylen)
+{
+	struct envelopeCacheEntry *e;
+	time_t now = time(NULL);
+	int i, found = 0;
+
+	mutex_lock(&ec->mutex);
+
+	for (i = 0, e = ec->entries; i < ENVELOPE_CACHE_ENTRIES; i++, e++) {
+		if (e->kek == 0) {
+			continue;
+		}
+
+		if (e->expires <= now) {
+			OPENSSL_cleanse(e, sizeof(*e));
+			continue;
+		}
+
+		if (!found && (e->kek == kek) && !memcmp(e->kekid, kekid, sizeof(e->kekid)) &&
+			!memcmp(e->context, context, sizeof(e->context))) {
+			memcpy(key, e->key, e->keylen);
+			*keylen = e->keylen;
+			found = 1;
+		}
+	}
+
+	mutex_unlock(&ec->mutex);
+
+	return found;
+}
+
+
+
+/**
+ * Add the data key to the cache, replacing the entry that expires first if the cache is full
+ */
+static void cacheDataKey(struct envelopeCache *ec, int kek, unsigned char *kekid, unsigned char *context, unsigned char *key, int keylen)
+{
+	struct envelopeCacheEntry *e, *victim;
+	int i, ttl;
+
+	ttl = getKeyTTL();
+
+	mutex_lock(&ec->mutex);
+
+	victim = ec->entries;
+	for (i = 0, e = ec->entries; i < ENVELOPE_CACHE_ENTRIES; i++, e++) {
+		if ((e->kek == 0) || ((e->kek == kek) && !memcmp(e->kekid, kekid, sizeof(e->kekid)) &&
+			!memcmp(e->context, context, sizeof(e->context)))) {
+			victim = e;
+			break;
+		}
+		if (e->expires < victim->expires) {
+			victim = e;
+		}
+	}
+
+	victim->kek = kek;
+	memcpy(victim->kekid, kekid, sizeof(victim->kekid));
+	memcpy(victim->context, context, sizeof(victim->context));
+	memcpy(victim->key, key, keylen);
+	victim->keylen = keylen;
+	victim->expires = time(NULL) + ttl;
+
+	mutex_unlock(&ec->mutex);
+}
+
+
+
+/**
+ * Obtain the data key for the key context, either from the cache or by derivation on the token
+ */
+static CK_RV getDataKey(struct p11Object_t *pObject, CK_SC_HSM_ENVELOPE_PARAMS_PTR params, envelopeDeriveKey_t derive, unsigned char *key, int *keylen)
+{
+	unsigned char kekid[SHA256_DIGEST_LENGTH], context[SHA256_DIGEST_LENGTH];
+	struct envelopeCache *ec = NULL;
+	struct p11Attribute_t *attr;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	// Keys without CKA_ID are not cached, as a different key may later use the same key reference
+	if ((getKeyTTL() > 0) && (findAttribute(pObject, CKA_ID, &attr) >= 0) && (attr->attrData.ulValueLen > 0)) {
+		ec = getCache(pObject->token);
+		SHA256(attr->attrData.pValue, attr->attrData.ulValueLen, kekid);
+	}
+
+	if (ec != NULL) {
+		SHA256(params->pKeyContext, params->ulKeyContextLen, context);
+
+		if (lookupDataKey(ec, pObject->tokenid, kekid, context, key, keylen)) {
+			FUNC_RETURNS(CKR_OK);
+		}
+	}
+
+	rv = derive(pObject, params->pKeyContext, params->ulKeyContextLen, key, keylen);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Deriving the data key failed");
+	}
+
+	if ((*keylen != 16) && (*keylen != 24) && (*keylen != 32)) {
+		OPENSSL_cleanse(key, 32);
+		FUNC_FAILS(CKR_KEY_SIZE_RANGE, "Derived key has an invalid length for AES");
+	}
+
+	if (ec != NULL) {
+		cacheDataKey(ec, pObject->tokenid, kekid, context, key, *keylen);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static const EVP_CIPHER *getCipher(int gcm, int keylen)
+{
+	switch(keylen) {
+	case 16:
+		return gcm ? EVP_aes_128_gcm() : EVP_aes_128_ctr();
+	case 24:
+		return gcm ? EVP_aes_192_gcm() : EVP_aes_192_ctr();
+	default:
+		return gcm ? EVP_aes_256_gcm() : EVP_aes_256_ctr();
+	}
+}
+
+
+
+static void releaseEnvelopeContext(void *context)
+{
+	struct envelopeContext *ctx = (struct envelopeContext *)context;
+
+	EVP_CIPHER_CTX_free(ctx->ctx);
+	OPENSSL_cleanse(ctx, sizeof(*ctx));
+	free(ctx);
+}
+
+
+
+static struct envelopeContext *getEnvelopeContext(struct p11Operation_t *op)
+{
+	if ((op == NULL) || (op->cryptoContext == NULL) || (op->releaseCryptoContext != releaseEnvelopeContext)) {
+		return NULL;
+	}
+	return (struct envelopeContext *)op->cryptoContext;
+}
+
+
+
+/**
+ * Pass the input to libcrypto, splitting it into parts that fit the int length argument
+ */
+static int cipherUpdate(EVP_CIPHER_CTX *ctx, CK_BYTE_PTR pOut, CK_BYTE_PTR pIn, CK_ULONG ulInLen)
+{
+	CK_ULONG chunk;
+	int len;
+
+	while (ulInLen > 0) {
+		chunk = ulInLen > ENVELOPE_MAX_UPDATE ? ENVELOPE_MAX_UPDATE : ulInLen;
+
+		if (!EVP_CipherUpdate(ctx, pOut, &len, pIn, (int)chunk) || (len != (int)chunk)) {
+			return -1;
+		}
+
+		pIn += chunk;
+		pOut += chunk;
+		ulInLen -= chunk;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Return true if the mechanism is an envelope mechanism
+ */
+int envelopeIsMechanism(CK_MECHANISM_TYPE mech)
+{
+	return (mech == CKM_SC_HSM_ENVELOPE_AES_GCM) || (mech == CKM_SC_HSM_ENVELOPE_AES_CTR);
+}
+
+
+
+/**
+ * Start an envelope encryption or decryption. The data key is obtained from the cache or derived
+ * on the token and the cipher state is stored in the operation, so that the parameter is no longer
+ * needed after this call.
+ *
+ * @param pObject       the key encryption key on the token
+ * @param op            the operation
+ * @param mech          the mechanism with a CK_SC_HSM_ENVELOPE_PARAMS parameter
+ * @param encrypt       1 for encryption, 0 for decryption
+ * @param derive        the token function deriving the data key
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+CK_RV envelopeInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, int encrypt, envelopeDeriveKey_t derive)
+{
+	CK_SC_HSM_ENVELOPE_PARAMS_PTR params;
+	struct envelopeContext *ctx;
+	unsigned char key[32];
+	int keylen, gcm, tagLen, len;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (op == NULL) {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Envelope mechanisms require a session");
+	}
+
+	if ((mech->pParameter == NULL) || (mech->ulParameterLen != sizeof(CK_SC_HSM_ENVELOPE_PARAMS))) {
+		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "Parameter must be CK_SC_HSM_ENVELOPE_PARAMS");
+	}
+
+	params = (CK_SC_HSM_ENVELOPE_PARAMS_PTR)mech->pParameter;
+	gcm = mech->mechanism == CKM_SC_HSM_ENVELOPE_AES_GCM;
+	tagLen = 0;
+
+	if ((params->pKeyContext == NULL) || (params->ulKeyContextLen == 0) || (params->pIv == NULL)) {
+		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "Key context and IV are required");
+	}
+
+	if (gcm) {
+		if ((params->ulIvLen == 0) || (params->ulIvLen > 128)) {
+			FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "Invalid GCM nonce length");
+		}
+
+		tagLen = params->ulTagBits ? (int)(params->ulTagBits >> 3) : 16;
+		if ((params->ulTagBits & 7) || (tagLen < 12) || (tagLen > 16)) {
+			FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "GCM tag length must be 96 to 128 bits");
+		}
+
+		if ((params->ulAADLen > 0) && (params->pAAD == NULL)) {
+			FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "AAD missing");
+		}
+	} else {
+		if (params->ulIvLen != 16) {
+			FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "Counter block must be 16 bytes");
+		}
+
+		if (params->ulAADLen > 0) {
+			FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "AAD only supported for GCM");
+		}
+	}
+
+	rv = getDataKey(pObject, params, derive, key, &keylen);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "No data key");
+	}
+
+	ctx = calloc(1, sizeof(struct envelopeContext));
+	if (ctx == NULL) {
+		OPENSSL_cleanse(key, sizeof(key));
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	ctx->encrypt = encrypt;
+	ctx->gcm = gcm;
+	ctx->tagLen = tagLen;
+	ctx->ctx = EVP_CIPHER_CTX_new();
+
+	if ((ctx->ctx == NULL) ||
+		!EVP_CipherInit_ex(ctx->ctx, getCipher(gcm, keylen), NULL, NULL, NULL, encrypt) ||
+		(gcm && !EVP_CIPHER_CTX_ctrl(ctx->ctx, EVP_CTRL_GCM_SET_IVLEN, (int)params->ulIvLen, NULL)) ||
+		!EVP_CipherInit_ex(ctx->ctx, NULL, NULL, key, params->pIv, encrypt) ||
+		((params->ulAADLen > 0) && !EVP_CipherUpdate(ctx->ctx, NULL, &len, params->pAAD, (int)params->ulAADLen))) {
+		OPENSSL_cleanse(key, sizeof(key));
+		releaseEnvelopeContext(ctx);
+		FUNC_FAILS(CKR_FUNCTION_FAILED, "Cipher initialization failed");
+	}
+
+	OPENSSL_cleanse(key, sizeof(key));
+
+	cryptoReleaseContext(op);
+	op->cryptoContext = ctx;
+	op->releaseCryptoContext = releaseEnvelopeContext;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Encrypt or decrypt the next part. For GCM decryption the last bytes received are held back,
+ * as they may contain the tag. The output of an update may therefore be shorter than the input.
+ * pOut may point to the same location as pIn.
+ *
+ * @param op            the operation
+ * @param pIn           the input part
+ * @param ulInLen       the length of the input part
+ * @param pOut          the buffer receiving the output or NULL to determine the length
+ * @param pulOutLen     the size of the buffer, updated with the length of the output
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+CK_RV envelopeUpdate(struct p11Operation_t *op, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct envelopeContext *ctx;
+	CK_ULONG outlen, total, inlen;
+	CK_BYTE_PTR copy = NULL;
+	unsigned char tail[16];
+	int heldLen, rc;
+
+	FUNC_CALLED();
+
+	ctx = getEnvelopeContext(op);
+
+	if (ctx == NULL) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "No envelope operation active");
+	}
+
+	if (ctx->encrypt || !ctx->gcm) {
+		outlen = ulInLen;
+	} else {
+		total = ctx->heldLen + ulInLen;
+		outlen = total > (CK_ULONG)ctx->tagLen ? total - ctx->tagLen : 0;
+	}
+
+	if (pOut == NULL) {
+		*pulOutLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulOutLen < outlen) {
+		*pulOutLen = outlen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+
+	if (ctx->encrypt || !ctx->gcm) {
+		if (cipherUpdate(ctx->ctx, pOut, pIn, ulInLen) < 0) {
+			FUNC_FAILS(CKR_FUNCTION_FAILED, "Cipher operation failed");
+		}
+		*pulOutLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (outlen == 0) {
+		memcpy(ctx->held + ctx->heldLen, pIn, ulInLen);
+		ctx->heldLen += (int)ulInLen;
+		*pulOutLen = 0;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (outlen < (CK_ULONG)ctx->heldLen) {
+		// Only part of the held back bytes is released, the input is appended to the remainder
+		heldLen = ctx->heldLen - (int)outlen;
+		rc = cipherUpdate(ctx->ctx, pOut, ctx->held, outlen);
+		memmove(ctx->held, ctx->held + outlen, heldLen);
+		memcpy(ctx->held + heldLen, pIn, ulInLen);
+		ctx->heldLen = heldLen + (int)ulInLen;
+	} else {
+		inlen = outlen - ctx->heldLen;
+
+		// The output runs ahead of the input by the held back bytes, which would overwrite
+		// unprocessed input if both buffers overlap
+		if ((ctx->heldLen > 0) && (pOut < pIn + inlen) && (pIn < pOut + outlen)) {
+			copy = malloc(inlen);
+			if (copy == NULL) {
+				FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+			}
+			memcpy(copy, pIn, inlen);
+		}
+
+		memcpy(tail, pIn + inlen, ulInLen - inlen);
+
+		rc = cipherUpdate(ctx->ctx, pOut, ctx->held, ctx->heldLen);
+		if (rc == 0) {
+			rc = cipherUpdate(ctx->ctx, pOut + ctx->heldLen, copy ? copy : pIn, inlen);
+		}
+
+		memcpy(ctx->held, tail, ulInLen - inlen);
+		ctx->heldLen = (int)(ulInLen - inlen);
+
+		if (copy != NULL) {
+			OPENSSL_cleanse(copy, inlen);
+			free(copy);
+		}
+	}
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_FUNCTION_FAILED, "Cipher operation failed");
+	}
+
+	*pulOutLen = outlen;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Finish the envelope operation. For GCM encryption the tag is returned, for GCM decryption
+ * the tag is verified. The state is released from the operation unless only the length
+ * is requested or the buffer is too small.
+ *
+ * @param op            the operation
+ * @param pOut          the buffer receiving the output or NULL to determine the length
+ * @param pulOutLen     the size of the buffer, updated with the length of the output
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+CK_RV envelopeFinal(struct p11Operation_t *op, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct envelopeContext *ctx;
+	unsigned char scr[16];
+	CK_ULONG outlen;
+	CK_RV rv = CKR_OK;
+	int len;
+
+	FUNC_CALLED();
+
+	ctx = getEnvelopeContext(op);
+
+	if (ctx == NULL) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "No envelope operation active");
+	}
+
+	outlen = (ctx->gcm && ctx->encrypt) ? ctx->tagLen : 0;
+
+	if (pOut == NULL) {
+		*pulOutLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulOutLen < outlen) {
+		*pulOutLen = outlen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+
+	if (!ctx->gcm) {
+		if (!EVP_CipherFinal_ex(ctx->ctx, scr, &len)) {
+			rv = CKR_FUNCTION_FAILED;
+		}
+	} else if (ctx->encrypt) {
+		if (!EVP_CipherFinal_ex(ctx->ctx, scr, &len) ||
+			!EVP_CIPHER_CTX_ctrl(ctx->ctx, EVP_CTRL_GCM_GET_TAG, ctx->tagLen, pOut)) {
+			rv = CKR_FUNCTION_FAILED;
+		}
+	} else {
+		if (ctx->heldLen < ctx->tagLen) {
+			rv = CKR_ENCRYPTED_DATA_LEN_RANGE;
+		} else if (!EVP_CIPHER_CTX_ctrl(ctx->ctx, EVP_CTRL_GCM_SET_TAG, ctx->tagLen, ctx->held) ||
+			(EVP_CipherFinal_ex(ctx->ctx, scr, &len) <= 0)) {
+			rv = CKR_ENCRYPTED_DATA_INVALID;
+		}
+	}
+
+	cryptoReleaseContext(op);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Final cipher operation failed");
+	}
+
+	*pulOutLen = outlen;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Encrypt or decrypt in a single part. For GCM the tag is appended to the cipher text.
+ *
+ * @param op            the operation
+ * @param pIn           the input
+ * @param ulInLen       the length of the input
+ * @param pOut          the buffer receiving the output or NULL to determine the length
+ * @param pulOutLen     the size of the buffer, updated with the length of the output
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+CK_RV envelopeCrypt(struct p11Operation_t *op, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct envelopeContext *ctx;
+	CK_ULONG outlen, len;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	ctx = getEnvelopeContext(op);
+
+	if (ctx == NULL) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "No envelope operation active");
+	}
+
+	if (!ctx->gcm) {
+		outlen = ulInLen;
+	} else if (ctx->encrypt) {
+		outlen = ulInLen + ctx->tagLen;
+	} else {
+		if (ulInLen < (CK_ULONG)ctx->tagLen) {
+			cryptoReleaseContext(op);
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Input shorter than tag");
+		}
+		outlen = ulInLen - ctx->tagLen;
+	}
+
+	if (pOut == NULL) {
+		*pulOutLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulOutLen < outlen) {
+		*pulOutLen = outlen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+
+	len = *pulOutLen;
+	rv = envelopeUpdate(op, pIn, ulInLen, pOut, &len);
+
+	if (rv != CKR_OK) {
+		cryptoReleaseContext(op);
+		FUNC_FAILS(rv, "Update failed");
+	}
+
+	*pulOutLen -= len;
+	rv = envelopeFinal(op, pOut + len, pulOutLen);
+
+	if (rv != CKR_OK) {
+		// Do not release plain text that failed authentication
+		OPENSSL_cleanse(pOut, len);
+		FUNC_FAILS(rv, "Final failed");
+	}
+
+	*pulOutLen = outlen;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Remove all data keys from the cache of the token
+ *
+ * @param token         the token
+ */
+void envelopeFlush(struct p11Token_t *token)
+{
+	struct envelopeCache *ec = (struct envelopeCache *)token->envelopeCache;
+
+	if (ec == NULL) {
+		return;
+	}
+
+	mutex_lock(&ec->mutex);
+	OPENSSL_cleanse(ec->entries, sizeof(ec->entries));
+	mutex_unlock(&ec->mutex);
+}
+
+
+
+/**
+ * Release the data key cache of a token
+ *
+ * @param token         the token
+ */
+void envelopeFree(struct p11Token_t *token)
+{
+	struct envelopeCache *ec;
+
+	static_mutex_lock(&cacheLock);
+	ec = (struct envelopeCache *)token->envelopeCache;
+	token->envelopeCache = NULL;
+	static_mutex_unlock(&cacheLock);
+
+	if (ec == NULL) {
+		return;
+	}
+
+	mutex_destroy(&ec->mutex);
+	freeLocked(ec, sizeof(struct envelopeCache));
+}
@@ -0,0 +1,61 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2017, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    envelope.h
+ * @brief   Host side bulk encryption with data keys derived on the token
+ */
+
+#ifndef ___ENVELOPE_INC___
+#define ___ENVELOPE_INC___
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/session.h>
+
+
+
+/**
+ * Derive the data key for the given key context on the token
+ *
+ * @param pObject           the key encryption key on the token
+ * @param pKeyContext       the derivation parameter
+ * @param ulKeyContextLen   the length of the derivation parameter
+ * @param key               the buffer receiving up to 32 bytes of key value
+ * @param keylen            the length of the key value
+ * @return                  CKR_OK or any other Cryptoki error code
+ */
+typedef CK_RV (*envelopeDeriveKey_t)(struct p11Object_t *pObject, CK_BYTE_PTR pKeyContext, CK_ULONG ulKeyContextLen, unsigned char *key, int *keylen);
+
+int envelopeIsMechanism(CK_MECHANISM_TYPE mech);
+CK_RV envelopeInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, int encrypt, envelopeDeriveKey_t derive);
+CK_RV envelopeUpdate(struct p11Operation_t *op, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen);
+CK_RV envelopeFinal(struct p11Operation_t *op, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen);
+CK_RV envelopeCrypt(struct p11Operation_t *op, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen);
+void envelopeFlush(struct p11Token_t *token);
+void envelopeFree(struct p11Token_t *token);
+
+#endif /* ___ENVELOPE_INC___ */
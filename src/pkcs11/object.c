@@ -36,6 +36,10 @@
 #include <string.h>
 #include <pkcs11/object.h>
 
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
+
 CK_BBOOL ckTrue = CK_TRUE, ckFalse = CK_FALSE;
 CK_MECHANISM_TYPE ckMechType = CK_UNAVAILABLE_INFORMATION;
 
@@ -230,6 +234,8 @@ struct id2name_t p11CKMName[] = {
 { CKM_EC_KEY_PAIR_GEN           , "EC_KEY_PAIR_GEN", 0 },
 { CKM_ECDSA                     , "ECDSA", 0 },
 { CKM_ECDSA_SHA1                , "ECDSA_SHA1", 0 },
+{ CKM_ECDSA_SHA384              , "ECDSA_SHA384", 0 },
+{ CKM_ECDSA_SHA512              , "ECDSA_SHA512", 0 },
 { CKM_ECDH1_DERIVE              , "ECDH1_DERIVE", 0 },
 { CKM_ECDH1_COFACTOR_DERIVE     , "ECDH1_COFACTOR_DERIVE", 0 },
 { CKM_ECMQV_DERIVE              , "ECMQV_DERIVE", 0 },
@@ -645,6 +651,10 @@ int addAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR pTemplate)
 	}
 	*ppAttribute = pAttribute;
 
+#ifdef ENABLE_LIBCRYPTO
+	cryptoReleaseKey(object);
+#endif
+
 	return CKR_OK;
 }
 
@@ -706,6 +716,10 @@ int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTempla
 	free(pAttr->attrData.pValue);
 	free(pAttr);
 
+#ifdef ENABLE_LIBCRYPTO
+	cryptoReleaseKey(object);
+#endif
+
 	return CKR_OK;
 }
 
@@ -54,6 +54,7 @@ struct p11Attribute_t {
 
 
 struct p11Token_t;				// Forward declaration
+struct p11Operation_t;				// Forward declaration
 
 /**
  * Internal structure to store common attributes of an object.
@@ -75,28 +76,31 @@ struct p11Object_t {
 
     struct p11Token_t *token;
 
-    CK_RV (*C_EncryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-    CK_RV (*C_Encrypt)      (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_EncryptUpdate)(struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_EncryptFinal) (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_EncryptInit)  (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR);
+    CK_RV (*C_Encrypt)      (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_EncryptUpdate)(struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_EncryptFinal) (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
 
-    CK_RV (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-    CK_RV (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_DecryptInit)  (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR);
+    CK_RV (*C_Decrypt)      (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_DecryptUpdate)(struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_DecryptFinal) (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
 
     CK_RV (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
     CK_RV (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
-    CK_RV (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_SignUpdate)   (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
+    CK_RV (*C_SignFinal)    (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
 
-    CK_RV (*C_VerifyInit)   (struct p11Object_t *, CK_MECHANISM_PTR);
+    CK_RV (*C_VerifyInit)   (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR);
     CK_RV (*C_Verify)       (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG);
-    CK_RV (*C_VerifyUpdate) (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
-    CK_RV (*C_VerifyFinal)  (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
+    CK_RV (*C_VerifyUpdate) (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
+    CK_RV (*C_VerifyFinal)  (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
 
     CK_RV (*C_DeriveKey)  (struct p11Object_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **);
 
+    void *publicKey;                /**< Public key cached by the crypto module  */
+    void *publicKeyContext;         /**< Key context cached by the crypto module */
+
     struct p11Attribute_t *attrList;    /**< The list of attributes              */
     struct p11Object_t *next;       /**< Pointer to next object              */
 
@@ -41,6 +41,7 @@
 #include <pkcs11/strbpcpy.h>
 
 #include <pkcs11/crypto.h>
+#include <pkcs11/drbg.h>
 
 #ifdef DEBUG
 #include <common/debug.h>
@@ -359,6 +360,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 
 	initSessionPool(&context->sessionPool);
 
+#ifdef ENABLE_LIBCRYPTO
+	// Objects created while the slot pool is initialized already use the public key cache
+	cryptoInitialize();
+	drbgInitialize();
+#endif
+
 	rv = initSlotPool(&context->slotPool);
 
 	if (rv != CKR_OK) {
@@ -367,12 +374,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 #endif
 		free(context);
 		context = NULL;
+#ifdef ENABLE_LIBCRYPTO
+		drbgFinalize();
+		cryptoFinalize();
+#endif
 		FUNC_RETURNS(rv);
 	}
 
-#ifdef ENABLE_LIBCRYPTO
-	cryptoInitialize();
-#endif
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -391,6 +399,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 	FUNC_CALLED();
 
 	if (context != NULL) {
+		cancelSlotEvents();
+
 		p11LockMutex(context->mutex);
 
 		terminateSessionPool(&context->sessionPool);
@@ -407,6 +417,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 		free(context);
 		context = NULL;
 #ifdef ENABLE_LIBCRYPTO
+		drbgFinalize();
 		cryptoFinalize();
 #endif
 	}
@@ -36,6 +36,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <pkcs11/cryptoki.h>
 // #include <pkcs11/object.h>
@@ -96,6 +97,7 @@
 
 
 struct p11TokenDriver;
+struct p11Operation_t;
 
 #define INT_CKU_NO_USER 0xFF
 
@@ -122,6 +124,9 @@ struct p11Token_t {
 
 	void *mutex;                        /**< Mutex used to synchronize internal updates     */
 	struct p11TokenDriver *drv;         /**< Driver for this token                          */
+	void *drbg;                         /**< Host DRBG seeded from this token               */
+	void *envelopeCache;                /**< Data keys derived for envelope encryption      */
+	void *sigCache;                     /**< Recent deterministic signatures                */
 };
 
 
@@ -151,6 +156,7 @@ struct p11Slot_t {
 	struct p11Slot_t *virtualSlots[2];/**< Virtual slots using this as base    */
 	struct p11Token_t *token;         /**< Pointer to token in the slot        */
 	struct p11Token_t *removedToken;  /**< Removed but not freed token         */
+	time_t lastAPDU;                  /**< Time of last command sent to token  */
 	struct p11Slot_t *next;           /**< Pointer to next available slot      */
 };
 
@@ -199,14 +205,14 @@ struct p11TokenDriver {
 	int (*initpin)(struct p11Slot_t *slot, CK_UTF8CHAR_PTR, CK_ULONG);
 	int (*setpin)(struct p11Slot_t *slot, CK_UTF8CHAR_PTR, CK_ULONG, CK_UTF8CHAR_PTR, CK_ULONG);
 
-	CK_RV (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-	CK_RV (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-	CK_RV (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-	CK_RV (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV (*C_DecryptInit)  (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR);
+	CK_RV (*C_Decrypt)      (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV (*C_DecryptUpdate)(struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV (*C_DecryptFinal) (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
 	CK_RV (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
 	CK_RV (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-	CK_RV (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
-	CK_RV (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
+	CK_RV (*C_SignUpdate)   (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG);
+	CK_RV (*C_SignFinal)    (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR, CK_BYTE_PTR, CK_ULONG_PTR);
 
 	int (*C_GenerateKey)      (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **);
 	int (*C_GenerateKeyPair)  (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **, struct p11Object_t **);
@@ -31,6 +31,8 @@
  * @brief   Crypto mechanisms at the PKCS#11 interface
  */
 
+#include <string.h>
+
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -43,6 +45,10 @@
 #include <pkcs11/crypto.h>
 #include <common/debug.h>
 
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/drbg.h>
+#endif
+
 
 extern struct p11Context_t *context;
 
@@ -59,6 +65,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -76,6 +83,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 		FUNC_RETURNS(rv);
 	}
 
+	op = &pSession->operation[P11_OP_ENCRYPT];
+
 	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
 
 	if (rv != CKR_OK) {
@@ -88,8 +97,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 		FUNC_RETURNS(rv);
 	}
 
+#ifdef ENABLE_LIBCRYPTO
+	cryptoReleaseContext(op);
+#endif
+
 	if (pObject->C_EncryptInit != NULL) {
-		rv = pObject->C_EncryptInit(pObject, pMechanism);
+		rv = pObject->C_EncryptInit(pObject, op, pMechanism);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -99,8 +112,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 	}
 
 	if (rv == CKR_OK) {
-		pSession->activeObjectHandle = pObject->handle;
-		rv = copyMechanismParameter(pSession, pMechanism);
+		op->activeObjectHandle = pObject->handle;
+		clearCryptoBuffer(op);
+		rv = copyMechanismParameter(op, pMechanism);
 	}
 
 	FUNC_RETURNS(rv);
@@ -121,6 +135,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -146,7 +161,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_ENCRYPT];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -156,17 +173,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_Encrypt != NULL) {
-		rv = pObject->C_Encrypt(pObject, &pSession->activeMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+		rv = pObject->C_Encrypt(pObject, op, &op->activeMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
 
 		if ((pEncryptedData != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
+			op->activeObjectHandle = CK_INVALID_HANDLE;
 		}
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
@@ -177,6 +194,58 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 
 
 
+/**
+ * Continue the active encryption operation of the session
+ *
+ * @param pSession            the session
+ * @param pPart               the data part
+ * @param ulPartLen           the length of the data part
+ * @param pEncryptedPart      the buffer receiving the encrypted part or NULL to query the length
+ * @param pulEncryptedPartLen the size of the buffer and the length of the encrypted part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV encryptUpdate(struct p11Session_t *pSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	CK_RV rv;
+	struct p11Object_t *pObject;
+	struct p11Slot_t *pSlot;
+	struct p11Operation_t *op;
+
+	FUNC_CALLED();
+
+	op = &pSession->operation[P11_OP_ENCRYPT];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (pObject->C_EncryptUpdate != NULL) {
+		rv = pObject->C_EncryptUpdate(pObject, op, &op->activeMechanism, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+		if (rv == CKR_DEVICE_ERROR) {
+			rv = handleDeviceError(pSession->handle);
+			FUNC_FAILS(rv, "Device error reported");
+		}
+	} else {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
 /*  C_EncryptUpdate continues a multiple-part encryption operation,
     processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
@@ -188,8 +257,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 )
 {
 	CK_RV rv;
-	struct p11Object_t *pObject;
-	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
 
 	FUNC_CALLED();
@@ -216,31 +283,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
-		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
-	}
-
-	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
-
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
-
-	if (pObject->C_EncryptUpdate != NULL) {
-		rv = pObject->C_EncryptUpdate(pObject, &pSession->activeMechanism, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
-		if (rv == CKR_DEVICE_ERROR) {
-			rv = handleDeviceError(hSession);
-			FUNC_FAILS(rv, "Device error reported");
-		}
-	} else {
-		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
-	}
+	rv = encryptUpdate(pSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
 
 	FUNC_RETURNS(rv);
 }
@@ -258,6 +301,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -279,7 +323,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_ENCRYPT];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -289,14 +335,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_EncryptFinal != NULL) {
-		rv = pObject->C_EncryptFinal(pObject, &pSession->activeMechanism, pLastEncryptedPart, pulLastEncryptedPartLen);
+		rv = pObject->C_EncryptFinal(pObject, op, &op->activeMechanism, pLastEncryptedPart, pulLastEncryptedPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -305,8 +351,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
-	if (!rv) {
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+	if (!rv && (pLastEncryptedPart != NULL)) {
+		op->activeObjectHandle = CK_INVALID_HANDLE;
 		rv = CKR_OK;
 	}
 
@@ -326,6 +372,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -343,6 +390,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 		FUNC_RETURNS(rv);
 	}
 
+	op = &pSession->operation[P11_OP_DECRYPT];
+
 	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
 
 	if (rv != CKR_OK) {
@@ -355,8 +404,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 		FUNC_RETURNS(rv);
 	}
 
+#ifdef ENABLE_LIBCRYPTO
+	cryptoReleaseContext(op);
+#endif
+
 	if (pObject->C_DecryptInit != NULL) {
-		rv = pObject->C_DecryptInit(pObject, pMechanism);
+		rv = pObject->C_DecryptInit(pObject, op, pMechanism);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -366,8 +419,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 	}
 
 	if (!rv) {
-		pSession->activeObjectHandle = pObject->handle;
-		rv = copyMechanismParameter(pSession, pMechanism);
+		op->activeObjectHandle = pObject->handle;
+		clearCryptoBuffer(op);
+		rv = copyMechanismParameter(op, pMechanism);
 	}
 
 	FUNC_RETURNS(rv);
@@ -388,6 +442,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -413,7 +468,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_DECRYPT];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -423,18 +480,18 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pData != NULL) {
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+		op->activeObjectHandle = CK_INVALID_HANDLE;
 	}
 
 	if (pObject->C_Decrypt != NULL) {
-		rv = pObject->C_Decrypt(pObject, &pSession->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		rv = pObject->C_Decrypt(pObject, op, &op->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -448,6 +505,58 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 
 
 
+/**
+ * Continue the active decryption operation of the session
+ *
+ * @param pSession           the session
+ * @param pEncryptedPart     the encrypted part
+ * @param ulEncryptedPartLen the length of the encrypted part
+ * @param pPart              the buffer receiving the plain part or NULL to query the length
+ * @param pulPartLen         the size of the buffer and the length of the plain part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV decryptUpdate(struct p11Session_t *pSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	CK_RV rv;
+	struct p11Object_t *pObject;
+	struct p11Slot_t *pSlot;
+	struct p11Operation_t *op;
+
+	FUNC_CALLED();
+
+	op = &pSession->operation[P11_OP_DECRYPT];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (pObject->C_DecryptUpdate != NULL) {
+		rv = pObject->C_DecryptUpdate(pObject, op, &op->activeMechanism, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+		if (rv == CKR_DEVICE_ERROR) {
+			rv = handleDeviceError(pSession->handle);
+			FUNC_FAILS(rv, "Device error reported");
+		}
+	} else {
+		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
 /*  C_DecryptUpdate continues a multiple-part decryption operation,
     processing another encrypted data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
@@ -459,8 +568,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 )
 {
 	CK_RV rv;
-	struct p11Object_t *pObject;
-	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
 
 	FUNC_CALLED();
@@ -487,31 +594,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
-		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
-	}
-
-	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
-
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
-
-	if (pObject->C_DecryptUpdate != NULL) {
-		rv = pObject->C_DecryptUpdate(pObject, &pSession->activeMechanism, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
-		if (rv == CKR_DEVICE_ERROR) {
-			rv = handleDeviceError(hSession);
-			FUNC_FAILS(rv, "Device error reported");
-		}
-	} else {
-		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
-	}
+	rv = decryptUpdate(pSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
 
 	FUNC_RETURNS(rv);
 }
@@ -529,6 +612,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -549,7 +633,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_DECRYPT];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -559,14 +645,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_DecryptFinal != NULL) {
-		rv = pObject->C_DecryptFinal(pObject, &pSession->activeMechanism, pLastPart, pulLastPartLen);
+		rv = pObject->C_DecryptFinal(pObject, op, &op->activeMechanism, pLastPart, pulLastPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -575,8 +661,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
-	if (!rv) {
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+	if (!rv && (pLastPart != NULL)) {
+		op->activeObjectHandle = CK_INVALID_HANDLE;
 		rv = CKR_OK;
 	}
 
@@ -611,7 +697,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestInit)(
 	}
 
 #ifdef ENABLE_LIBCRYPTO
-	rv = cryptoDigestInit(pSession, pMechanism);
+	rv = cryptoDigestInit(&pSession->operation[P11_OP_DIGEST], pMechanism);
 #endif
 
 	FUNC_RETURNS(rv);
@@ -652,7 +738,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Digest)(
 	}
 
 #ifdef ENABLE_LIBCRYPTO
-	rv = cryptoDigest(pSession, pData, ulDataLen, pDigest, pulDigestLen);
+	rv = cryptoDigest(&pSession->operation[P11_OP_DIGEST], pData, ulDataLen, pDigest, pulDigestLen);
 #endif
 
 	FUNC_RETURNS(rv);
@@ -688,7 +774,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestUpdate)(
 	}
 
 #ifdef ENABLE_LIBCRYPTO
-	rv = cryptoDigestUpdate(pSession, pPart, ulPartLen);
+	rv = cryptoDigestUpdate(&pSession->operation[P11_OP_DIGEST], pPart, ulPartLen);
 #endif
 
 	FUNC_RETURNS(rv);
@@ -747,7 +833,56 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestFinal)(
 	}
 
 #ifdef ENABLE_LIBCRYPTO
-	rv = cryptoDigestFinal(pSession, pDigest, pulDigestLen);
+	rv = cryptoDigestFinal(&pSession->operation[P11_OP_DIGEST], pDigest, pulDigestLen);
+#endif
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  C_SC_HSM_DigestBatch digests a number of inputs with the same mechanism
+    in one call. This is a vendor extension. */
+CK_DECLARE_FUNCTION(CK_RV, C_SC_HSM_DigestBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_SC_HSM_DIGEST_REQUEST_PTR pRequests,
+		CK_ULONG ulCount,
+		CK_BYTE_PTR pDigests,
+		CK_ULONG_PTR pulDigestsLen
+)
+{
+	struct p11Session_t *pSession;
+	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pMechanism) || (ulCount && !isValidPtr(pRequests))) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pDigests && !isValidPtr(pDigests)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulDigestsLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+#ifdef ENABLE_LIBCRYPTO
+	rv = cryptoDigestBatch(pMechanism->mechanism, pRequests, ulCount, pDigests, pulDigestsLen);
+#else
+	rv = CKR_FUNCTION_NOT_SUPPORTED;
 #endif
 
 	FUNC_RETURNS(rv);
@@ -767,6 +902,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -784,6 +920,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 		FUNC_RETURNS(rv);
 	}
 
+	op = &pSession->operation[P11_OP_SIGN];
+
 	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
 
 	if (rv != CKR_OK) {
@@ -807,8 +945,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 	}
 
 	if (!rv) {
-		pSession->activeObjectHandle = pObject->handle;
-		rv = copyMechanismParameter(pSession, pMechanism);
+		op->activeObjectHandle = pObject->handle;
+		clearCryptoBuffer(op);
+#ifdef ENABLE_LIBCRYPTO
+		cryptoReleaseContext(op);
+#endif
+		rv = copyMechanismParameter(op, pMechanism);
 	}
 
 	FUNC_RETURNS(rv);
@@ -829,6 +971,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -854,7 +997,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_SIGN];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -864,17 +1009,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_Sign != NULL) {
-		rv = pObject->C_Sign(pObject, &pSession->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
+		rv = pObject->C_Sign(pObject, &op->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
+			op->activeObjectHandle = CK_INVALID_HANDLE;
 		}
 
 		if (rv == CKR_DEVICE_ERROR) {
@@ -890,36 +1035,26 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 
 
 
-/*  C_SignUpdate continues a multiple-part signature operation,
-    processing another data part. */
-CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
-		CK_SESSION_HANDLE hSession,
-		CK_BYTE_PTR pPart,
-		CK_ULONG ulPartLen
-)
+/**
+ * Continue the active signature operation of the session
+ *
+ * @param pSession  the session
+ * @param pPart     the data part
+ * @param ulPartLen the length of the data part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV signUpdate(struct p11Session_t *pSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	CK_RV rv;
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
-	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
-	if (context == NULL) {
-		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
-	}
-
-	if (!isValidPtr(pPart)) {
-		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
-	}
-
-	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+	op = &pSession->operation[P11_OP_SIGN];
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -929,22 +1064,56 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_SignUpdate != NULL) {
-		rv = pObject->C_SignUpdate(pObject, &pSession->activeMechanism, pPart, ulPartLen);
+		rv = pObject->C_SignUpdate(pObject, op, &op->activeMechanism, pPart, ulPartLen);
 		if (rv == CKR_DEVICE_ERROR) {
-			rv = handleDeviceError(hSession);
+			rv = handleDeviceError(pSession->handle);
 			FUNC_FAILS(rv, "Device error reported");
 		}
 	} else {
-		rv = appendToCryptoBuffer(pSession, pPart, ulPartLen);
+		rv = appendToCryptoBuffer(op, pPart, ulPartLen);
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  C_SignUpdate continues a multiple-part signature operation,
+    processing another data part. */
+CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen
+)
+{
+	CK_RV rv;
+	struct p11Session_t *pSession;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
 	}
 
+	rv = signUpdate(pSession, pPart, ulPartLen);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -961,6 +1130,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -982,7 +1152,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_SIGN];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -992,18 +1164,18 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSlotKey(pSlot, pSession->activeObjectHandle, &pObject);
+	rv = findSlotKey(pSlot, op->activeObjectHandle, &pObject);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
 	}
 
 	if (pObject->C_SignFinal != NULL) {
-		rv = pObject->C_SignFinal(pObject, &pSession->activeMechanism, pSignature, pulSignatureLen);
+		rv = pObject->C_SignFinal(pObject, op, &op->activeMechanism, pSignature, pulSignatureLen);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
-			clearCryptoBuffer(pSession);
+			op->activeObjectHandle = CK_INVALID_HANDLE;
+			clearCryptoBuffer(op);
 		}
 
 		if (rv == CKR_DEVICE_ERROR) {
@@ -1012,11 +1184,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		}
 	} else {
 		if (pObject->C_Sign != NULL) {
-			rv = pObject->C_Sign(pObject, &pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, pulSignatureLen);
+			rv = pObject->C_Sign(pObject, &op->activeMechanism, op->cryptoBuffer, op->cryptoBufferSize, pSignature, pulSignatureLen);
 
 			if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
-				pSession->activeObjectHandle = CK_INVALID_HANDLE;
-				clearCryptoBuffer(pSession);
+				op->activeObjectHandle = CK_INVALID_HANDLE;
+				clearCryptoBuffer(op);
 			}
 
 			if (rv == CKR_DEVICE_ERROR) {
@@ -1089,6 +1261,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -1106,6 +1279,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
 		FUNC_RETURNS(rv);
 	}
 
+	op = &pSession->operation[P11_OP_VERIFY];
+
 	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
 
 	if (rv != CKR_OK) {
@@ -1117,14 +1292,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
 	}
 
 	if (pObject->C_VerifyInit != NULL) {
-		rv = pObject->C_VerifyInit(pObject, pMechanism);
+		clearCryptoBuffer(op);
+		rv = pObject->C_VerifyInit(pObject, op, pMechanism);
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
 
 	if (rv == CKR_OK) {
-		pSession->activeObjectHandle = pObject->handle;
-		rv = copyMechanismParameter(pSession, pMechanism);
+		op->activeObjectHandle = pObject->handle;
+		rv = copyMechanismParameter(op, pMechanism);
 	}
 
 	FUNC_RETURNS(rv);
@@ -1146,6 +1322,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -1167,7 +1344,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_VERIFY];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -1177,13 +1356,16 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 		FUNC_RETURNS(rv);
 	}
 
-	if ((findSessionObject(pSession, pSession->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, pSession->activeObjectHandle, &pObject, TRUE) < 0)) {
+	if ((findSessionObject(pSession, op->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, op->activeObjectHandle, &pObject, TRUE) < 0)) {
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "Can not find key for handle");
 	}
 
 	if (pObject->C_Verify != NULL) {
-		rv = pObject->C_Verify(pObject, &pSession->activeMechanism, pData, ulDataLen, pSignature, ulSignatureLen);
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
+		rv = pObject->C_Verify(pObject, &op->activeMechanism, pData, ulDataLen, pSignature, ulSignatureLen);
+		op->activeObjectHandle = CK_INVALID_HANDLE;
+#ifdef ENABLE_LIBCRYPTO
+		cryptoReleaseContext(op);
+#endif
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
@@ -1193,36 +1375,26 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 
 
 
-/*  C_VerifyUpdate continues a multiple-part verification operation,
-    processing another data part. */
-CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
-		CK_SESSION_HANDLE hSession,
-		CK_BYTE_PTR pPart,
-		CK_ULONG ulPartLen
-)
+/**
+ * Continue the active verification operation of the session
+ *
+ * @param pSession  the session
+ * @param pPart     the data part
+ * @param ulPartLen the length of the data part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV verifyUpdate(struct p11Session_t *pSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
 	CK_RV rv;
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
-	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
-	if (context == NULL) {
-		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
-	}
-
-	if (!isValidPtr(pPart)) {
-		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
-	}
-
-	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
-
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+	op = &pSession->operation[P11_OP_VERIFY];
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -1232,16 +1404,50 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 		FUNC_RETURNS(rv);
 	}
 
-	if ((findSessionObject(pSession, pSession->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, pSession->activeObjectHandle, &pObject, TRUE) < 0)) {
+	if ((findSessionObject(pSession, op->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, op->activeObjectHandle, &pObject, TRUE) < 0)) {
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "Can not find key for handle");
 	}
 
 	if (pObject->C_VerifyUpdate != NULL) {
-		rv = pObject->C_VerifyUpdate(pObject, &pSession->activeMechanism, pPart, ulPartLen);
+		rv = pObject->C_VerifyUpdate(pObject, op, &op->activeMechanism, pPart, ulPartLen);
 	} else {
-		rv = appendToCryptoBuffer(pSession, pPart, ulPartLen);
+		rv = appendToCryptoBuffer(op, pPart, ulPartLen);
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  C_VerifyUpdate continues a multiple-part verification operation,
+    processing another data part. */
+CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen
+)
+{
+	CK_RV rv;
+	struct p11Session_t *pSession;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
 	}
 
+	rv = verifyUpdate(pSession, pPart, ulPartLen);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -1259,6 +1465,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	struct p11Operation_t *op;
 
 	FUNC_CALLED();
 
@@ -1276,7 +1483,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if (pSession->activeObjectHandle == CK_INVALID_HANDLE) {
+	op = &pSession->operation[P11_OP_VERIFY];
+
+	if (op->activeObjectHandle == CK_INVALID_HANDLE) {
 		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
 	}
 
@@ -1286,21 +1495,21 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 		FUNC_RETURNS(rv);
 	}
 
-	if ((findSessionObject(pSession, pSession->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, pSession->activeObjectHandle, &pObject, TRUE) < 0)) {
+	if ((findSessionObject(pSession, op->activeObjectHandle, &pObject) < 0) && (findObject(pSlot->token, op->activeObjectHandle, &pObject, TRUE) < 0)) {
 		FUNC_FAILS(CKR_KEY_HANDLE_INVALID, "Can not find key for handle");
 	}
 
 	if (pObject->C_VerifyFinal != NULL) {
-		rv = pObject->C_VerifyFinal(pObject, &pSession->activeMechanism, pSignature, ulSignatureLen);
+		rv = pObject->C_VerifyFinal(pObject, op, &op->activeMechanism, pSignature, ulSignatureLen);
 
-		pSession->activeObjectHandle = CK_INVALID_HANDLE;
-		clearCryptoBuffer(pSession);
+		op->activeObjectHandle = CK_INVALID_HANDLE;
+		clearCryptoBuffer(op);
 	} else {
 		if (pObject->C_Verify != NULL) {
-			rv = pObject->C_Verify(pObject, &pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, ulSignatureLen);
+			rv = pObject->C_Verify(pObject, &op->activeMechanism, op->cryptoBuffer, op->cryptoBufferSize, pSignature, ulSignatureLen);
 
-			pSession->activeObjectHandle = CK_INVALID_HANDLE;
-			clearCryptoBuffer(pSession);
+			op->activeObjectHandle = CK_INVALID_HANDLE;
+			clearCryptoBuffer(op);
 		} else {
 			FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 		}
@@ -1311,6 +1520,89 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 
 
 
+/*  C_SC_HSM_VerifyBatch verifies a number of signatures in one call, using
+    the threads of the verification pool. This is a vendor extension. */
+CK_DECLARE_FUNCTION(CK_RV, C_SC_HSM_VerifyBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_SC_HSM_VERIFY_REQUEST_PTR pRequests,
+		CK_ULONG ulCount,
+		CK_ULONG ulThreads,
+		CK_RV *pResults
+)
+{
+#ifdef ENABLE_LIBCRYPTO
+	CK_RV rv;
+	CK_ULONG i;
+	struct p11Object_t **pObjects;
+	struct p11Slot_t *pSlot;
+	struct p11Session_t *pSession;
+#endif
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+#ifdef ENABLE_LIBCRYPTO
+	if (!isValidPtr(pRequests) || !isValidPtr(pResults)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlot(&context->slotPool, pSession->slotID, &pSlot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (ulCount == 0) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	pObjects = calloc(ulCount, sizeof(*pObjects));
+
+	if (pObjects == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	// Resolve all keys upfront, the workers only run the cryptographic operation
+	for (i = 0; i < ulCount; i++) {
+		if (!isValidPtr(pRequests[i].pMechanism)) {
+			pResults[i] = CKR_ARGUMENTS_BAD;
+			continue;
+		}
+
+		if ((findSessionObject(pSession, pRequests[i].hKey, &pObjects[i]) < 0) &&
+				((pSlot->token == NULL) || (findObject(pSlot->token, pRequests[i].hKey, &pObjects[i], TRUE) < 0))) {
+			pObjects[i] = NULL;
+			pResults[i] = CKR_KEY_HANDLE_INVALID;
+			continue;
+		}
+
+		if (pObjects[i]->C_Verify != cryptoVerify) {
+			pObjects[i] = NULL;
+			pResults[i] = CKR_KEY_FUNCTION_NOT_PERMITTED;
+		}
+	}
+
+	rv = cryptoVerifyBatch(pObjects, pRequests, ulCount, ulThreads, pResults);
+
+	free(pObjects);
+
+	FUNC_RETURNS(rv);
+#else
+	FUNC_RETURNS(CKR_FUNCTION_NOT_SUPPORTED);
+#endif
+}
+
+
+
 /*  C_VerifyRecoverInit initializes a signature verification operation,
     where the data is recovered from the signature. */
 CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecoverInit)(
@@ -1355,6 +1647,151 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecover)(
 
 
 
+/**
+ * Feed a data part into the digest operation of the session
+ *
+ * @param pSession  the session
+ * @param pPart     the data part
+ * @param ulPartLen the length of the data part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV digestUpdate(struct p11Session_t *pSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	return cryptoDigestUpdate(&pSession->operation[P11_OP_DIGEST], pPart, ulPartLen);
+#else
+	return CKR_FUNCTION_NOT_SUPPORTED;
+#endif
+}
+
+
+
+/**
+ * Return true if the signature, verification or digest operation of the session is active
+ *
+ * @param pSession  the session
+ * @param type      one of P11_OP_SIGN, P11_OP_VERIFY or P11_OP_DIGEST
+ * @return true if the operation was initialized
+ */
+static int isOperationActive(struct p11Session_t *pSession, int type)
+{
+	if (type == P11_OP_DIGEST) {
+		return pSession->operation[type].cryptoContext != NULL;
+	}
+	return pSession->operation[type].activeObjectHandle != CK_INVALID_HANDLE;
+}
+
+
+
+/**
+ * Encrypt a data part and feed the plain text into the signature or digest operation of the session.
+ *
+ * The required output length is checked before any data is processed, so that a length query or a buffer
+ * that is too small does not feed the same data twice. The plain text is then passed to the second operation
+ * before it is encrypted, which also covers output that overlaps the input. If either step fails, then both
+ * operations are terminated, so that the signature or digest can never cover data that was not encrypted.
+ *
+ * @param pSession            the session
+ * @param type                the second operation, either P11_OP_SIGN or P11_OP_DIGEST
+ * @param pPart               the data part
+ * @param ulPartLen           the length of the data part
+ * @param pEncryptedPart      the buffer receiving the encrypted part or NULL to query the length
+ * @param pulEncryptedPartLen the size of the buffer and the length of the encrypted part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV encryptDualUpdate(struct p11Session_t *pSession, int type, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	CK_ULONG outlen;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (!isOperationActive(pSession, type)) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = encryptUpdate(pSession, pPart, ulPartLen, NULL, &outlen);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (pEncryptedPart == NULL) {
+		*pulEncryptedPartLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulEncryptedPartLen < outlen) {
+		*pulEncryptedPartLen = outlen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+
+	if (type == P11_OP_SIGN) {
+		rv = signUpdate(pSession, pPart, ulPartLen);
+	} else {
+		rv = digestUpdate(pSession, pPart, ulPartLen);
+	}
+
+	if (rv == CKR_OK) {
+		rv = encryptUpdate(pSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	}
+
+	if (rv != CKR_OK) {
+		releaseOperation(&pSession->operation[P11_OP_ENCRYPT]);
+		releaseOperation(&pSession->operation[type]);
+		FUNC_FAILS(rv, "Dual-function update failed, both operations terminated");
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Decrypt an encrypted part and feed the plain text into the verification or digest operation of the session.
+ * If the second operation fails after the part was decrypted, then both operations are terminated.
+ *
+ * @param pSession           the session
+ * @param type               the second operation, either P11_OP_VERIFY or P11_OP_DIGEST
+ * @param pEncryptedPart     the encrypted part
+ * @param ulEncryptedPartLen the length of the encrypted part
+ * @param pPart              the buffer receiving the plain part or NULL to query the length
+ * @param pulPartLen         the size of the buffer and the length of the plain part
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV decryptDualUpdate(struct p11Session_t *pSession, int type, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (!isOperationActive(pSession, type)) {
+		FUNC_FAILS(CKR_OPERATION_NOT_INITIALIZED, "Operation not initialized");
+	}
+
+	rv = decryptUpdate(pSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+
+	if ((rv != CKR_OK) || (pPart == NULL) || (*pulPartLen == 0)) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (type == P11_OP_VERIFY) {
+		rv = verifyUpdate(pSession, pPart, *pulPartLen);
+	} else {
+		rv = digestUpdate(pSession, pPart, *pulPartLen);
+	}
+
+	if (rv != CKR_OK) {
+		releaseOperation(&pSession->operation[P11_OP_DECRYPT]);
+		releaseOperation(&pSession->operation[type]);
+		FUNC_FAILS(rv, "Dual-function update failed, both operations terminated");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /*  C_DigestEncryptUpdate continues multiple-part digest and encryption
     operations, processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_DigestEncryptUpdate)(
@@ -1365,7 +1802,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestEncryptUpdate)(
 		CK_ULONG_PTR pulEncryptedPartLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *pSession;
 
 	FUNC_CALLED();
 
@@ -1373,11 +1811,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_DigestEncryptUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (!isValidPtr(pPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pEncryptedPart && !isValidPtr(pEncryptedPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulEncryptedPartLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = encryptDualUpdate(pSession, P11_OP_DIGEST, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+
 	FUNC_RETURNS(rv);
 }
 
 
 
+
 /*  C_DecryptDigestUpdate continues a multiple-part combined decryption and
     digest operation, processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_DecryptDigestUpdate)(
@@ -1388,7 +1847,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptDigestUpdate)(
 		CK_ULONG_PTR pulPartLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *pSession;
 
 	FUNC_CALLED();
 
@@ -1396,11 +1856,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptDigestUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (!isValidPtr(pEncryptedPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pPart && !isValidPtr(pPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulPartLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = decryptDualUpdate(pSession, P11_OP_DIGEST, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+
 	FUNC_RETURNS(rv);
 }
 
 
 
+
 /*  C_SignEncryptUpdate continues a multiple-part combined signature and
     encryption operation, processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_SignEncryptUpdate)(
@@ -1411,7 +1892,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignEncryptUpdate)(
 		CK_ULONG_PTR pulEncryptedPartLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *pSession;
 
 	FUNC_CALLED();
 
@@ -1419,11 +1901,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignEncryptUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (!isValidPtr(pPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pEncryptedPart && !isValidPtr(pEncryptedPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulEncryptedPartLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = encryptDualUpdate(pSession, P11_OP_SIGN, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+
 	FUNC_RETURNS(rv);
 }
 
 
 
+
 /*  C_DecryptVerifyUpdate continues a multiple-part combined decryption and verification
     operation, processing another data part. */
 CK_DECLARE_FUNCTION(CK_RV, C_DecryptVerifyUpdate)(
@@ -1434,7 +1937,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptVerifyUpdate)(
 		CK_ULONG_PTR pulPartLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	CK_RV rv;
+	struct p11Session_t *pSession;
 
 	FUNC_CALLED();
 
@@ -1442,11 +1946,32 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptVerifyUpdate)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (!isValidPtr(pEncryptedPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pPart && !isValidPtr(pPart)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulPartLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = decryptDualUpdate(pSession, P11_OP_VERIFY, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+
 	FUNC_RETURNS(rv);
 }
 
 
 
+
 /*  C_GenerateKey generates a secret key or set of domain parameters,
     creating a new object. */
 CK_DECLARE_FUNCTION(CK_RV, C_GenerateKey)(
@@ -1771,6 +2296,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
 )
 {
 	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+#ifdef ENABLE_LIBCRYPTO
+	struct p11Slot_t *slot;
+	struct p11Session_t *pSession;
+	struct p11Token_t *token;
+#endif
 
 	FUNC_CALLED();
 
@@ -1778,6 +2308,41 @@ CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+#ifdef ENABLE_LIBCRYPTO
+	if (!drbgEnabled()) {
+		FUNC_RETURNS(rv);
+	}
+
+	if (!isValidPtr(pSeed)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &pSession);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlot(&context->slotPool, pSession->slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getValidatedToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = drbgSeed(slot, pSeed, ulSeedLen);
+
+	if (rv == CKR_DEVICE_ERROR) {
+		rv = handleDeviceError(hSession);
+		FUNC_FAILS(rv, "Device error reported");
+	}
+#endif
+
 	FUNC_RETURNS(rv);
 }
 
@@ -1823,7 +2388,12 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 		return rv;
 	}
 
-	rv = generateTokenRandom(slot, pRandomData, ulRandomLen);
+#ifdef ENABLE_LIBCRYPTO
+	if (drbgEnabled())
+		rv = drbgGenerate(slot, pRandomData, ulRandomLen);
+	else
+#endif
+		rv = generateTokenRandom(slot, pRandomData, ulRandomLen);
 
 	if (rv == CKR_DEVICE_ERROR) {
 		rv = handleDeviceError(hSession);
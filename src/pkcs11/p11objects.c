@@ -41,6 +41,10 @@
 #include <pkcs11/dataobject.h>
 #include <pkcs11/certificateobject.h>
 
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
+
 #ifdef DEBUG
 #include <common/debug.h>
 #endif
@@ -348,6 +352,41 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 
 
 
+/**
+ * Find an object visible to the session, either a session object, a public token object or,
+ * if the user is logged in, a private token object.
+ *
+ * @param session       The session
+ * @param slot          The slot of the session
+ * @param hObject       The object handle
+ * @param pObject       Variable receiving the object
+ * @return              0 if found, -1 otherwise
+ */
+static int findReadableObject(struct p11Session_t *session, struct p11Slot_t *slot, CK_OBJECT_HANDLE hObject, struct p11Object_t **pObject)
+{
+	CK_STATE state;
+
+	if (findSessionObject(session, hObject, pObject) >= 0) {
+		return 0;
+	}
+
+	if (findObject(slot->token, hObject, pObject, TRUE) >= 0) {
+		return 0;
+	}
+
+	state = getSessionState(session, slot->token);
+	if ((state != CKS_RW_USER_FUNCTIONS) && (state != CKS_RO_USER_FUNCTIONS)) {
+		return -1;
+	}
+
+	if (findObject(slot->token, hObject, pObject, FALSE) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+
+
 /*  C_GetAttributeValue obtains the value of one or more attributes of an object. */
 CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 		CK_SESSION_HANDLE hSession,
@@ -362,7 +401,6 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 	struct p11Session_t *session;
 	struct p11Slot_t *slot;
 	struct p11Attribute_t *attribute;
-	CK_STATE state;
 
 	FUNC_CALLED();
 
@@ -386,23 +424,8 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 		FUNC_RETURNS(rv);
 	}
 
-	rv = findSessionObject(session, hObject, &pObject);
-
-	if (rv < 0) {
-		rv = findObject(slot->token, hObject, &pObject, TRUE);
-
-		if (rv < 0) {
-			state = getSessionState(session, slot->token);
-			if ((state == CKS_RW_USER_FUNCTIONS) || (state == CKS_RO_USER_FUNCTIONS)) {
-				rv = findObject(slot->token, hObject, &pObject, FALSE);
-
-				if (rv < 0) {
-					FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "Private token object not found with handle");
-				}
-			} else {
-				FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "Public token object not found with handle");
-			}
-		}
+	if (findReadableObject(session, slot, hObject, &pObject) < 0) {
+		FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "Object not found with handle");
 	}
 
 #ifdef DEBUG
@@ -449,6 +472,138 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 
 
 
+/**
+ * Encode the attributes for C_SC_HSM_GetAttributeValueBatch() into po.
+ *
+ * Each entry is a CK_ULONG length followed by the value padded to a multiple of sizeof(CK_ULONG).
+ * Unavailable attributes are encoded as CK_UNAVAILABLE_INFORMATION without a value.
+ *
+ * @param session       The session
+ * @param slot          The slot of the session
+ * @param phObjects     The object handles
+ * @param ulObjectCount The number of object handles
+ * @param pTypes        The attribute types
+ * @param ulTypeCount   The number of attribute types
+ * @param po            The output buffer or NULL to only determine the length
+ * @return              The length of the encoded attributes
+ */
+static CK_ULONG encodeAttributeBatch(struct p11Session_t *session, struct p11Slot_t *slot, CK_OBJECT_HANDLE_PTR phObjects, CK_ULONG ulObjectCount, CK_ATTRIBUTE_TYPE *pTypes, CK_ULONG ulTypeCount, CK_BYTE_PTR po)
+{
+	CK_ULONG i, j, len, padded, total;
+	struct p11Object_t *pObject;
+	struct p11Attribute_t *attribute;
+
+	total = 0;
+
+	for (i = 0; i < ulObjectCount; i++) {
+		if (findReadableObject(session, slot, phObjects[i], &pObject) < 0) {
+			pObject = NULL;
+		}
+
+		for (j = 0; j < ulTypeCount; j++) {
+			attribute = NULL;
+
+			if (pObject != NULL) {
+				findAttribute(pObject, pTypes[j], &attribute);
+
+				if (attribute && (pTypes[j] == CKA_VALUE) && pObject->sensitiveObj) {
+					attribute = NULL;
+				}
+			}
+
+			len = attribute ? attribute->attrData.ulValueLen : CK_UNAVAILABLE_INFORMATION;
+			padded = attribute ? (len + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1) : 0;
+			total += sizeof(CK_ULONG) + padded;
+
+			if (po == NULL) {
+				continue;
+			}
+
+			memcpy(po, &len, sizeof(CK_ULONG));
+			po += sizeof(CK_ULONG);
+
+			if (attribute) {
+				if (len > 0) {
+					memcpy(po, attribute->attrData.pValue, len);
+				}
+				memset(po + len, 0, padded - len);
+				po += padded;
+			}
+		}
+	}
+	return total;
+}
+
+
+
+/*  C_SC_HSM_GetAttributeValueBatch obtains a list of attributes for a number of objects
+    in one call. This is a vendor extension. */
+CK_DECLARE_FUNCTION(CK_RV, C_SC_HSM_GetAttributeValueBatch)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE_PTR phObjects,
+		CK_ULONG ulObjectCount,
+		CK_ATTRIBUTE_TYPE *pTypes,
+		CK_ULONG ulTypeCount,
+		CK_BYTE_PTR pBuffer,
+		CK_ULONG_PTR pulBufferLen
+)
+{
+	int rv;
+	CK_ULONG needed;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if ((ulObjectCount && !isValidPtr(phObjects)) || (ulTypeCount && !isValidPtr(pTypes))) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (pBuffer && !isValidPtr(pBuffer)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulBufferLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &session);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlot(&context->slotPool, session->slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+#ifdef DEBUG
+	debug("[C_SC_HSM_GetAttributeValueBatch] Trying to get %u attributes from %u objects ...\n", ulTypeCount, ulObjectCount);
+#endif
+
+	needed = encodeAttributeBatch(session, slot, phObjects, ulObjectCount, pTypes, ulTypeCount, NULL);
+
+	if (pBuffer != NULL) {
+		if (*pulBufferLen < needed) {
+			*pulBufferLen = needed;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Buffer too small");
+		}
+		encodeAttributeBatch(session, slot, phObjects, ulObjectCount, pTypes, ulTypeCount, pBuffer);
+	}
+
+	*pulBufferLen = needed;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /*  C_SetAttributeValue modifies the value of one or more attributes of an object. */
 CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 		CK_SESSION_HANDLE hSession,
@@ -575,6 +730,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 			attribute->attrData.ulValueLen = pTemplate[i].ulValueLen;
 			memcpy(attribute->attrData.pValue, pTemplate[i].pValue, pTemplate[i].ulValueLen);
 
+#ifdef ENABLE_LIBCRYPTO
+			cryptoReleaseKey(pObject);
+#endif
 			pObject->dirtyFlag = 1;
 		}
 	}
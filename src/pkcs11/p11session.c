@@ -113,7 +113,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_OpenSession)(
 
 	session->slotID = slotID;
 	session->flags = flags;
-	session->activeObjectHandle = CK_INVALID_HANDLE;
+	initOperations(session);
 
 	addSession(&context->sessionPool, session);
 
@@ -233,12 +233,45 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetOperationState)(
 		CK_ULONG_PTR pulOperationStateLen
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	struct p11Session_t *session;
+
+	FUNC_CALLED();
 
 	if (context == NULL) {
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (pOperationState && !isValidPtr(pOperationState)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	if (!isValidPtr(pulOperationStateLen)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &session);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlot(&context->slotPool, session->slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getValidatedToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getOperationState(session, slot, pOperationState, pulOperationStateLen);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -253,12 +286,41 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetOperationState)(
 		CK_OBJECT_HANDLE hAuthenticationKey
 )
 {
-	CK_RV rv = CKR_FUNCTION_NOT_SUPPORTED;
+	int rv;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	struct p11Session_t *session;
+
+	FUNC_CALLED();
 
 	if (context == NULL) {
 		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
 	}
 
+	if (!isValidPtr(pOperationState)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &session);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = findSlot(&context->slotPool, session->slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getValidatedToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = setOperationState(session, slot, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey);
+
 	FUNC_RETURNS(rv);
 }
 
@@ -247,7 +247,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
 			FUNC_FAILS(rv, "Could not get next slot event");
 		}
 
-		if ((rv == CKR_NO_EVENT) && !(flags & flags & ~CKF_DONT_BLOCK)) {
+		if ((rv == CKR_NO_EVENT) && !(flags & CKF_DONT_BLOCK)) {
 			rv = waitForSlotEvent(&context->slotPool);
 
 			if (rv != CKR_OK) {
@@ -37,9 +37,51 @@
 
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/slot.h>
+#include <pkcs11/token.h>
+#include <pkcs11/crc32.h>
+
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
 
 extern struct p11Context_t *context;
 
+/* Header of the blob returned by C_GetOperationState */
+#define OPERATION_STATE_MAGIC       "SHOS"
+#define OPERATION_STATE_VERSION     1
+
+/**
+ * Sequential writer for the operation state. Without a buffer only the length is determined.
+ */
+struct stateWriter {
+	unsigned char *p;
+	CK_ULONG len;
+};
+
+/**
+ * Sequential reader for the operation state. Reading beyond the end sets the failed flag.
+ */
+struct stateReader {
+	unsigned char *p;
+	CK_ULONG len;
+	CK_ULONG pos;
+	int failed;
+};
+
+/**
+ * A decoded operation from the state, with references into the blob
+ */
+struct savedOperation {
+	int type;
+	CK_MECHANISM mech;
+	CK_OBJECT_HANDLE hKey;
+	CK_BYTE_PTR buffer;
+	CK_ULONG bufferLen;
+	CK_BYTE_PTR digestState;
+	CK_ULONG digestStateLen;
+};
+
 
 /**
  * Initialize the session-pool structure
@@ -194,7 +236,7 @@ int findSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, struct
  */
 int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 {
-	int rc;
+	int rc, i;
 	struct p11Session_t *session;
 	struct p11Session_t **pSession;
 	struct p11Slot_t *slot;
@@ -230,17 +272,8 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 			return CKR_GENERAL_ERROR;
 	}
 
-	if (session->activeMechanism.pParameter) {
-		free(session->activeMechanism.pParameter);
-		session->activeMechanism.pParameter = NULL;
-		session->activeMechanism.ulParameterLen = 0;
-	}
-
-	if (session->cryptoBuffer) {
-		free(session->cryptoBuffer);
-		session->cryptoBuffer = NULL;
-		session->cryptoBufferMax = 0;
-		session->cryptoBufferSize = 0;
+	for (i = 0; i < P11_OP_MAX; i++) {
+		releaseOperation(&session->operation[i]);
 	}
 
 	free(session);
@@ -458,29 +491,76 @@ void clearSearchList(struct p11Session_t *session)
 
 
 /**
- * Copy mechanism parameter into the session object
+ * Initialize the operation slots of a new session
  *
- * @param session    the session
+ * @param session   the session
+ */
+void initOperations(struct p11Session_t *session)
+{
+	int i;
+
+	for (i = 0; i < P11_OP_MAX; i++) {
+		session->operation[i].session = session;
+		session->operation[i].activeObjectHandle = CK_INVALID_HANDLE;
+	}
+}
+
+
+
+/**
+ * Release all resources held by an operation and mark the slot as unused
+ *
+ * @param op        the operation
+ */
+void releaseOperation(struct p11Operation_t *op)
+{
+	if (op->activeMechanism.pParameter) {
+		free(op->activeMechanism.pParameter);
+		op->activeMechanism.pParameter = NULL;
+		op->activeMechanism.ulParameterLen = 0;
+	}
+
+	if (op->cryptoBuffer) {
+		free(op->cryptoBuffer);
+		op->cryptoBuffer = NULL;
+		op->cryptoBufferMax = 0;
+		op->cryptoBufferSize = 0;
+	}
+
+#ifdef ENABLE_LIBCRYPTO
+	cryptoReleaseContext(op);
+#endif
+
+	op->cryptoProcessed = 0;
+	op->activeObjectHandle = CK_INVALID_HANDLE;
+}
+
+
+
+/**
+ * Copy mechanism parameter into the operation
+ *
+ * @param op         the operation
  * @param pMechanism the mechanism parameter
  * @return CKR_OK or CKR_HOST_MEMORY
  */
-int copyMechanismParameter(struct p11Session_t *session, CK_MECHANISM_PTR pMechanism)
+int copyMechanismParameter(struct p11Operation_t *op, CK_MECHANISM_PTR pMechanism)
 {
-	if (session->activeMechanism.pParameter) {
-		free(session->activeMechanism.pParameter);
-		session->activeMechanism.pParameter = NULL;
-		session->activeMechanism.ulParameterLen = 0;
+	if (op->activeMechanism.pParameter) {
+		free(op->activeMechanism.pParameter);
+		op->activeMechanism.pParameter = NULL;
+		op->activeMechanism.ulParameterLen = 0;
 	}
 
-	session->activeMechanism.mechanism = pMechanism->mechanism;
+	op->activeMechanism.mechanism = pMechanism->mechanism;
 
 	if (pMechanism->ulParameterLen > 0) {
-		session->activeMechanism.pParameter = calloc(1, pMechanism->ulParameterLen);
-		if (session->activeMechanism.pParameter == NULL) {
+		op->activeMechanism.pParameter = calloc(1, pMechanism->ulParameterLen);
+		if (op->activeMechanism.pParameter == NULL) {
 			return CKR_HOST_MEMORY;
 		}
-		memcpy(session->activeMechanism.pParameter, pMechanism->pParameter, pMechanism->ulParameterLen);
-		session->activeMechanism.ulParameterLen = pMechanism->ulParameterLen;
+		memcpy(op->activeMechanism.pParameter, pMechanism->pParameter, pMechanism->ulParameterLen);
+		op->activeMechanism.ulParameterLen = pMechanism->ulParameterLen;
 	}
 
 	return CKR_OK;
@@ -491,30 +571,30 @@ int copyMechanismParameter(struct p11Session_t *session, CK_MECHANISM_PTR pMecha
 /**
  * Append data to an internal buffer for token that don not implement an update() function
  *
- * @param session   the session
+ * @param op        the operation
  * @param data      the data to be added
  * @param length    length of the data to be added
  * @return CKR_OK or CKR_HOST_MEMORY
  */
-int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULONG length)
+int appendToCryptoBuffer(struct p11Operation_t *op, CK_BYTE_PTR data, CK_ULONG length)
 {
-	if (session->cryptoBufferMax < session->cryptoBufferSize + length) {
-		if (session->cryptoBufferMax == 0) {
-			session->cryptoBufferMax = 256;
+	if (op->cryptoBufferMax < op->cryptoBufferSize + length) {
+		if (op->cryptoBufferMax == 0) {
+			op->cryptoBufferMax = 256;
 		}
-		while (session->cryptoBufferMax < session->cryptoBufferSize + length) {
-			session->cryptoBufferMax <<= 1;
+		while (op->cryptoBufferMax < op->cryptoBufferSize + length) {
+			op->cryptoBufferMax <<= 1;
 		}
 
-		session->cryptoBuffer = (CK_BYTE_PTR)realloc(session->cryptoBuffer, session->cryptoBufferMax);
-		if (session->cryptoBuffer == NULL) {
-			session->cryptoBufferMax = 0;
+		op->cryptoBuffer = (CK_BYTE_PTR)realloc(op->cryptoBuffer, op->cryptoBufferMax);
+		if (op->cryptoBuffer == NULL) {
+			op->cryptoBufferMax = 0;
 			return CKR_HOST_MEMORY;
 		}
 	}
 
-	memcpy(session->cryptoBuffer + session->cryptoBufferSize, data, length);
-	session->cryptoBufferSize += length;
+	memcpy(op->cryptoBuffer + op->cryptoBufferSize, data, length);
+	op->cryptoBufferSize += length;
 
 	return CKR_OK;
 }
@@ -524,12 +604,507 @@ int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULON
 /**
  * Clear crypto buffer used to collect input data
  *
- * @param session   the session
+ * @param op        the operation
+ */
+void clearCryptoBuffer(struct p11Operation_t *op)
+{
+	if (op->cryptoBuffer) {
+		memset(op->cryptoBuffer, 0, op->cryptoBufferMax);
+		op->cryptoBufferSize = 0;
+	}
+	op->cryptoProcessed = 0;
+}
+
+
+
+static void putBytes(struct stateWriter *w, void *data, CK_ULONG len)
+{
+	if ((w->p != NULL) && (len > 0)) {
+		memcpy(w->p + w->len, data, len);
+	}
+	w->len += len;
+}
+
+
+
+static void putLong(struct stateWriter *w, CK_ULONG val)
+{
+	unsigned char b[4];
+
+	b[0] = (unsigned char)(val >> 24);
+	b[1] = (unsigned char)(val >> 16);
+	b[2] = (unsigned char)(val >> 8);
+	b[3] = (unsigned char)val;
+	putBytes(w, b, 4);
+}
+
+
+
+static unsigned char *getBytes(struct stateReader *r, CK_ULONG len)
+{
+	unsigned char *p;
+
+	if (r->failed || (len > r->len - r->pos)) {
+		r->failed = 1;
+		return NULL;
+	}
+	p = r->p + r->pos;
+	r->pos += len;
+	return p;
+}
+
+
+
+static CK_ULONG getLong(struct stateReader *r)
+{
+	unsigned char *b;
+
+	b = getBytes(r, 4);
+	if (b == NULL) {
+		return 0;
+	}
+	return ((CK_ULONG)b[0] << 24) | ((CK_ULONG)b[1] << 16) | ((CK_ULONG)b[2] << 8) | b[3];
+}
+
+
+
+/**
+ * Return true if the operation slot is in use
+ */
+static int isActiveOperation(struct p11Operation_t *op, int type)
+{
+	if (type == P11_OP_DIGEST) {
+		return op->cryptoContext != NULL;
+	}
+	return op->activeObjectHandle != CK_INVALID_HANDLE;
+}
+
+
+
+/**
+ * Return true if the mechanism parameter has the expected length, contains no pointer and can be used in another process
  */
-void clearCryptoBuffer(struct p11Session_t *session)
+static int isPortableParameter(CK_MECHANISM_PTR mech)
 {
-	if (session->cryptoBuffer) {
-		memset(session->cryptoBuffer, 0, session->cryptoBufferMax);
-		session->cryptoBufferSize = 0;
+	if (mech->ulParameterLen == 0) {
+		return TRUE;
+	}
+
+	switch(mech->mechanism) {
+	case CKM_AES_CBC:
+	case CKM_AES_CBC_PAD:
+		return mech->ulParameterLen == 16;
+	case CKM_RSA_PKCS_PSS:
+	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		return mech->ulParameterLen == sizeof(CK_RSA_PKCS_PSS_PARAMS);
+	case CKM_RSA_PKCS_OAEP:
+		return (mech->ulParameterLen == sizeof(CK_RSA_PKCS_OAEP_PARAMS)) &&
+			(((CK_RSA_PKCS_OAEP_PARAMS_PTR)mech->pParameter)->ulSourceDataLen == 0);
+	}
+	return FALSE;
+}
+
+
+
+/**
+ * Find the key used by an operation, which is either a session or a token object
+ */
+static int findOperationKey(struct p11Session_t *session, struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object)
+{
+	if (findSessionObject(session, handle, object) >= 0) {
+		return CKR_OK;
+	}
+	return findSlotKey(slot, handle, object);
+}
+
+
+
+/**
+ * Check a restored operation with the same token function that validates key and mechanism in C_xxxInit()
+ *
+ * @param session       the session
+ * @param slot          the slot of the session
+ * @param type          the operation type, one of P11_OP_ENCRYPT, P11_OP_DECRYPT, P11_OP_SIGN or P11_OP_VERIFY
+ * @param op            the operation with the restored mechanism
+ * @param hKey          the key of the operation
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static int initRestoredOperation(struct p11Session_t *session, struct p11Slot_t *slot, int type, struct p11Operation_t *op, CK_OBJECT_HANDLE hKey)
+{
+	struct p11Object_t *pObject;
+	int rv;
+
+	rv = findOperationKey(session, slot, hKey, &pObject);
+	if (rv != CKR_OK) {
+		return rv;
+	}
+
+	rv = CKR_KEY_FUNCTION_NOT_PERMITTED;
+
+	switch(type) {
+	case P11_OP_ENCRYPT:
+		if (pObject->C_EncryptInit != NULL) {
+			rv = pObject->C_EncryptInit(pObject, op, &op->activeMechanism);
+		}
+		break;
+	case P11_OP_DECRYPT:
+		if (pObject->C_DecryptInit != NULL) {
+			rv = pObject->C_DecryptInit(pObject, op, &op->activeMechanism);
+		}
+		break;
+	case P11_OP_SIGN:
+		if (pObject->C_SignInit != NULL) {
+			rv = pObject->C_SignInit(pObject, &op->activeMechanism);
+		}
+		break;
+	case P11_OP_VERIFY:
+		if (pObject->C_VerifyInit != NULL) {
+			rv = pObject->C_VerifyInit(pObject, op, &op->activeMechanism);
+		}
+		break;
 	}
+
+	return rv;
+}
+
+
+
+/**
+ * Serialize the active operations of the session.
+ *
+ * Keys are referenced by CKA_CLASS and CKA_ID, so that the state can be restored in a session of
+ * another process attached to the same token. Operations with a state that can not be moved
+ * to another session, like an on-card hash or a cipher context, can not be saved.
+ *
+ * @param session       the session
+ * @param slot          the slot of the session
+ * @param pState        the buffer receiving the state or NULL to query the length
+ * @param pulStateLen   the size of the buffer and the length of the state
+ * @return CKR_OK or any other Cryptoki error code
+ */
+int getOperationState(struct p11Session_t *session, struct p11Slot_t *slot, CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen)
+{
+	struct stateWriter w;
+	struct p11Operation_t *op;
+	struct p11Object_t *pObject;
+	struct p11Attribute_t *cls, *id;
+	CK_ULONG digestStateLen, count, pass;
+	int i, rv;
+
+	count = 0;
+	for (i = 0; i < P11_OP_MAX; i++) {
+		op = &session->operation[i];
+		if (!isActiveOperation(op, i)) {
+			continue;
+		}
+		if ((op->cryptoProcessed != 0) || !isPortableParameter(&op->activeMechanism)) {
+			return CKR_STATE_UNSAVEABLE;
+		}
+#ifndef ENABLE_LIBCRYPTO
+		if (op->cryptoContext != NULL) {
+			return CKR_STATE_UNSAVEABLE;
+		}
+#endif
+		count++;
+	}
+
+	if (count == 0) {
+		return CKR_OPERATION_NOT_INITIALIZED;
+	}
+
+	// The first pass determines the length, the second writes the state
+	for (pass = 0; pass < 2; pass++) {
+		w.p = pass ? pState : NULL;
+		w.len = 0;
+
+		putBytes(&w, OPERATION_STATE_MAGIC, 4);
+		putLong(&w, (OPERATION_STATE_VERSION << 8) | sizeof(CK_ULONG));
+		putBytes(&w, slot->token->info.serialNumber, sizeof(slot->token->info.serialNumber));
+		putLong(&w, count);
+
+		for (i = 0; i < P11_OP_MAX; i++) {
+			op = &session->operation[i];
+			if (!isActiveOperation(op, i)) {
+				continue;
+			}
+
+			putLong(&w, i);
+			putLong(&w, op->activeMechanism.mechanism);
+
+			if (op->activeObjectHandle != CK_INVALID_HANDLE) {
+				if (findSessionObject(session, op->activeObjectHandle, &pObject) >= 0) {
+					return CKR_STATE_UNSAVEABLE;		// Session objects are not visible in other sessions
+				}
+				rv = findSlotKey(slot, op->activeObjectHandle, &pObject);
+				if (rv != CKR_OK) {
+					return rv;
+				}
+				findAttribute(pObject, CKA_CLASS, &cls);
+				findAttribute(pObject, CKA_ID, &id);
+				if ((cls == NULL) || (id == NULL)) {
+					return CKR_STATE_UNSAVEABLE;
+				}
+				putLong(&w, *(CK_OBJECT_CLASS *)cls->attrData.pValue);
+				putLong(&w, id->attrData.ulValueLen);
+				putBytes(&w, id->attrData.pValue, id->attrData.ulValueLen);
+			} else {
+				putLong(&w, 0);
+				putLong(&w, 0);
+			}
+
+			putLong(&w, op->activeMechanism.ulParameterLen);
+			putBytes(&w, op->activeMechanism.pParameter, op->activeMechanism.ulParameterLen);
+
+			putLong(&w, op->cryptoBufferSize);
+			putBytes(&w, op->cryptoBuffer, op->cryptoBufferSize);
+
+			digestStateLen = 0;
+#ifdef ENABLE_LIBCRYPTO
+			if (w.p != NULL) {
+				digestStateLen = *pulStateLen - w.len - 8;
+				rv = cryptoGetDigestState(op, w.p + w.len + 4, &digestStateLen);
+			} else {
+				rv = cryptoGetDigestState(op, NULL, &digestStateLen);
+			}
+			if (rv != CKR_OK) {
+				return rv;
+			}
+#endif
+			putLong(&w, digestStateLen);
+			w.len += digestStateLen;
+		}
+
+		if (w.p == NULL) {
+			w.len += 4;
+			if (pState == NULL) {
+				*pulStateLen = w.len;
+				return CKR_OK;
+			}
+			if (*pulStateLen < w.len) {
+				*pulStateLen = w.len;
+				return CKR_BUFFER_TOO_SMALL;
+			}
+		}
+	}
+
+	putLong(&w, crc32(0, pState, w.len));
+	*pulStateLen = w.len;
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Decode and check a state produced by getOperationState()
+ */
+static int decodeOperationState(struct p11Slot_t *slot, CK_BYTE_PTR pState, CK_ULONG ulStateLen, struct savedOperation *saved, CK_ULONG *count)
+{
+	struct stateReader r;
+	struct p11Object_t *pObject;
+	unsigned char *magic, *serial, *id;
+	CK_ULONG ver, i, idLen;
+	CK_OBJECT_CLASS cls;
+	struct savedOperation *so;
+
+	if ((ulStateLen < 4) || (crc32(0, pState, ulStateLen - 4) != (((CK_ULONG)pState[ulStateLen - 4] << 24) | ((CK_ULONG)pState[ulStateLen - 3] << 16) | ((CK_ULONG)pState[ulStateLen - 2] << 8) | pState[ulStateLen - 1]))) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+
+	r.p = pState;
+	r.len = ulStateLen - 4;
+	r.pos = 0;
+	r.failed = 0;
+
+	magic = getBytes(&r, 4);
+	if (r.failed || memcmp(magic, OPERATION_STATE_MAGIC, 4)) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+
+	ver = getLong(&r);
+	if (ver != ((OPERATION_STATE_VERSION << 8) | sizeof(CK_ULONG))) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+
+	serial = getBytes(&r, sizeof(slot->token->info.serialNumber));
+	if (r.failed || memcmp(serial, slot->token->info.serialNumber, sizeof(slot->token->info.serialNumber))) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+
+	*count = getLong(&r);
+	if (r.failed || (*count == 0) || (*count > P11_OP_MAX)) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+
+	for (i = 0; i < *count; i++) {
+		so = &saved[i];
+		so->type = (int)getLong(&r);
+		so->mech.mechanism = getLong(&r);
+		cls = getLong(&r);
+		idLen = getLong(&r);
+		id = getBytes(&r, idLen);
+		so->mech.ulParameterLen = getLong(&r);
+		so->mech.pParameter = getBytes(&r, so->mech.ulParameterLen);
+		so->bufferLen = getLong(&r);
+		so->buffer = getBytes(&r, so->bufferLen);
+		so->digestStateLen = getLong(&r);
+		so->digestState = getBytes(&r, so->digestStateLen);
+
+		if (r.failed || (so->type < 0) || (so->type >= P11_OP_MAX) || ((i > 0) && (so->type <= saved[i - 1].type))) {
+			return CKR_SAVED_STATE_INVALID;
+		}
+
+		so->hKey = CK_INVALID_HANDLE;
+		if (idLen > 0) {
+			if (findMatchingTokenObjectById(slot->token, cls, id, (int)idLen, &pObject) == CKR_OK) {
+				so->hKey = pObject->handle;
+			}
+		}
+	}
+
+	if (r.pos != r.len) {
+		return CKR_SAVED_STATE_INVALID;
+	}
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Restore the operations of a session from a state produced by getOperationState().
+ *
+ * Keys are located by the CKA_CLASS and CKA_ID saved in the state. The keys passed by the
+ * application take precedence.
+ *
+ * @param session               the session
+ * @param slot                  the slot of the session
+ * @param pState                the saved state
+ * @param ulStateLen            the length of the saved state
+ * @param hEncryptionKey        the key for the encryption or decryption operation or CK_INVALID_HANDLE
+ * @param hAuthenticationKey    the key for the signature or verification operation or CK_INVALID_HANDLE
+ * @return CKR_OK or any other Cryptoki error code
+ */
+int setOperationState(struct p11Session_t *session, struct p11Slot_t *slot, CK_BYTE_PTR pState, CK_ULONG ulStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey)
+{
+	struct savedOperation saved[P11_OP_MAX];
+	struct savedOperation *so;
+	struct p11Operation_t *op;
+	struct p11Object_t *pObject;
+	CK_OBJECT_HANDLE hKey;
+	CK_ULONG count, i;
+	int rv, encKeyUsed = 0, authKeyUsed = 0;
+
+	rv = decodeOperationState(slot, pState, ulStateLen, saved, &count);
+	if (rv != CKR_OK) {
+		return rv;
+	}
+
+	for (i = 0; i < count; i++) {
+		so = &saved[i];
+		if (so->type == P11_OP_DIGEST) {
+			continue;
+		}
+
+		if ((so->type == P11_OP_ENCRYPT) || (so->type == P11_OP_DECRYPT)) {
+			hKey = hEncryptionKey;
+			encKeyUsed = 1;
+		} else {
+			hKey = hAuthenticationKey;
+			authKeyUsed = 1;
+		}
+
+		if (hKey != CK_INVALID_HANDLE) {
+			rv = findOperationKey(session, slot, hKey, &pObject);
+			if (rv != CKR_OK) {
+				return rv;
+			}
+			so->hKey = hKey;
+		}
+
+		if (so->hKey == CK_INVALID_HANDLE) {
+			return CKR_KEY_NEEDED;
+		}
+	}
+
+	if (((hEncryptionKey != CK_INVALID_HANDLE) && !encKeyUsed) || ((hAuthenticationKey != CK_INVALID_HANDLE) && !authKeyUsed)) {
+		return CKR_KEY_NOT_NEEDED;
+	}
+
+#ifndef ENABLE_LIBCRYPTO
+	for (i = 0; i < count; i++) {
+		if (saved[i].digestStateLen > 0) {
+			return CKR_SAVED_STATE_INVALID;
+		}
+	}
+#endif
+
+	for (i = 0; i < P11_OP_MAX; i++) {
+		releaseOperation(&session->operation[i]);
+	}
+
+	for (i = 0; i < count; i++) {
+		so = &saved[i];
+		op = &session->operation[so->type];
+
+		if (so->type != P11_OP_DIGEST) {
+			rv = copyMechanismParameter(op, &so->mech);
+			if (rv != CKR_OK) {
+				break;
+			}
+
+			// Check the copy, as the parameter in the state may not be aligned
+			if (!isPortableParameter(&op->activeMechanism)) {
+				rv = CKR_SAVED_STATE_INVALID;
+				break;
+			}
+			if ((op->activeMechanism.mechanism == CKM_RSA_PKCS_OAEP) && (op->activeMechanism.ulParameterLen > 0)) {
+				((CK_RSA_PKCS_OAEP_PARAMS_PTR)op->activeMechanism.pParameter)->pSourceData = NULL;
+			}
+
+			rv = initRestoredOperation(session, slot, so->type, op, so->hKey);
+			if (rv != CKR_OK) {
+				break;
+			}
+		} else if (so->digestStateLen == 0) {
+			rv = CKR_SAVED_STATE_INVALID;
+			break;
+		}
+
+		if (so->bufferLen > 0) {
+			rv = appendToCryptoBuffer(op, so->buffer, so->bufferLen);
+			if (rv != CKR_OK) {
+				break;
+			}
+		}
+
+#ifdef ENABLE_LIBCRYPTO
+		if (so->digestStateLen > 0) {
+			// Only a digest or a signature hashed on the host carries a digest state. Any other
+			// operation has a context of another type, which must not be replaced
+			if ((so->type != P11_OP_DIGEST) && ((so->type != P11_OP_SIGN) || (op->cryptoContext != NULL))) {
+				rv = CKR_SAVED_STATE_INVALID;
+				break;
+			}
+
+			rv = cryptoSetDigestState(op, so->digestState, so->digestStateLen);
+			if (rv != CKR_OK) {
+				break;
+			}
+		}
+#endif
+		op->activeObjectHandle = (int)so->hKey;
+	}
+
+	if (rv != CKR_OK) {
+		for (i = 0; i < P11_OP_MAX; i++) {
+			releaseOperation(&session->operation[i]);
+		}
+	}
+
+	return rv;
 }
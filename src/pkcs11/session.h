@@ -46,6 +46,36 @@ struct p11ObjectSearch_t {
 };
 
 
+#define P11_OP_ENCRYPT      0            /**< Slot of the encryption operation                  */
+#define P11_OP_DECRYPT      1            /**< Slot of the decryption operation                  */
+#define P11_OP_SIGN         2            /**< Slot of the signature operation                   */
+#define P11_OP_VERIFY       3            /**< Slot of the verification operation                */
+#define P11_OP_DIGEST       4            /**< Slot of the message digest operation              */
+#define P11_OP_MAX          5
+
+/**
+ * Internal structure to store the state of a cryptographic operation.
+ *
+ * A session has one operation slot for each type of operation, so that the dual-function
+ * operations can run an encryption or decryption together with a signature, verification
+ * or digest operation.
+ */
+
+struct p11Operation_t {
+
+	struct p11Session_t *session;       /**< The session this operation belongs to              */
+	int activeObjectHandle;             /**< The handle of the active object, -1 if no object   */
+	CK_MECHANISM activeMechanism;       /**< The currently active mechanism                     */
+	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results                */
+	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer                   */
+	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer                      */
+	void *cryptoContext;                /**< Host side hash state of the active operation       */
+	void (*releaseCryptoContext)(void *); /**< Release function for a context other than a hash */
+	CK_ULONG cryptoProcessed;           /**< Input already processed by the token               */
+};
+
+
+
 /**
  * Internal structure to store information about specific session.
  *
@@ -57,11 +87,7 @@ struct p11Session_t {
 	CK_FLAGS flags;                     /**< The flags of this session                          */
 	CK_SESSION_HANDLE handle;           /**< The handle of the session                          */
 	int isRemoved;                      /**< The token has been removed                         */
-	int activeObjectHandle;             /**< The handle of the active object, -1 if no object   */
-	CK_MECHANISM activeMechanism;       /**< The currently active mechanism                     */
-	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results                */
-	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer                   */
-	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer                      */
+	struct p11Operation_t operation[P11_OP_MAX]; /**< Active operations, indexed by P11_OP_xxx */
 
 	struct p11ObjectSearch_t searchObj; /**< Store the result of a search operation             */
 
@@ -90,8 +116,12 @@ int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, str
 int removeSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle);
 int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *object);
 void clearSearchList(struct p11Session_t *session);
-int copyMechanismParameter(struct p11Session_t *session, CK_MECHANISM_PTR pMechanism);
-int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULONG length);
-void clearCryptoBuffer(struct p11Session_t *session);
+void initOperations(struct p11Session_t *session);
+void releaseOperation(struct p11Operation_t *op);
+int copyMechanismParameter(struct p11Operation_t *op, CK_MECHANISM_PTR pMechanism);
+int appendToCryptoBuffer(struct p11Operation_t *op, CK_BYTE_PTR data, CK_ULONG length);
+void clearCryptoBuffer(struct p11Operation_t *op);
+int getOperationState(struct p11Session_t *session, struct p11Slot_t *slot, CK_BYTE_PTR pState, CK_ULONG_PTR pulStateLen);
+int setOperationState(struct p11Session_t *session, struct p11Slot_t *slot, CK_BYTE_PTR pState, CK_ULONG ulStateLen, CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey);
 
 #endif /* ___SESSION_H_INC___ */
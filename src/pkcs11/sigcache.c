@@ -0,0 +1,482 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2017, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    sigcache.c
+ * @brief   Cache for deterministic signatures
+ *
+ * RSA PKCS#1 V1.5 signatures and CMACs always produce the same result for the same key and input. If
+ * enabled with PKCS11_SIGNATURE_CACHE=<entries>, the results of such operations are kept in a LRU list
+ * per token, keyed by the key reference and CKA_ID of the key, algorithm and the SHA-256 hash of the input.
+ * Object handles are not used, as they may be reused for a different key. Concurrent requests for the
+ * same signature wait for the first request to complete, so that only one operation is performed by the
+ * token.
+ *
+ * The cache can be limited to selected keys by listing their labels in PKCS11_SIGNATURE_CACHE_KEYS,
+ * separated by comma. Keys with CKA_ALWAYS_AUTHENTICATE are never cached, as each signature requires
+ * a fresh authentication.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/sha.h>
+
+#include <pkcs11/sigcache.h>
+#include <pkcs11/object.h>
+#include <common/mutex.h>
+
+#ifdef DEBUG
+#include <common/debug.h>
+#endif
+
+#define SIGCACHE_MAX_SIGNATURE		512		// Largest signature, RSA 4096
+
+
+
+struct sigCacheEntry {
+	struct sigCacheEntry *prev;
+	struct sigCacheEntry *next;
+	int tokenid;				// Key reference on the token
+	unsigned char keyid[SHA256_DIGEST_LENGTH];	// SHA-256 of CKA_ID
+	int algo;
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	MUTEX done;				// Held by the thread performing the operation until the result is available
+	int pending;
+	int linked;
+	int refs;
+	CK_RV rv;
+	CK_ULONG signatureLen;
+	unsigned char signature[SIGCACHE_MAX_SIGNATURE];
+};
+
+
+
+/**
+ * Signature cache of a token with entries in LRU order, most recently used first
+ */
+struct sigCache {
+	MUTEX mutex;
+	struct sigCacheEntry *head;
+	struct sigCacheEntry *tail;
+	int count;
+};
+
+
+
+/*
+ * Serializes the allocation and release of the cache of a token
+ */
+static STATIC_MUTEX cacheLock = STATIC_MUTEX_INITIALIZER;
+
+
+
+static int getMaxEntries()
+{
+	static int entries = -1;
+	char *po;
+
+	if (entries < 0) {
+		po = getenv("PKCS11_SIGNATURE_CACHE");
+		entries = po ? atoi(po) : 0;
+		if (entries < 0) {
+			entries = 0;
+		}
+#ifdef DEBUG
+		debug("Signature cache with %d entries\n", entries);
+#endif
+	}
+	return entries;
+}
+
+
+
+/**
+ * Return true if the signature cache is enabled for the key
+ *
+ * @param pObject       the key
+ */
+int sigCacheEnabled(struct p11Object_t *pObject)
+{
+	struct p11Attribute_t *attr;
+	char *labels, *po;
+	size_t len;
+
+	if (getMaxEntries() == 0) {
+		return 0;
+	}
+
+	if ((findAttribute(pObject, CKA_ALWAYS_AUTHENTICATE, &attr) >= 0) && (attr->attrData.pValue != NULL) &&
+		*(CK_BBOOL *)attr->attrData.pValue) {
+		return 0;
+	}
+
+	if ((findAttribute(pObject, CKA_ID, &attr) < 0) || (attr->attrData.ulValueLen == 0)) {
+		return 0;
+	}
+
+	labels = getenv("PKCS11_SIGNATURE_CACHE_KEYS");
+	if ((labels == NULL) || (*labels == 0)) {
+		return 1;
+	}
+
+	if ((findAttribute(pObject, CKA_LABEL, &attr) < 0) || (attr->attrData.pValue == NULL)) {
+		return 0;
+	}
+
+	len = attr->attrData.ulValueLen;
+	while (*labels) {
+		po = strchr(labels, ',');
+		if (po == NULL) {
+			po = labels + strlen(labels);
+		}
+
+		if (((size_t)(po - labels) == len) && !memcmp(labels, attr->attrData.pValue, len)) {
+			return 1;
+		}
+
+		labels = *po ? po + 1 : po;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Return the signature cache of the token, allocating it on first use
+ */
+static struct sigCache *getCache(struct p11Token_t *token)
+{
+	struct sigCache *sc;
+
+	static_mutex_lock(&cacheLock);
+
+	if (token->sigCache == NULL) {
+		sc = calloc(1, sizeof(struct sigCache));
+
+		if ((sc != NULL) && (mutex_init(&sc->mutex) != 0)) {
+			free(sc);
+			sc = NULL;
+		}
+		token->sigCache = sc;
+	}
+
+	sc = (struct sigCache *)token->sigCache;
+
+	static_mutex_unlock(&cacheLock);
+
+	return sc;
+}
+
+
+
+/**
+ * Remove the entry from the LRU list. The caller must hold the cache lock.
+ */
+static void unlinkEntry(struct sigCache *sc, struct sigCacheEntry *e)
+{
+	if (e->prev != NULL) {
+		e->prev->next = e->next;
+	} else {
+		sc->head = e->next;
+	}
+
+	if (e->next != NULL) {
+		e->next->prev = e->prev;
+	} else {
+		sc->tail = e->prev;
+	}
+
+	e->prev = e->next = NULL;
+	e->linked = 0;
+	sc->count--;
+}
+
+
+
+/**
+ * Insert the entry at the head of the LRU list. The caller must hold the cache lock.
+ */
+static void linkEntry(struct sigCache *sc, struct sigCacheEntry *e)
+{
+	e->prev = NULL;
+	e->next = sc->head;
+	if (sc->head != NULL) {
+		sc->head->prev = e;
+	} else {
+		sc->tail = e;
+	}
+	sc->head = e;
+	e->linked = 1;
+	sc->count++;
+}
+
+
+
+/**
+ * Free the entry, if it is no longer in the list and no longer referenced by a request.
+ * The caller must hold the cache lock.
+ */
+static void freeEntryIfUnused(struct sigCacheEntry *e)
+{
+	if ((e->refs > 0) || e->linked) {
+		return;
+	}
+
+	mutex_destroy(&e->done);
+	free(e);
+}
+
+
+
+/**
+ * Remove the least recently used entries exceeding the limit. Entries with an operation
+ * in progress are skipped. The caller must hold the cache lock.
+ */
+static void evictEntries(struct sigCache *sc, int max)
+{
+	struct sigCacheEntry *e, *prev;
+
+	for (e = sc->tail; (e != NULL) && (sc->count > max); e = prev) {
+		prev = e->prev;
+		if (!e->pending) {
+			unlinkEntry(sc, e);
+			freeEntryIfUnused(e);
+		}
+	}
+}
+
+
+
+/**
+ * Determine the SHA-256 of CKA_ID of the key, which identifies the key together with the key reference
+ */
+static int getKeyId(struct p11Object_t *pObject, unsigned char *keyid)
+{
+	struct p11Attribute_t *attr;
+
+	if ((findAttribute(pObject, CKA_ID, &attr) < 0) || (attr->attrData.pValue == NULL)) {
+		return -1;
+	}
+
+	SHA256(attr->attrData.pValue, attr->attrData.ulValueLen, keyid);
+	return 0;
+}
+
+
+
+static struct sigCacheEntry *findEntry(struct sigCache *sc, int tokenid, unsigned char *keyid, int algo, unsigned char *hash)
+{
+	struct sigCacheEntry *e;
+
+	for (e = sc->head; e != NULL; e = e->next) {
+		if ((e->tokenid == tokenid) && !memcmp(e->keyid, keyid, sizeof(e->keyid)) &&
+			(e->algo == algo) && !memcmp(e->hash, hash, sizeof(e->hash))) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+
+static CK_RV copySignature(struct sigCacheEntry *e, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	if (e->rv != CKR_OK) {
+		return e->rv;
+	}
+
+	if (*pulSignatureLen < e->signatureLen) {
+		*pulSignatureLen = e->signatureLen;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(pSignature, e->signature, e->signatureLen);
+	*pulSignatureLen = e->signatureLen;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Return the signature from the cache, wait for a concurrent operation with the same input or
+ * perform the operation and add the result to the cache.
+ *
+ * @param pObject           the key
+ * @param algo              the token algorithm, which must be deterministic
+ * @param pData             the input to the signature operation
+ * @param ulDataLen         the length of the input
+ * @param pSignature        the buffer receiving the signature
+ * @param pulSignatureLen   the size of the buffer, updated with the length of the signature
+ * @param sign              the function performing the operation on the token
+ * @return                  CKR_OK or any other Cryptoki error code
+ */
+CK_RV sigCacheSign(struct p11Object_t *pObject, int algo, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen, sigCacheSign_t sign)
+{
+	unsigned char hash[SHA256_DIGEST_LENGTH], keyid[SHA256_DIGEST_LENGTH];
+	struct sigCacheEntry *e;
+	struct sigCache *sc;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	sc = getCache(pObject->token);
+
+	if ((sc == NULL) || (getKeyId(pObject, keyid) < 0)) {
+		FUNC_RETURNS(sign(pObject, algo, pData, ulDataLen, pSignature, pulSignatureLen));
+	}
+
+	SHA256(pData, ulDataLen, hash);
+
+	mutex_lock(&sc->mutex);
+
+	e = findEntry(sc, pObject->tokenid, keyid, algo, hash);
+
+	if (e != NULL) {
+		if (e->pending) {
+			// Wait until the thread performing the operation releases the entry
+			e->refs++;
+			mutex_unlock(&sc->mutex);
+
+			mutex_lock(&e->done);
+			mutex_unlock(&e->done);
+
+			mutex_lock(&sc->mutex);
+			rv = copySignature(e, pSignature, pulSignatureLen);
+			e->refs--;
+			freeEntryIfUnused(e);
+			mutex_unlock(&sc->mutex);
+#ifdef DEBUG
+			debug("Signature shared with concurrent request\n");
+#endif
+			FUNC_RETURNS(rv);
+		}
+
+		unlinkEntry(sc, e);
+		linkEntry(sc, e);
+		rv = copySignature(e, pSignature, pulSignatureLen);
+		mutex_unlock(&sc->mutex);
+		FUNC_RETURNS(rv);
+	}
+
+	e = calloc(1, sizeof(struct sigCacheEntry));
+
+	if ((e == NULL) || (mutex_init(&e->done) != 0)) {
+		mutex_unlock(&sc->mutex);
+		free(e);
+		FUNC_RETURNS(sign(pObject, algo, pData, ulDataLen, pSignature, pulSignatureLen));
+	}
+
+	e->tokenid = pObject->tokenid;
+	memcpy(e->keyid, keyid, sizeof(keyid));
+	e->algo = algo;
+	memcpy(e->hash, hash, sizeof(hash));
+	e->pending = 1;
+	e->refs = 1;
+	mutex_lock(&e->done);
+
+	linkEntry(sc, e);
+	evictEntries(sc, getMaxEntries());
+
+	mutex_unlock(&sc->mutex);
+
+	e->signatureLen = sizeof(e->signature);
+	e->rv = sign(pObject, algo, pData, ulDataLen, e->signature, &e->signatureLen);
+
+	mutex_unlock(&e->done);
+
+	mutex_lock(&sc->mutex);
+
+	e->pending = 0;
+
+	// Failures are shared with waiting requests, but not cached
+	if ((e->rv != CKR_OK) && e->linked) {
+		unlinkEntry(sc, e);
+	}
+
+	rv = copySignature(e, pSignature, pulSignatureLen);
+	e->refs--;
+	freeEntryIfUnused(e);
+
+	evictEntries(sc, getMaxEntries());
+
+	mutex_unlock(&sc->mutex);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Remove all signatures from the cache of the token
+ *
+ * @param token         the token
+ */
+void sigCacheFlush(struct p11Token_t *token)
+{
+	struct sigCache *sc = (struct sigCache *)token->sigCache;
+	struct sigCacheEntry *e;
+
+	if (sc == NULL) {
+		return;
+	}
+
+	mutex_lock(&sc->mutex);
+
+	while ((e = sc->head) != NULL) {
+		unlinkEntry(sc, e);
+		freeEntryIfUnused(e);
+	}
+
+	mutex_unlock(&sc->mutex);
+}
+
+
+
+/**
+ * Release the signature cache of a token
+ *
+ * @param token         the token
+ */
+void sigCacheFree(struct p11Token_t *token)
+{
+	struct sigCache *sc;
+
+	sigCacheFlush(token);
+
+	static_mutex_lock(&cacheLock);
+	sc = (struct sigCache *)token->sigCache;
+	token->sigCache = NULL;
+	static_mutex_unlock(&cacheLock);
+
+	if (sc == NULL) {
+		return;
+	}
+
+	mutex_destroy(&sc->mutex);
+	free(sc);
+}
@@ -0,0 +1,58 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2017, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    sigcache.h
+ * @brief   Cache for deterministic signatures
+ */
+
+#ifndef ___SIGCACHE_INC___
+#define ___SIGCACHE_INC___
+
+#include <pkcs11/p11generic.h>
+
+
+
+/**
+ * Perform the signature operation on the token
+ *
+ * @param pObject           the key
+ * @param algo              the token algorithm
+ * @param pData             the input to the signature operation
+ * @param ulDataLen         the length of the input
+ * @param pSignature        the buffer receiving the signature
+ * @param pulSignatureLen   the size of the buffer, updated with the length of the signature
+ * @return                  CKR_OK or any other Cryptoki error code
+ */
+typedef CK_RV (*sigCacheSign_t)(struct p11Object_t *pObject, int algo, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen);
+
+int sigCacheEnabled(struct p11Object_t *pObject);
+CK_RV sigCacheSign(struct p11Object_t *pObject, int algo, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen, sigCacheSign_t sign);
+void sigCacheFlush(struct p11Token_t *token);
+void sigCacheFree(struct p11Token_t *token);
+
+#endif /* ___SIGCACHE_INC___ */
@@ -39,8 +39,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include <common/memset_s.h>
+#include <common/mutex.h>
 
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
@@ -57,9 +61,35 @@
 
 extern struct p11Context_t *context;
 
-#define MAX_READERS 16
 static unsigned short numberOfReaders = 0;
 
+/*
+ * Event counter for CT_wait()
+ */
+static unsigned int slotEvent = 0;
+
+/*
+ * Maximum time in milliseconds a thread waits in CT_wait() before the slots are polled. Only readers with
+ * an interrupt endpoint signal card insertion and readers attached while no reader is open are not notified
+ */
+#define CTAPI_EVENT_POLL	1000
+
+/*
+ * Threads waiting in waitForCTAPIEvent(). cancelCTAPIEvents() increments the epoch and waits until the
+ * threads that entered before have left, so that they never use the context released by C_Finalize
+ */
+static STATIC_MUTEX eventLock = STATIC_MUTEX_INITIALIZER;
+static unsigned int eventEpoch = 0;
+static int eventWaiters = 0;
+
+/*
+ * Card terminal initialized by a worker thread in updateCTAPISlots()
+ */
+struct ctapiInit {
+	unsigned short ctn;
+	int rc;
+};
+
 
 
 /*
@@ -313,12 +343,134 @@ int getCTAPIToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 
 
+#ifdef _WIN32
+static unsigned __stdcall initWorker(void *arg)
+#else
+static void *initWorker(void *arg)
+#endif
+{
+	struct ctapiInit *init = (struct ctapiInit *)arg;
+
+	init->rc = CT_init(init->ctn, init->ctn);
+	return 0;
+}
+
+
+
+/**
+ * Determine the number of attached readers
+ *
+ * @return the number of readers or 0 if the readers could not be listed
+ */
+static int countCTAPIReaders()
+{
+	unsigned char *readers;
+	unsigned short lr;
+	int rc;
+
+	lr = 0xFFFF;
+	readers = malloc(lr);
+
+	if (readers == NULL) {
+		return 0;
+	}
+
+	rc = CT_list(readers, &lr, CTAPI_NO_READER_NAME);
+	free(readers);
+
+	if (rc != OK) {
+#ifdef DEBUG
+		debug("CT_list returns %d\n", rc);
+#endif
+		return 0;
+	}
+
+	return lr / 3;		// Port (2 bytes) and empty reader name
+}
+
+
+
+/**
+ * Initialize card terminals first ... first + count - 1 in parallel, as opening a reader
+ * takes a number of USB round trips. Slots are numbered consecutively, so card terminals
+ * following the first one that failed are closed again
+ *
+ * @param first     the first card terminal number
+ * @param count     the number of card terminals
+ * @return          the number of card terminals initialized
+ */
+static int initCTAPIReaders(unsigned short first, int count)
+{
+	struct ctapiInit *init;
+#ifdef _WIN32
+	HANDLE *threads;
+#else
+	pthread_t *threads;
+#endif
+	int *started;
+	int i, ok;
+
+	init = calloc(count, sizeof(*init));
+	threads = calloc(count, sizeof(*threads));
+	started = calloc(count, sizeof(*started));
+
+	if ((init == NULL) || (threads == NULL) || (started == NULL)) {
+		free(init);
+		free(threads);
+		free(started);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		init[i].ctn = first + i;
+#ifdef _WIN32
+		threads[i] = (HANDLE)_beginthreadex(NULL, 0, initWorker, &init[i], 0, NULL);
+		started[i] = (threads[i] != 0);
+#else
+		started[i] = (pthread_create(&threads[i], NULL, initWorker, &init[i]) == 0);
+#endif
+		if (!started[i]) {
+			initWorker(&init[i]);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (started[i]) {
+#ifdef _WIN32
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+#else
+			pthread_join(threads[i], NULL);
+#endif
+		}
+	}
+
+	for (ok = 0; (ok < count) && (init[ok].rc == OK); ok++);
+
+	for (i = ok; i < count; i++) {
+#ifdef DEBUG
+		debug("CT_init(%d) returns %d\n", init[i].ctn, init[i].rc);
+#endif
+		if (init[i].rc == OK) {
+			CT_close(init[i].ctn);
+		}
+	}
+
+	free(init);
+	free(threads);
+	free(started);
+
+	return ok;
+}
+
+
+
 int updateCTAPISlots(struct p11SlotPool_t *pool)
 {
 	struct p11Slot_t *slot;
 	unsigned short ctn;
 	char scr[20];
-	int rc;
+	int rc, i, count;
 
 	FUNC_CALLED();
 
@@ -339,17 +491,14 @@ int updateCTAPISlots(struct p11SlotPool_t *pool)
 		slot = slot->next;
 	}
 
-	while (numberOfReaders < MAX_READERS) {
-		ctn = numberOfReaders;
+	count = countCTAPIReaders() - numberOfReaders;
 
-		rc = CT_init(ctn, ctn);
+	if (count > 0) {
+		count = initCTAPIReaders(numberOfReaders, count);
+	}
 
-		if (rc != OK) {
-#ifdef DEBUG
-			debug("CT_init returns %d\n", rc);
-#endif
-			break;
-		}
+	for (i = 0; i < count; i++) {
+		ctn = numberOfReaders;
 
 		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
 
@@ -388,6 +537,165 @@ int updateCTAPISlots(struct p11SlotPool_t *pool)
 
 
 
+/**
+ * Update the slot list and the token in all slots after CT_wait() returned or the poll interval expired
+ *
+ * GET STATUS only queries the reader if it signaled a slot change on the interrupt endpoint
+ * or if it has no interrupt endpoint.
+ *
+ * @param pool the pool of slots
+ * @return TRUE if the token changed in any slot
+ */
+static int updateCTAPIEvents(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token, *before;
+	unsigned short readers;
+	int event = FALSE;
+
+	readers = numberOfReaders;
+	updateCTAPISlots(pool);
+
+	slot = pool->list;
+	while (slot) {
+		if (!slot->primarySlot) {
+			if (slot->ctn >= readers) {		// Added by updateCTAPISlots()
+				slot->eventOccured = (slot->token != NULL);
+			} else if (!slot->closed) {
+				before = slot->token;
+				getCTAPIToken(slot, &token);
+
+				if (slot->token != before) {
+					slot->eventOccured = TRUE;
+				}
+			}
+			event |= slot->eventOccured;
+		}
+		slot = slot->next;
+	}
+
+	return event;
+}
+
+
+
+/**
+ * Wait for a card being inserted or removed or a reader being attached or removed and update
+ * the token in the affected slots.
+ *
+ * Readers signal slot changes on the interrupt endpoint, so no status request is sent to idle readers.
+ * Readers without interrupt endpoint and newly attached readers are polled every CTAPI_EVENT_POLL ms.
+ *
+ * @param pool the pool of slots
+ * @param timeout the timeout in milliseconds or -1 to wait without timeout
+ * @return CKR_OK, CKR_NO_EVENT if the timeout expired or CKR_CRYPTOKI_NOT_INITIALIZED if finalized while waiting
+ */
+int waitForCTAPIEvent(struct p11SlotPool_t *pool, int timeout)
+{
+	unsigned int epoch;
+	int rc, rv, wait, event;
+
+	FUNC_CALLED();
+
+	static_mutex_lock(&eventLock);
+	epoch = eventEpoch;
+	eventWaiters++;
+	static_mutex_unlock(&eventLock);
+
+	while (1) {
+		wait = CTAPI_EVENT_POLL;
+		if ((timeout >= 0) && (timeout < wait)) {
+			wait = timeout;
+		}
+
+		rc = wait > 0 ? CT_wait(&slotEvent, wait) : CT_NO_EVENT;
+
+		static_mutex_lock(&eventLock);
+		if (epoch != eventEpoch) {
+			rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+		} else if ((rc != OK) && (rc != CT_NO_EVENT)) {
+			rv = CKR_DEVICE_ERROR;
+		} else {
+			rv = CKR_OK;
+		}
+		static_mutex_unlock(&eventLock);
+
+		if (rv != CKR_OK) {
+			break;
+		}
+
+		// The context remains valid, as C_Finalize waits in cancelCTAPIEvents() until we left
+		p11LockMutex(context->mutex);
+		event = updateCTAPIEvents(pool);
+		p11UnlockMutex(context->mutex);
+
+		if (event) {
+			break;
+		}
+
+		if (timeout >= 0) {
+			timeout -= wait;
+			if (timeout <= 0) {
+				rv = CKR_NO_EVENT;
+				break;
+			}
+		}
+	}
+
+	static_mutex_lock(&eventLock);
+	eventWaiters--;
+	static_mutex_unlock(&eventLock);
+
+	if (rv == CKR_NO_EVENT) {
+		FUNC_FAILS(rv, "Timeout before event was detected");
+	}
+
+	if (rv == CKR_CRYPTOKI_NOT_INITIALIZED) {
+		FUNC_FAILS(rv, "Wait for slot event cancelled");
+	}
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "CT_wait failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Wake up threads waiting in waitForCTAPIEvent() and wait until all have returned. Called
+ * by C_Finalize before the context is released
+ */
+void cancelCTAPIEvents()
+{
+	int waiters;
+
+	static_mutex_lock(&eventLock);
+	eventEpoch++;
+	static_mutex_unlock(&eventLock);
+
+	while (1) {
+		static_mutex_lock(&eventLock);
+		waiters = eventWaiters;
+		static_mutex_unlock(&eventLock);
+
+		if (waiters == 0) {
+			break;
+		}
+
+		// Threads are either in CT_wait() or waiting for the context mutex
+		CT_signal();
+#ifdef _WIN32
+		Sleep(10);
+#else
+		usleep(10000);
+#endif
+	}
+}
+
+
+
 int closeCTAPISlot(struct p11Slot_t *slot)
 {
 	int rc;
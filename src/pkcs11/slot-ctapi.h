@@ -42,6 +42,8 @@ int transmitAPDUviaCTAPI(struct p11Slot_t *slot, int todad,
 	unsigned char *rapdu, size_t rapdu_len);
 int getCTAPIToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int updateCTAPISlots(struct p11SlotPool_t *pool);
+int waitForCTAPIEvent(struct p11SlotPool_t *pool, int timeout);
+void cancelCTAPIEvents();
 int closeCTAPISlot(struct p11Slot_t *slot);
 int detachCTAPISlot(struct p11Slot_t *slot);
 
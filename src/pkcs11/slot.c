@@ -34,6 +34,7 @@
 #include <string.h>
 
 #include <common/memset_s.h>
+#include <common/mutex.h>
 
 #include <pkcs11/p11generic.h>
 #include <pkcs11/slot.h>
@@ -59,6 +60,8 @@
 extern struct p11Context_t *context;
 #endif
 
+static STATIC_MUTEX activityMutex = STATIC_MUTEX_INITIALIZER;
+
 
 
 /**
@@ -236,6 +239,41 @@ int encodeCommandAPDU(
 
 
 
+/**
+ * Record the time a command is sent to the token in the slot
+ */
+static void updateLastAPDU(struct p11Slot_t *slot)
+{
+	static_mutex_lock(&activityMutex);
+	slot->lastAPDU = time(NULL);
+	static_mutex_unlock(&activityMutex);
+}
+
+
+
+/**
+ * Return the number of seconds since the last command was sent to the token in the slot.
+ * This may be called from a thread other than the one sending commands.
+ *
+ * @param slot      the slot
+ * @return the number of seconds the token was idle
+ */
+int getSlotIdleTime(struct p11Slot_t *slot)
+{
+	time_t last;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	static_mutex_lock(&activityMutex);
+	last = slot->lastAPDU;
+	static_mutex_unlock(&activityMutex);
+
+	return (int)(time(NULL) - last);
+}
+
+
+
 /*
  *  Process an ISO 7816 APDU with the underlying terminal hardware.
  *
@@ -267,6 +305,8 @@ int transmitAPDU(struct p11Slot_t *slot,
 	if (slot->primarySlot)
 		slot = slot->primarySlot;
 
+	updateLastAPDU(slot);
+
 #ifdef DEBUG
 	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
 	po = strchr(scr, '\0');
@@ -369,6 +409,8 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 	if (slot->primarySlot)
 		slot = slot->primarySlot;
 
+	updateLastAPDU(slot);
+
 #ifdef DEBUG
 	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
 
@@ -58,6 +58,7 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token);
 int handleDeviceError(CK_SESSION_HANDLE hSession);
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject);
 int findSlotKey(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
+int getSlotIdleTime(struct p11Slot_t *slot);
 int lockSlot(struct p11Slot_t *slot);
 int unlockSlot(struct p11Slot_t *slot);
 int updateSlots(struct p11SlotPool_t *pool);
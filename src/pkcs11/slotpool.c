@@ -283,6 +283,20 @@ int nextSlotEvent(struct p11SlotPool_t *pool, struct p11Slot_t **pslot)
 
 
 
+/**
+ * Wake up and wait for threads blocked in waitForSlotEvent(), before the context is released
+ *
+ * With PC/SC the wait is cancelled when the last slot is closed.
+ */
+void cancelSlotEvents()
+{
+#ifdef CTAPI
+	cancelCTAPIEvents();
+#endif
+}
+
+
+
 /**
  * Wait a new event
  *
@@ -296,7 +310,7 @@ int waitForSlotEvent(struct p11SlotPool_t *pool)
 	FUNC_CALLED();
 
 #ifdef CTAPI
-	rc = CKR_FUNCTION_NOT_SUPPORTED;
+	rc = waitForCTAPIEvent(pool, -1);
 #else
 	rc = waitForPCSCEvent(pool, -1);
 #endif
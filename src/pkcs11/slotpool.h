@@ -45,5 +45,6 @@ int findSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID, struct p11Slot_t **s
 int removeSlot(struct p11SlotPool_t *pool, CK_SLOT_ID slotID);
 int nextSlotEvent(struct p11SlotPool_t *pool, struct p11Slot_t **pslot);
 int waitForSlotEvent(struct p11SlotPool_t *pool);
+void cancelSlotEvents();
 
 #endif /* ___SLOTPOOL_H_INC___ */
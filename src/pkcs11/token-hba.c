@@ -303,7 +303,7 @@ static CK_RV hba_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_B
 
 
 
-static CK_RV hba_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+static CK_RV hba_C_DecryptInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech)
 {
 	unsigned char algo;
 
@@ -314,7 +314,7 @@ static CK_RV hba_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mec
 
 
 
-static CK_RV hba_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+static CK_RV hba_C_Decrypt(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	int rc;
 	unsigned char *d,algo;
@@ -500,6 +500,8 @@ struct p11TokenDriver *getHBATokenDriver()
 	token.newToken = newHBAToken;
 	token.C_SignInit = hba_C_SignInit;
 	token.C_Sign = hba_C_Sign;
+	token.C_SignUpdate = NULL;
+	token.C_SignFinal = NULL;
 	token.C_DecryptInit = hba_C_DecryptInit;
 	token.C_Decrypt = hba_C_Decrypt;
 	token.C_GetMechanismList = hba_C_GetMechanismList;
@@ -34,15 +34,21 @@
 #include <string.h>
 #include <ctype.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #include "token-sc-hsm.h"
 
 #include <common/asn1.h>
 #include <common/cvc.h>
 #include <common/pkcs15.h>
 #include <common/debug.h>
+#include <common/mutex.h>
 
 #include <pkcs11/slot.h>
 #include <pkcs11/object.h>
+#include <pkcs11/session.h>
 #include <pkcs11/token.h>
 #include <pkcs11/certificateobject.h>
 #include <pkcs11/privatekeyobject.h>
@@ -51,6 +57,11 @@
 #include <pkcs11/strbpcpy.h>
 #include <pkcs11/crypto.h>
 
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/envelope.h>
+#include <pkcs11/sigcache.h>
+#endif
+
 
 
 static unsigned char aid[] = { 0xE8,0x2B,0x06,0x01,0x04,0x01,0x81,0xC3,0x1F,0x02,0x01 };
@@ -68,6 +79,14 @@ static struct bytestring_s defaultCHR = { (unsigned char *)"UTDUMMY00000", 12 };
 static struct bytestring_s defaultPublicExponent = { (unsigned char *)"\x01\x00\x01", 3 };
 static struct bytestring_s defaultAESAlgorithms = { (unsigned char *)"\x10\x11\x18\x99", 4 };
 
+#ifdef ENABLE_LIBCRYPTO
+static unsigned char digestInfoSHA1[]   = { 0x30,0x21,0x30,0x09,0x06,0x05,0x2B,0x0E,0x03,0x02,0x1A,0x05,0x00,0x04,0x14 };
+static unsigned char digestInfoSHA224[] = { 0x30,0x2D,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x04,0x05,0x00,0x04,0x1C };
+static unsigned char digestInfoSHA256[] = { 0x30,0x31,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x01,0x05,0x00,0x04,0x20 };
+static unsigned char digestInfoSHA384[] = { 0x30,0x41,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x02,0x05,0x00,0x04,0x30 };
+static unsigned char digestInfoSHA512[] = { 0x30,0x51,0x30,0x0D,0x06,0x09,0x60,0x86,0x48,0x01,0x65,0x03,0x04,0x02,0x03,0x05,0x00,0x04,0x40 };
+#endif
+
 
 
 static const CK_MECHANISM_TYPE p11MechanismList[] = {
@@ -83,12 +102,22 @@ static const CK_MECHANISM_TYPE p11MechanismList[] = {
 		CKM_AES_CBC,
 		CKM_AES_CMAC,
 #ifdef ENABLE_LIBCRYPTO
+		CKM_SHA224_RSA_PKCS,
+		CKM_SHA384_RSA_PKCS,
+		CKM_SHA512_RSA_PKCS,
+		CKM_SHA224_RSA_PKCS_PSS,
+		CKM_SHA384_RSA_PKCS_PSS,
+		CKM_SHA512_RSA_PKCS_PSS,
+		CKM_ECDSA_SHA384,
+		CKM_ECDSA_SHA512,
 		CKM_RSA_PKCS_OAEP,
 		CKM_SHA_1,
 		CKM_SHA224,
 		CKM_SHA256,
 		CKM_SHA384,
 		CKM_SHA512,
+		CKM_SC_HSM_ENVELOPE_AES_GCM,
+		CKM_SC_HSM_ENVELOPE_AES_CTR,
 #endif
 		CKM_EC_KEY_PAIR_GEN,
 		CKM_RSA_PKCS_KEY_PAIR_GEN,
@@ -344,12 +373,14 @@ static int getSignatureSize(CK_MECHANISM_TYPE mech, struct p11Object_t *pObject)
 	case CKM_RSA_PKCS:
 	case CKM_RSA_PKCS_PSS:
 	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS:
 	case CKM_SHA256_RSA_PKCS:
 	case CKM_SHA384_RSA_PKCS:
 	case CKM_SHA512_RSA_PKCS:
 	case CKM_SC_HSM_PSS_SHA1:
 	case CKM_SC_HSM_PSS_SHA256:
 	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_SHA224_RSA_PKCS_PSS:
 	case CKM_SHA256_RSA_PKCS_PSS:
 	case CKM_SHA384_RSA_PKCS_PSS:
 	case CKM_SHA512_RSA_PKCS_PSS:
@@ -358,6 +389,8 @@ static int getSignatureSize(CK_MECHANISM_TYPE mech, struct p11Object_t *pObject)
 	case CKM_ECDSA_SHA1:
 	case CKM_SC_HSM_ECDSA_SHA224:
 	case CKM_SC_HSM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
 		return (pObject->keysize + 7) >> 2 & ~1;
 	case CKM_AES_CMAC:
 		return 16;
@@ -374,6 +407,28 @@ static int getAlgorithmIdForSigning(CK_MECHANISM_TYPE mech)
 	case CKM_RSA_X_509:
 	case CKM_RSA_PKCS:
 		return ALGO_RSA_RAW;
+#ifdef ENABLE_LIBCRYPTO
+	// Hash is calculated on the host, the card only signs the hash value
+	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
+		return ALGO_RSA_RAW;
+	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+		return ALGO_RSA_PSS;
+	case CKM_ECDSA:
+	case CKM_ECDSA_SHA1:
+	case CKM_SC_HSM_ECDSA_SHA224:
+	case CKM_SC_HSM_ECDSA_SHA256:
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
+		return ALGO_EC_RAW;
+#else
 	case CKM_SHA1_RSA_PKCS:
 		return ALGO_RSA_PKCS1_SHA1;
 	case CKM_SHA256_RSA_PKCS:
@@ -394,6 +449,7 @@ static int getAlgorithmIdForSigning(CK_MECHANISM_TYPE mech)
 		return ALGO_EC_SHA224;
 	case CKM_SC_HSM_ECDSA_SHA256:
 		return ALGO_EC_SHA256;
+#endif
 	case CKM_RSA_PKCS_PSS:
 	case CKM_SC_HSM_PSS_SHA1:
 	case CKM_SC_HSM_PSS_SHA256:
@@ -407,6 +463,102 @@ static int getAlgorithmIdForSigning(CK_MECHANISM_TYPE mech)
 
 
 
+#ifdef ENABLE_LIBCRYPTO
+/**
+ * Determine the hash mechanism for signature mechanisms that are hashed on the host
+ *
+ * @param mech      the signature mechanism
+ * @param hashmech  the hash mechanism to use
+ * @return          0 if the hash is calculated on the host, -1 otherwise
+ */
+static int getHashMechanismForSigning(CK_MECHANISM_TYPE mech, CK_MECHANISM_TYPE *hashmech)
+{
+	switch(mech) {
+	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA1_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA1:
+		*hashmech = CKM_SHA_1;
+		break;
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_SC_HSM_ECDSA_SHA224:
+		*hashmech = CKM_SHA224;
+		break;
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+	case CKM_SC_HSM_ECDSA_SHA256:
+		*hashmech = CKM_SHA256;
+		break;
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA384:
+		*hashmech = CKM_SHA384;
+		break;
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS_PSS:
+	case CKM_ECDSA_SHA512:
+		*hashmech = CKM_SHA512;
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Encode the DigestInfo structure for PKCS#1 V1.5 signatures
+ *
+ * @param hashmech  the hash mechanism used to calculate the hash value
+ * @param hash      the hash value
+ * @param hashlen   the length of the hash value
+ * @param di        the buffer receiving the DigestInfo
+ * @param dilen     the size of the buffer
+ * @return          the length of the DigestInfo or -1 on error
+ */
+static int encodeDigestInfo(CK_MECHANISM_TYPE hashmech, unsigned char *hash, int hashlen, unsigned char *di, int dilen)
+{
+	unsigned char *prefix;
+	int prefixlen;
+
+	switch(hashmech) {
+	case CKM_SHA_1:
+		prefix = digestInfoSHA1;
+		prefixlen = sizeof(digestInfoSHA1);
+		break;
+	case CKM_SHA224:
+		prefix = digestInfoSHA224;
+		prefixlen = sizeof(digestInfoSHA224);
+		break;
+	case CKM_SHA256:
+		prefix = digestInfoSHA256;
+		prefixlen = sizeof(digestInfoSHA256);
+		break;
+	case CKM_SHA384:
+		prefix = digestInfoSHA384;
+		prefixlen = sizeof(digestInfoSHA384);
+		break;
+	case CKM_SHA512:
+		prefix = digestInfoSHA512;
+		prefixlen = sizeof(digestInfoSHA512);
+		break;
+	default:
+		return -1;
+	}
+
+	if ((prefix[prefixlen - 1] != hashlen) || (prefixlen + hashlen > dilen)) {
+		return -1;
+	}
+
+	memcpy(di, prefix, prefixlen);
+	memcpy(di + prefixlen, hash, hashlen);
+	return prefixlen + hashlen;
+}
+#endif
+
+
+
 static int getAlgorithmIdForEncryption(CK_MECHANISM_TYPE mech)
 {
 	switch(mech) {
@@ -530,42 +682,24 @@ static void applyPKCSPadding(unsigned char *di, int dilen, unsigned char *buff,
 
 
 
-static CK_RV sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+/**
+ * Send the signature command to the card and decode the response
+ *
+ * @param pObject           the private or secret key
+ * @param algo              the algorithm id for the card
+ * @param pData             the data, padded block or hash value send to the card
+ * @param ulDataLen         the length of the data
+ * @param pSignature        the buffer receiving the signature
+ * @param pulSignatureLen   the size of the buffer, updated with the length of the signature
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV sendSignCommand(struct p11Object_t *pObject, int algo, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
-	int rc, algo, signaturelen;
+	int rc;
 	unsigned short SW1SW2;
 	unsigned char scr[512];
 	FUNC_CALLED();
 
-	rc = getSignatureSize(mech->mechanism, pObject);
-	if (rc < 0) {
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Unknown mechanism");
-	}
-	signaturelen = rc;
-
-	if (pSignature == NULL) {
-		*pulSignatureLen = signaturelen;
-		FUNC_RETURNS(CKR_OK);
-	}
-
-	if (*pulSignatureLen < (CK_ULONG)signaturelen) {
-		*pulSignatureLen = signaturelen;
-		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
-	}
-
-	algo = getAlgorithmIdForSigning(mech->mechanism);
-	if (algo < 0) {
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
-	}
-
-	if ((mech->mechanism == CKM_SC_HSM_PSS_SHA1) && ulDataLen != 20) {
-		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Input for CKM_SC_HSM_PSS_SHA1 must be 20 bytes long");
-	}
-
-	if ((mech->mechanism == CKM_SC_HSM_PSS_SHA256) && ulDataLen != 32) {
-		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Input for CKM_SC_HSM_PSS_SHA256 must be 32 bytes long");
-	}
-
 	if ((algo == ALGO_EC_RAW) || (algo == ALGO_EC_SHA1) || (algo == ALGO_EC_SHA224) || (algo == ALGO_EC_SHA256)) {
 		rc = transmitAPDU(pObject->token->slot, 0x80, 0x68, (unsigned char)pObject->tokenid, (unsigned char)algo,
 				ulDataLen, pData,
@@ -575,19 +709,9 @@ static CK_RV sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, C
 				ulDataLen, pData,
 				0, pSignature, *pulSignatureLen, &SW1SW2);
 	} else {
-		if (mech->mechanism == CKM_RSA_PKCS) {
-			if (signaturelen > sizeof(scr)) {
-				FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
-			}
-			applyPKCSPadding(pData, ulDataLen, scr, signaturelen);
-			rc = transmitAPDU(pObject->token->slot, 0x80, 0x68, (unsigned char)pObject->tokenid, (unsigned char)algo,
-				signaturelen, scr,
-				0x10000, pSignature, *pulSignatureLen, &SW1SW2);
-		} else {
-			rc = transmitAPDU(pObject->token->slot, 0x80, 0x68, (unsigned char)pObject->tokenid, (unsigned char)algo,
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x68, (unsigned char)pObject->tokenid, (unsigned char)algo,
 				ulDataLen, pData,
 				0x10000, pSignature, *pulSignatureLen, &SW1SW2);
-		}
 	}
 
 	if (rc < 0) {
@@ -624,636 +748,1920 @@ static CK_RV sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, C
 
 
 
-static CK_RV sc_hsm_C_EncryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+#ifdef ENABLE_LIBCRYPTO
+static int isDeterministic(int algo)
 {
-	int algo;
+	switch(algo) {
+	case ALGO_RSA_RAW:
+	case ALGO_RSA_PKCS1:
+	case ALGO_RSA_PKCS1_SHA1:
+	case ALGO_RSA_PKCS1_SHA256:
+	case ALGO_RSA_PKCS1_SHA384:
+	case ALGO_RSA_PKCS1_SHA512:
+	case ALGO_AES_CMAC:
+		return 1;
+	default:
+		return 0;
+	}
+}
+#endif
 
-	FUNC_CALLED();
 
-	algo = getAlgorithmIdForEncryption(mech->mechanism);
-	if (algo < 0) {
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
-	}
 
-	if ((algo == ALGO_AES_CBC_ENCRYPT) && mech->ulParameterLen && ((mech->ulParameterLen != 16) || (mech->pParameter == NULL))) {
-		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "IV must be 16 bytes");
+/**
+ * Sign on the card. Deterministic signatures are served from the signature cache, if enabled for the key
+ *
+ * @param pObject           the private or secret key
+ * @param algo              the algorithm id for the card
+ * @param pData             the data, padded block or hash value send to the card
+ * @param ulDataLen         the length of the data
+ * @param pSignature        the buffer receiving the signature
+ * @param pulSignatureLen   the size of the buffer, updated with the length of the signature
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV signOnCard(struct p11Object_t *pObject, int algo, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	if (isDeterministic(algo) && sigCacheEnabled(pObject)) {
+		return sigCacheSign(pObject, algo, pData, ulDataLen, pSignature, pulSignatureLen, sendSignCommand);
 	}
-
-	FUNC_RETURNS(CKR_OK);
+#endif
+	return sendSignCommand(pObject, algo, pData, ulDataLen, pSignature, pulSignatureLen);
 }
 
 
 
-static CK_RV sc_hsm_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+#ifdef ENABLE_LIBCRYPTO
+/**
+ * Sign a hash value calculated on the host
+ *
+ * For PKCS#1 V1.5 the DigestInfo is encoded and padded on the host and signed with the raw RSA
+ * algorithm. For PSS the card performs the encoding. For ECDSA the hash is truncated to the
+ * field size and signed with the raw ECDSA algorithm.
+ *
+ * @param pObject           the private key
+ * @param mech              the hash and sign mechanism
+ * @param hashmech          the hash mechanism used to calculate the hash value
+ * @param hash              the hash value
+ * @param hashlen           the length of the hash value
+ * @param pSignature        the buffer receiving the signature
+ * @param pulSignatureLen   the size of the buffer, updated with the length of the signature
+ * @return CKR_OK or any other Cryptoki error code
+ */
+static CK_RV signHash(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_MECHANISM_TYPE hashmech, unsigned char *hash, int hashlen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
-	int algo;
-
+	int algo, signaturelen, dilen;
+	unsigned char di[96];
+	unsigned char scr[512];
 	FUNC_CALLED();
 
-	algo = getAlgorithmIdForDecryption(mech->mechanism);
-	if (algo < 0) {
-#ifdef DEBUG
-		debug("Mechanism %lx unknown\n", mech->mechanism);
-#endif
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
-	}
-
-	if ((algo == ALGO_AES_CBC_DECRYPT) && mech->ulParameterLen && ((mech->ulParameterLen != 16) || (mech->pParameter == NULL))) {
-		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "IV must be 16 bytes");
-	}
+	algo = getAlgorithmIdForSigning(mech->mechanism);
 
-	FUNC_RETURNS(CKR_OK);
-}
+	switch(algo) {
+	case ALGO_RSA_RAW:
+		signaturelen = getSignatureSize(mech->mechanism, pObject);
+		if (signaturelen > sizeof(scr)) {
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
+		}
 
+		dilen = encodeDigestInfo(hashmech, hash, hashlen, di, sizeof(di));
+		if (dilen < 0) {
+			FUNC_FAILS(CKR_GENERAL_ERROR, "Encoding DigestInfo failed");
+		}
 
+		if (dilen + 11 > signaturelen) {
+			FUNC_FAILS(CKR_KEY_SIZE_RANGE, "Key too small for DigestInfo");
+		}
 
-static void xor(CK_BYTE_PTR buff1, CK_BYTE_PTR buff2, int len)
-{
-	while(len-- > 0) {
-		*buff1++ ^= *buff2++;
+		applyPKCSPadding(di, dilen, scr, signaturelen);
+		FUNC_RETURNS(signOnCard(pObject, algo, scr, signaturelen, pSignature, pulSignatureLen));
+	case ALGO_EC_RAW:
+		if (hashlen > ((pObject->keysize + 7) >> 3)) {
+			hashlen = (pObject->keysize + 7) >> 3;
+		}
+		FUNC_RETURNS(signOnCard(pObject, algo, hash, hashlen, pSignature, pulSignatureLen));
+	case ALGO_RSA_PSS:
+		FUNC_RETURNS(signOnCard(pObject, algo, hash, hashlen, pSignature, pulSignatureLen));
+	default:
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 }
+#endif
 
 
 
-static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG pulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR ulEncryptedDataLen)
+static CK_RV sc_hsm_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
-	int rc, algo;
-	unsigned short SW1SW2;
-	unsigned char scr[2048];
-
+	int rc, algo, signaturelen;
+	unsigned char scr[512];
+#ifdef ENABLE_LIBCRYPTO
+	CK_MECHANISM_TYPE hashmech;
+	unsigned char hash[64];
+	CK_ULONG hashlen;
+	CK_RV rv;
+#endif
 	FUNC_CALLED();
 
-	if (pEncryptedData == NULL) {
-		*ulEncryptedDataLen = pulDataLen;
+	rc = getSignatureSize(mech->mechanism, pObject);
+	if (rc < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Unknown mechanism");
+	}
+	signaturelen = rc;
+
+	if (pSignature == NULL) {
+		*pulSignatureLen = signaturelen;
 		FUNC_RETURNS(CKR_OK);
 	}
 
-	algo = getAlgorithmIdForEncryption(mech->mechanism);
+	if (*pulSignatureLen < (CK_ULONG)signaturelen) {
+		*pulSignatureLen = signaturelen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
+	}
+
+	algo = getAlgorithmIdForSigning(mech->mechanism);
 	if (algo < 0) {
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
-	if (mech->ulParameterLen && (algo == ALGO_AES_CBC_ENCRYPT)) {
-		if (pulDataLen > sizeof(scr)) {
-			FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Input too large");
-		}
-
-		if (pulDataLen < 16) {
-			FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Input too short");
-		}
-
-		if (pulDataLen &0x0F) {
-			FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Input not a multiple of 16");
+#ifdef ENABLE_LIBCRYPTO
+	if (getHashMechanismForSigning(mech->mechanism, &hashmech) == 0) {
+		hashlen = sizeof(hash);
+		rv = cryptoHash(hashmech, pData, ulDataLen, hash, &hashlen);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Calculating hash failed");
 		}
-
-		memcpy(scr, pData, pulDataLen);
-		xor(scr, (CK_BYTE_PTR)mech->pParameter, (int)mech->ulParameterLen);
-
-		rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
-				pulDataLen, scr,
-				0, scr, sizeof(scr), &SW1SW2);
-	} else {
-		rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
-				pulDataLen, pData,
-				0, scr, sizeof(scr), &SW1SW2);
+		FUNC_RETURNS(signHash(pObject, mech, hashmech, hash, (int)hashlen, pSignature, pulSignatureLen));
 	}
+#endif
 
-	if (rc < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	if ((mech->mechanism == CKM_SC_HSM_PSS_SHA1) && ulDataLen != 20) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Input for CKM_SC_HSM_PSS_SHA1 must be 20 bytes long");
 	}
 
-	switch(SW1SW2) {
-	case 0x9000:
-		break;
-	case 0x6A81:
-		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Encryption operation not allowed for key");
-		break;
-	case 0x6982:
-		FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
-		break;
-	case 0x6A80:
-		FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Encryption operation failed");
-		break;
-	default:
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Encryption operation failed");
-		break;
+	if ((mech->mechanism == CKM_SC_HSM_PSS_SHA256) && ulDataLen != 32) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Input for CKM_SC_HSM_PSS_SHA256 must be 32 bytes long");
 	}
 
-	if (rc > (int)*ulEncryptedDataLen) {
-		*ulEncryptedDataLen = rc;
-		memset(scr, 0, sizeof(scr));
-		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	if (mech->mechanism == CKM_RSA_PKCS) {
+		if (signaturelen > sizeof(scr)) {
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
+		}
+		applyPKCSPadding(pData, ulDataLen, scr, signaturelen);
+		FUNC_RETURNS(signOnCard(pObject, algo, scr, signaturelen, pSignature, pulSignatureLen));
 	}
-	*ulEncryptedDataLen = rc;
-	memcpy(pEncryptedData, scr, rc);
-
-	memset(scr, 0, sizeof(scr));
 
-	FUNC_RETURNS(CKR_OK);
+	FUNC_RETURNS(signOnCard(pObject, algo, pData, ulDataLen, pSignature, pulSignatureLen));
 }
 
 
 
-static int stripPKCS15Padding(unsigned char *scr, int len, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+static CK_RV sc_hsm_C_SignUpdate(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
 {
-	int c1,c2,c3;
+#ifdef ENABLE_LIBCRYPTO
+	CK_MECHANISM hashmech = { 0, NULL, 0 };
+	CK_RV rv;
+#endif
+	FUNC_CALLED();
 
-	c1 = *scr++ == 0x00;
-	c2 = *scr++ == 0x02;
-	len -= 2;
-	while ((len > 0) && *scr) {
-		scr++;
-		len--;
-	}
-	c3 = len > 0;
-
-	if (!(c1 && c2 && c3)) {
-		return CKR_ENCRYPTED_DATA_INVALID;
+#ifdef ENABLE_LIBCRYPTO
+	if (getHashMechanismForSigning(mech->mechanism, &hashmech.mechanism) == 0) {
+		if (op->cryptoContext == NULL) {
+			rv = cryptoDigestInit(op, &hashmech);
+			if (rv != CKR_OK) {
+				FUNC_FAILS(rv, "cryptoDigestInit() failed");
+			}
+		}
+		FUNC_RETURNS(cryptoDigestUpdate(op, pPart, ulPartLen));
 	}
+#endif
 
-	scr++;
-	len--;
+	FUNC_RETURNS(appendToCryptoBuffer(op, pPart, ulPartLen));
+}
 
-	if (len > (int)*pulDataLen) {
-		return CKR_BUFFER_TOO_SMALL;
-	}
 
-	memcpy(pData, scr, len);
-	*pulDataLen = len;
 
-	return CKR_OK;
-}
+static CK_RV sc_hsm_C_SignFinal(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	CK_MECHANISM hashmech = { 0, NULL, 0 };
+	unsigned char hash[64];
+	CK_ULONG hashlen;
+	int signaturelen;
+	CK_RV rv;
+#endif
+	FUNC_CALLED();
 
+#ifdef ENABLE_LIBCRYPTO
+	if (getHashMechanismForSigning(mech->mechanism, &hashmech.mechanism) == 0) {
+		signaturelen = getSignatureSize(mech->mechanism, pObject);
 
+		if (pSignature == NULL) {
+			*pulSignatureLen = signaturelen;
+			FUNC_RETURNS(CKR_OK);
+		}
 
-static CK_RV sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
-{
-	int rc, algo, ins;
-	unsigned short SW1SW2;
-	unsigned char scr[2048];
+		if (*pulSignatureLen < (CK_ULONG)signaturelen) {
+			*pulSignatureLen = signaturelen;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
+		}
 
-	FUNC_CALLED();
+		if (op->cryptoContext == NULL) {
+			rv = cryptoDigestInit(op, &hashmech);
+			if (rv != CKR_OK) {
+				FUNC_FAILS(rv, "cryptoDigestInit() failed");
+			}
+		}
 
-	if (pData == NULL) {
-		if (mech->mechanism == CKM_AES_CBC) {
-			*pulDataLen = ulEncryptedDataLen;
-		} else {
-			*pulDataLen = (pObject->keysize + 7) >> 3;
+		hashlen = sizeof(hash);
+		rv = cryptoDigestFinal(op, hash, &hashlen);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "cryptoDigestFinal() failed");
 		}
-		FUNC_RETURNS(CKR_OK);
-	}
 
-	algo = getAlgorithmIdForDecryption(mech->mechanism);
-	if (algo < 0) {
-		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+		FUNC_RETURNS(signHash(pObject, mech, hashmech.mechanism, hash, (int)hashlen, pSignature, pulSignatureLen));
 	}
+#endif
 
-	if (mech->mechanism == CKM_AES_CBC) {
-		ins = 0x78;
-	} else {
-		ins = 0x62;
-	}
+	FUNC_RETURNS(sc_hsm_C_Sign(pObject, mech, op->cryptoBuffer, op->cryptoBufferSize, pSignature, pulSignatureLen));
+}
 
-	rc = transmitAPDU(pObject->token->slot, 0x80, ins, (unsigned char)pObject->tokenid, (unsigned char)algo,
-			ulEncryptedDataLen, pEncryptedData,
-			0, scr, sizeof(scr), &SW1SW2);
 
-	if (rc < 0) {
+
+/**
+ * Derive a key value from an AES key on the token using the SP 800-56C extraction-then-expansion algorithm
+ *
+ * @param pObject               the AES key
+ * @param pDerivationParam      the derivation parameter
+ * @param ulDerivationParamLen  the length of the derivation parameter
+ * @param key                   the 32 byte buffer receiving the key value
+ * @param keylen                the length of the key value returned by the token
+ * @return                      CKR_OK or any other Cryptoki error code
+ */
+static CK_RV deriveKeyValue(struct p11Object_t *pObject, CK_BYTE_PTR pDerivationParam, CK_ULONG ulDerivationParamLen, unsigned char *key, int *keylen)
+{
+	int rc;
+	unsigned short SW1SW2;
+
+	FUNC_CALLED();
+
+	rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, ALGO_AES_DERIVE,
+			ulDerivationParamLen, pDerivationParam, 0, key, 32, &SW1SW2);
+
+	if (rc < 0)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
-	}
 
 	switch(SW1SW2) {
 	case 0x9000:
 		break;
-	case 0x6984:
-		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key user counter expired");
-		break;
 	case 0x6A81:
-		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Decryption operation not allowed for key");
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key derivation not allowed for key");
 		break;
 	case 0x6982:
 		FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
 		break;
-	case 0x6A80:
-		FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Decryption operation failed");
-		break;
 	default:
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Decryption operation failed");
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Key derivation failed");
 		break;
 	}
 
-	if ((mech->mechanism == CKM_RSA_X_509)
-			|| (mech->mechanism == CKM_AES_CBC)) {
-		if (rc > (int)*pulDataLen) {
-			*pulDataLen = rc;
-			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
-		}
+	*keylen = rc;
+	FUNC_RETURNS(CKR_OK);
+}
 
-		if (mech->ulParameterLen && (algo == ALGO_AES_CBC_DECRYPT)) {
-			xor(scr, (CK_BYTE_PTR)mech->pParameter, (int)mech->ulParameterLen);
-		}
 
-		*pulDataLen = rc;
-		memcpy(pData, scr, rc);
-	} else if (mech->mechanism == CKM_RSA_PKCS) {
-		rc = stripPKCS15Padding(scr, rc, pData, pulDataLen);
-		if (rc != CKR_OK) {
-			FUNC_FAILS(rc, "Invalid PKCS#1 padding");
+
+#ifdef ENABLE_LIBCRYPTO
+static int isAESKey(struct p11Object_t *pObject)
+{
+	struct p11Attribute_t *attr;
+
+	if (findAttribute(pObject, CKA_KEY_TYPE, &attr) < 0) {
+		return 0;
+	}
+	return *(CK_KEY_TYPE *)attr->attrData.pValue == CKK_AES;
+}
+#endif
+
+
+
+static CK_RV sc_hsm_C_EncryptInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech)
+{
+	int algo;
+
+	FUNC_CALLED();
+
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		if (!isAESKey(pObject)) {
+			FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Envelope mechanisms require an AES key");
 		}
-	} else {
+		FUNC_RETURNS(envelopeInit(pObject, op, mech, 1, deriveKeyValue));
+	}
+#endif
+
+	algo = getAlgorithmIdForEncryption(mech->mechanism);
+	if (algo < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	}
+
+	if ((algo == ALGO_AES_CBC_ENCRYPT) && mech->ulParameterLen && ((mech->ulParameterLen != 16) || (mech->pParameter == NULL))) {
+		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "IV must be 16 bytes");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static CK_RV sc_hsm_C_DecryptInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech)
+{
+	int algo;
+
+	FUNC_CALLED();
+
 #ifdef ENABLE_LIBCRYPTO
-		rc = stripOAEPPadding(scr, rc, pData, pulDataLen);
-		if (rc != CKR_OK) {
-			FUNC_FAILS(rc, "Invalid OAEP padding");
+	if (envelopeIsMechanism(mech->mechanism)) {
+		if (!isAESKey(pObject)) {
+			FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Envelope mechanisms require an AES key");
 		}
+		FUNC_RETURNS(envelopeInit(pObject, op, mech, 0, deriveKeyValue));
+	}
+#endif
+
+	algo = getAlgorithmIdForDecryption(mech->mechanism);
+	if (algo < 0) {
+#ifdef DEBUG
+		debug("Mechanism %lx unknown\n", mech->mechanism);
 #endif
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
-	memset(scr, 0, sizeof(scr));
+	if ((algo == ALGO_AES_CBC_DECRYPT) && mech->ulParameterLen && ((mech->ulParameterLen != 16) || (mech->pParameter == NULL))) {
+		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "IV must be 16 bytes");
+	}
 
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-static int sc_hsm_C_GenerateRandom(struct p11Slot_t *slot, CK_BYTE_PTR rnd, CK_ULONG rndlen)
+static void xor(CK_BYTE_PTR buff1, CK_BYTE_PTR buff2, int len)
+{
+	while(len-- > 0) {
+		*buff1++ ^= *buff2++;
+	}
+}
+
+
+
+/**
+ * Encrypt or decrypt AES blocks in CBC mode, splitting the data into chunks that fit into a single command.
+ *
+ * The token processes each chunk with a zero IV, so the chaining value is added to the first block on the
+ * host. After each chunk the last cipher text block becomes the chaining value for the next chunk and is
+ * returned in iv for the next call.
+ *
+ * The input consists of up to 15 bytes in prefix followed by the data in pIn. The total length must be a
+ * multiple of the block size. pOut may point to the same location as pIn.
+ *
+ * @param pObject       the secret key object
+ * @param algo          ALGO_AES_CBC_ENCRYPT or ALGO_AES_CBC_DECRYPT
+ * @param iv            the 16 byte chaining value, updated with the last cipher text block
+ * @param prefix        the data preceding pIn or NULL
+ * @param prefixlen     the length of the data in prefix
+ * @param pIn           the data to encrypt or decrypt
+ * @param ulInLen       the length of the data in pIn
+ * @param pOut          the buffer receiving prefixlen + ulInLen bytes of output
+ * @return              CKR_OK or any other Cryptoki error code
+ */
+static CK_RV aesCBC(struct p11Object_t *pObject, int algo, CK_BYTE_PTR iv, CK_BYTE_PTR prefix, CK_ULONG prefixlen, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut)
 {
+	unsigned char scr[AES_CBC_CHUNK_SIZE], carry[16], next[16];
+	CK_ULONG remaining, chunk, len;
 	unsigned short SW1SW2;
-	size_t maxblk;
 	int rc;
 
 	FUNC_CALLED();
 
-	maxblk = 1024;			// Maximum block size
+	memset(next, 0, sizeof(next));
 
-	if ((int)maxblk + 2 > slot->maxRAPDU) {
-		maxblk = slot->maxRAPDU - 2;
+	if (prefixlen > 0) {
+		memcpy(carry, prefix, prefixlen);
 	}
-	while (rndlen > 0) {
-		if (rndlen < maxblk) {
-			maxblk = rndlen;
+	remaining = prefixlen + ulInLen;
+
+	while (remaining > 0) {
+		chunk = remaining > sizeof(scr) ? sizeof(scr) : remaining;
+
+		memcpy(scr, carry, prefixlen);
+		len = chunk - prefixlen;
+		memcpy(scr + prefixlen, pIn, len);
+		pIn += len;
+		ulInLen -= len;
+
+		// Input that is overwritten by the output of this chunk when operating in-place
+		prefixlen = prefixlen < ulInLen ? prefixlen : ulInLen;
+		memcpy(carry, pIn, prefixlen);
+		pIn += prefixlen;
+		ulInLen -= prefixlen;
+
+		if (algo == ALGO_AES_CBC_ENCRYPT) {
+			xor(scr, iv, 16);
+		} else {
+			memcpy(next, scr + chunk - 16, 16);
+		}
+
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
+				(int)chunk, scr,
+				0, scr, sizeof(scr), &SW1SW2);
+
+		if ((rc < 0) || (SW1SW2 != 0x9000) || (rc != (int)chunk)) {
+			// Wipe the plain text of the failed chunk and the input kept for the next one
+			memset(scr, 0, sizeof(scr));
+			memset(carry, 0, sizeof(carry));
 		}
-		rc = transmitAPDU(slot, 0x00, 0x84, 0x00, 0x00,
-				0, NULL,
-				(int)maxblk, rnd, rndlen, &SW1SW2);
 
 		if (rc < 0) {
 			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 		}
 
-		if (SW1SW2 != 0x9000) {
-			FUNC_FAILS(CKR_DEVICE_ERROR, "device reported error");
+		switch(SW1SW2) {
+		case 0x9000:
+			break;
+		case 0x6984:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key user counter expired");
+			break;
+		case 0x6A81:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Operation not allowed for key");
+			break;
+		case 0x6982:
+			FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
+			break;
+		case 0x6A80:
+			FUNC_FAILS(algo == ALGO_AES_CBC_ENCRYPT ? CKR_DATA_INVALID : CKR_ENCRYPTED_DATA_INVALID, "Operation failed");
+			break;
+		default:
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Operation failed");
+			break;
 		}
-		rndlen -= rc;
-		rnd += rc;
+
+		if (rc != (int)chunk) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Unexpected response length");
+		}
+
+		if (algo == ALGO_AES_CBC_ENCRYPT) {
+			memcpy(iv, scr + chunk - 16, 16);
+		} else {
+			xor(scr, iv, 16);
+			memcpy(iv, next, 16);
+		}
+
+		memcpy(pOut, scr, chunk);
+		pOut += chunk;
+		remaining -= chunk;
 	}
 
+	memset(scr, 0, sizeof(scr));
+	memset(carry, 0, sizeof(carry));
+
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-static int encodeGSK(bytebuffer bb, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulKeyAttributeCount)
+/**
+ * Return the chaining value of a multi-part AES-CBC operation, which is kept in the mechanism parameter
+ * of the operation. A mechanism without IV starts with a zero chaining value.
+ */
+static CK_BYTE_PTR getChainingValue(CK_MECHANISM_PTR mech)
 {
-	int rc;
-	CK_ULONG kuc;
-	unsigned char scr[4];
-	FUNC_CALLED();
+	if (mech->ulParameterLen == 0) {
+		mech->pParameter = calloc(1, 16);
+		if (mech->pParameter == NULL) {
+			return NULL;
+		}
+		mech->ulParameterLen = 16;
+	}
+	return (CK_BYTE_PTR)mech->pParameter;
+}
 
-	bbClear(bb);
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_ALGORITHM_LIST, pTemplate, ulKeyAttributeCount);
-	if (rc >= 0) {
-		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen > 16) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_ALGORITHM_LIST must not be longer that 16 bytes");
-		}
-		asn1AppendBytes(bb, 0x91, pTemplate[rc].pValue, pTemplate[rc].ulValueLen);
-	} else {
-		asn1AppendBytes(bb, 0x91, defaultAESAlgorithms.val, defaultAESAlgorithms.len);
+
+static CK_RV aesCBCUpdate(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, int algo, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	CK_ULONG outlen, inlen;
+	CK_BYTE_PTR iv;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (mech->mechanism != CKM_AES_CBC) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Multi-part operation only supported for CKM_AES_CBC");
 	}
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_USE_COUNTER, pTemplate, ulKeyAttributeCount);
-	if (rc >= 0) {
-		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen != sizeof(CK_ULONG)) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER must be CK_ULONG");
-		}
-		kuc = *(CK_ULONG *)pTemplate[rc].pValue;
+	// Only complete blocks are processed, the remainder is kept in the crypto buffer of the operation
+	outlen = (op->cryptoBufferSize + ulInLen) & ~0x0F;
 
-		if ((kuc < 1) || (kuc > 0xFFFFFFFF)) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER is not in the range between 1 and 2^32");
-		}
+	if (pOut == NULL) {
+		*pulOutLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
 
-		scr[0] = (unsigned char)((kuc >> 24) & 0xFF);
-		scr[1] = (unsigned char)((kuc >> 16) & 0xFF);
-		scr[2] = (unsigned char)((kuc >>  8) & 0xFF);
-		scr[3] = (unsigned char)( kuc & 0xFF);
-		asn1AppendBytes(bb, 0x90, scr, 4);
+	if (*pulOutLen < outlen) {
+		*pulOutLen = outlen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
 	}
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_DOMAIN, pTemplate, ulKeyAttributeCount);
-	if (rc >= 0) {
-		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen != 1) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_DOMAIN must be a single CK_BYTE");
-		}
-		asn1AppendBytes(bb, 0x92, pTemplate[rc].pValue, pTemplate[rc].ulValueLen);
+	iv = getChainingValue(mech);
+	if (iv == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 	}
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_WRAPPING_KEY_ID, pTemplate, ulKeyAttributeCount);
-	if (rc >= 0) {
-		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen != 1) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_WRAPPING_KEY_ID must be a single CK_BYTE");
+	if (outlen > 0) {
+		inlen = outlen - op->cryptoBufferSize;
+
+		rv = aesCBC(pObject, algo, iv, op->cryptoBuffer, op->cryptoBufferSize, pIn, inlen, pOut);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "AES operation failed");
 		}
-		asn1AppendBytes(bb, 0x93, pTemplate[rc].pValue, pTemplate[rc].ulValueLen);
+
+		clearCryptoBuffer(op);
+		pIn += inlen;
+		ulInLen -= inlen;
 	}
 
-	if (bbHasFailed(bb)) {
-		FUNC_FAILS(CKR_DEVICE_MEMORY, "Buffer to encode GSK buffer too small");
+	rv = appendToCryptoBuffer(op, pIn, ulInLen);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Out of memory");
 	}
 
+	*pulOutLen = outlen;
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-static int encodeGAKP(bytebuffer bb, struct p11Token_t *token, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, int *keysize)
+static CK_RV aesCBCFinal(struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_RV err, CK_ULONG_PTR pulOutLen)
+{
+	FUNC_CALLED();
+
+	if (mech->mechanism != CKM_AES_CBC) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Multi-part operation only supported for CKM_AES_CBC");
+	}
+
+	if (op->cryptoBufferSize != 0) {
+		clearCryptoBuffer(op);
+		FUNC_FAILS(err, "Data is not a multiple of the block size");
+	}
+
+	*pulOutLen = 0;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static CK_RV sc_hsm_C_EncryptUpdate(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		return envelopeUpdate(op, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	}
+#endif
+	return aesCBCUpdate(pObject, op, mech, ALGO_AES_CBC_ENCRYPT, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+}
+
+
+
+static CK_RV sc_hsm_C_EncryptFinal(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		return envelopeFinal(op, pLastEncryptedPart, pulLastEncryptedPartLen);
+	}
+#endif
+	return aesCBCFinal(op, mech, CKR_DATA_LEN_RANGE, pulLastEncryptedPartLen);
+}
+
+
+
+static CK_RV sc_hsm_C_DecryptUpdate(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		return envelopeUpdate(op, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+	}
+#endif
+	return aesCBCUpdate(pObject, op, mech, ALGO_AES_CBC_DECRYPT, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+}
+
+
+
+static CK_RV sc_hsm_C_DecryptFinal(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
+{
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		return envelopeFinal(op, pLastPart, pulLastPartLen);
+	}
+#endif
+	return aesCBCFinal(op, mech, CKR_ENCRYPTED_DATA_LEN_RANGE, pulLastPartLen);
+}
+
+
+
+static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG pulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR ulEncryptedDataLen)
+{
+	int rc, algo;
+	unsigned short SW1SW2;
+	unsigned char scr[2048], iv[16];
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		FUNC_RETURNS(envelopeCrypt(op, pData, pulDataLen, pEncryptedData, ulEncryptedDataLen));
+	}
+#endif
+
+	if (pEncryptedData == NULL) {
+		*ulEncryptedDataLen = pulDataLen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	algo = getAlgorithmIdForEncryption(mech->mechanism);
+	if (algo < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	}
+
+	if (algo == ALGO_AES_CBC_ENCRYPT) {
+		if (pulDataLen < 16) {
+			FUNC_FAILS(CKR_DATA_LEN_RANGE, "Input too short");
+		}
+
+		if (pulDataLen &0x0F) {
+			FUNC_FAILS(CKR_DATA_LEN_RANGE, "Input not a multiple of 16");
+		}
+
+		if (pulDataLen > *ulEncryptedDataLen) {
+			*ulEncryptedDataLen = pulDataLen;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+
+		memset(iv, 0, sizeof(iv));
+		if (mech->ulParameterLen) {
+			memcpy(iv, mech->pParameter, sizeof(iv));
+		}
+
+		rv = aesCBC(pObject, algo, iv, NULL, 0, pData, pulDataLen, pEncryptedData);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Encryption operation failed");
+		}
+
+		*ulEncryptedDataLen = pulDataLen;
+		FUNC_RETURNS(CKR_OK);
+	} else {
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
+				pulDataLen, pData,
+				0, scr, sizeof(scr), &SW1SW2);
+	}
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	switch(SW1SW2) {
+	case 0x9000:
+		break;
+	case 0x6A81:
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Encryption operation not allowed for key");
+		break;
+	case 0x6982:
+		FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
+		break;
+	case 0x6A80:
+		FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Encryption operation failed");
+		break;
+	default:
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Encryption operation failed");
+		break;
+	}
+
+	if (rc > (int)*ulEncryptedDataLen) {
+		*ulEncryptedDataLen = rc;
+		memset(scr, 0, sizeof(scr));
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+	*ulEncryptedDataLen = rc;
+	memcpy(pEncryptedData, scr, rc);
+
+	memset(scr, 0, sizeof(scr));
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int stripPKCS15Padding(unsigned char *scr, int len, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	int c1,c2,c3;
+
+	c1 = *scr++ == 0x00;
+	c2 = *scr++ == 0x02;
+	len -= 2;
+	while ((len > 0) && *scr) {
+		scr++;
+		len--;
+	}
+	c3 = len > 0;
+
+	if (!(c1 && c2 && c3)) {
+		return CKR_ENCRYPTED_DATA_INVALID;
+	}
+
+	scr++;
+	len--;
+
+	if (len > (int)*pulDataLen) {
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	memcpy(pData, scr, len);
+	*pulDataLen = len;
+
+	return CKR_OK;
+}
+
+
+
+static CK_RV sc_hsm_C_Decrypt(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	int rc, algo, ins;
+	unsigned short SW1SW2;
+	unsigned char scr[2048], iv[16];
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+#ifdef ENABLE_LIBCRYPTO
+	if (envelopeIsMechanism(mech->mechanism)) {
+		FUNC_RETURNS(envelopeCrypt(op, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen));
+	}
+#endif
+
+	if (pData == NULL) {
+		if (mech->mechanism == CKM_AES_CBC) {
+			*pulDataLen = ulEncryptedDataLen;
+		} else {
+			*pulDataLen = (pObject->keysize + 7) >> 3;
+		}
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	algo = getAlgorithmIdForDecryption(mech->mechanism);
+	if (algo < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
+	}
+
+	if (mech->mechanism == CKM_AES_CBC) {
+		if (ulEncryptedDataLen & 0x0F) {
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Input not a multiple of 16");
+		}
+
+		if (ulEncryptedDataLen > *pulDataLen) {
+			*pulDataLen = ulEncryptedDataLen;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+
+		memset(iv, 0, sizeof(iv));
+		if (mech->ulParameterLen) {
+			memcpy(iv, mech->pParameter, sizeof(iv));
+		}
+
+		rv = aesCBC(pObject, algo, iv, NULL, 0, pEncryptedData, ulEncryptedDataLen, pData);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Decryption operation failed");
+		}
+
+		*pulDataLen = ulEncryptedDataLen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	ins = 0x62;
+
+	rc = transmitAPDU(pObject->token->slot, 0x80, ins, (unsigned char)pObject->tokenid, (unsigned char)algo,
+			ulEncryptedDataLen, pEncryptedData,
+			0, scr, sizeof(scr), &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	switch(SW1SW2) {
+	case 0x9000:
+		break;
+	case 0x6984:
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key user counter expired");
+		break;
+	case 0x6A81:
+		FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Decryption operation not allowed for key");
+		break;
+	case 0x6982:
+		FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
+		break;
+	case 0x6A80:
+		FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Decryption operation failed");
+		break;
+	default:
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Decryption operation failed");
+		break;
+	}
+
+	if (mech->mechanism == CKM_RSA_X_509) {
+		if (rc > (int)*pulDataLen) {
+			*pulDataLen = rc;
+			FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+		}
+
+		*pulDataLen = rc;
+		memcpy(pData, scr, rc);
+	} else if (mech->mechanism == CKM_RSA_PKCS) {
+		rc = stripPKCS15Padding(scr, rc, pData, pulDataLen);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Invalid PKCS#1 padding");
+		}
+	} else {
+#ifdef ENABLE_LIBCRYPTO
+		rc = stripOAEPPadding(scr, rc, pData, pulDataLen);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Invalid OAEP padding");
+		}
+#endif
+	}
+
+	memset(scr, 0, sizeof(scr));
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int sc_hsm_C_GenerateRandom(struct p11Slot_t *slot, CK_BYTE_PTR rnd, CK_ULONG rndlen)
+{
+	unsigned short SW1SW2;
+	size_t maxblk;
+	int rc;
+
+	FUNC_CALLED();
+
+	maxblk = 1024;			// Maximum block size
+
+	if ((int)maxblk + 2 > slot->maxRAPDU) {
+		maxblk = slot->maxRAPDU - 2;
+	}
+	while (rndlen > 0) {
+		if (rndlen < maxblk) {
+			maxblk = rndlen;
+		}
+		rc = transmitAPDU(slot, 0x00, 0x84, 0x00, 0x00,
+				0, NULL,
+				(int)maxblk, rnd, rndlen, &SW1SW2);
+
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		}
+
+		if (SW1SW2 != 0x9000) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "device reported error");
+		}
+		rndlen -= rc;
+		rnd += rc;
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int encodeGSK(bytebuffer bb, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulKeyAttributeCount)
+{
+	int rc;
+	CK_ULONG kuc;
+	unsigned char scr[4];
+	FUNC_CALLED();
+
+	bbClear(bb);
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_ALGORITHM_LIST, pTemplate, ulKeyAttributeCount);
+	if (rc >= 0) {
+		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen > 16) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_ALGORITHM_LIST must not be longer that 16 bytes");
+		}
+		asn1AppendBytes(bb, 0x91, pTemplate[rc].pValue, pTemplate[rc].ulValueLen);
+	} else {
+		asn1AppendBytes(bb, 0x91, defaultAESAlgorithms.val, defaultAESAlgorithms.len);
+	}
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_USE_COUNTER, pTemplate, ulKeyAttributeCount);
+	if (rc >= 0) {
+		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen != sizeof(CK_ULONG)) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER must be CK_ULONG");
+		}
+		kuc = *(CK_ULONG *)pTemplate[rc].pValue;
+
+		if ((kuc < 1) || (kuc > 0xFFFFFFFF)) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER is not in the range between 1 and 2^32");
+		}
+
+		scr[0] = (unsigned char)((kuc >> 24) & 0xFF);
+		scr[1] = (unsigned char)((kuc >> 16) & 0xFF);
+		scr[2] = (unsigned char)((kuc >>  8) & 0xFF);
+		scr[3] = (unsigned char)( kuc & 0xFF);
+		asn1AppendBytes(bb, 0x90, scr, 4);
+	}
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_DOMAIN, pTemplate, ulKeyAttributeCount);
+	if (rc >= 0) {
+		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen != 1) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_DOMAIN must be a single CK_BYTE");
+		}
+		asn1AppendBytes(bb, 0x92, pTemplate[rc].pValue, pTemplate[rc].ulValueLen);
+	}
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_WRAPPING_KEY_ID, pTemplate, ulKeyAttributeCount);
+	if (rc >= 0) {
+		if (pTemplate[rc].pValue == NULL || pTemplate[rc].ulValueLen != 1) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_WRAPPING_KEY_ID must be a single CK_BYTE");
+		}
+		asn1AppendBytes(bb, 0x93, pTemplate[rc].pValue, pTemplate[rc].ulValueLen);
+	}
+
+	if (bbHasFailed(bb)) {
+		FUNC_FAILS(CKR_DEVICE_MEMORY, "Buffer to encode GSK buffer too small");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int encodeGAKP(bytebuffer bb, struct p11Token_t *token, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, int *keysize)
 {
 	int rc,pos,ofs;
 	CK_ULONG keybits,kuc;
 	struct bytestring_s publicKeyAlgorithm;
 	struct bytestring_s oid;
-	struct bytestring_s publicExponent;
-	struct ec_curve *curve, crve;
-	unsigned char scr[4];
+	struct bytestring_s publicExponent;
+	struct ec_curve *curve, crve;
+	unsigned char scr[4];
+
+	FUNC_CALLED();
+
+	bbClear(bb);
+	asn1AppendBytes(bb, 0x5F29, (unsigned char *)"\x00", 1);
+
+	rc = findAttributeInTemplate(CKA_CVC_INNER_CAR, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		asn1AppendBytes(bb, 0x42, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	} else {
+		if (token->info.firmwareVersion.major < 2) {
+			asn1Append(bb, 0x42, &defaultCHR);
+		}
+	}
+
+	ofs = (int)bbGetLength(bb);
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_PUBLIC_KEY_ALGORITHM, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		publicKeyAlgorithm.val = pPublicKeyTemplate[rc].pValue;
+		publicKeyAlgorithm.len = pPublicKeyTemplate[rc].ulValueLen;
+	} else {
+		if (pMechanism->mechanism == CKM_EC_KEY_PAIR_GEN) {
+			publicKeyAlgorithm = defaultAlgorithmEC;
+		} else {
+			publicKeyAlgorithm = defaultAlgorithmRSA;
+		}
+	}
+	asn1Append(bb, 0x06, &publicKeyAlgorithm);
+
+	if (pMechanism->mechanism == CKM_EC_KEY_PAIR_GEN) {
+		pos = findAttributeInTemplate(CKA_EC_PARAMS, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+		if (pos < 0) {
+			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "Missing CKA_EC_PARAMS in public key template");
+		}
+
+		if ((pPublicKeyTemplate[pos].ulValueLen < 2) || asn1Validate(pPublicKeyTemplate[pos].pValue, pPublicKeyTemplate[pos].ulValueLen)) {
+			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_EC_PARAMS not valid ASN");
+		}
+
+		if (*(unsigned char *)pPublicKeyTemplate[pos].pValue == 0x06) {
+			oid.val = (unsigned char *)pPublicKeyTemplate[pos].pValue + 2;
+			oid.len = pPublicKeyTemplate[pos].ulValueLen - 2;
+
+			curve = cvcGetCurveForOID(&oid);
+
+			if (curve == NULL) {
+				FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_EC_PARAMS contains unknown curve OID");
+			}
+		} else if (*(unsigned char *)pPublicKeyTemplate[pos].pValue == 0x30) {
+			rc = cvcDetermineCurveFromECParam((unsigned char *)pPublicKeyTemplate[pos].pValue, pPublicKeyTemplate[pos].ulValueLen, &crve);
+			if (rc < 0) {
+				FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "Explicit parameter in CKA_EC_PARAMS invalid");
+			}
+			curve = &crve;
+		} else {
+			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_EC_PARAMS not a curve object identifier or explicit domain parameter");
+		}
+
+		asn1Append(bb, 0x81, &curve->prime);
+		asn1Append(bb, 0x82, &curve->coefficientA);
+		asn1Append(bb, 0x83, &curve->coefficientB);
+		asn1Append(bb, 0x84, &curve->basePointG);
+		asn1Append(bb, 0x85, &curve->order);
+		asn1Append(bb, 0x87, &curve->coFactor);
+
+		keybits = (int)(curve->prime.len << 3);
+	} else {
+		rc = findAttributeInTemplate(CKA_MODULUS_BITS, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+		if (rc < 0) {
+			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "Missing CKA_MODULUS_BITS in public key template");
+		}
+		if (pPublicKeyTemplate[rc].ulValueLen != sizeof(CK_ULONG)) {
+			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_MODULUS_BITS not an CK_ULONG");
+		}
+		keybits = *(CK_ULONG *)pPublicKeyTemplate[rc].pValue;
+
+		rc = findAttributeInTemplate(CKA_PUBLIC_EXPONENT, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+		if (rc < 0) {
+			publicExponent = defaultPublicExponent;
+		} else {
+			publicExponent.val = pPublicKeyTemplate[rc].pValue;
+			publicExponent.len = pPublicKeyTemplate[rc].ulValueLen;
+		}
+
+		asn1Append(bb, 0x82, &publicExponent);
+		scr[0] = (unsigned char)(keybits >> 8);
+		scr[1] = (unsigned char)(keybits & 0xFF);
+		asn1AppendBytes(bb, 0x02, scr, 2);
+	}
+
+	asn1EncapBuffer(0x7F49, bb, ofs);
+
+	rc = findAttributeInTemplate(CKA_CVC_CHR, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		asn1AppendBytes(bb, 0x5F20, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	} else {
+		asn1Append(bb, 0x5F20, &defaultCHR);
+	}
+
+	rc = findAttributeInTemplate(CKA_CVC_OUTER_CAR, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		asn1AppendBytes(bb, 0x45, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	}
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_USE_COUNTER, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		if (pPublicKeyTemplate[rc].pValue == NULL || pPublicKeyTemplate[rc].ulValueLen != sizeof(CK_ULONG)) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER must be CK_ULONG");
+		}
+		kuc = *(CK_ULONG *)pPublicKeyTemplate[rc].pValue;
+
+		if ((kuc < 1) || (kuc > 0xFFFFFFFF)) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER is not in the range between 1 and 2^32");
+		}
+
+		scr[0] = (unsigned char)((kuc >> 24) & 0xFF);
+		scr[1] = (unsigned char)((kuc >> 16) & 0xFF);
+		scr[2] = (unsigned char)((kuc >>  8) & 0xFF);
+		scr[3] = (unsigned char)( kuc & 0xFF);
+		asn1AppendBytes(bb, 0x90, scr, 4);
+	}
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_ALGORITHM_LIST, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		if (pPublicKeyTemplate[rc].pValue == NULL || pPublicKeyTemplate[rc].ulValueLen > 16) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_ALGORITHM_LIST must not be longer that 16 bytes");
+		}
+		asn1AppendBytes(bb, 0x91, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	}
+
+	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_DOMAIN, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+	if (rc >= 0) {
+		if (pPublicKeyTemplate[rc].pValue == NULL || pPublicKeyTemplate[rc].ulValueLen != 1) {
+			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_DOMAIN must be a single CK_BYTE");
+		}
+		asn1AppendBytes(bb, 0x92, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	}
+
+	if (bbHasFailed(bb)) {
+		FUNC_FAILS(CKR_DEVICE_MEMORY, "Buffer to encode GAKP buffer too small");
+	}
+
+	*keysize = (int)keybits;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int decodeLabel(struct p11Token_t *token)
+{
+	int rc, len;
+	unsigned char ciainfo[256], *po;
+
+	FUNC_CALLED();
+
+	rc = readEF(token->slot, 0x2F03, ciainfo, sizeof(ciainfo));
+
+	if (rc < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading CIAInfo");
+
+	rc = (int)asn1Validate(ciainfo, rc);
+
+	if (rc < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not decode CVC request");
+
+	po = asn1Find(ciainfo, (unsigned char *)"\x30\x80", 2);
+
+	if (po == NULL)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "label not found");
+
+	memset(token->info.label, ' ', sizeof(token->info.label));
+	asn1Tag(&po);
+	len = asn1Length(&po);
+
+	if (len > sizeof(token->info.label))
+		len = sizeof(token->info.label);
+
+	memcpy(token->info.label, po, len);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int decodeDevAutCert(struct p11Token_t *token)
+{
+	int rc, len, certlen;
+	unsigned char cert[MAX_CERTIFICATE_SIZE];
+	struct p15CertificateDescription p15;
+	struct p11Object_t *p11cert;
+	struct p11Attribute_t *attribute;
+	unsigned char *po;
+
+	FUNC_CALLED();
+
+	len = readEF(token->slot, 0x2F02, cert, sizeof(cert));
+
+	if (len < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading C.DevAut");
+	}
+
+	memset(&p15, 0, sizeof(p15));
+	p15.certtype = P15_CT_CVC;
+	p15.coa.label = "C.DevAut";
+	p15.isModifiable = 0;
+
+	rc = createCertificateObjectFromP15(&p15, cert, len, &p11cert);
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Problem adding C.DevAut");
+	}
+	addObject(token, p11cert, TRUE);
+
+	findAttribute(p11cert, CKA_CVC_CHR, &attribute);
+
+	po = cert;
+	asn1Tag(&po);
+	certlen = asn1Length(&po);
+	certlen += (int)(po - cert);
+
+	if (certlen < len) {		// Add device issuer CA certificate
+		p15.certtype = P15_CT_CVC;
+		p15.coa.label = "C.DICA";
+		p15.isCA = TRUE;
+		rc = createCertificateObjectFromP15(&p15, cert + certlen, len - certlen, &p11cert);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Problem adding C.DICA");
+		}
+		addObject(token, p11cert, TRUE);
+	}
+
+	memset(token->info.serialNumber, ' ', sizeof(token->info.serialNumber));
+	len = attribute->attrData.ulValueLen - 5;
+	if (len > sizeof(token->info.serialNumber))
+		len = sizeof(token->info.serialNumber);
+
+	memcpy(token->info.serialNumber, attribute->attrData.pValue, len);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Determine a free key identifier by enumerating all files and locating a free id in the range CC01-CCFF
+ */
+static int determineFreeKeyId(struct p11Slot_t *slot, unsigned char prefix) {
+	unsigned char filelist[MAX_FILES * 2];
+	int listlen,i,id;
+
+	FUNC_CALLED();
+
+	listlen = enumerateObjects(slot, filelist, sizeof(filelist));
+	if (listlen < 0) {
+		FUNC_FAILS(listlen, "enumerateObjects failed");
+	}
+
+	for (id = 1; id <= 255; id++) {
+		for (i = 0; i < listlen; i += 2) {
+			if ((filelist[i] == prefix) && (filelist[i + 1] == id)) {
+				break;
+			}
+		}
+		if (i >= listlen) {
+			break;
+		}
+	}
+
+	FUNC_RETURNS(id <= 255 ? id : -1);
+}
+
+
+
+/*
+ * Pool of pre-generated key pairs
+ *
+ * Key pair generation takes seconds on the SmartCard-HSM. If configured with PKCS11_KEY_POOL, a background
+ * thread generates key pairs while the user is logged in and the token is idle. The card can not process other
+ * commands during key generation, so the worker waits for an idle period of several times the duration of the
+ * last generation with the same key specification.
+ *
+ * Pooled keys have a key file, the CVC request generated by the token and a PRKD with the label KEYPOOL_LABEL.
+ * No objects are created for a key with that PRKD, so pooled keys are not visible as objects, even in processes
+ * without PKCS11_KEY_POOL. A call to C_GenerateKeyPair() with a template that encodes to the same GAKP command
+ * claims a pooled key and only needs to replace the PRKD. The CVC request of each pooled key is kept in memory
+ * to create the key objects.
+ *
+ * The configuration is a comma separated list of EC:<curve>:<count> or RSA:<bits>:<count>, e.g.
+ * PKCS11_KEY_POOL=EC:secp256r1:8,RSA:2048:2
+ */
+
+#define KEYPOOL_MAX_SPECS	4		/* Maximum number of key specifications */
+#define KEYPOOL_MAX_KEYS	32		/* Maximum number of pooled keys per specification */
+#define KEYPOOL_IDLE_TIME	2		/* Seconds without command before the token is considered idle */
+#define KEYPOOL_IDLE_FACTOR	4		/* Minimum idle time as multiple of the last key generation time */
+#define KEYPOOL_LABEL		"SmartCard-HSM Key Pool"	/* Label of the PRKD that marks a pooled key */
+#define KEYPOOL_POLL_INTERVAL	250		/* Milliseconds between checks of the worker thread */
+#define KEYPOOL_BACKOFF		120		/* Poll intervals to wait after a failed key generation */
+
+struct keyPoolEntry {
+	unsigned char id;			/* Key identifier */
+	unsigned char *request;			/* CVC request returned by the token */
+	size_t requestlen;
+};
+
+struct keyPoolSpec {
+	CK_MECHANISM_TYPE mechanism;
+	struct bytestring_s curve;		/* Curve OID for EC keys */
+	CK_ULONG modulusBits;			/* Key size for RSA keys */
+	int target;				/* Number of keys to keep in the pool */
+	unsigned char gakp[512];		/* The GAKP command data for this specification */
+	size_t gakplen;
+	int keysize;				/* Key size in bits as encoded in the PRKD */
+	int duration;				/* Seconds taken by the last key generation */
+	int count;				/* Number of keys in the pool */
+	struct keyPoolEntry keys[KEYPOOL_MAX_KEYS];
+};
+
+struct keyPool {
+	struct p11Token_t *token;
+	MUTEX mutex;				/* Protects the list of pooled keys, the durations and loggedIn */
+	MUTEX allocMutex;			/* Serializes key identifier allocation and key generation */
+	int numberOfSpecs;
+	struct keyPoolSpec spec[KEYPOOL_MAX_SPECS];
+	int loggedIn;				/* The user is logged in and keys may be generated */
+	volatile int stop;
+	int running;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+};
+
+static struct {
+	char *name;
+	struct bytestring_s oid;
+} keyPoolCurves[] = {
+	{ "secp192r1",		{ (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x01", 8 } },
+	{ "prime192v1",		{ (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x01", 8 } },
+	{ "secp256r1",		{ (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x07", 8 } },
+	{ "prime256v1",		{ (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x07", 8 } },
+	{ "secp384r1",		{ (unsigned char *)"\x2B\x81\x04\x00\x22", 5 } },
+	{ "secp521r1",		{ (unsigned char *)"\x2B\x81\x04\x00\x23", 5 } },
+	{ "brainpoolP192r1",	{ (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x03", 9 } },
+	{ "brainpoolP224r1",	{ (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x05", 9 } },
+	{ "brainpoolP256r1",	{ (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x07", 9 } },
+	{ "brainpoolP320r1",	{ (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x09", 9 } },
+	{ "brainpoolP384r1",	{ (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x0B", 9 } },
+	{ "brainpoolP512r1",	{ (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x0D", 9 } },
+	{ "secp192k1",		{ (unsigned char *)"\x2B\x81\x04\x00\x1F", 5 } },
+	{ "secp256k1",		{ (unsigned char *)"\x2B\x81\x04\x00\x0A", 5 } },
+	{ NULL,			{ NULL, 0 } }
+};
+
+
+
+/**
+ * Parse a single key specification from the PKCS11_KEY_POOL configuration
+ */
+static int parseKeyPoolSpec(char *str, struct keyPoolSpec *spec)
+{
+	char *type, *param, *count;
+	int i;
+
+	type = str;
+	param = strchr(type, ':');
+	if (param == NULL)
+		return -1;
+	*param++ = 0;
+
+	count = strchr(param, ':');
+	if (count == NULL)
+		return -1;
+	*count++ = 0;
+
+	memset(spec, 0, sizeof(*spec));
+
+	spec->target = atoi(count);
+	if ((spec->target < 1) || (spec->target > KEYPOOL_MAX_KEYS))
+		return -1;
+
+	if (!strcmp(type, "EC")) {
+		spec->mechanism = CKM_EC_KEY_PAIR_GEN;
+		for (i = 0; keyPoolCurves[i].name != NULL; i++) {
+			if (!strcmp(keyPoolCurves[i].name, param))
+				break;
+		}
+		if (keyPoolCurves[i].name == NULL)
+			return -1;
+		spec->curve = keyPoolCurves[i].oid;
+	} else if (!strcmp(type, "RSA")) {
+		spec->mechanism = CKM_RSA_PKCS_KEY_PAIR_GEN;
+		spec->modulusBits = atoi(param);
+		if ((spec->modulusBits < 1024) || (spec->modulusBits > 4096))
+			return -1;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Encode the GAKP command data for a key specification, exactly as C_GenerateKeyPair() would
+ * for a template that only contains CKA_EC_PARAMS or CKA_MODULUS_BITS.
+ */
+static int encodeKeyPoolSpec(struct p11Token_t *token, struct keyPoolSpec *spec)
+{
+	CK_MECHANISM mech = { spec->mechanism, NULL, 0 };
+	unsigned char ecparams[18];
+	CK_ATTRIBUTE template[1];
+	struct bytebuffer_s bb = { spec->gakp, 0, sizeof(spec->gakp) };
+	int rc, keysize;
+
+	if (spec->mechanism == CKM_EC_KEY_PAIR_GEN) {
+		ecparams[0] = 0x06;
+		ecparams[1] = (unsigned char)spec->curve.len;
+		memcpy(ecparams + 2, spec->curve.val, spec->curve.len);
+		template[0].type = CKA_EC_PARAMS;
+		template[0].pValue = ecparams;
+		template[0].ulValueLen = (CK_ULONG)spec->curve.len + 2;
+	} else {
+		template[0].type = CKA_MODULUS_BITS;
+		template[0].pValue = &spec->modulusBits;
+		template[0].ulValueLen = sizeof(CK_ULONG);
+	}
+
+	rc = encodeGAKP(&bb, token, &mech, template, 1, &keysize);
+	if (rc != CKR_OK)
+		return -1;
+
+	spec->gakplen = bbGetLength(&bb);
+	spec->keysize = keysize;
+	return 0;
+}
+
+
+
+/**
+ * Create the key pool for the token if PKCS11_KEY_POOL is defined
+ */
+static int createKeyPool(struct p11Token_t *token)
+{
+	struct token_sc_hsm *sc = getPrivateData(token);
+	struct keyPool *pool;
+	char *po, *config, *spec, *next;
 
 	FUNC_CALLED();
 
-	bbClear(bb);
-	asn1AppendBytes(bb, 0x5F29, (unsigned char *)"\x00", 1);
+	po = getenv("PKCS11_KEY_POOL");
+	if ((po == NULL) || (*po == 0))
+		FUNC_RETURNS(CKR_OK);
 
-	rc = findAttributeInTemplate(CKA_CVC_INNER_CAR, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		asn1AppendBytes(bb, 0x42, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
-	} else {
-		if (token->info.firmwareVersion.major < 2) {
-			asn1Append(bb, 0x42, &defaultCHR);
-		}
+	config = strdup(po);
+	pool = calloc(1, sizeof(struct keyPool));
+
+	if ((config == NULL) || (pool == NULL)) {
+		free(config);
+		free(pool);
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
 	}
 
-	ofs = (int)bbGetLength(bb);
+	for (spec = config; (spec != NULL) && (pool->numberOfSpecs < KEYPOOL_MAX_SPECS); spec = next) {
+		next = strchr(spec, ',');
+		if (next != NULL)
+			*next++ = 0;
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_PUBLIC_KEY_ALGORITHM, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		publicKeyAlgorithm.val = pPublicKeyTemplate[rc].pValue;
-		publicKeyAlgorithm.len = pPublicKeyTemplate[rc].ulValueLen;
-	} else {
-		if (pMechanism->mechanism == CKM_EC_KEY_PAIR_GEN) {
-			publicKeyAlgorithm = defaultAlgorithmEC;
-		} else {
-			publicKeyAlgorithm = defaultAlgorithmRSA;
+		if ((parseKeyPoolSpec(spec, &pool->spec[pool->numberOfSpecs]) < 0) ||
+			(encodeKeyPoolSpec(token, &pool->spec[pool->numberOfSpecs]) < 0)) {
+#ifdef DEBUG
+			debug("Ignoring invalid key specification in PKCS11_KEY_POOL\n");
+#endif
+			continue;
 		}
+		pool->numberOfSpecs++;
 	}
-	asn1Append(bb, 0x06, &publicKeyAlgorithm);
 
-	if (pMechanism->mechanism == CKM_EC_KEY_PAIR_GEN) {
-		pos = findAttributeInTemplate(CKA_EC_PARAMS, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-		if (pos < 0) {
-			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "Missing CKA_EC_PARAMS in public key template");
-		}
+	free(config);
 
-		if ((pPublicKeyTemplate[pos].ulValueLen < 2) || asn1Validate(pPublicKeyTemplate[pos].pValue, pPublicKeyTemplate[pos].ulValueLen)) {
-			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_EC_PARAMS not valid ASN");
-		}
+	if (pool->numberOfSpecs == 0) {
+		free(pool);
+		FUNC_RETURNS(CKR_OK);
+	}
 
-		if (*(unsigned char *)pPublicKeyTemplate[pos].pValue == 0x06) {
-			oid.val = (unsigned char *)pPublicKeyTemplate[pos].pValue + 2;
-			oid.len = pPublicKeyTemplate[pos].ulValueLen - 2;
+	if (mutex_init(&pool->mutex) != 0) {
+		free(pool);
+		FUNC_FAILS(CKR_CANT_LOCK, "Could not create mutex");
+	}
 
-			curve = cvcGetCurveForOID(&oid);
+	if (mutex_init(&pool->allocMutex) != 0) {
+		mutex_destroy(&pool->mutex);
+		free(pool);
+		FUNC_FAILS(CKR_CANT_LOCK, "Could not create mutex");
+	}
 
-			if (curve == NULL) {
-				FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_EC_PARAMS contains unknown curve OID");
-			}
-		} else if (*(unsigned char *)pPublicKeyTemplate[pos].pValue == 0x30) {
-			rc = cvcDetermineCurveFromECParam((unsigned char *)pPublicKeyTemplate[pos].pValue, pPublicKeyTemplate[pos].ulValueLen, &crve);
-			if (rc < 0) {
-				FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "Explicit parameter in CKA_EC_PARAMS invalid");
-			}
-			curve = &crve;
-		} else {
-			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_EC_PARAMS not a curve object identifier or explicit domain parameter");
-		}
+	pool->token = token;
+	sc->keyPool = pool;
 
-		asn1Append(bb, 0x81, &curve->prime);
-		asn1Append(bb, 0x82, &curve->coefficientA);
-		asn1Append(bb, 0x83, &curve->coefficientB);
-		asn1Append(bb, 0x84, &curve->basePointG);
-		asn1Append(bb, 0x85, &curve->order);
-		asn1Append(bb, 0x87, &curve->coFactor);
+#ifdef DEBUG
+	debug("Key pool with %d key specifications\n", pool->numberOfSpecs);
+#endif
 
-		keybits = (int)(curve->prime.len << 3);
-	} else {
-		rc = findAttributeInTemplate(CKA_MODULUS_BITS, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-		if (rc < 0) {
-			FUNC_FAILS(CKR_TEMPLATE_INCOMPLETE, "Missing CKA_MODULUS_BITS in public key template");
-		}
-		if (pPublicKeyTemplate[rc].ulValueLen != sizeof(CK_ULONG)) {
-			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "CKA_MODULUS_BITS not an CK_ULONG");
-		}
-		keybits = *(CK_ULONG *)pPublicKeyTemplate[rc].pValue;
+	FUNC_RETURNS(CKR_OK);
+}
 
-		rc = findAttributeInTemplate(CKA_PUBLIC_EXPONENT, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-		if (rc < 0) {
-			publicExponent = defaultPublicExponent;
-		} else {
-			publicExponent.val = pPublicKeyTemplate[rc].pValue;
-			publicExponent.len = pPublicKeyTemplate[rc].ulValueLen;
+
+
+/**
+ * Serialize the allocation of key identifier with the background key generation
+ */
+static void lockKeyAllocation(struct p11Token_t *token)
+{
+	struct keyPool *pool = getPrivateData(token)->keyPool;
+
+	if (pool != NULL)
+		mutex_lock(&pool->allocMutex);
+}
+
+
+
+static void unlockKeyAllocation(struct p11Token_t *token)
+{
+	struct keyPool *pool = getPrivateData(token)->keyPool;
+
+	if (pool != NULL)
+		mutex_unlock(&pool->allocMutex);
+}
+
+
+
+/**
+ * Return true if the PRKD marks a key that was generated for the pool and not yet claimed
+ */
+static int isPooledKeyDescription(struct p15PrivateKeyDescription *p15key)
+{
+	return (p15key->coa.label != NULL) && !strcmp(p15key->coa.label, KEYPOOL_LABEL);
+}
+
+
+
+/**
+ * Write the PRKD that marks a key as pooled
+ */
+static int writePooledKeyDescription(struct p11Slot_t *slot, struct keyPoolSpec *spec, unsigned char id)
+{
+	unsigned char buff[MAX_P15_SIZE];
+	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
+	struct p15PrivateKeyDescription p15key;
+
+	FUNC_CALLED();
+
+	memset(&p15key, 0, sizeof(p15key));
+	p15key.keytype = spec->mechanism == CKM_EC_KEY_PAIR_GEN ? P15_KEYTYPE_ECC : P15_KEYTYPE_RSA;
+	p15key.coa.label = KEYPOOL_LABEL;
+	p15key.id.val = &id;
+	p15key.id.len = 1;
+	p15key.keysize = spec->keysize;
+	p15key.keyReference = id;
+
+	if (encodePrivateKeyDescription(&bb, &p15key) < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Encoding PRKD failed");
+
+	if (writeEF(slot, (PRKD_PREFIX << 8) | id, bb.val, bb.len) < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Writing PRKD failed");
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add a key and its CVC request to the pool
+ */
+static int addPooledKey(struct keyPool *pool, struct keyPoolSpec *spec, unsigned char id, unsigned char *request, size_t requestlen)
+{
+	struct keyPoolEntry *entry;
+	unsigned char *po;
+
+	po = malloc(requestlen);
+	if (po == NULL)
+		return CKR_HOST_MEMORY;
+
+	memcpy(po, request, requestlen);
+
+	mutex_lock(&pool->mutex);
+	entry = &spec->keys[spec->count++];
+	entry->id = id;
+	entry->request = po;
+	entry->requestlen = requestlen;
+	mutex_unlock(&pool->mutex);
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Add a key left by a previous instance to the pool, if the key has the PRKD that marks it as
+ * pooled or no PRKD at all, and the CVC request created during key generation matches one of the
+ * configured key specifications
+ *
+ * @param token     the token
+ * @param id        the key identifier
+ * @param hasPRKD   true if the token has a PRKD for the key
+ */
+static int reclaimPooledKey(struct p11Token_t *token, unsigned char id, int hasPRKD)
+{
+	struct keyPool *pool = getPrivateData(token)->keyPool;
+	struct keyPoolSpec *spec;
+	struct p15PrivateKeyDescription *p15key = NULL;
+	unsigned char certValue[MAX_CERTIFICATE_SIZE];
+	unsigned char prkd[MAX_P15_SIZE];
+	struct cvc cvc;
+	bytestring oid;
+	int rc, i, certLen;
+
+	FUNC_CALLED();
+
+	if (hasPRKD) {
+		rc = readEF(token->slot, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
+
+		if ((rc <= 0) || (prkd[0] == P15_KEYTYPE_AES) || (decodePrivateKeyDescription(prkd, rc, &p15key) < 0)) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Key is not a pooled key");
 		}
 
-		asn1Append(bb, 0x82, &publicExponent);
-		scr[0] = (unsigned char)(keybits >> 8);
-		scr[1] = (unsigned char)(keybits & 0xFF);
-		asn1AppendBytes(bb, 0x02, scr, 2);
+		rc = isPooledKeyDescription(p15key);
+		freePrivateKeyDescription(&p15key);
+
+		if (!rc) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Key is not a pooled key");
+		}
 	}
 
-	asn1EncapBuffer(0x7F49, bb, ofs);
+	certLen = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
 
-	rc = findAttributeInTemplate(CKA_CVC_CHR, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		asn1AppendBytes(bb, 0x5F20, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
-	} else {
-		asn1Append(bb, 0x5F20, &defaultCHR);
+	if ((certLen <= 0) || (certValue[0] != 0x67) || (cvcDecode(certValue, certLen, &cvc) < 0)) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "No CVC request for key without PRKD");
 	}
 
-	rc = findAttributeInTemplate(CKA_CVC_OUTER_CAR, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		asn1AppendBytes(bb, 0x45, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	// Keys generated for the pool always use the default CHR and algorithm
+	if (bsCompare(&cvc.chr, &defaultCHR) ||
+		(bsCompare(&cvc.pukoid, &defaultAlgorithmEC) && bsCompare(&cvc.pukoid, &defaultAlgorithmRSA))) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Key was not generated for the pool");
 	}
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_USE_COUNTER, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		if (pPublicKeyTemplate[rc].pValue == NULL || pPublicKeyTemplate[rc].ulValueLen != sizeof(CK_ULONG)) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER must be CK_ULONG");
-		}
-		kuc = *(CK_ULONG *)pPublicKeyTemplate[rc].pValue;
+	for (i = 0; i < pool->numberOfSpecs; i++) {
+		spec = &pool->spec[i];
 
-		if ((kuc < 1) || (kuc > 0xFFFFFFFF)) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_USE_COUNTER is not in the range between 1 and 2^32");
+		if (spec->count >= KEYPOOL_MAX_KEYS)
+			continue;
+
+		if (spec->mechanism == CKM_EC_KEY_PAIR_GEN) {
+			if (!bsCompare(&cvc.pukoid, &defaultAlgorithmEC) &&
+				!cvcDetermineCurveOID(&cvc, &oid) && !bsCompare(oid, &spec->curve))
+				break;
+		} else {
+			if (!bsCompare(&cvc.pukoid, &defaultAlgorithmRSA) &&
+				!bsCompare(&cvc.coefficientAorExponent, &defaultPublicExponent) &&
+				(cvc.primeOrModulus.len << 3 == spec->modulusBits))
+				break;
 		}
+	}
 
-		scr[0] = (unsigned char)((kuc >> 24) & 0xFF);
-		scr[1] = (unsigned char)((kuc >> 16) & 0xFF);
-		scr[2] = (unsigned char)((kuc >>  8) & 0xFF);
-		scr[3] = (unsigned char)( kuc & 0xFF);
-		asn1AppendBytes(bb, 0x90, scr, 4);
+	if (i >= pool->numberOfSpecs) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Key does not match a key specification");
 	}
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_ALGORITHM_LIST, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		if (pPublicKeyTemplate[rc].pValue == NULL || pPublicKeyTemplate[rc].ulValueLen > 16) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_ALGORITHM_LIST must not be longer that 16 bytes");
-		}
-		asn1AppendBytes(bb, 0x91, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
+	rc = addPooledKey(pool, spec, id, certValue, certLen);
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Out of memory");
 	}
 
-	rc = findAttributeInTemplate(CKA_SC_HSM_KEY_DOMAIN, pPublicKeyTemplate, ulPublicKeyAttributeCount);
-	if (rc >= 0) {
-		if (pPublicKeyTemplate[rc].pValue == NULL || pPublicKeyTemplate[rc].ulValueLen != 1) {
-			FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_SC_HSM_KEY_DOMAIN must be a single CK_BYTE");
+#ifdef DEBUG
+	debug("Reclaimed key %d for key pool\n", id);
+#endif
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Claim a pooled key matching the encoded GAKP command. The caller takes ownership of the CVC request.
+ *
+ * @return the key identifier or -1 if no matching key is in the pool
+ */
+static int claimPooledKey(struct p11Token_t *token, CK_MECHANISM_TYPE mechanism, unsigned char *gakp, size_t gakplen, unsigned char **request, size_t *requestlen)
+{
+	struct keyPool *pool = getPrivateData(token)->keyPool;
+	struct keyPoolSpec *spec;
+	struct keyPoolEntry *entry;
+	int i, id = -1;
+
+	if (pool == NULL)
+		return -1;
+
+	mutex_lock(&pool->mutex);
+
+	for (i = 0; i < pool->numberOfSpecs; i++) {
+		spec = &pool->spec[i];
+
+		if ((spec->mechanism == mechanism) && (spec->gakplen == gakplen) && !memcmp(spec->gakp, gakp, gakplen)) {
+			if (spec->count > 0) {
+				entry = &spec->keys[--spec->count];
+				id = entry->id;
+				*request = entry->request;
+				*requestlen = entry->requestlen;
+				entry->request = NULL;
+			}
+			break;
 		}
-		asn1AppendBytes(bb, 0x92, pPublicKeyTemplate[rc].pValue, pPublicKeyTemplate[rc].ulValueLen);
 	}
 
-	if (bbHasFailed(bb)) {
-		FUNC_FAILS(CKR_DEVICE_MEMORY, "Buffer to encode GAKP buffer too small");
+	mutex_unlock(&pool->mutex);
+
+#ifdef DEBUG
+	if (id > 0) {
+		debug("Claimed key %d from key pool\n", id);
 	}
+#endif
 
-	*keysize = (int)keybits;
-	FUNC_RETURNS(CKR_OK);
+	return id;
 }
 
 
 
-static int decodeLabel(struct p11Token_t *token)
+/**
+ * Generate a key for the pool
+ */
+static int generatePooledKey(struct keyPool *pool, struct keyPoolSpec *spec)
 {
-	int rc, len;
-	unsigned char ciainfo[256], *po;
+	struct p11Slot_t *slot = pool->token->slot;
+	unsigned char request[MAX_CERTIFICATE_SIZE];
+	unsigned short SW1SW2 = 0;
+	time_t start;
+	int rc = -1, id;
+
+	FUNC_CALLED();
+
+	mutex_lock(&pool->allocMutex);
+
+	id = determineFreeKeyId(slot, KEY_PREFIX);
+
+	if (id > 0) {
+		start = time(NULL);
+		rc = transmitAPDU(slot, 0x00, 0x46, id, 0x00,
+				(int)spec->gakplen, spec->gakp,
+				0x10000, request, sizeof(request), &SW1SW2);
+
+		mutex_lock(&pool->mutex);
+		spec->duration = (int)(time(NULL) - start);
+		mutex_unlock(&pool->mutex);
+	}
+
+	mutex_unlock(&pool->allocMutex);
+
+	if (id < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
+
+	if (rc < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+
+	if (SW1SW2 != 0x9000)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Generate key pair failed");
+
+	if ((rc == 0) || (request[0] != 0x67))
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Response does not contain a CVC request");
+
+	// A key without PRKD is reclaimed by the next process with a key pool
+	if (writePooledKeyDescription(slot, spec, (unsigned char)id) != CKR_OK)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not mark key as pooled");
+
+	rc = addPooledKey(pool, spec, id, request, rc);
+	if (rc != CKR_OK)
+		FUNC_FAILS(rc, "Out of memory");
+
+#ifdef DEBUG
+	debug("Generated key %d for key pool\n", id);
+#endif
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Return the next key specification with less keys than configured or NULL if the pool is
+ * full or the user is not logged in
+ *
+ * @param pool      the key pool
+ * @param idle      the seconds the token must be idle before a key is generated
+ */
+static struct keyPoolSpec *getKeyPoolSpecToFill(struct keyPool *pool, int *idle)
+{
+	struct keyPoolSpec *spec = NULL;
+	int i;
 
-	FUNC_CALLED();
+	mutex_lock(&pool->mutex);
 
-	rc = readEF(token->slot, 0x2F03, ciainfo, sizeof(ciainfo));
+	for (i = 0; pool->loggedIn && (i < pool->numberOfSpecs); i++) {
+		if (pool->spec[i].count < pool->spec[i].target) {
+			spec = &pool->spec[i];
+			*idle = spec->duration * KEYPOOL_IDLE_FACTOR;
+			if (*idle < KEYPOOL_IDLE_TIME)
+				*idle = KEYPOOL_IDLE_TIME;
+			break;
+		}
+	}
 
-	if (rc < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading CIAInfo");
+	mutex_unlock(&pool->mutex);
 
-	rc = (int)asn1Validate(ciainfo, rc);
+	return spec;
+}
 
-	if (rc < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not decode CVC request");
 
-	po = asn1Find(ciainfo, (unsigned char *)"\x30\x80", 2);
 
-	if (po == NULL)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "label not found");
+#ifdef _WIN32
+static unsigned __stdcall keyPoolWorker(void *arg)
+#else
+static void *keyPoolWorker(void *arg)
+#endif
+{
+	struct keyPool *pool = (struct keyPool *)arg;
+	struct p11Slot_t *slot = pool->token->slot;
+	struct keyPoolSpec *spec;
+	int backoff = 0, idle;
+
+	while (!pool->stop) {
+#ifdef _WIN32
+		Sleep(KEYPOOL_POLL_INTERVAL);
+#else
+		usleep(KEYPOOL_POLL_INTERVAL * 1000);
+#endif
+		if (pool->stop)
+			break;
 
-	memset(token->info.label, ' ', sizeof(token->info.label));
-	asn1Tag(&po);
-	len = asn1Length(&po);
+		if (backoff > 0) {
+			backoff--;
+			continue;
+		}
 
-	if (len > sizeof(token->info.label))
-		len = sizeof(token->info.label);
+		// Key generation requires the user to be logged in. Leave the token to the application if
+		// it was used recently. A removed token fails the key generation.
+		spec = getKeyPoolSpecToFill(pool, &idle);
+		if ((spec == NULL) || (getSlotIdleTime(slot) < idle))
+			continue;
 
-	memcpy(token->info.label, po, len);
+		if (generatePooledKey(pool, spec) != CKR_OK)
+			backoff = KEYPOOL_BACKOFF;
+	}
 
-	FUNC_RETURNS(CKR_OK);
+	return 0;
 }
 
 
 
-static int decodeDevAutCert(struct p11Token_t *token)
+/**
+ * Start the background key generation after the user logged in
+ */
+static void startKeyPool(struct p11Token_t *token)
 {
-	int rc, len, certlen;
-	unsigned char cert[MAX_CERTIFICATE_SIZE];
-	struct p15CertificateDescription p15;
-	struct p11Object_t *p11cert;
-	struct p11Attribute_t *attribute;
-	unsigned char *po;
+	struct keyPool *pool = getPrivateData(token)->keyPool;
 
-	FUNC_CALLED();
+	if (pool == NULL)
+		return;
 
-	len = readEF(token->slot, 0x2F02, cert, sizeof(cert));
+	mutex_lock(&pool->mutex);
+	pool->loggedIn = 1;
+	mutex_unlock(&pool->mutex);
 
-	if (len < 0) {
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading C.DevAut");
-	}
+	if (pool->running)
+		return;
 
-	memset(&p15, 0, sizeof(p15));
-	p15.certtype = P15_CT_CVC;
-	p15.coa.label = "C.DevAut";
-	p15.isModifiable = 0;
+#ifdef _WIN32
+	pool->thread = (HANDLE)_beginthreadex(NULL, 0, keyPoolWorker, pool, 0, NULL);
+	pool->running = (pool->thread != 0);
+#else
+	pool->running = (pthread_create(&pool->thread, NULL, keyPoolWorker, pool) == 0);
+#endif
 
-	rc = createCertificateObjectFromP15(&p15, cert, len, &p11cert);
-	if (rc != CKR_OK) {
-		FUNC_FAILS(rc, "Problem adding C.DevAut");
+#ifdef DEBUG
+	if (!pool->running) {
+		debug("Could not start key pool worker\n");
 	}
-	addObject(token, p11cert, TRUE);
-
-	findAttribute(p11cert, CKA_CVC_CHR, &attribute);
+#endif
+}
 
-	po = cert;
-	asn1Tag(&po);
-	certlen = asn1Length(&po);
-	certlen += (int)(po - cert);
 
-	if (certlen < len) {		// Add device issuer CA certificate
-		p15.certtype = P15_CT_CVC;
-		p15.coa.label = "C.DICA";
-		p15.isCA = TRUE;
-		rc = createCertificateObjectFromP15(&p15, cert + certlen, len - certlen, &p11cert);
-		if (rc != CKR_OK) {
-			FUNC_FAILS(rc, "Problem adding C.DICA");
-		}
-		addObject(token, p11cert, TRUE);
-	}
 
-	memset(token->info.serialNumber, ' ', sizeof(token->info.serialNumber));
-	len = attribute->attrData.ulValueLen - 5;
-	if (len > sizeof(token->info.serialNumber))
-		len = sizeof(token->info.serialNumber);
+/**
+ * Suspend the background key generation after the user logged out
+ */
+static void suspendKeyPool(struct p11Token_t *token)
+{
+	struct keyPool *pool = getPrivateData(token)->keyPool;
 
-	memcpy(token->info.serialNumber, attribute->attrData.pValue, len);
+	if (pool == NULL)
+		return;
 
-	FUNC_RETURNS(CKR_OK);
+	mutex_lock(&pool->mutex);
+	pool->loggedIn = 0;
+	mutex_unlock(&pool->mutex);
 }
 
 
 
 /**
- * Determine a free key identifier by enumerating all files and locating a free id in the range CC01-CCFF
+ * Stop the background key generation and release the pool. Pooled keys remain
+ * on the token and are reclaimed when the token is loaded the next time.
  */
-static int determineFreeKeyId(struct p11Slot_t *slot, unsigned char prefix) {
-	unsigned char filelist[MAX_FILES * 2];
-	int listlen,i,id;
+static void freeKeyPool(struct p11Token_t *token)
+{
+	struct token_sc_hsm *sc = getPrivateData(token);
+	struct keyPool *pool = sc->keyPool;
+	int i, j;
 
-	FUNC_CALLED();
+	if (pool == NULL)
+		return;
 
-	listlen = enumerateObjects(slot, filelist, sizeof(filelist));
-	if (listlen < 0) {
-		FUNC_FAILS(listlen, "enumerateObjects failed");
+	if (pool->running) {
+		pool->stop = 1;
+#ifdef _WIN32
+		WaitForSingleObject(pool->thread, INFINITE);
+		CloseHandle(pool->thread);
+#else
+		pthread_join(pool->thread, NULL);
+#endif
 	}
 
-	for (id = 1; id <= 255; id++) {
-		for (i = 0; i < listlen; i += 2) {
-			if ((filelist[i] == prefix) && (filelist[i + 1] == id)) {
-				break;
-			}
-		}
-		if (i >= listlen) {
-			break;
+	for (i = 0; i < pool->numberOfSpecs; i++) {
+		for (j = 0; j < pool->spec[i].count; j++) {
+			free(pool->spec[i].keys[j].request);
 		}
 	}
 
-	FUNC_RETURNS(id <= 255 ? id : -1);
+	mutex_destroy(&pool->allocMutex);
+	mutex_destroy(&pool->mutex);
+	free(pool);
+	sc->keyPool = NULL;
+}
+
+
+
+static void sc_hsm_freeToken(struct p11Token_t *token)
+{
+	freeKeyPool(token);
 }
 
 
@@ -1272,6 +2680,18 @@ static CK_RV sc_hsm_C_DeriveKey(
 		CK_ULONG ulAttributeCount,
 		struct p11Object_t **pKey);
 
+static void setKeyFunctions(struct p11Object_t *p11prikey)
+{
+	p11prikey->C_SignInit = sc_hsm_C_SignInit;
+	p11prikey->C_Sign = sc_hsm_C_Sign;
+	p11prikey->C_SignUpdate = sc_hsm_C_SignUpdate;
+	p11prikey->C_SignFinal = sc_hsm_C_SignFinal;
+	p11prikey->C_DecryptInit = sc_hsm_C_DecryptInit;
+	p11prikey->C_Decrypt = sc_hsm_C_Decrypt;
+}
+
+
+
 static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char id, struct p11Object_t **priKey, struct p11Object_t **pubKey, struct p11Object_t **cert)
 {
 	unsigned char certValue[MAX_CERTIFICATE_SIZE];
@@ -1307,6 +2727,10 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 
 		p11prikey->C_EncryptInit = sc_hsm_C_EncryptInit;
 		p11prikey->C_Encrypt = sc_hsm_C_Encrypt;
+		p11prikey->C_EncryptUpdate = sc_hsm_C_EncryptUpdate;
+		p11prikey->C_EncryptFinal = sc_hsm_C_EncryptFinal;
+		p11prikey->C_DecryptUpdate = sc_hsm_C_DecryptUpdate;
+		p11prikey->C_DecryptFinal = sc_hsm_C_DecryptFinal;
 		p11prikey->C_DeriveKey = sc_hsm_C_DeriveSymmetricKey;
 	} else {
 		rc = decodePrivateKeyDescription(prkd, rc, &p15key);
@@ -1315,6 +2739,12 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
 		}
 
+		// Keys generated for the key pool are not visible until claimed by C_GenerateKeyPair()
+		if (isPooledKeyDescription(p15key)) {
+			freePrivateKeyDescription(&p15key);
+			FUNC_RETURNS(CKR_OK);
+		}
+
 		rc = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
 
 		if (rc > 0) {
@@ -1409,10 +2839,7 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 		p11prikey->C_DeriveKey = sc_hsm_C_DeriveKey;
 	}
 
-	p11prikey->C_SignInit = sc_hsm_C_SignInit;
-	p11prikey->C_Sign = sc_hsm_C_Sign;
-	p11prikey->C_DecryptInit = sc_hsm_C_DecryptInit;
-	p11prikey->C_Decrypt = sc_hsm_C_Decrypt;
+	setKeyFunctions(p11prikey);
 
 	p11prikey->tokenid = (int)id;
 
@@ -1432,6 +2859,48 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 
 
 
+/**
+ * Create the key objects for a newly generated key pair from the private key description written by
+ * the caller and the CVC request returned by the GENERATE ASYMMETRIC KEY PAIR command. This is what
+ * addEECertificateAndKeyObjects() obtains by reading back the PRKD and the request from the token.
+ */
+static int addKeyObjectsFromRequest(struct p11Token_t *token, unsigned char id, struct p15PrivateKeyDescription *p15key, unsigned char *request, size_t requestlen, struct p11Object_t **priKey, struct p11Object_t **pubKey)
+{
+	struct p11Object_t *p11pubkey, *p11prikey;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = createPublicKeyObjectFromCVC(p15key, request, requestlen, &p11pubkey);
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create public key object");
+	}
+
+	rc = createPrivateKeyObjectFromP15AndPublicKey(p15key, p11pubkey, FALSE, &p11prikey);
+
+	if (rc != CKR_OK) {
+		freeObject(p11pubkey);
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create private key object");
+	}
+
+	p11prikey->C_DeriveKey = sc_hsm_C_DeriveKey;
+	setKeyFunctions(p11prikey);
+
+	p11prikey->tokenid = (int)id;
+
+	// Add both objects only if both could be created, so a failure leaves no half-added key pair
+	addObject(token, p11pubkey, TRUE);
+	addObject(token, p11prikey, FALSE);
+
+	*priKey = p11prikey;
+	*pubKey = p11pubkey;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
 {
 	unsigned char certValue[MAX_CERTIFICATE_SIZE];
@@ -1622,7 +3091,8 @@ static int createPrivateKeyDescription(
 		CK_ATTRIBUTE_PTR pPrivateKeyTemplate,
 		CK_ULONG ulPrivateKeyAttributeCount,
 		int id,
-		int keysize)
+		int keysize,
+		struct p15PrivateKeyDescription **pp15key)
 {
 	int rc, len;
 	unsigned char buff[512], *po;
@@ -1691,15 +3161,23 @@ static int createPrivateKeyDescription(
 
 	rc = encodePrivateKeyDescription(&bb, p15key);
 
-	freePrivateKeyDescription(&p15key);
-
-	if (rc < 0)
+	if (rc < 0) {
+		freePrivateKeyDescription(&p15key);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Encoding PRKD failed");
+	}
 
 	rc = writeEF(slot, (PRKD_PREFIX << 8) | id, bb.val, bb.len);
 
-	if (rc < 0)
+	if (rc < 0) {
+		freePrivateKeyDescription(&p15key);
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Writing PRKD failed");
+	}
+
+	if (pp15key != NULL) {
+		*pp15key = p15key;
+	} else {
+		freePrivateKeyDescription(&p15key);
+	}
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -1713,9 +3191,7 @@ static CK_RV sc_hsm_C_DeriveSymmetricKey(
 		CK_ULONG ulAttributeCount,
 		struct p11Object_t **pKey)
 {
-	int rc;
-	unsigned short SW1SW2;
-	unsigned char *pDerivationParam;
+	int rc, keylen;
 	unsigned char derivedKeyValue[32];
 	struct p11Object_t *derivedKey;
 	CK_ATTRIBUTE kva = { CKA_VALUE, &derivedKeyValue, sizeof(derivedKeyValue) };
@@ -1724,19 +3200,12 @@ static CK_RV sc_hsm_C_DeriveSymmetricKey(
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism must be CKM_SC_HSM_SP80056C_DERIVE");
 	}
 
-	pDerivationParam = malloc(pMechanism->ulParameterLen);
-	memcpy(pDerivationParam, pMechanism->pParameter, pMechanism->ulParameterLen);
+	rc = deriveKeyValue(pObject, pMechanism->pParameter, pMechanism->ulParameterLen, derivedKeyValue, &keylen);
 
-	rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, 0x99,
-			pMechanism->ulParameterLen, pDerivationParam, 0, derivedKeyValue, sizeof(derivedKeyValue), &SW1SW2);
-
-	free(pDerivationParam);
-
-	if (rc < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	if (rc != CKR_OK)
+		FUNC_FAILS(rc, "Key derivation failed");
 
-	if (SW1SW2 != 0x9000)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Key derivation failed");
+	kva.ulValueLen = keylen;
 
 	derivedKey = calloc(sizeof(struct p11Object_t), 1);
 
@@ -1798,28 +3267,34 @@ static CK_RV sc_hsm_C_DeriveKey(
 			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "A secret key with that CKA_ID does already exist");
 	}
 
-	id = determineFreeKeyId(pObject->token->slot, KEY_PREFIX);
-
-	if (id < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
-
 	len = pMechanism->ulParameterLen + 1;
 	pDerivationParam = malloc(len);
 	pDerivationParam[0] = ALGO_EC_DERIVE;
 	memcpy(pDerivationParam + 1, pMechanism->pParameter, pMechanism->ulParameterLen);
 
-	rc = transmitAPDU(pObject->token->slot, 0x80, 0x76, (unsigned char)pObject->tokenid, id,
-			len, pDerivationParam, 0, NULL, 0, &SW1SW2);
+	lockKeyAllocation(pObject->token);
+
+	id = determineFreeKeyId(pObject->token->slot, KEY_PREFIX);
+
+	if (id >= 0) {
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x76, (unsigned char)pObject->tokenid, id,
+				len, pDerivationParam, 0, NULL, 0, &SW1SW2);
+	}
+
+	unlockKeyAllocation(pObject->token);
 
 	free(pDerivationParam);
 
+	if (id < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
+
 	if (rc < 0)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 
 	if (SW1SW2 != 0x9000)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Key derivation failed");
 
-	createPrivateKeyDescription(pObject->token->slot, pMechanism, pTemplate, ulAttributeCount, id, pObject->keysize);
+	createPrivateKeyDescription(pObject->token->slot, pMechanism, pTemplate, ulAttributeCount, id, pObject->keysize, NULL);
 
 	rc = addEECertificateAndKeyObjects(pObject->token->slot->token, id, &key, NULL, NULL);
 	if (rc != CKR_OK)
@@ -2056,17 +3531,25 @@ static int sc_hsm_C_GenerateKey(
 			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "A key with that CKA_ID does already exist");
 
 		id = *(CK_BYTE *)pTemplate[idpos].pValue;
-	} else {
+	}
+
+	lockKeyAllocation(slot->token);
+
+	if (idpos < 0) {
 		id = determineFreeKeyId(slot, KEY_PREFIX);
 	}
 
+	if (id >= 0) {
+		rc = transmitAPDU(slot, 0x00, 0x48, id, algo,
+				(int)bbGetLength(&bb), buff,
+				0, NULL, 0, &SW1SW2);
+	}
+
+	unlockKeyAllocation(slot->token);
+
 	if (id < 0)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
 
-	rc = transmitAPDU(slot, 0x00, 0x48, id, algo,
-			(int)bbGetLength(&bb), buff,
-			0, NULL, 0, &SW1SW2);
-
 	if (rc < 0)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 
@@ -2099,7 +3582,10 @@ static int sc_hsm_C_GenerateKeyPair(
 {
 	unsigned char buff[512];
 	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
-	struct p11Object_t *priKey, *pubKey;
+	unsigned char response[MAX_CERTIFICATE_SIZE], *request = NULL;
+	size_t requestlen = 0;
+	struct p15PrivateKeyDescription *p15key = NULL;
+	struct p11Object_t *priKey = NULL, *pubKey = NULL;
 	unsigned short SW1SW2;
 	int rc,id,keysize,idpos;
 
@@ -2125,29 +3611,63 @@ static int sc_hsm_C_GenerateKeyPair(
 	if (rc != CKR_OK)
 		FUNC_FAILS(rc, "Encoding GAKP failed");
 
-	id = determineFreeKeyId(slot, KEY_PREFIX);
+	id = claimPooledKey(slot->token, pMechanism->mechanism, buff, bbGetLength(&bb), &request, &requestlen);
 
-	if (id < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
+	if (id < 0) {
+		lockKeyAllocation(slot->token);
 
-	rc = transmitAPDU(slot, 0x00, 0x46, id, 0x00,
-			(int)bbGetLength(&bb), buff,
-			0, NULL, 0, &SW1SW2);
+		id = determineFreeKeyId(slot, KEY_PREFIX);
 
-	if (rc < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		if (id >= 0) {
+			rc = transmitAPDU(slot, 0x00, 0x46, id, 0x00,
+					(int)bbGetLength(&bb), buff,
+					0x10000, response, sizeof(response), &SW1SW2);
+		}
 
-	if (SW1SW2 != 0x9000)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+		unlockKeyAllocation(slot->token);
+
+		if (id < 0)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
+
+		if (rc < 0)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+
+		if (SW1SW2 != 0x9000)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+
+		// The response contains the CVC request, which the token also stores in the EE certificate file
+		if ((rc > 0) && (response[0] == 0x67)) {
+			request = response;
+			requestlen = rc;
+		}
+	} else {
+		// Remove the PRKD marking the key as pooled, as a shorter PRKD would not replace it entirely
+		deleteEF(slot, (PRKD_PREFIX << 8) | id);
+	}
+
+	rc = createPrivateKeyDescription(slot,pMechanism, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, id, keysize, &p15key);
 
-	createPrivateKeyDescription(slot,pMechanism, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, id, keysize);
+	if (rc == CKR_OK) {
+		if (request != NULL) {
+			rc = addKeyObjectsFromRequest(slot->token, id, p15key, request, requestlen, &priKey, &pubKey);
+		} else {
+			rc = addEECertificateAndKeyObjects(slot->token, id, &priKey, &pubKey, NULL);
+		}
+	}
+
+	if (p15key != NULL)
+		freePrivateKeyDescription(&p15key);
+
+	if (request != response)
+		free(request);
 
-	rc = addEECertificateAndKeyObjects(slot->token, id, &priKey, &pubKey, NULL);
+	if (rc != CKR_OK)
+		FUNC_FAILS(rc, "Creating key objects failed");
 
 	*phPublicKey = pubKey;
 	*phPrivateKey = priKey;
 
-	FUNC_RETURNS(rc);
+	FUNC_RETURNS(CKR_OK);
 }
 
 
@@ -2358,7 +3878,7 @@ static int sc_hsm_loadObjects(struct p11Token_t *token)
 {
 	unsigned char filelist[MAX_FILES * 2];
 	struct p11Slot_t *slot = token->slot;
-	int rc,listlen,i,id,prefix;
+	int rc,listlen,i,j,id,prefix;
 
 	FUNC_CALLED();
 
@@ -2374,6 +3894,12 @@ static int sc_hsm_loadObjects(struct p11Token_t *token)
 
 		switch(prefix) {
 		case KEY_PREFIX:
+			if ((id != 0) && (getPrivateData(token)->keyPool != NULL)) {
+				for (j = 0; (j < listlen) && ((filelist[j] != PRKD_PREFIX) || (filelist[j + 1] != id)); j += 2);
+				if (reclaimPooledKey(token, id, j < listlen) == CKR_OK) {
+					break;
+				}
+			}
 			if (id != 0) {				// Skip Device Authentication Key
 				rc = addEECertificateAndKeyObjects(token, id, NULL, NULL, NULL);
 				if (rc != CKR_OK) {
@@ -2553,6 +4079,8 @@ static int sc_hsm_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pi
 
 			FUNC_FAILS(rc, "sc_hsm_login failed");
 		}
+
+		startKeyPool(slot->token);
 	}
 
 	FUNC_RETURNS(rc);
@@ -2576,6 +4104,8 @@ static int sc_hsm_logout(struct p11Slot_t *slot)
 	sc = getPrivateData(slot->token);
 	memset(sc->sopin, 0, sizeof(sc->sopin));
 
+	suspendKeyPool(slot->token);
+
 	rc = selectApplet(slot, NULL, NULL);
 	if (rc < 0) {
 		FUNC_FAILS(CKR_TOKEN_NOT_RECOGNIZED, "applet selection failed");
@@ -2829,6 +4359,12 @@ int newSmartCardHSMToken(struct p11Slot_t *slot, struct p11Token_t **token)
 	}
 #endif
 
+	rc = createKeyPool(ptoken);
+	if (rc != CKR_OK) {
+		freeToken(ptoken);
+		FUNC_FAILS(rc, "createKeyPool() failed");
+	}
+
 	rc = sc_hsm_loadObjects(ptoken);
 	if (rc != CKR_OK) {
 		freeToken(ptoken);
@@ -2892,6 +4428,12 @@ static int sc_hsm_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_P
 	case CKM_SC_HSM_PSS_SHA1:
 	case CKM_SC_HSM_PSS_SHA256:
 #ifdef ENABLE_LIBCRYPTO
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
 	case CKM_RSA_PKCS_OAEP:
 #endif
 
@@ -2904,6 +4446,10 @@ static int sc_hsm_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_P
 	case CKM_ECDSA_SHA1:
 	case CKM_SC_HSM_ECDSA_SHA224:
 	case CKM_SC_HSM_ECDSA_SHA256:
+#ifdef ENABLE_LIBCRYPTO
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
+#endif
 		pInfo->ulMinKeySize = 192;
 		pInfo->ulMaxKeySize = 521;
 		break;
@@ -2911,6 +4457,10 @@ static int sc_hsm_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_P
 	case CKM_AES_KEY_GEN:
 	case CKM_AES_CBC:
 	case CKM_AES_CMAC:
+#ifdef ENABLE_LIBCRYPTO
+	case CKM_SC_HSM_ENVELOPE_AES_GCM:
+	case CKM_SC_HSM_ENVELOPE_AES_CTR:
+#endif
 		pInfo->ulMinKeySize = 16;
 		pInfo->ulMaxKeySize = 32;
 		break;
@@ -2956,6 +4506,12 @@ static int sc_hsm_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_P
 	case CKM_SC_HSM_PSS_SHA1:
 	case CKM_SC_HSM_PSS_SHA256:
 #ifdef ENABLE_LIBCRYPTO
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA512_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+	case CKM_SHA512_RSA_PKCS_PSS:
 		pInfo->flags = CKF_HW|CKF_SIGN|CKF_VERIFY;
 #else
 		pInfo->flags = CKF_HW|CKF_SIGN;
@@ -2970,6 +4526,8 @@ static int sc_hsm_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_P
 	case CKM_SC_HSM_ECDSA_SHA224:
 	case CKM_SC_HSM_ECDSA_SHA256:
 #ifdef ENABLE_LIBCRYPTO
+	case CKM_ECDSA_SHA384:
+	case CKM_ECDSA_SHA512:
 		pInfo->flags = CKF_HW|CKF_SIGN|CKF_VERIFY;
 #else
 		pInfo->flags = CKF_HW|CKF_SIGN;
@@ -2984,6 +4542,10 @@ static int sc_hsm_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_P
 	case CKM_SHA512:
 		pInfo->flags = CKF_DIGEST;
 		break;
+	case CKM_SC_HSM_ENVELOPE_AES_GCM:
+	case CKM_SC_HSM_ENVELOPE_AES_CTR:
+		pInfo->flags = CKF_DECRYPT|CKF_ENCRYPT;
+		break;
 #endif
 	case CKM_AES_KEY_GEN:
 		pInfo->flags = CKF_HW|CKF_GENERATE;
@@ -3015,7 +4577,7 @@ struct p11TokenDriver *getSmartCardHSMTokenDriver()
 		0,
 		isCandidate,
 		newSmartCardHSMToken,
-		NULL,
+		sc_hsm_freeToken,
 		sc_hsm_C_GetMechanismList,
 		sc_hsm_C_GetMechanismInfo,
 		sc_hsm_login,
@@ -41,6 +41,7 @@
 #define MAX_EXT_APDU_LENGTH	1014
 #define MAX_FILES		128
 #define MAX_P15_SIZE		1024
+#define AES_CBC_CHUNK_SIZE	((MAX_EXT_APDU_LENGTH - 15) & ~0x0F)	/* Whole AES blocks that fit into a single command */
 
 #define PRKD_PREFIX		0xC4		/* Hi byte in file identifier for PKCS#15 PRKD objects */
 #define CD_PREFIX		0xC8		/* Hi byte in file identifier for PKCS#15 CD objects */
@@ -76,12 +77,16 @@
 #define ALGO_AES_CBC_ENCRYPT	0x10
 #define ALGO_AES_CBC_DECRYPT	0x11
 #define ALGO_AES_CMAC		0x18
+#define ALGO_AES_DERIVE		0x99		/* SP 800-56C key derivation */
 
 #define ID_USER_PIN		0x81		/* User PIN identifier */
 #define ID_SO_PIN		0x88		/* Security officer PIN identifier */
 
+struct keyPool;
+
 struct token_sc_hsm {
 	unsigned char sopin[8];
+	struct keyPool *keyPool;	/* Pool of pre-generated key pairs or NULL */
 };
 
 struct p11TokenDriver *sc_hsm_getDriver();
@@ -368,6 +368,8 @@ static int newDGNToken(struct p11Slot_t *slot, struct p11Token_t **token)
 	esign_token.isCandidate = isCandidate;
 	esign_token.newToken = newDGNToken;
 	esign_token.C_Sign = esign_C_Sign;
+	esign_token.C_SignUpdate = NULL;
+	esign_token.C_SignFinal = NULL;
 
 	rc = createStarcosToken(slot, &ptoken, &esign_token, &starcosApplications[1]);
 	if (rc != CKR_OK)
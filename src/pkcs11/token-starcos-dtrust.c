@@ -327,7 +327,7 @@ static int createDTrustToken(struct p11Slot_t *slot, struct p11Token_t **token,
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error loading objects from token");
 	}
 
-	rc = starcosCheckPINStatus(slot, sc->application->pinref);
+	rc = starcosCheckPINStatus(ptoken, sc->application->pinref);
 
 	if (rc < 0) {
 		freeToken(ptoken);
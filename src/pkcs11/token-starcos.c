@@ -41,6 +41,7 @@
 
 #include <pkcs11/slot.h>
 #include <pkcs11/object.h>
+#include <pkcs11/session.h>
 #include <pkcs11/token.h>
 #include <pkcs11/certificateobject.h>
 #include <pkcs11/privatekeyobject.h>
@@ -118,6 +119,49 @@ void starcosUnlock(struct p11Token_t *token)
 
 
 
+/**
+ * Return the session that owns the chained hash operation on the card. The state is kept
+ * in the base token, as virtual slots share the same card.
+ */
+static CK_SESSION_HANDLE *getHashSession(struct p11Token_t *token)
+{
+	if (token->slot->primarySlot) {
+		return &(starcosGetPrivateData(getBaseToken(token))->hashSession);
+	}
+	return &(starcosGetPrivateData(token)->hashSession);
+}
+
+
+
+/**
+ * Terminate a chained hash operation still open on the card, so that the next command
+ * is not taken as part of the chain
+ */
+static void starcosAbortHash(struct p11Token_t *token)
+{
+	CK_SESSION_HANDLE *hs;
+	unsigned short SW1SW2;
+	unsigned char scr[2] = { 0x80, 0x00 };
+
+	hs = getHashSession(token);
+
+	if (*hs == CK_INVALID_HANDLE) {
+		return;
+	}
+
+#ifdef DEBUG
+	debug("Terminate on-card hash of session %lu\n", *hs);
+#endif
+
+	transmitAPDU(token->slot, 0x00, 0x2A, 0x90, 0xA0,
+			2, scr,
+			0, NULL, 0, &SW1SW2);
+
+	*hs = CK_INVALID_HANDLE;
+}
+
+
+
 int starcosSwitchApplication(struct p11Token_t *token, struct starcosApplication *application)
 {
 	int rc, *sa;
@@ -126,6 +170,8 @@ int starcosSwitchApplication(struct p11Token_t *token, struct starcosApplication
 
 	FUNC_CALLED();
 
+	starcosAbortHash(token);
+
 	sc = starcosGetPrivateData(token);
 
 	if (token->slot->primarySlot) {
@@ -317,13 +363,25 @@ int starcosReadICCSN(struct p11Token_t *token)
 
 
 
-int starcosCheckPINStatus(struct p11Slot_t *slot, unsigned char pinref)
+/**
+ * Query the PIN status with a VERIFY command without data
+ *
+ * The caller must hold the token lock or the token must not yet be registered with the slot.
+ * A chained hash of another session is terminated, as the command would break the chain.
+ *
+ * @param token     The token to query
+ * @param pinref    The PIN reference
+ * @return          SW1/SW2 returned by the card or a negative value in case of a transmission error
+ */
+int starcosCheckPINStatus(struct p11Token_t *token, unsigned char pinref)
 {
 	int rc;
 	unsigned short SW1SW2;
 	FUNC_CALLED();
 
-	rc = transmitAPDU(slot, 0x00, 0x20, 0x00, pinref,
+	starcosAbortHash(token);
+
+	rc = transmitAPDU(token->slot, 0x00, 0x20, 0x00, pinref,
 			0, NULL,
 			0, NULL, 0, &SW1SW2);
 
@@ -603,12 +661,18 @@ static int getAlgorithmIdForDecryption(struct p11Token_t *token, CK_MECHANISM_TY
 
 
 
-int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned char *data, size_t len)
+/**
+ * Set the hash algorithm and open a chained hash operation on the card
+ *
+ * @param token     the token
+ * @param mech      the hash and sign mechanism
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int starcosHashStart(struct p11Token_t *token, CK_MECHANISM_TYPE mech)
 {
 	int rc;
-	size_t chunk;
 	unsigned short SW1SW2;
-	unsigned char scr[1008],*algo, *po;
+	unsigned char scr[2],*algo, *po;
 
 	FUNC_CALLED();
 
@@ -634,60 +698,129 @@ int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned cha
 		FUNC_FAILS(CKR_DEVICE_ERROR, "MANAGE SE failed");
 	}
 
-	if (len <= 1000) {
-		scr[0] = 0x90;
-		scr[1] = 0x00;
-		memcpy(scr + 2, data, len);
-		rc = asn1Encap(0x80, scr + 2, (int)len) + 2;
+	scr[0] = 0x90;
+	scr[1] = 0x00;
 
-		rc = transmitAPDU(token->slot, 0x00, 0x2A, 0x90, 0xA0,
-				rc, scr,
-				0, NULL, 0, &SW1SW2);
+	rc = transmitAPDU(token->slot, 0x10, 0x2A, 0x90, 0xA0,
+			2, scr,
+			0, NULL, 0, &SW1SW2);
 
-		if (rc < 0) {
-			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
-		}
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
 
-		if (SW1SW2 != 0x9000) {
-			FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
-		}
-	} else {
-		scr[0] = 0x90;
-		scr[1] = 0x00;
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
+	}
 
-		rc = transmitAPDU(token->slot, 0x10, 0x2A, 0x90, 0xA0,
-				2, scr,
-				0, NULL, 0, &SW1SW2);
+	FUNC_RETURNS(CKR_OK);
+}
 
-		if (rc < 0) {
-			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
-		}
 
-		if (SW1SW2 != 0x9000) {
-			FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
-		}
 
-		while (len > 0) {
-			chunk = (len > (size_t)token->drv->maxHashBlock ? (size_t)token->drv->maxHashBlock : len);
+/**
+ * Send a block of data to the chained hash operation on the card
+ *
+ * @param token     the token
+ * @param last      1 for the last block, which terminates the chain
+ * @param data      the data to hash, at most maxHashBlock bytes
+ * @param len       the length of the data. Must be a multiple of the hash block size for all but the last block
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int starcosHashBlock(struct p11Token_t *token, int last, unsigned char *data, size_t len)
+{
+	int rc;
+	unsigned short SW1SW2;
+	unsigned char scr[1008];
 
-			memcpy(scr, data, chunk);
-			rc = asn1Encap(0x80, scr, (int)chunk);
+	FUNC_CALLED();
 
-			rc = transmitAPDU(token->slot, len > chunk ? 0x10 : 0x00, 0x2A, 0x90, 0xA0,
-					rc, scr,
-					0, NULL, 0, &SW1SW2);
+	memcpy(scr, data, len);
+	rc = asn1Encap(0x80, scr, (int)len);
 
-			if (rc < 0) {
-				FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
-			}
+	rc = transmitAPDU(token->slot, last ? 0x00 : 0x10, 0x2A, 0x90, 0xA0,
+			rc, scr,
+			0, NULL, 0, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
 
-			if (SW1SW2 != 0x9000) {
-				FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned char *data, size_t len)
+{
+	int rc;
+	size_t chunk;
+	unsigned short SW1SW2;
+	unsigned char scr[1008],*algo, *po;
+
+	FUNC_CALLED();
+
+	if (len > 1000) {
+		rc = starcosHashStart(token, mech);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "starcosHashStart() failed");
+		}
+
+		while (len > 0) {
+			chunk = (len > (size_t)token->drv->maxHashBlock ? (size_t)token->drv->maxHashBlock : len);
+
+			rc = starcosHashBlock(token, len == chunk, data, chunk);
+			if (rc != CKR_OK) {
+				FUNC_FAILS(rc, "starcosHashBlock() failed");
 			}
 
 			len -= chunk;
 			data += chunk;
 		}
+		return CKR_OK;
+	}
+
+	rc = getAlgorithmIdForDigest(token, mech, &algo);
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "getAlgorithmIdForDigest() failed");
+	}
+
+	po = algo;
+	asn1Tag(&po);
+	rc = asn1Length(&po);
+	rc += (int)(po - algo);
+
+	rc = transmitAPDU(token->slot, 0x00, 0x22, 0x41, 0xAA,
+		rc, algo,
+		0, NULL, 0, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "MANAGE SE failed");
+	}
+
+	scr[0] = 0x90;
+	scr[1] = 0x00;
+	memcpy(scr + 2, data, len);
+	rc = asn1Encap(0x80, scr + 2, (int)len) + 2;
+
+	rc = transmitAPDU(token->slot, 0x00, 0x2A, 0x90, 0xA0,
+			rc, scr,
+			0, NULL, 0, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
 	}
 
 	return CKR_OK;
@@ -695,6 +828,29 @@ int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned cha
 
 
 
+/**
+ * Return true if the hash for the mechanism is calculated by the card
+ */
+static int isHashedOnCard(CK_MECHANISM_TYPE mech)
+{
+	switch(mech) {
+	case CKM_RSA_PKCS:
+	case CKM_RSA_PKCS_PSS:
+	case CKM_ECDSA:
+	case CKM_ECDSA_SHA1:
+	case CKM_SC_HSM_PSS_SHA1:
+	case CKM_SC_HSM_PSS_SHA224:
+	case CKM_SC_HSM_PSS_SHA256:
+	case CKM_SC_HSM_PSS_SHA384:
+	case CKM_SC_HSM_PSS_SHA512:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+
+
 static CK_RV starcos_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
 {
 	unsigned char *algotlv;
@@ -706,11 +862,88 @@ static CK_RV starcos_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR me
 
 
 
-static CK_RV starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+/**
+ * Set the signature key and compute the signature. The caller must hold the token lock.
+ *
+ * @param pObject           the private key
+ * @param mech              the mechanism
+ * @param pData             the data to sign or NULL if the hash was calculated by the card
+ * @param ulDataLen         the length of the data
+ * @param pSignature        the buffer receiving the signature
+ * @param pulSignatureLen   the size of the buffer, updated with the length of the signature
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static CK_RV starcosComputeSignature(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
 {
-	int rc, len, signaturelen;
+	int rc, len;
 	unsigned short SW1SW2;
 	unsigned char scr[256],*s, *d;
+
+	FUNC_CALLED();
+
+	rc = getAlgorithmIdForSigning(pObject->token, mech->mechanism, &s);
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "getAlgorithmIdForSigning() failed");
+	}
+
+	d = scr;
+	*d++ = *s++;
+	len = *s;
+	*d++ = *s++;
+	while (len--) {
+		*d++ = *s++;
+	}
+	*d++ = 0x84;
+	*d++ = 0x01;
+	*d++ = (unsigned char)pObject->tokenid;
+
+	rc = transmitAPDU(pObject->token->slot, 0x00, 0x22, 0x41, 0xB6,
+		(int)(d - scr), scr,
+		0, NULL, 0, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if (SW1SW2 != 0x9000) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "MANAGE SE failed");
+	}
+
+	rc = transmitAPDU(pObject->token->slot, 0x00, 0x2A, 0x9E, 0x9A,
+			ulDataLen, pData,
+			0, pSignature, *pulSignatureLen, &SW1SW2);
+
+	if (rc < 0) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	}
+
+	if (SW1SW2 != 0x9000) {
+		switch(SW1SW2) {
+		case 0x6A81:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Signature operation not allowed for key");
+			break;
+		case 0x6982:
+			pObject->token->user = INT_CKU_NO_USER;
+			FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
+			break;
+		}
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+	}
+
+	*pulSignatureLen = rc;
+
+	if ((pObject->token->user == CKU_USER) && (pObject->token->pinUseCounter == 1)) {
+		pObject->token->user = INT_CKU_NO_USER;
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static CK_RV starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	int rc, signaturelen;
 	struct p11Slot_t *slot;
 
 	FUNC_CALLED();
@@ -743,9 +976,7 @@ static CK_RV starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech,
 		FUNC_FAILS(CKR_DEVICE_ERROR, "selecting application failed");
 	}
 
-	if ((mech->mechanism != CKM_RSA_PKCS) && (mech->mechanism != CKM_RSA_PKCS_PSS) && (mech->mechanism != CKM_ECDSA) && (mech->mechanism != CKM_ECDSA_SHA1) &&
-		(mech->mechanism != CKM_SC_HSM_PSS_SHA1) && (mech->mechanism != CKM_SC_HSM_PSS_SHA224) &&
-		(mech->mechanism != CKM_SC_HSM_PSS_SHA256) && (mech->mechanism != CKM_SC_HSM_PSS_SHA384)  && (mech->mechanism != CKM_SC_HSM_PSS_SHA512)) {
+	if (isHashedOnCard(mech->mechanism)) {
 		rc = starcosDigest(pObject->token, mech->mechanism, pData, ulDataLen);
 		if (rc != CKR_OK) {
 			starcosUnlock(pObject->token);
@@ -755,73 +986,162 @@ static CK_RV starcos_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_PTR mech,
 		ulDataLen = 0;
 	}
 
-	rc = getAlgorithmIdForSigning(pObject->token, mech->mechanism, &s);
-	if (rc != CKR_OK) {
-		starcosUnlock(pObject->token);
-		FUNC_FAILS(rc, "getAlgorithmIdForSigning() failed");
+	rc = starcosComputeSignature(pObject, mech, pData, ulDataLen, pSignature, pulSignatureLen);
+
+	starcosUnlock(pObject->token);
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Stream data into a chained hash operation on the card.
+ *
+ * Input is collected until more than maxHashBlock bytes are available. Then the hash is opened
+ * on the card and full blocks are send with command chaining. The remaining partial block is
+ * kept in the operation and send with the last command in C_SignFinal.
+ */
+static CK_RV starcos_C_SignUpdate(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	int rc;
+	CK_ULONG blocksize, fill;
+	CK_SESSION_HANDLE *hs;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	blocksize = (CK_ULONG)pObject->token->drv->maxHashBlock;
+
+	if (!isHashedOnCard(mech->mechanism) || (op->cryptoBufferSize + ulPartLen <= blocksize)) {
+		FUNC_RETURNS(appendToCryptoBuffer(op, pPart, ulPartLen));
 	}
 
-	d = scr;
-	*d++ = *s++;
-	len = *s;
-	*d++ = *s++;
-	while (len--) {
-		*d++ = *s++;
+	slot = pObject->token->slot;
+	starcosLock(pObject->token);
+	if (!slot->token) {
+		starcosUnlock(pObject->token);
+		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
-	*d++ = 0x84;
-	*d++ = 0x01;
-	*d++ = (unsigned char)pObject->tokenid;
 
-	rc = transmitAPDU(pObject->token->slot, 0x00, 0x22, 0x41, 0xB6,
-		(int)(d - scr), scr,
-		0, NULL, 0, &SW1SW2);
+	hs = getHashSession(pObject->token);
 
-	if (rc < 0) {
+	if (op->cryptoProcessed == 0) {
+		rc = starcosSelectApplication(pObject->token);
+		if (rc < 0) {
+			starcosUnlock(pObject->token);
+			FUNC_FAILS(CKR_DEVICE_ERROR, "selecting application failed");
+		}
+
+		rc = starcosHashStart(pObject->token, mech->mechanism);
+		if (rc != CKR_OK) {
+			starcosUnlock(pObject->token);
+			FUNC_FAILS(rc, "starcosHashStart() failed");
+		}
+		*hs = op->session->handle;
+	} else if (*hs != op->session->handle) {
 		starcosUnlock(pObject->token);
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		FUNC_FAILS(CKR_FUNCTION_FAILED, "Hash operation on card was terminated by other operation");
 	}
 
-	if (SW1SW2 != 0x9000) {
-		starcosUnlock(pObject->token);
-		FUNC_FAILS(CKR_DEVICE_ERROR, "MANAGE SE failed");
+	if (op->cryptoBufferSize > 0) {
+		fill = blocksize - op->cryptoBufferSize;
+		rc = appendToCryptoBuffer(op, pPart, fill);
+		if (rc != CKR_OK) {
+			starcosUnlock(pObject->token);
+			FUNC_FAILS(rc, "appendToCryptoBuffer() failed");
+		}
+		pPart += fill;
+		ulPartLen -= fill;
+
+		rc = starcosHashBlock(pObject->token, 0, op->cryptoBuffer, blocksize);
+		if (rc != CKR_OK) {
+			*hs = CK_INVALID_HANDLE;
+			starcosUnlock(pObject->token);
+			FUNC_FAILS(rc, "starcosHashBlock() failed");
+		}
+		op->cryptoProcessed += blocksize;
+		op->cryptoBufferSize = 0;
 	}
 
-	rc = transmitAPDU(pObject->token->slot, 0x00, 0x2A, 0x9E, 0x9A,
-			ulDataLen, pData,
-			0, pSignature, *pulSignatureLen, &SW1SW2);
+	// Keep at least one byte for the last command in the chain
+	while (ulPartLen > blocksize) {
+		rc = starcosHashBlock(pObject->token, 0, pPart, blocksize);
+		if (rc != CKR_OK) {
+			*hs = CK_INVALID_HANDLE;
+			starcosUnlock(pObject->token);
+			FUNC_FAILS(rc, "starcosHashBlock() failed");
+		}
+		op->cryptoProcessed += blocksize;
+		pPart += blocksize;
+		ulPartLen -= blocksize;
+	}
+
+	starcosUnlock(pObject->token);
+
+	FUNC_RETURNS(appendToCryptoBuffer(op, pPart, ulPartLen));
+}
+
 
+
+static CK_RV starcos_C_SignFinal(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	int rc, signaturelen;
+	CK_SESSION_HANDLE *hs;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (!isHashedOnCard(mech->mechanism) || (op->cryptoProcessed == 0)) {
+		FUNC_RETURNS(starcos_C_Sign(pObject, mech, op->cryptoBuffer, op->cryptoBufferSize, pSignature, pulSignatureLen));
+	}
+
+	rc = getSignatureSize(mech->mechanism, pObject);
 	if (rc < 0) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Unknown mechanism");
+	}
+	signaturelen = rc;
+
+	if (pSignature == NULL) {
+		*pulSignatureLen = signaturelen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (*pulSignatureLen < (CK_ULONG)signaturelen) {
+		*pulSignatureLen = signaturelen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "Signature length is larger than buffer");
+	}
+
+	slot = pObject->token->slot;
+	starcosLock(pObject->token);
+	if (!slot->token) {
 		starcosUnlock(pObject->token);
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		FUNC_RETURNS(CKR_DEVICE_REMOVED);
 	}
 
-	if (SW1SW2 != 0x9000) {
+	hs = getHashSession(pObject->token);
+
+	if (*hs != op->session->handle) {
 		starcosUnlock(pObject->token);
-		switch(SW1SW2) {
-		case 0x6A81:
-			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Signature operation not allowed for key");
-			break;
-		case 0x6982:
-			pObject->token->user = INT_CKU_NO_USER;
-			FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
-			break;
-		}
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+		FUNC_FAILS(CKR_FUNCTION_FAILED, "Hash operation on card was terminated by other operation");
 	}
 
-	*pulSignatureLen = rc;
+	rc = starcosHashBlock(pObject->token, 1, op->cryptoBuffer, op->cryptoBufferSize);
+	*hs = CK_INVALID_HANDLE;
 
-	if ((pObject->token->user == CKU_USER) && (pObject->token->pinUseCounter == 1)) {
-		pObject->token->user = INT_CKU_NO_USER;
+	if (rc != CKR_OK) {
+		starcosUnlock(pObject->token);
+		FUNC_FAILS(rc, "starcosHashBlock() failed");
 	}
 
+	rc = starcosComputeSignature(pObject, mech, NULL, 0, pSignature, pulSignatureLen);
+
 	starcosUnlock(pObject->token);
-	FUNC_RETURNS(CKR_OK);
+	FUNC_RETURNS(rc);
 }
 
 
 
-static CK_RV starcos_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+static CK_RV starcos_C_DecryptInit(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech)
 {
 	unsigned char *algotlv;
 
@@ -832,7 +1152,7 @@ static CK_RV starcos_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR
 
 
 
-static CK_RV starcos_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+static CK_RV starcos_C_Decrypt(struct p11Object_t *pObject, struct p11Operation_t *op, CK_MECHANISM_PTR mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	int rc, len;
 	unsigned char *d,*s;
@@ -940,13 +1260,24 @@ static CK_RV starcos_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_PTR mec
 
 static int starcos_C_GenerateRandom(struct p11Slot_t *slot, CK_BYTE_PTR rnd, CK_ULONG rndlen)
 {
+	struct p11Token_t *token;
 	unsigned short SW1SW2;
 	CK_ULONG maxblk;
 	int rc;
 
 	FUNC_CALLED();
 
-	maxblk = slot->token->drv->maxRAPDU - 2;		// Maximum block size
+	token = slot->token;
+	starcosLock(token);
+	if (!slot->token) {
+		starcosUnlock(token);
+		FUNC_RETURNS(CKR_DEVICE_REMOVED);
+	}
+
+	// GET CHALLENGE would break a chained hash of another session, so terminate it
+	starcosAbortHash(token);
+
+	maxblk = token->drv->maxRAPDU - 2;		// Maximum block size
 	while (rndlen > 0) {
 		if (rndlen < maxblk) {
 			maxblk = rndlen;
@@ -956,16 +1287,19 @@ static int starcos_C_GenerateRandom(struct p11Slot_t *slot, CK_BYTE_PTR rnd, CK_
 				maxblk, rnd, rndlen, &SW1SW2);
 
 		if (rc < 0) {
+			starcosUnlock(token);
 			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
 		}
 
 		if (SW1SW2 != 0x9000) {
+			starcosUnlock(token);
 			FUNC_FAILS(CKR_DEVICE_ERROR, "device reported error");
 		}
 		rndlen -= rc;
 		rnd += rc;
 	}
 
+	starcosUnlock(token);
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -1029,6 +1363,8 @@ int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDes
 
 	p11prikey->C_SignInit = token->drv->C_SignInit;
 	p11prikey->C_Sign = token->drv->C_Sign;
+	p11prikey->C_SignUpdate = token->drv->C_SignUpdate;
+	p11prikey->C_SignFinal = token->drv->C_SignFinal;
 	p11prikey->C_DecryptInit = token->drv->C_DecryptInit;
 	p11prikey->C_Decrypt = token->drv->C_Decrypt;
 
@@ -1276,7 +1612,7 @@ static int initpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
 		FUNC_FAILS(CKR_PIN_INCORRECT, "Invalid SO-PIN");
 	}
 
-	rc = starcosCheckPINStatus(slot, pinref);
+	rc = starcosCheckPINStatus(slot->token, pinref);
 
 	if (rc < 0) {
 		starcosUnlock(slot->token);
@@ -1478,7 +1814,7 @@ int createStarcosToken(struct p11Slot_t *slot, struct p11Token_t **token, struct
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error loading objects from token");
 	}
 
-	rc = starcosCheckPINStatus(slot, sc->application->pinref);
+	rc = starcosCheckPINStatus(ptoken, sc->application->pinref);
 
 	if (rc < 0) {
 		freeToken(ptoken);
@@ -1624,15 +1960,15 @@ struct p11TokenDriver *getStarcosTokenDriver()
 		initpin,
 		setpin,
 
-		starcos_C_DecryptInit,		// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-		starcos_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		starcos_C_DecryptInit,		// int (*C_DecryptInit)  (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_PTR);
+		starcos_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
 		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
 		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 		starcos_C_SignInit,		// int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
 		starcos_C_Sign,			// int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
-		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+		starcos_C_SignUpdate,		// int (*C_SignUpdate)   (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+		starcos_C_SignFinal,		// int (*C_SignFinal)    (struct p11Object_t *, struct p11Operation_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 		NULL,
 		NULL,				// int (*C_GenerateKeyPair)  (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **, struct p11Object_t **);
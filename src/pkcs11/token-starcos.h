@@ -60,6 +60,7 @@ struct starcosApplication {
 struct starcosPrivateData {
 	struct starcosApplication   *application;
 	int                         selectedApplication;
+	CK_SESSION_HANDLE           hashSession;
 	unsigned char               sopin[8];
 };
 
@@ -69,7 +70,7 @@ void starcosUnlock(struct p11Token_t *token);
 int starcosSwitchApplication(struct p11Token_t *token, struct starcosApplication *application);
 int starcosSelectApplication(struct p11Token_t *token);
 int starcosReadTLVEF(struct p11Token_t *token, bytestring fid, unsigned char *content, size_t len);
-int starcosCheckPINStatus(struct p11Slot_t *slot, unsigned char pinref);
+int starcosCheckPINStatus(struct p11Token_t *token, unsigned char pinref);
 int starcosUpdatePinStatus(struct p11Token_t *token, int pinstatus);
 int starcosAddCertificateObject(struct p11Token_t *token, struct p15CertificateDescription *p15);
 int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15);
@@ -45,6 +45,12 @@
 
 #include <pkcs11/token-sc-hsm.h>
 
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/drbg.h>
+#include <pkcs11/envelope.h>
+#include <pkcs11/sigcache.h>
+#endif
+
 #ifdef DEBUG
 #include <common/debug.h>
 #endif
@@ -398,6 +404,12 @@ int destroyObject(struct p11Slot_t *slot, struct p11Object_t *object)
 		return CKR_FUNCTION_NOT_SUPPORTED;
 	}
 
+#ifdef ENABLE_LIBCRYPTO
+	// A new key may later be generated with the same key reference and CKA_ID
+	envelopeFlush(slot->token);
+	sigCacheFlush(slot->token);
+#endif
+
 	return slot->token->drv->destroyObject(slot, object);
 }
 
@@ -575,6 +587,11 @@ int logOut(struct p11Slot_t *slot)
 {
 	slot->token->user = INT_CKU_NO_USER;
 
+#ifdef ENABLE_LIBCRYPTO
+	envelopeFlush(slot->token);
+	sigCacheFlush(slot->token);
+#endif
+
 	return slot->token->drv->logout(slot);
 }
 
@@ -695,6 +712,11 @@ void freeToken(struct p11Token_t *token)
 
 		removePrivateObjects(token);
 		removePublicObjects(token);
+#ifdef ENABLE_LIBCRYPTO
+		drbgFree(token);
+		envelopeFree(token);
+		sigCacheFree(token);
+#endif
 		p11DestroyMutex(token->mutex);
 		free(token);
 	}
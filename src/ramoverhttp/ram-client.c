@@ -53,12 +53,17 @@ static char *optReader = NULL;
 static char *optURL = NULL;
 static char *optPin = NULL;
 static int optVerbose = 0;
+static int optHTTP2 = 0;
+static int optAllReaders = 0;
 
 
 struct localContext {
 	LPSTR reader;
 	SCARDCONTEXT scardContext;
 	SCARDHANDLE card;
+	unsigned char atr[36];			// Used with --all only
+	DWORD atrlen;
+	int failed;
 };
 
 
@@ -194,6 +199,8 @@ void usage()
 	puts("  -r, --reader         Select reader name");
 	puts("  -l, --list-readers   List available card readers");
 	puts("  -v, --verbose        Tell us what you do");
+	puts("  -a, --all            Run sessions concurrently with the cards in all readers");
+	puts("      --http2          Use HTTP/2 if supported by the server");
 }
 
 
@@ -228,6 +235,10 @@ void decodeArgs(int argc, char **argv)
 			optListReaders = 1;
 		} else if (!strcmp(*argv, "--verbose") || !strcmp(*argv, "-v")) {
 			optVerbose = 1;
+		} else if (!strcmp(*argv, "--all") || !strcmp(*argv, "-a")) {
+			optAllReaders = 1;
+		} else if (!strcmp(*argv, "--http2")) {
+			optHTTP2 = 1;
 		} else if (**argv == '-') {
 			printf("Unknown argument %s\n", *argv);
 			usage();
@@ -402,6 +413,183 @@ static void verifyPIN(SCARDHANDLE card) {
 
 
 
+static void printResult(int rc)
+{
+	switch(rc) {
+	case RAME_OK:
+		printf("Completed\n");
+		break;
+	case RAME_OUT_OF_MEMORY:
+		printf("Out of memory error\n");
+		break;
+	case RAME_INVALID_TLV:
+		printf("Invalid TLV encoding in request from server\n");
+		break;
+	case RAME_INVALID_REQ:
+		printf("Server request invalid. Is the server URL a valid RAMOverHTTP end-point ?\n");
+		break;
+	case RAME_CARD_ERROR:
+		printf("Card communication error\n");
+		break;
+	case RAME_HOST_NOT_FOUND:
+		printf("Host not found\n");
+		break;
+	case RAME_INVALID_URL:
+		printf("URL is invalid or not found on server\n");
+		break;
+	case RAME_CONNECT_FAILED:
+		printf("Connection to host failed\n");
+		break;
+	case RAME_CURL_ERROR:
+		printf("Networking error\n");
+		break;
+	case RAME_NO_CONNECT:
+		printf("Server did not initiate connection to card. See server log for details\n");
+		break;
+	case RAME_SERVER_ABORT:
+		printf("Server aborted connection to card. See server log for details\n");
+		break;
+	case RAME_HTTP_CODE:
+		printf("Server send unexpected HTTP code\n");
+		break;
+	default:
+		printf("Error %d\n", rc);
+		break;
+	}
+}
+
+
+
+static void sessionDone(struct ramContext *ctx, int rc) {
+	struct localContext *lctx = (struct localContext *)ramGetUserObject(ctx);
+
+	printf("%s: ", lctx->reader);
+	printResult(rc);
+	fflush(stdout);
+
+	if (rc != 0)
+		lctx->failed = 1;
+}
+
+
+
+/**
+ * Run a session with the card in each reader. Every reader uses its own PC/SC context,
+ * as the card call-backs of all readers run in parallel
+ */
+static int runAllReaders(LPTSTR readers)
+{
+	struct ramMulti *multi;
+	struct localContext *lctx;
+	struct ramContext **ctx;
+	DWORD dwActiveProtocol;
+	DWORD readernamelen, state, protocol;
+	LPTSTR p;
+	LONG scrc;
+	int i, cnt, sessions, rc;
+
+	cnt = 0;
+	for (p = readers; *p != '\0'; p += strlen(p) + 1)
+		cnt++;
+
+	sessions = 0;
+	rc = RAME_OK;
+
+	lctx = calloc(cnt, sizeof(struct localContext));
+	ctx = calloc(cnt, sizeof(struct ramContext *));
+
+	if ((lctx == NULL) || (ctx == NULL) || (ramNewMulti(&multi) < 0)) {
+		printf("Out of memory error\n");
+		exit(1);
+	}
+
+	for (i = 0, p = readers; i < cnt; i++, p += strlen(p) + 1) {
+		lctx[i].reader = p;
+
+		scrc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &lctx[i].scardContext);
+
+		if (scrc != SCARD_S_SUCCESS) {
+			printf("Could not establish context to PC/SC manager (%s)\n", pcsc_error_to_string(scrc));
+			exit(1);
+		}
+
+		scrc = SCardConnect(lctx[i].scardContext, p, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &lctx[i].card, &dwActiveProtocol);
+
+		if (scrc != SCARD_S_SUCCESS) {
+			if (optVerbose)
+				printf("%s: Could not connect to card (%s)\n", p, pcsc_error_to_string(scrc));
+			continue;
+		}
+
+		readernamelen = 0;
+		lctx[i].atrlen = sizeof(lctx[i].atr);
+		scrc = SCardStatus(lctx[i].card, NULL, &readernamelen, &state, &protocol, lctx[i].atr, &lctx[i].atrlen);
+
+		if (scrc != SCARD_S_SUCCESS) {
+			printf("%s: Could not query card status (%s)\n", p, pcsc_error_to_string(scrc));
+			SCardDisconnect(lctx[i].card, SCARD_UNPOWER_CARD);
+			continue;
+		}
+
+		if (optPin != NULL) {
+			verifyPIN(lctx[i].card);
+		}
+
+		if (ramNewContext(&ctx[i]) < 0) {
+			printf("%s: Could not create RAM context\n", p);
+			SCardDisconnect(lctx[i].card, SCARD_UNPOWER_CARD);
+			rc = RAME_GENERAL_ERROR;
+			continue;
+		}
+
+		ramSetSendApduHandler(ctx[i], sendApdu);
+		ramSetNotifyHandler(ctx[i], notify);
+		ramSetResetHandler(ctx[i], reset);
+		ramSetDoneHandler(ctx[i], sessionDone);
+		ramSetUserObject(ctx[i], (void *)&lctx[i]);
+		ramSetURL(ctx[i], optURL);
+		ramSetATR(ctx[i], lctx[i].atr, lctx[i].atrlen);
+		ramSetOptions(ctx[i], optHTTP2 ? RAM_OPT_HTTP2 : 0);
+
+		if (ramMultiAdd(multi, ctx[i]) < 0) {
+			printf("%s: Could not add session\n", p);
+			ramFreeContext(&ctx[i]);
+			SCardDisconnect(lctx[i].card, SCARD_UNPOWER_CARD);
+			rc = RAME_GENERAL_ERROR;
+			continue;
+		}
+
+		sessions++;
+	}
+
+	if (sessions > 0) {
+		if (ramMultiRun(multi) < 0) {
+			rc = RAME_GENERAL_ERROR;
+		}
+	} else {
+		printf("No session could be started\n");
+		rc = RAME_GENERAL_ERROR;
+	}
+
+	ramFreeMulti(&multi);
+
+	for (i = 0; i < cnt; i++) {
+		if (ctx[i] != NULL) {
+			ramFreeContext(&ctx[i]);
+			SCardDisconnect(lctx[i].card, SCARD_UNPOWER_CARD);
+			if (lctx[i].failed)
+				rc = RAME_GENERAL_ERROR;
+		}
+		SCardReleaseContext(lctx[i].scardContext);
+	}
+
+	free(ctx);
+	free(lctx);
+	return rc;
+}
+
+
+
 int main(int argc, char **argv)
 {
 	struct ramContext *ctx;
@@ -440,6 +628,16 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (optAllReaders && !optListReaders) {
+		if (optURL == NULL) {
+			printf("No URL defined\n");
+			exit(1);
+		}
+		rc = runAllReaders(readers);
+		SCardReleaseContext(lctx.scardContext);
+		exit(rc == 0 ? 0 : 1);
+	}
+
 	if (!optReader)
 		optReader = readers;
 
@@ -484,6 +682,7 @@ int main(int argc, char **argv)
 		ramSetUserObject(ctx, (void *)&lctx);
 		ramSetURL(ctx, optURL);
 		ramSetATR(ctx, atr, atrlen);
+		ramSetOptions(ctx, optHTTP2 ? RAM_OPT_HTTP2 : 0);
 		rc = ramConnect(ctx);
 		ramFreeContext(&ctx);
 	} else {
@@ -494,47 +693,7 @@ int main(int argc, char **argv)
 	SCardDisconnect(lctx.card, SCARD_UNPOWER_CARD);
 	SCardReleaseContext(lctx.scardContext);
 
-	switch(rc) {
-	case RAME_OK:
-		printf("Completed\n");
-		break;
-	case RAME_OUT_OF_MEMORY:
-		printf("Out of memory error\n");
-		break;
-	case RAME_INVALID_TLV:
-		printf("Invalid TLV encoding in request from server\n");
-		break;
-	case RAME_INVALID_REQ:
-		printf("Server request invalid. Is the server URL a valid RAMOverHTTP end-point ?\n");
-		break;
-	case RAME_CARD_ERROR:
-		printf("Card communication error\n");
-		break;
-	case RAME_HOST_NOT_FOUND:
-		printf("Host not found\n");
-		break;
-	case RAME_INVALID_URL:
-		printf("URL is invalid or not found on server\n");
-		break;
-	case RAME_CONNECT_FAILED:
-		printf("Connection to host failed\n");
-		break;
-	case RAME_CURL_ERROR:
-		printf("Networking error\n");
-		break;
-	case RAME_NO_CONNECT:
-		printf("Server did not initiate connection to card. See server log for details\n");
-		break;
-	case RAME_SERVER_ABORT:
-		printf("Server aborted connection to card. See server log for details\n");
-		break;
-	case RAME_HTTP_CODE:
-		printf("Server send unexpected HTTP code\n");
-		break;
-	default:
-		printf("Error %d\n", rc);
-		break;
-	}
+	printResult(rc);
 
 	exit(rc == 0 ? 0 : 1);
 }
@@ -36,10 +36,114 @@
 #include <stdlib.h>
 
 #include <common/memset_s.h>
+#include <common/mutex.h>
 #include "ramoverhttp.h"
 
 #include <curl/curl.h>
 
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+/*
+ * curl_multi_poll() and curl_multi_wakeup() are available since libcurl 7.68
+ */
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define RAM_MULTI_WAKEUP
+#endif
+
+/*
+ * Initial size of read and write buffer, which is sufficient for most requests and responses
+ */
+#define RAM_BUFFER_SIZE		8192
+
+/*
+ * Upper bound for allocating the read buffer in advance from the Content-Length of a response
+ */
+#define RAM_MAX_PREALLOC	(1024 * 1024)
+
+/*
+ * Number of idle connections kept open. The default of libcurl is too small for the shared
+ * connection cache, if many contexts run sessions in parallel
+ */
+#define RAM_MAX_CONNECTIONS	64
+
+/*
+ * Number of locks for data shared between CURL handles, indexed by curl_lock_data
+ */
+#define RAM_SHARE_LOCKS		8
+
+/*
+ * DNS cache, TLS sessions and, with libcurl 7.57 and later, connections are shared between
+ * all contexts, so that a new context does not need a new TCP connection and full TLS handshake
+ */
+static CURLSH *share = NULL;
+static int shareUsers = 0;
+static STATIC_MUTEX shareLock = STATIC_MUTEX_INITIALIZER;
+static STATIC_MUTEX shareDataLocks[RAM_SHARE_LOCKS] = {
+	STATIC_MUTEX_INITIALIZER, STATIC_MUTEX_INITIALIZER, STATIC_MUTEX_INITIALIZER, STATIC_MUTEX_INITIALIZER,
+	STATIC_MUTEX_INITIALIZER, STATIC_MUTEX_INITIALIZER, STATIC_MUTEX_INITIALIZER, STATIC_MUTEX_INITIALIZER
+};
+
+/*
+ * Maximum time in milliseconds the engine of a ramMulti waits for network or worker events.
+ * libcurl before 7.68 can not be woken up by a worker, so the interval also limits the delay
+ * for sending the response of a card to the server
+ */
+#ifdef RAM_MULTI_WAKEUP
+#define RAM_POLL_INTERVAL	1000
+#else
+#define RAM_POLL_INTERVAL	10
+#endif
+
+/*
+ * State of a session run by a ramMulti
+ */
+#define RAM_SESSION_IDLE	0		// No session active
+#define RAM_SESSION_QUEUED	1		// Added, but not yet started by the engine
+#define RAM_SESSION_HTTP	2		// Request send to the server, waiting for the response
+#define RAM_SESSION_CARD	3		// Worker processes requests of the server with the card
+#define RAM_SESSION_CARDDONE	4		// Worker completed, response ready for the engine
+
+/*
+ * Worker of a ramMulti, which runs the card related call-backs of a single context. With one
+ * worker per reader, card communication of all readers and the HTTP transfers run in parallel
+ */
+struct ramWorker {
+	struct ramMulti *multi;
+	struct ramContext *ctx;
+	int state;					// RAM_SESSION_*, protected by the lock of the ramMulti
+	int rc;						// Result of the session so far
+	int excnt;					// Number of requests received from the server
+	int stop;
+	int running;
+#ifdef _WIN32
+	HANDLE thread;
+	CONDITION_VARIABLE signal;
+#else
+	pthread_t thread;
+	pthread_cond_t signal;
+#endif
+	struct ramWorker *next;
+};
+
+/*
+ * Engine driving the HTTP transfers of many contexts from a single thread using the multi interface of libcurl
+ */
+struct ramMulti {
+	CURLM *curlm;
+	struct ramWorker *workers;	// List of workers, one per context ever added
+	int active;					// Number of sessions not in state RAM_SESSION_IDLE
+	int events;					// Number of state changes not yet seen by the engine
+#ifdef _WIN32
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE signal;
+#else
+	pthread_mutex_t lock;
+	pthread_cond_t signal;
+#endif
+};
+
 
 
 /**
@@ -68,14 +172,17 @@ static int initByteBuffer(struct ramByteBuffer *bb, size_t size) {
  * @return 0 or error code
  */
 static int adjustByteBuffer(struct ramByteBuffer *bb, size_t increment) {
+	unsigned char *p;
+
 	if (bb->len + increment > bb->size) {
 		do {
 			bb->size <<= 1;
 		} while (bb->len + increment > bb->size);
 
-		bb->buffer = realloc(bb->buffer, bb->size);
-		if (bb->buffer == NULL)
+		p = realloc(bb->buffer, bb->size);
+		if (p == NULL)
 			return RAME_OUT_OF_MEMORY;
+		bb->buffer = p;
 	}
 	return 0;
 }
@@ -130,11 +237,13 @@ static int insertByteBuffer(struct ramByteBuffer *bb, unsigned char *data, size_
 /**
  * Clear the byte buffer
  *
+ * Only the content is wiped, as the buffer beyond the length has not been used since the last clear
+ *
  * @param bb The byte buffer structure
  * @return 0 or error code
  */
 static void clearByteBuffer(struct ramByteBuffer *bb) {
-	memset_s(bb->buffer, bb->size, 0, bb->size);
+	memset_s(bb->buffer, bb->size, 0, bb->len);
 	bb->len = 0;
 }
 
@@ -506,6 +615,21 @@ static size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp) {
 	struct ramContext *c = (struct ramContext *)userp;
 	size_t len = size * nmemb;
 
+	// Allocate the buffer for the complete response with the first block
+	if (c->readbuffer.len == 0) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+		curl_off_t cl = -1;
+
+		curl_easy_getinfo(c->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &cl);
+#else
+		double cl = -1;
+
+		curl_easy_getinfo(c->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &cl);
+#endif
+		if ((cl > 0) && (cl <= RAM_MAX_PREALLOC) && (adjustByteBuffer(&c->readbuffer, (size_t)cl) < 0))
+			return 0;
+	}
+
 	if (addByteBuffer(&c->readbuffer, buffer, len) < 0)
 		return 0;
 
@@ -514,6 +638,230 @@ static size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp) {
 
 
 
+static void lockShare(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+	static_mutex_lock(&shareDataLocks[data % RAM_SHARE_LOCKS]);
+}
+
+
+
+static void unlockShare(CURL *handle, curl_lock_data data, void *userptr) {
+	static_mutex_unlock(&shareDataLocks[data % RAM_SHARE_LOCKS]);
+}
+
+
+
+/**
+ * Obtain a reference to the share handle, which is created for the first context
+ */
+static void acquireShare(void) {
+	static_mutex_lock(&shareLock);
+
+	if (shareUsers == 0) {
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+
+		share = curl_share_init();
+		if (share != NULL) {
+			curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+			curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+			curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+		}
+	}
+	shareUsers++;
+
+	static_mutex_unlock(&shareLock);
+}
+
+
+
+/**
+ * Release the reference to the share handle, which is removed with the last context.
+ * All CURL handles using it must have been cleaned up before
+ */
+static void releaseShare(void) {
+	static_mutex_lock(&shareLock);
+
+	if (--shareUsers == 0) {
+		if (share != NULL) {
+			curl_share_cleanup(share);
+			share = NULL;
+		}
+		curl_global_cleanup();
+	}
+
+	static_mutex_unlock(&shareLock);
+}
+
+
+
+/**
+ * Create the CURL handle of the context, which is kept for all sessions run with the context
+ *
+ * @param ctx The initialized context
+ * @return 0 or error code
+ */
+static int initCurlHandle(struct ramContext *ctx) {
+	struct curl_slist *headers = NULL, *h;
+	CURL *curl;
+
+	curl = curl_easy_init();
+	if (curl == NULL)
+		return RAME_CURL_ERROR;
+
+	h = curl_slist_append(headers, "Content-Type: application/org.openscdp-content-mgt-response;version=1.0");
+	if (h != NULL)
+		h = curl_slist_append(headers = h, "Accept: */*");
+	if (h != NULL)
+		h = curl_slist_append(headers = h, "X-Admin-Protocol: openscdp-remote-admin/1.0");
+	if (h != NULL)
+		h = curl_slist_append(headers = h, "Expect:");		// No extra round trip for 100-continue on larger requests
+
+	if (h == NULL) {
+		curl_slist_free_all(headers);
+		curl_easy_cleanup(curl);
+		return RAME_OUT_OF_MEMORY;
+	}
+	headers = h;
+
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, ctx);
+	curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 40L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, (long)RAM_MAX_CONNECTIONS);
+
+	if (share != NULL)
+		curl_easy_setopt(curl, CURLOPT_SHARE, share);
+
+	ctx->curl = curl;
+	ctx->headers = headers;
+	return 0;
+}
+
+
+
+/**
+ * Map the result of a CURL transfer to an error code
+ *
+ * @param res The CURL result
+ * @param rc The error code retained if the transfer succeeded
+ * @return 0 or error code
+ */
+static int curlResult(CURLcode res, int rc) {
+	switch(res) {
+	case CURLE_OK:
+		break;
+	case CURLE_COULDNT_RESOLVE_HOST:
+		rc = RAME_HOST_NOT_FOUND;
+		break;
+	case CURLE_URL_MALFORMAT:
+		rc = RAME_INVALID_URL;
+		break;
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_COULDNT_CONNECT:
+		rc = RAME_CONNECT_FAILED;
+		break;
+	case CURLE_OPERATION_TIMEDOUT:
+		rc = RAME_TIMEOUT;
+		break;
+	default:
+		rc = RAME_CURL_ERROR;
+		break;
+	}
+	return rc;
+}
+
+
+
+/**
+ * Map the HTTP code that terminated the session to the result of the session
+ *
+ * @param httpcode The HTTP code of the last response
+ * @param excnt The number of requests received from the server
+ * @param rc The error code of the session so far
+ * @return 0 or error code
+ */
+static int httpResult(long httpcode, int excnt, int rc) {
+	switch(httpcode) {
+	case 0:
+		break;
+	case 504:			// Gateway timeout
+		if (excnt)
+			rc = RAME_SERVER_ABORT;
+		else
+			rc = RAME_NO_CONNECT;
+		break;
+	case 200:			// New request, but aborted
+	case 204:			// Completed
+		break;
+	case 404:
+		rc = RAME_INVALID_URL;
+		break;
+	default:
+		printf("Server HTTP code %ld\n", httpcode);
+		rc = RAME_HTTP_CODE;
+	}
+	return rc;
+}
+
+
+
+/**
+ * Prepare the CURL handle and the initiation request for a new session
+ *
+ * @param ctx The initialized context
+ * @return 0 or error code
+ */
+static int prepareSession(struct ramContext *ctx) {
+	int rc;
+	CURL *curl;
+
+	if (!ctx->URL)
+		return RAME_INVALID_URL;
+
+	if (!ctx->atr || !ctx->atrlen)
+		return RAME_GENERAL_ERROR;
+
+	if (!ctx->curl) {
+		rc = initCurlHandle(ctx);
+		if (rc < 0)
+			return rc;
+	}
+
+	curl = ctx->curl;
+	curl_easy_setopt(curl, CURLOPT_URL, ctx->URL);
+	curl_easy_setopt(curl, CURLOPT_COOKIELIST, "ALL");	// Session cookies of the previous session
+
+	if (ctx->options & RAM_OPT_HTTP2) {
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2_0);
+	} else {
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_NONE);
+	}
+
+	clearByteBuffer(&ctx->readbuffer);
+	clearByteBuffer(&ctx->writebuffer);
+	makeInitiationRequest(ctx);
+	return 0;
+}
+
+
+
+/**
+ * Set the content of the write buffer as body of the next POST request
+ *
+ * @param ctx The initialized context
+ */
+static void setPostData(struct ramContext *ctx) {
+	curl_easy_setopt(ctx->curl, CURLOPT_POSTFIELDS, (void *)ctx->writebuffer.buffer);
+	curl_easy_setopt(ctx->curl, CURLOPT_POSTFIELDSIZE, (long)ctx->writebuffer.len);
+}
+
+
+
 /**
  * Establish a connection to the RAM server at the given URL and process
  * requests until the server closed the connection
@@ -530,66 +878,31 @@ static size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp) {
  * a user object using ramSetUserObject(). In the call-back the user object
  * can be received with ramGetUserObject().
  *
+ * The connection to the server is kept open after the session, so that further
+ * sessions with the same context, e.g. for the next card, avoid the TCP and TLS
+ * handshake. Cookies from previous sessions are removed.
+ *
  * @param ctx The initialized context
  * @return 0 or error code
  */
 int ramConnect(struct ramContext *ctx) {
-	struct curl_slist *headers=NULL;
 	CURLcode res;
 	long httpcode;
 	int rc,excnt;
 	CURL *curl;
 
-	if (!ctx->URL)
-		return RAME_INVALID_URL;
-
-	if (!ctx->atr || !ctx->atrlen)
-		return RAME_GENERAL_ERROR;
-
-	curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_URL, ctx->URL);
-
-	headers = curl_slist_append(headers, "Content-Type: application/org.openscdp-content-mgt-response;version=1.0");
-	headers = curl_slist_append(headers, "Accept: */*");
-	headers = curl_slist_append(headers, "X-Admin-Protocol: openscdp-remote-admin/1.0");
-
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, ctx);
-	curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 40L);
-
-	clearByteBuffer(&ctx->writebuffer);
-	makeInitiationRequest(ctx);
+	rc = prepareSession(ctx);
+	if (rc < 0)
+		return rc;
 
+	curl = ctx->curl;
 	rc = 0;
 	excnt = 0;		// Counter number of received requests
 	do {
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (void *)ctx->writebuffer.buffer);
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)ctx->writebuffer.len);
+		setPostData(ctx);
 
 		res = curl_easy_perform(curl);
-
-		switch(res) {
-		case CURLE_OK:
-			break;
-		case CURLE_COULDNT_RESOLVE_HOST:
-			rc = RAME_HOST_NOT_FOUND;
-			break;
-		case CURLE_URL_MALFORMAT:
-			rc = RAME_INVALID_URL;
-			break;
-		case CURLE_SSL_CONNECT_ERROR:
-		case CURLE_COULDNT_CONNECT:
-			rc = RAME_CONNECT_FAILED;
-			break;
-		case CURLE_OPERATION_TIMEDOUT:
-			rc = RAME_TIMEOUT;
-			break;
-		default:
-			rc = RAME_CURL_ERROR;
-			break;
-		}
+		rc = curlResult(res, rc);
 
 		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
 
@@ -603,32 +916,508 @@ int ramConnect(struct ramContext *ctx) {
 		}
 	} while (httpcode == 200);
 
-	switch(httpcode) {
-	case 0:
-		break;
-	case 504:			// Gateway timeout
-		if (excnt)
-			rc = RAME_SERVER_ABORT;
-		else
-			rc = RAME_NO_CONNECT;
-		break;
-	case 200:			// New request, but aborted
-	case 204:			// Completed
-		break;
-	case 404:
-		rc = RAME_INVALID_URL;
-		break;
-	default:
-		printf("Server HTTP code %ld\n", httpcode);
-		rc = RAME_HTTP_CODE;
-	}
+	rc = httpResult(httpcode, excnt, rc);
 
-	curl_easy_cleanup(curl);
+	clearByteBuffer(&ctx->readbuffer);
+	clearByteBuffer(&ctx->writebuffer);
 	return rc;
 }
 
 
 
+/**
+ * Acquire the lock of the engine
+ */
+static void lockMulti(struct ramMulti *m) {
+#ifdef _WIN32
+	EnterCriticalSection(&m->lock);
+#else
+	pthread_mutex_lock(&m->lock);
+#endif
+}
+
+
+
+/**
+ * Release the lock of the engine
+ */
+static void unlockMulti(struct ramMulti *m) {
+#ifdef _WIN32
+	LeaveCriticalSection(&m->lock);
+#else
+	pthread_mutex_unlock(&m->lock);
+#endif
+}
+
+
+
+/**
+ * Wait for a signal on the condition. Must be called with the lock of the engine held
+ *
+ * @param m The engine
+ * @param cond The condition to wait for
+ * @param timeout Timeout in milliseconds or 0 to wait without timeout
+ */
+#ifdef _WIN32
+static void waitMulti(struct ramMulti *m, CONDITION_VARIABLE *cond, int timeout) {
+	SleepConditionVariableCS(cond, &m->lock, timeout ? (DWORD)timeout : INFINITE);
+}
+#else
+static void waitMulti(struct ramMulti *m, pthread_cond_t *cond, int timeout) {
+	struct timespec ts;
+
+	if (timeout == 0) {
+		pthread_cond_wait(cond, &m->lock);
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout / 1000;
+	ts.tv_nsec += (timeout % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(cond, &m->lock, &ts);
+}
+#endif
+
+
+
+/**
+ * Notify the engine of a state change. Must be called with the lock of the engine held
+ *
+ * @param m The engine
+ */
+static void wakeupMulti(struct ramMulti *m) {
+	m->events++;
+#ifdef _WIN32
+	WakeConditionVariable(&m->signal);
+#else
+	pthread_cond_signal(&m->signal);
+#endif
+#ifdef RAM_MULTI_WAKEUP
+	curl_multi_wakeup(m->curlm);
+#endif
+}
+
+
+
+/**
+ * Worker thread, which processes the server requests of one context whenever the engine
+ * passes a response from the server
+ */
+#ifdef _WIN32
+static unsigned __stdcall sessionWorker(void *arg)
+#else
+static void *sessionWorker(void *arg)
+#endif
+{
+	struct ramWorker *w = (struct ramWorker *)arg;
+	struct ramMulti *m = w->multi;
+	int rc;
+
+	lockMulti(m);
+	while (!w->stop) {
+		if (w->state != RAM_SESSION_CARD) {
+			waitMulti(m, &w->signal, 0);
+			continue;
+		}
+		unlockMulti(m);
+
+		rc = processRequests(w->ctx);
+		clearByteBuffer(&w->ctx->readbuffer);
+
+		lockMulti(m);
+		w->rc = rc;
+		w->state = RAM_SESSION_CARDDONE;
+		wakeupMulti(m);
+	}
+	unlockMulti(m);
+
+	return 0;
+}
+
+
+
+/**
+ * Complete the session of a worker and pass the result to the done handler
+ *
+ * @param w The worker
+ * @param rc The result of the session
+ */
+static void finishSession(struct ramWorker *w, int rc) {
+	struct ramContext *ctx = w->ctx;
+	struct ramMulti *m = w->multi;
+
+	clearByteBuffer(&ctx->readbuffer);
+	clearByteBuffer(&ctx->writebuffer);
+
+	lockMulti(m);
+	w->state = RAM_SESSION_IDLE;
+	m->active--;
+	unlockMulti(m);
+
+	// The handler may add the context again for the next card
+	if (ctx->done)
+		ctx->done(ctx, rc);
+}
+
+
+
+/**
+ * Send the content of the write buffer to the server
+ *
+ * @param w The worker
+ */
+static void startTransfer(struct ramWorker *w) {
+	struct ramMulti *m = w->multi;
+
+	setPostData(w->ctx);
+
+	if (curl_multi_add_handle(m->curlm, w->ctx->curl) != CURLM_OK) {
+		finishSession(w, RAME_CURL_ERROR);
+		return;
+	}
+
+	lockMulti(m);
+	w->state = RAM_SESSION_HTTP;
+	unlockMulti(m);
+}
+
+
+
+/**
+ * Start the session of a queued context
+ *
+ * @param w The worker
+ */
+static void startSession(struct ramWorker *w) {
+	struct ramContext *ctx = w->ctx;
+	int rc;
+
+	rc = prepareSession(ctx);
+	if (rc < 0) {
+		finishSession(w, rc);
+		return;
+	}
+
+	curl_easy_setopt(ctx->curl, CURLOPT_PRIVATE, (void *)w);
+#if LIBCURL_VERSION_NUM >= 0x072B00
+	// Wait for a connection that can be multiplexed rather than opening a new one
+	curl_easy_setopt(ctx->curl, CURLOPT_PIPEWAIT, (ctx->options & RAM_OPT_HTTP2) ? 1L : 0L);
+#endif
+
+	w->rc = 0;
+	w->excnt = 0;
+	startTransfer(w);
+}
+
+
+
+/**
+ * Process a completed transfer and pass the requests of the server to the worker
+ *
+ * @param w The worker
+ * @param res The result of the transfer
+ */
+static void transferDone(struct ramWorker *w, CURLcode res) {
+	struct ramContext *ctx = w->ctx;
+	struct ramMulti *m = w->multi;
+	long httpcode;
+
+	w->rc = curlResult(res, w->rc);
+
+	httpcode = 0;
+	curl_easy_getinfo(ctx->curl, CURLINFO_RESPONSE_CODE, &httpcode);
+
+	if (httpcode != 200) {
+		finishSession(w, httpResult(httpcode, w->excnt, w->rc));
+		return;
+	}
+
+	clearByteBuffer(&ctx->writebuffer);
+
+	lockMulti(m);
+	w->state = RAM_SESSION_CARD;
+#ifdef _WIN32
+	WakeConditionVariable(&w->signal);
+#else
+	pthread_cond_signal(&w->signal);
+#endif
+	unlockMulti(m);
+}
+
+
+
+/**
+ * Continue the session after the worker processed the requests of the server
+ *
+ * @param w The worker
+ */
+static void cardDone(struct ramWorker *w) {
+	if ((w->rc != 0) && (w->rc != RAME_CARD_ERROR)) {
+		finishSession(w, w->rc);
+		return;
+	}
+	w->excnt++;
+	startTransfer(w);
+}
+
+
+
+/**
+ * Allocate and initialize a new engine to run sessions of many contexts concurrently.
+ *
+ * The engine must be released with ramFreeMulti().
+ *
+ * @param multi A pointer to the engine pointer.
+ * @return 0 or error code
+ */
+int ramNewMulti(struct ramMulti **multi) {
+	struct ramMulti *m;
+
+	m = (struct ramMulti *)calloc(1, sizeof(struct ramMulti));
+	if (m == NULL)
+		return RAME_OUT_OF_MEMORY;
+
+	acquireShare();
+
+	m->curlm = curl_multi_init();
+	if (m->curlm == NULL) {
+		releaseShare();
+		free(m);
+		return RAME_CURL_ERROR;
+	}
+
+#ifdef CURLPIPE_MULTIPLEX
+	curl_multi_setopt(m->curlm, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
+
+#ifdef _WIN32
+	InitializeCriticalSection(&m->lock);
+	InitializeConditionVariable(&m->signal);
+#else
+	pthread_mutex_init(&m->lock, NULL);
+	pthread_cond_init(&m->signal, NULL);
+#endif
+
+	*multi = m;
+	return 0;
+}
+
+
+
+/**
+ * Stop the workers and release the engine.
+ *
+ * Contexts added to the engine are not released. Sessions still active, because ramMultiRun()
+ * failed, are abandoned.
+ *
+ * @param multi A pointer to the engine pointer.
+ */
+void ramFreeMulti(struct ramMulti **multi) {
+	struct ramMulti *m = *multi;
+	struct ramWorker *w;
+
+	while (m->workers != NULL) {
+		w = m->workers;
+		m->workers = w->next;
+
+		if (w->running) {
+			lockMulti(m);
+			w->stop = 1;
+#ifdef _WIN32
+			WakeConditionVariable(&w->signal);
+#else
+			pthread_cond_signal(&w->signal);
+#endif
+			unlockMulti(m);
+#ifdef _WIN32
+			WaitForSingleObject(w->thread, INFINITE);
+			CloseHandle(w->thread);
+#else
+			pthread_join(w->thread, NULL);
+#endif
+		}
+
+		// Only if ramMultiRun() was aborted
+		if (w->state == RAM_SESSION_HTTP)
+			curl_multi_remove_handle(m->curlm, w->ctx->curl);
+
+#ifndef _WIN32
+		pthread_cond_destroy(&w->signal);
+#endif
+		free(w);
+	}
+
+	curl_multi_cleanup(m->curlm);
+
+#ifdef _WIN32
+	DeleteCriticalSection(&m->lock);
+#else
+	pthread_cond_destroy(&m->signal);
+	pthread_mutex_destroy(&m->lock);
+#endif
+
+	free(m);
+	*multi = NULL;
+
+	releaseShare();
+}
+
+
+
+/**
+ * Add a context to the engine to run a session with the card
+ *
+ * The session is started by the thread running ramMultiRun(). The call-backs of the context
+ * are called from a worker thread dedicated to the context, so that card communication in
+ * one reader does not block HTTP transfers or card communication of other contexts. The
+ * done handler set with ramSetDoneHandler() is called from the thread running ramMultiRun()
+ * after the session completed.
+ *
+ * The context must be prepared as for ramConnect(). A context can be added again once the
+ * session completed, e.g. in the done handler. The function can be called from any thread.
+ *
+ * @param multi The engine
+ * @param ctx The initialized context
+ * @return 0 or error code
+ */
+int ramMultiAdd(struct ramMulti *multi, struct ramContext *ctx) {
+	struct ramWorker *w;
+
+	lockMulti(multi);
+
+	for (w = multi->workers; (w != NULL) && (w->ctx != ctx); w = w->next);
+
+	if (w == NULL) {
+		w = (struct ramWorker *)calloc(1, sizeof(struct ramWorker));
+		if (w == NULL) {
+			unlockMulti(multi);
+			return RAME_OUT_OF_MEMORY;
+		}
+		w->multi = multi;
+		w->ctx = ctx;
+
+#ifdef _WIN32
+		InitializeConditionVariable(&w->signal);
+		w->thread = (HANDLE)_beginthreadex(NULL, 0, sessionWorker, w, 0, NULL);
+		w->running = (w->thread != 0);
+#else
+		pthread_cond_init(&w->signal, NULL);
+		w->running = (pthread_create(&w->thread, NULL, sessionWorker, w) == 0);
+#endif
+
+		if (!w->running) {
+#ifndef _WIN32
+			pthread_cond_destroy(&w->signal);
+#endif
+			free(w);
+			unlockMulti(multi);
+			return RAME_GENERAL_ERROR;
+		}
+
+		w->next = multi->workers;
+		multi->workers = w;
+	}
+
+	if (w->state != RAM_SESSION_IDLE) {
+		unlockMulti(multi);
+		return RAME_GENERAL_ERROR;
+	}
+
+	w->state = RAM_SESSION_QUEUED;
+	multi->active++;
+	wakeupMulti(multi);
+
+	unlockMulti(multi);
+	return 0;
+}
+
+
+
+/**
+ * Run the sessions of all contexts added to the engine until completed
+ *
+ * All HTTP transfers are performed by the calling thread. The function returns if no session is
+ * active, which includes sessions added during the run with ramMultiAdd().
+ *
+ * @param multi The engine
+ * @return 0 or error code
+ */
+int ramMultiRun(struct ramMulti *multi) {
+	struct ramWorker *w, *list;
+	CURLMsg *msg;
+	CURLcode res;
+	CURL *curl;
+	int running, msgs, state, active, events;
+
+	running = 0;
+	while (1) {
+		lockMulti(multi);
+		multi->events = 0;
+		list = multi->workers;
+		unlockMulti(multi);
+
+		// Workers are only added to the head of the list and not removed while running
+		for (w = list; w != NULL; w = w->next) {
+			lockMulti(multi);
+			state = w->state;
+			unlockMulti(multi);
+
+			if (state == RAM_SESSION_QUEUED) {
+				startSession(w);
+			} else if (state == RAM_SESSION_CARDDONE) {
+				cardDone(w);
+			}
+		}
+
+		if (curl_multi_perform(multi->curlm, &running) != CURLM_OK)
+			return RAME_CURL_ERROR;
+
+		while ((msg = curl_multi_info_read(multi->curlm, &msgs)) != NULL) {
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+
+			curl = msg->easy_handle;
+			res = msg->data.result;
+			curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&w);
+			curl_multi_remove_handle(multi->curlm, curl);
+
+			transferDone(w, res);
+		}
+
+		lockMulti(multi);
+		active = multi->active;
+		events = multi->events;
+		unlockMulti(multi);
+
+		if (active == 0)
+			break;
+
+		if (events)
+			continue;
+
+#ifdef RAM_MULTI_WAKEUP
+		curl_multi_poll(multi->curlm, NULL, 0, RAM_POLL_INTERVAL, NULL);
+#else
+		if (running) {
+			curl_multi_wait(multi->curlm, NULL, 0, RAM_POLL_INTERVAL, NULL);
+		} else {
+			lockMulti(multi);
+			if (multi->events == 0)
+				waitMulti(multi, &multi->signal, RAM_POLL_INTERVAL);
+			unlockMulti(multi);
+		}
+#endif
+	}
+
+	return 0;
+}
+
+
+
 /**
  * Force closing a connection if an unrecoverable local error occurred (e.g. card removed)
  *
@@ -676,13 +1465,15 @@ int ramNewContext(struct ramContext **ctx) {
 	if (c == NULL)
 		return RAME_OUT_OF_MEMORY;
 
-	rc = initByteBuffer(&c->readbuffer, 512);
+	acquireShare();
+
+	rc = initByteBuffer(&c->readbuffer, RAM_BUFFER_SIZE);
 	if (rc < 0) {
 		ramFreeContext(&c);
 		return rc;
 	}
 
-	rc = initByteBuffer(&c->writebuffer, 512);
+	rc = initByteBuffer(&c->writebuffer, RAM_BUFFER_SIZE);
 	if (rc < 0) {
 		ramFreeContext(&c);
 		return rc;
@@ -695,12 +1486,19 @@ int ramNewContext(struct ramContext **ctx) {
 
 
 /**
- * Release context.
+ * Release context and close the connection to the server.
  *
  * @param ctx A pointer to the context pointer.
  * @return 0 or error code
  */
 void ramFreeContext(struct ramContext **ctx) {
+	if ((*ctx)->curl)
+		curl_easy_cleanup((*ctx)->curl);
+	if ((*ctx)->headers)
+		curl_slist_free_all((*ctx)->headers);
+
+	releaseShare();
+
 	freeByteBuffer(&(*ctx)->readbuffer);
 	freeByteBuffer(&(*ctx)->writebuffer);
 
@@ -839,3 +1637,37 @@ void ramSetNotifyHandler(struct ramContext *ctx, ramNotify_t notifyHandler) {
 	ctx->notify = notifyHandler;
 }
 
+
+
+
+/**
+ * Set options for the connection to the server
+ *
+ * With RAM_OPT_HTTP2 the context requests HTTP/2, which for https URLs is negotiated
+ * during the TLS handshake. libcurl falls back to HTTP/1.1 if it or the server does not support HTTP/2.
+ *
+ * @param ctx The initialized context
+ * @param options A combination of RAM_OPT_* values
+ */
+void ramSetOptions(struct ramContext *ctx, int options) {
+	ctx->options = options;
+}
+
+
+
+/**
+ * Set call-back to receive the result of a session run with ramMultiRun()
+ *
+ * The handler must be declared as
+ *
+ * void done(struct ramContext *ctx, int rc)
+ *
+ * rc is the result, which ramConnect() would have returned for the session. The handler is called from
+ * the thread running ramMultiRun() and must not block, as this delays the sessions of all other contexts.
+ *
+ * @param ctx The initialized context
+ * @param doneHandler The call-back
+ */
+void ramSetDoneHandler(struct ramContext *ctx, ramDone_t doneHandler) {
+	ctx->done = doneHandler;
+}
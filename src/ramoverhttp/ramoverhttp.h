@@ -74,11 +74,17 @@ extern "C" {
 #define RAM_CLOSE			0xE1
 
 
+/* Options for ramSetOptions() */
+#define RAM_OPT_HTTP2		0x0001		/** Use HTTP/2 if supported by libcurl and the server */
+
+
 struct ramContext;
+struct ramMulti;
 
 typedef int (*ramSendApdu_t) (struct ramContext *, unsigned char *, size_t , unsigned char *, size_t *);
 typedef int (*ramReset_t) (struct ramContext *, unsigned char *, size_t *);
 typedef int (*ramNotify_t) (struct ramContext *, int , char *);
+typedef void (*ramDone_t) (struct ramContext *, int);
 
 
 
@@ -100,6 +106,10 @@ struct ramContext {
 	ramSendApdu_t sendApdu;
 	ramReset_t reset;
 	ramNotify_t notify;
+	ramDone_t done;
+	void *curl;					// CURL handle, kept to reuse the connection for the next session
+	void *headers;				// HTTP header list of the CURL handle
+	int options;				// Options set with ramSetOptions()
 };
 
 
@@ -113,9 +123,16 @@ void ramSetATR(struct ramContext *, unsigned char *, size_t);
 void ramSetSendApduHandler(struct ramContext *, ramSendApdu_t);
 void ramSetResetHandler(struct ramContext *, ramReset_t);
 void ramSetNotifyHandler(struct ramContext *, ramNotify_t);
+void ramSetOptions(struct ramContext *, int);
+void ramSetDoneHandler(struct ramContext *, ramDone_t);
 int ramConnect(struct ramContext *);
 void ramForceClose(struct ramContext *, char *msg);
 
+int ramNewMulti(struct ramMulti **);
+void ramFreeMulti(struct ramMulti **);
+int ramMultiAdd(struct ramMulti *, struct ramContext *);
+int ramMultiRun(struct ramMulti *);
+
 /* Support for C++ compiler ----------------------------------------------- */
 
 #ifdef __cplusplus
@@ -69,12 +69,24 @@ extern "C" {
 #define CKM_SC_HSM_ECDSA_SHA224 		CKC_VENDOR_DEFINED + 0x00000010
 #define CKM_SC_HSM_ECDSA_SHA256			CKC_VENDOR_DEFINED + 0x00000011
 
+/* ECDSA with SHA-2 as defined in PKCS#11 V2.40, missing in the V2.20 headers */
+#ifndef CKM_ECDSA_SHA384
+#define CKM_ECDSA_SHA384			0x00001045
+#endif
+#ifndef CKM_ECDSA_SHA512
+#define CKM_ECDSA_SHA512			0x00001046
+#endif
+
 /* Derive EC private key from EC private key */
 #define CKM_SC_HSM_EC_DERIVE			CKC_VENDOR_DEFINED + 0x00000012
 
 /* Derive key value using the Extraction-then-Expansion key derivation algorithm */
 #define CKM_SC_HSM_SP80056C_DERIVE		CKC_VENDOR_DEFINED + 0x00000013
 
+/* Bulk encryption on the host with a data key derived on the token using CKM_SC_HSM_SP80056C_DERIVE */
+#define CKM_SC_HSM_ENVELOPE_AES_GCM		CKC_VENDOR_DEFINED + 0x00000014
+#define CKM_SC_HSM_ENVELOPE_AES_CTR		CKC_VENDOR_DEFINED + 0x00000015
+
 /* Support for C++ compiler ----------------------------------------------- */
 
 #ifdef __cplusplus
@@ -82,3 +94,60 @@ extern "C" {
 #endif
 #endif
 
+
+
+/* Vendor functions, available if the Cryptoki types are defined ----------- */
+
+#if defined(CK_PTR) && !defined(__SC_HSM_PKCS11_FUNCTIONS__)
+#define __SC_HSM_PKCS11_FUNCTIONS__
+
+/* Signature verification request for C_SC_HSM_VerifyBatch() */
+typedef struct CK_SC_HSM_VERIFY_REQUEST {
+	CK_OBJECT_HANDLE hKey;			/* Public key object in the session or token */
+	CK_MECHANISM_PTR pMechanism;		/* Verification mechanism                    */
+	CK_BYTE_PTR pData;			/* Signed data                               */
+	CK_ULONG ulDataLen;
+	CK_BYTE_PTR pSignature;			/* Signature to verify                       */
+	CK_ULONG ulSignatureLen;
+} CK_SC_HSM_VERIFY_REQUEST;
+
+typedef CK_SC_HSM_VERIFY_REQUEST CK_PTR CK_SC_HSM_VERIFY_REQUEST_PTR;
+
+/* Verify ulCount signatures with up to ulThreads threads from the verification pool, including
+   the calling thread (0 = all threads in the pool, see PKCS11_VERIFY_THREADS).
+   The result for each request is returned in the corresponding entry of pResults */
+typedef CK_RV (*CK_C_SC_HSM_VerifyBatch)(CK_SESSION_HANDLE hSession, CK_SC_HSM_VERIFY_REQUEST_PTR pRequests, CK_ULONG ulCount, CK_ULONG ulThreads, CK_RV *pResults);
+
+/* Input for C_SC_HSM_DigestBatch() */
+typedef struct CK_SC_HSM_DIGEST_REQUEST {
+	CK_BYTE_PTR pData;
+	CK_ULONG ulDataLen;
+} CK_SC_HSM_DIGEST_REQUEST;
+
+typedef CK_SC_HSM_DIGEST_REQUEST CK_PTR CK_SC_HSM_DIGEST_REQUEST_PTR;
+
+/* Hash ulCount inputs with the same mechanism. The hash values are returned concatenated
+   in pDigests. Call with pDigests = NULL to determine the required length */
+typedef CK_RV (*CK_C_SC_HSM_DigestBatch)(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_SC_HSM_DIGEST_REQUEST_PTR pRequests, CK_ULONG ulCount, CK_BYTE_PTR pDigests, CK_ULONG_PTR pulDigestsLen);
+
+/* Obtain ulTypeCount attributes for each of ulObjectCount objects. For every object and type in that
+   order pBuffer contains a CK_ULONG length followed by the value, padded to a multiple of sizeof(CK_ULONG).
+   The length is CK_UNAVAILABLE_INFORMATION without a value, if the object handle is invalid, the attribute
+   is not defined for the object or the attribute is sensitive. Call with pBuffer = NULL to determine the
+   required length */
+typedef CK_RV (*CK_C_SC_HSM_GetAttributeValueBatch)(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObjects, CK_ULONG ulObjectCount, CK_ATTRIBUTE_TYPE *pTypes, CK_ULONG ulTypeCount, CK_BYTE_PTR pBuffer, CK_ULONG_PTR pulBufferLen);
+
+/* Parameter for CKM_SC_HSM_ENVELOPE_AES_GCM and CKM_SC_HSM_ENVELOPE_AES_CTR */
+typedef struct CK_SC_HSM_ENVELOPE_PARAMS {
+	CK_BYTE_PTR pKeyContext;		/* Derivation parameter for CKM_SC_HSM_SP80056C_DERIVE */
+	CK_ULONG ulKeyContextLen;
+	CK_BYTE_PTR pIv;			/* GCM nonce or initial CTR counter block (16 bytes) */
+	CK_ULONG ulIvLen;
+	CK_BYTE_PTR pAAD;			/* Additional authenticated data for GCM              */
+	CK_ULONG ulAADLen;
+	CK_ULONG ulTagBits;			/* GCM tag length, 0 for the default of 128 bits      */
+} CK_SC_HSM_ENVELOPE_PARAMS;
+
+typedef CK_SC_HSM_ENVELOPE_PARAMS CK_PTR CK_SC_HSM_ENVELOPE_PARAMS_PTR;
+
+#endif
@@ -35,6 +35,14 @@
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
 #include <ctccid/ctapi.h>
 
 #ifndef _WIN32
@@ -603,6 +611,284 @@ int TestEjectICC(int ctn)
 
 
 
+/*
+ * Stress test running GET CHALLENGE on all readers in parallel
+ *
+ */
+
+#define STRESS_APDUS 1000
+
+struct stress {
+	int ctn;
+	int apdus;
+	int errors;
+};
+
+
+
+static long Milliseconds()
+{
+#ifdef _WIN32
+	return (long)GetTickCount();
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+
+
+#ifdef _WIN32
+static unsigned __stdcall StressWorker(void *arg)
+#else
+static void *StressWorker(void *arg)
+#endif
+{
+	struct stress *st = (struct stress *)arg;
+	unsigned char Brsp[260];
+	unsigned short SW1SW2;
+	int i, rc;
+
+	for (i = 0; i < STRESS_APDUS; i++) {
+		rc = ProcessAPDU(st->ctn, 0, 0x00,0x84,0x00,0x00,
+						 0, NULL,
+						 8, Brsp, sizeof(Brsp), &SW1SW2);
+
+		if ((rc != 8) || (SW1SW2 != 0x9000)) {
+			st->errors++;
+		} else {
+			st->apdus++;
+		}
+	}
+	return 0;
+}
+
+
+
+/*
+ * Drive readers 0 ... readers - 1 from one thread each and report the aggregate
+ * throughput. With independent readers the throughput should grow linearly with the
+ * number of readers
+ *
+ */
+
+int TestStress(int readers)
+
+{
+	struct stress *st;
+#ifdef _WIN32
+	HANDLE *threads;
+#else
+	pthread_t *threads;
+#endif
+	long start, elapsed;
+	int i, started, apdus, errors;
+
+	st = calloc(readers, sizeof(*st));
+	threads = calloc(readers, sizeof(*threads));
+
+	if ((st == NULL) || (threads == NULL)) {
+		free(st);
+		free(threads);
+		return -1;
+	}
+
+	printf("- STRESS TEST with %d readers ------------------\n", readers);
+
+	start = Milliseconds();
+
+	for (started = 0; started < readers; started++) {
+		st[started].ctn = started;
+#ifdef _WIN32
+		threads[started] = (HANDLE)_beginthreadex(NULL, 0, StressWorker, &st[started], 0, NULL);
+		if (threads[started] == 0) {
+			break;
+		}
+#else
+		if (pthread_create(&threads[started], NULL, StressWorker, &st[started]) != 0) {
+			break;
+		}
+#endif
+	}
+
+	if (started < readers) {
+		printf("Could only start %d of %d threads\n", started, readers);
+	}
+
+	for (i = 0; i < started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+	elapsed = Milliseconds() - start;
+
+	if (elapsed == 0) {
+		elapsed = 1;
+	}
+
+	apdus = 0;
+	errors = started < readers ? 1 : 0;
+	for (i = 0; i < started; i++) {
+		printf("ctn=%d: %d APDUs, %d errors\n", st[i].ctn, st[i].apdus, st[i].errors);
+		apdus += st[i].apdus;
+		errors += st[i].errors;
+	}
+
+	printf("%d APDUs with %d errors in %ld ms: %ld APDUs/s aggregate, %ld APDUs/s per reader\n",
+		apdus, errors, elapsed, apdus * 1000L / elapsed, apdus * 1000L / elapsed / readers);
+
+	free(st);
+	free(threads);
+
+	return errors ? -1 : 0;
+}
+
+
+
+/*
+ * Transfer commands and responses of increasing length, which are split into several
+ * T=1 blocks or CCID messages. A card may reject the long SELECT, but the transfer must succeed
+ *
+ */
+
+int TestChaining(int ctn)
+
+{
+	static const int lens[] = { 8, 254, 255, 256, 1000, 4000 };
+	unsigned char Bcmd[4000], Brsp[4096];
+	unsigned short SW1SW2;
+	int i, rc, errors;
+
+	printf("- CHAINING TEST for ctn=%d ------------------\n", ctn);
+
+	memset(Bcmd, 0x5A, sizeof(Bcmd));
+	errors = 0;
+
+	for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])); i++) {
+		rc = ProcessAPDU(ctn, 0, 0x00,0x84,0x00,0x00,
+						 0, NULL,
+						 lens[i], Brsp, sizeof(Brsp), &SW1SW2);
+
+		printf("GET CHALLENGE Le=%d: rc=%d, SW1SW2=%04X\n", lens[i], rc, SW1SW2);
+
+		if ((rc < 0) || ((SW1SW2 == 0x9000) && (rc != lens[i]))) {
+			errors++;
+		}
+
+		rc = ProcessAPDU(ctn, 0, 0x00,0xA4,0x04,0x00,
+						 lens[i], Bcmd,
+						 0, NULL, 0, &SW1SW2);
+
+		printf("SELECT Lc=%d: rc=%d, SW1SW2=%04X\n", lens[i], rc, SW1SW2);
+
+		if (rc < 0) {
+			errors++;
+		}
+	}
+
+	printf("%d errors\n", errors);
+
+	return errors ? -1 : 0;
+}
+
+
+
+/*
+ * Check the response timeouts derived from the block waiting time. With the emulated reader
+ * main() sets CTCCID_MOCK_WTX and CTCCID_MOCK_DELAY, so that the card requests time extensions
+ * and responses are only received if the timeout exceeds the latency
+ *
+ */
+
+int TestTimeouts(int ctn)
+
+{
+	CT_TIMEOUTS timeouts, saved;
+	unsigned char Brsp[256];
+	unsigned short SW1SW2;
+	int i, rc, errors;
+
+	printf("- TIMEOUT TEST for ctn=%d ------------------\n", ctn);
+
+	errors = 0;
+
+	if (CT_getTimeouts((unsigned short)ctn, &saved) != OK) {
+		printf("CT_getTimeouts failed\n");
+		return -1;
+	}
+
+	printf("BWT=%u ms, margin=%u ms, maximum=%u ms\n", saved.bwt, saved.margin, saved.maximum);
+
+	if (saved.bwt == 0) {
+		errors++;
+	}
+
+	for (i = 0; i < 4; i++) {
+		rc = ProcessAPDU(ctn, 0, 0x00,0x84,0x00,0x00,
+						 0, NULL,
+						 8, Brsp, sizeof(Brsp), &SW1SW2);
+
+		printf("GET CHALLENGE with default timeouts: rc=%d, SW1SW2=%04X\n", rc, SW1SW2);
+
+		if (rc != 8) {
+			errors++;
+		}
+	}
+
+	timeouts = saved;
+	timeouts.margin = 1;
+	timeouts.maximum = 0;
+
+	if (CT_setTimeouts((unsigned short)ctn, &timeouts) != OK) {
+		printf("CT_setTimeouts failed\n");
+		return -1;
+	}
+
+	// With a time extension every second APDU, one of two consecutive commands is extended
+	for (i = 0; i < 2; i++) {
+		rc = ProcessAPDU(ctn, 0, 0x00,0x84,0x00,0x00,
+						 0, NULL,
+						 8, Brsp, sizeof(Brsp), &SW1SW2);
+
+		printf("GET CHALLENGE with time extension and margin=1 ms: rc=%d, SW1SW2=%04X\n", rc, SW1SW2);
+
+		if (rc != 8) {
+			errors++;
+		}
+	}
+
+	timeouts.maximum = 1;
+
+	if (CT_setTimeouts((unsigned short)ctn, &timeouts) != OK) {
+		printf("CT_setTimeouts failed\n");
+		return -1;
+	}
+
+	rc = ProcessAPDU(ctn, 0, 0x00,0x84,0x00,0x00,
+					 0, NULL,
+					 8, Brsp, sizeof(Brsp), &SW1SW2);
+
+	printf("GET CHALLENGE with maximum=1 ms: rc=%d\n", rc);
+
+	if (rc >= 0) {
+		errors++;
+	}
+
+	CT_setTimeouts((unsigned short)ctn, &saved);
+
+	printf("%d errors\n", errors);
+
+	return errors ? -1 : 0;
+}
+
+
+
 #define MAXPORT 2
 
 /*
@@ -618,10 +904,62 @@ int main(int argc, char **argv)
 
 {
 	unsigned int i;
-	unsigned short lr;
-	int ctns[MAXPORT],rc;
+	unsigned short lr, SW1SW2;
+	int ctns[MAXPORT],rc,cnt;
 	unsigned char readers[4096],*po;
 
+	if ((argc > 1) && !strcmp(argv[1], "-chain")) {
+		if (CT_init(0, 0) < 0) {
+			return -1;
+		}
+
+		rc = TestRequestICC(0) < 0 ? -1 : TestChaining(0);
+
+		CT_close(0);
+		return rc;
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "-timeout")) {
+		// The emulated reader answers without latency unless configured otherwise
+		setenv("CTCCID_MOCK_DELAY", "20000", 0);
+		setenv("CTCCID_MOCK_WTX", "2", 0);
+
+		if (CT_init(0, 0) < 0) {
+			return -1;
+		}
+
+		rc = TestRequestICC(0) < 0 ? -1 : TestTimeouts(0);
+
+		CT_close(0);
+		return rc;
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "-stress")) {
+		lr = sizeof(readers);
+		CT_list(readers, &lr, CTAPI_NO_READER_NAME);
+
+		for (cnt = 0; cnt < lr / 3; cnt++) {
+			if (CT_init((unsigned short)cnt, (unsigned short)cnt) < 0) {
+				break;
+			}
+			if (TestRequestICC(cnt) < 0) {
+				CT_close((unsigned short)cnt);
+				break;
+			}
+			ProcessAPDU(cnt, 0, 0x00,0xA4,0x04,0x04,
+						 11, (unsigned char*)"\xE8\x2B\x06\x01\x04\x01\x81\xC3\x1F\x02\x01",
+						 0, readers, sizeof(readers), &SW1SW2);
+		}
+
+		rc = cnt > 0 ? TestStress(cnt) : -1;
+
+		for (i = 0; i < (unsigned int)cnt; i++) {
+			CT_close((unsigned short)i);
+		}
+
+		return rc;
+	}
+
 	for (i = 0; i < MAXPORT; i++) {
 		ctns[i] = -1;
 	}
@@ -363,11 +363,17 @@ static int optThreadsPerToken = 1;
 static int optIteration = 1;
 static int optUnlockPIN = 0;
 static int optFailFast = 0;
+static int optSignatureCache = 0;
+static int optDigestState = 0;
 static long optSlotId = -1;
 static char *optTokenFilter = "";
 
 static char namebuf[40]; /* used by main thread */
 
+static CK_C_SC_HSM_VerifyBatch p11VerifyBatch = NULL;
+static CK_C_SC_HSM_DigestBatch p11DigestBatch = NULL;
+static CK_C_SC_HSM_GetAttributeValueBatch p11GetAttributeValueBatch = NULL;
+
 static struct bytestring_s ecparam_prime256v1 = { (unsigned char *)"\x30\x81\xE0\x02\x01\x01\x30\x2C\x06\x07\x2A\x86\x48\xCE\x3D\x01\x01\x02\x21\x00\xFF\xFF\xFF\xFF\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x30\x44\x04\x20\xFF\xFF\xFF\xFF\x00\x00\x00\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFC\x04\x20\x5A\xC6\x35\xD8\xAA\x3A\x93\xE7\xB3\xEB\xBD\x55\x76\x98\x86\xBC\x65\x1D\x06\xB0\xCC\x53\xB0\xF6\x3B\xCE\x3C\x3E\x27\xD2\x60\x4B\x04\x41\x04\x6B\x17\xD1\xF2\xE1\x2C\x42\x47\xF8\xBC\xE6\xE5\x63\xA4\x40\xF2\x77\x03\x7D\x81\x2D\xEB\x33\xA0\xF4\xA1\x39\x45\xD8\x98\xC2\x96\x4F\xE3\x42\xE2\xFE\x1A\x7F\x9B\x8E\xE7\xEB\x4A\x7C\x0F\x9E\x16\x2B\xCE\x33\x57\x6B\x31\x5E\xCE\xCB\xB6\x40\x68\x37\xBF\x51\xF5\x02\x21\x00\xFF\xFF\xFF\xFF\x00\x00\x00\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xBC\xE6\xFA\xAD\xA7\x17\x9E\x84\xF3\xB9\xCA\xC2\xFC\x63\x25\x51\x02\x01\x01", 227 };
 
 
@@ -618,6 +624,95 @@ int findObject(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_ATTRIBUTE
 
 
 
+void testAttributeBatch(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_HANDLE hnd[64];
+	CK_ATTRIBUTE_TYPE types[] = { CKA_CLASS, CKA_ID, CKA_LABEL, CKA_VALUE };
+	CK_ATTRIBUTE template;
+	CK_ULONG cnt, buflen, len;
+	CK_BYTE *buf, *po;
+	CK_RV rc, rcs;
+	int i, j, match;
+
+	if (p11GetAttributeValueBatch == NULL) {
+		return;
+	}
+
+	printf("Calling C_FindObjectsInit ");
+	rc = p11->C_FindObjectsInit(session, NULL, 0);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_FindObjects ");
+	rc = p11->C_FindObjects(session, hnd, sizeof(hnd) / sizeof(*hnd) - 1, &cnt);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_FindObjectsFinal ");
+	p11->C_FindObjectsFinal(session);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	if (rc != CKR_OK) {
+		return;
+	}
+
+	// Add an invalid handle, which must be reported as unavailable
+	hnd[cnt++] = 0;
+
+	printf("Calling C_SC_HSM_GetAttributeValueBatch - query size");
+	buflen = 0;
+	rc = p11GetAttributeValueBatch(session, hnd, cnt, types, 4, NULL, &buflen);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (buflen >= cnt * 4 * sizeof(CK_ULONG))));
+
+	if (rc != CKR_OK) {
+		return;
+	}
+
+	buf = malloc(buflen);
+
+	len = buflen - 1;
+	printf("Calling C_SC_HSM_GetAttributeValueBatch - buffer too small");
+	rc = p11GetAttributeValueBatch(session, hnd, cnt, types, 4, buf, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_BUFFER_TOO_SMALL) && (len == buflen)));
+
+	printf("Calling C_SC_HSM_GetAttributeValueBatch ");
+	rc = p11GetAttributeValueBatch(session, hnd, cnt, types, 4, buf, &buflen);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	match = 1;
+	po = buf;
+	for (i = 0; (rc == CKR_OK) && match && (i < (int)cnt); i++) {
+		for (j = 0; j < 4; j++) {
+			memcpy(&len, po, sizeof(CK_ULONG));
+			po += sizeof(CK_ULONG);
+
+			template.type = types[j];
+			template.pValue = NULL;
+			template.ulValueLen = 0;
+			rcs = p11->C_GetAttributeValue(session, hnd[i], &template, 1);
+
+			if (rcs != CKR_OK) {
+				match &= (len == CK_UNAVAILABLE_INFORMATION);
+				continue;
+			}
+
+			match &= (len == template.ulValueLen);
+			if (!match) {
+				break;
+			}
+
+			template.pValue = malloc(len + 1);
+			p11->C_GetAttributeValue(session, hnd[i], &template, 1);
+			match &= !memcmp(po, template.pValue, len);
+			free(template.pValue);
+			po += (len + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1);
+		}
+	}
+
+	printf("Batch matches C_GetAttributeValue for %lu objects - %s\n", cnt, verdict(match && (po == buf + buflen)));
+	free(buf);
+}
+
+
+
 int testRSASigning(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, int id, CK_MECHANISM_TYPE mt, int hashlen)
 {
 	CK_SESSION_HANDLE session;
@@ -864,6 +959,20 @@ int testRSASigning(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, int id, CK_MECHA
 
 		rc = p11->C_VerifyFinal(session, signature, len);
 		printf("C_VerifyFinal (Thread %i, Session %ld, Slot=%ld) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		signature[len - 1] ^= 0x01;
+
+		rc = p11->C_VerifyInit(session, &mech, pubhnd);
+		printf("C_VerifyInit (Thread %i, Session %ld, Slot=%ld) - Multipart with wrong signature - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyUpdate(session, (CK_BYTE_PTR)tbs, 6);
+		printf("C_VerifyUpdate (Thread %i, Session %ld, Slot=%ld - Part #1) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyUpdate(session, (CK_BYTE_PTR)tbs + 6, tbslen - 6);
+		printf("C_VerifyUpdate (Thread %i, Session %ld, Slot=%ld - Part #2) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyFinal(session, signature, len);
+		printf("C_VerifyFinal (Thread %i, Session %ld, Slot=%ld) - Wrong signature - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SIGNATURE_INVALID));
 #endif
 		keyno++;
 	}
@@ -899,6 +1008,12 @@ int testECSigning(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, int id, CK_MECHAN
 	CK_ULONG len;
 	char scr[1024];
 	int rc,keyno;
+#ifdef ENABLE_LIBCRYPTO
+	CK_SC_HSM_VERIFY_REQUEST batch[16];
+	CK_RV batchrc[16];
+	CK_BYTE wrongsignature[512];
+	int i;
+#endif
 
 	mech.mechanism = mt;
 	keyno = 0;
@@ -959,6 +1074,52 @@ int testECSigning(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, int id, CK_MECHAN
 
 		rc = p11->C_Verify(session, (CK_BYTE_PTR)tbs, (CK_ULONG)strlen(tbs), signature, len);
 		printf("C_Verify (Thread %i, Session %ld, Slot=%ld) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		memcpy(wrongsignature, signature, len);
+		wrongsignature[len - 1] ^= 0x01;
+
+		rc = p11->C_VerifyInit(session, &mech, pubhnd);
+		printf("C_VerifyInit (Thread %i, Session %ld, Slot=%ld) - Multipart - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyUpdate(session, (CK_BYTE_PTR)tbs, 5);
+		printf("C_VerifyUpdate (Thread %i, Session %ld, Slot=%ld - Part #1) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyUpdate(session, (CK_BYTE_PTR)tbs + 5, (CK_ULONG)strlen(tbs) - 5);
+		printf("C_VerifyUpdate (Thread %i, Session %ld, Slot=%ld - Part #2) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyFinal(session, signature, len);
+		printf("C_VerifyFinal (Thread %i, Session %ld, Slot=%ld) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyInit(session, &mech, pubhnd);
+		printf("C_VerifyInit (Thread %i, Session %ld, Slot=%ld) - Multipart with wrong signature - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyUpdate(session, (CK_BYTE_PTR)tbs, 5);
+		printf("C_VerifyUpdate (Thread %i, Session %ld, Slot=%ld - Part #1) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyUpdate(session, (CK_BYTE_PTR)tbs + 5, (CK_ULONG)strlen(tbs) - 5);
+		printf("C_VerifyUpdate (Thread %i, Session %ld, Slot=%ld - Part #2) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		rc = p11->C_VerifyFinal(session, wrongsignature, len);
+		printf("C_VerifyFinal (Thread %i, Session %ld, Slot=%ld) - Wrong signature - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SIGNATURE_INVALID));
+
+		if (p11VerifyBatch != NULL) {
+			for (i = 0; i < 16; i++) {
+				batch[i].hKey = pubhnd;
+				batch[i].pMechanism = &mech;
+				batch[i].pData = (CK_BYTE_PTR)tbs;
+				batch[i].ulDataLen = (CK_ULONG)strlen(tbs);
+				batch[i].pSignature = (i & 1) ? wrongsignature : signature;
+				batch[i].ulSignatureLen = len;
+			}
+
+			rc = p11VerifyBatch(session, batch, 16, 4, batchrc);
+			for (i = 0; (rc == CKR_OK) && (i < 16); i++) {
+				if (batchrc[i] != ((i & 1) ? CKR_SIGNATURE_INVALID : CKR_OK)) {
+					rc = batchrc[i];
+				}
+			}
+			printf("C_SC_HSM_VerifyBatch (Thread %i, Session %ld, Slot=%ld) - %s : %s\n", id, session, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+		}
 #endif
 
 		keyno++;
@@ -1109,8 +1270,12 @@ int testAES(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, int id)
 	CK_BYTE signature[512];
 	CK_BYTE plain[1216];
 	CK_BYTE ciphertext[1216];
+	CK_BYTE multipart[1216];
 	CK_BYTE iv[16];
-	CK_ULONG len;
+	// Unaligned parts, the second exceeds AES_CBC_CHUNK_SIZE of 992 bytes
+	CK_ULONG encparts[] = { 7, 1201, 8 };
+	CK_ULONG decparts[] = { 33, 1000, 183 };
+	CK_ULONG len, ofs, outofs, partlen;
 	char scr[1024];
 	int rc,keyno,i;
 
@@ -1129,149 +1294,858 @@ int testAES(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid, int id)
 	rc = p11->C_Login(session, CKU_USER, pin, pinlen);
 	printf("C_Login User (Thread %i, Slot=%ld) - %s : %s\n", id, slotid, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK || rc == CKR_USER_ALREADY_LOGGED_IN));
 
-	if (rc != CKR_OK && rc != CKR_USER_ALREADY_LOGGED_IN)
+	if (rc != CKR_OK && rc != CKR_USER_ALREADY_LOGGED_IN)
+		goto out;
+
+	while (1) {
+		rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), keyno, &hnd);
+
+		if (rc != CKR_OK) {
+			rc = CKR_OK;
+			break;
+		}
+
+		memset(iv, 0xA5, sizeof(iv));
+		mech.mechanism = CKM_AES_CBC;
+		mech.pParameter = iv;
+		mech.ulParameterLen = sizeof(iv);
+
+		printf("Calling C_EncryptInit()");
+		rc = p11->C_EncryptInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_Encrypt() to query cipher size");
+
+		len = 0;
+		rc = p11->C_Encrypt(session, plain, sizeof(plain), NULL, &len);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Ciphertext size = %lu : %s\n", len, verdict(len == sizeof(plain)));
+
+		printf("Calling C_Encrypt()");
+
+		rc = p11->C_Encrypt(session, plain, sizeof(plain), ciphertext, &len);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		bin2str(scr, sizeof(scr), ciphertext, len);
+		printf("Ciphertext:\n%s\n", scr);
+
+		printf("Calling C_EncryptInit() for multi-part");
+		rc = p11->C_EncryptInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		ofs = outofs = 0;
+		for (i = 0; (rc == CKR_OK) && (i < (int)(sizeof(encparts) / sizeof(encparts[0]))); i++) {
+			partlen = sizeof(multipart) - outofs;
+			rc = p11->C_EncryptUpdate(session, plain + ofs, encparts[i], multipart + outofs, &partlen);
+			printf("Calling C_EncryptUpdate() with %lu bytes, %lu bytes returned - %s : %s\n", encparts[i], partlen, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+			ofs += encparts[i];
+			outofs += partlen;
+		}
+
+		partlen = sizeof(multipart) - outofs;
+		rc = p11->C_EncryptFinal(session, multipart + outofs, &partlen);
+		printf("Calling C_EncryptFinal() - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (partlen == 0)));
+
+		printf("Compare multi-part with single-part ciphertext... %s\n", verdict((outofs == sizeof(plain)) && (memcmp(multipart, ciphertext, sizeof(plain)) == 0)));
+
+		printf("Calling C_DecryptInit() for multi-part");
+		rc = p11->C_DecryptInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		ofs = outofs = 0;
+		for (i = 0; (rc == CKR_OK) && (i < (int)(sizeof(decparts) / sizeof(decparts[0]))); i++) {
+			partlen = sizeof(multipart) - outofs;
+			rc = p11->C_DecryptUpdate(session, ciphertext + ofs, decparts[i], multipart + outofs, &partlen);
+			printf("Calling C_DecryptUpdate() with %lu bytes, %lu bytes returned - %s : %s\n", decparts[i], partlen, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+			ofs += decparts[i];
+			outofs += partlen;
+		}
+
+		partlen = sizeof(multipart) - outofs;
+		rc = p11->C_DecryptFinal(session, multipart + outofs, &partlen);
+		printf("Calling C_DecryptFinal() - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (partlen == 0)));
+
+		printf("Verify multi-part plaintext... %s\n", verdict((outofs == sizeof(plain)) && (memcmp(multipart, plain, sizeof(plain)) == 0)));
+
+		printf("Calling C_DecryptInit()");
+
+		rc = p11->C_DecryptInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_Decrypt() to query plaintext size");
+
+		rc = p11->C_Decrypt(session, (CK_BYTE_PTR)ciphertext, len, NULL, &len);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Plaintext size = %lu : %s\n", len, verdict(len == sizeof(plain)));
+
+		printf("Calling C_Decrypt()");
+
+		rc = p11->C_Decrypt(session, (CK_BYTE_PTR)ciphertext, len, ciphertext, &len);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		bin2str(scr, sizeof(scr), ciphertext, len);
+		printf("Plain:\n%s\n", scr);
+		printf("Verify plaintext... %s\n", verdict(memcmp(ciphertext, plain, len) == 0));
+
+		mech.mechanism = CKM_AES_CMAC;
+
+		printf("Calling C_SignInit()");
+		rc = p11->C_SignInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_Sign()");
+
+		len = 0;
+		rc = p11->C_Sign(session, (CK_BYTE_PTR)tbs, (CK_ULONG)strlen(tbs), NULL, &len);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Signature size = %lu\n", len);
+
+		len = sizeof(signature);
+		rc = p11->C_Sign(session, (CK_BYTE_PTR)tbs, (CK_ULONG)strlen(tbs), signature, &len);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		bin2str(scr, sizeof(scr), signature, len);
+		printf("Signature:\n%s\n", scr);
+
+		keyno++;
+	}
+
+	out:
+		printf("Closing Session %ld\n", session);
+		p11->C_CloseSession(session);
+
+	return rc;
+}
+
+
+
+#ifndef _WIN32
+void*
+#else
+DWORD WINAPI
+#endif
+SignThread(void *arg) {
+
+	struct thread_data *d;
+	int rc;
+
+	d = (struct thread_data *) arg;
+
+	rc = CKR_OK;
+	while (d->iterations && rc == CKR_OK) {
+
+		rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SHA1_RSA_PKCS, 0);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_RSA_PKCS, 20);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SHA256_RSA_PKCS_PSS, 0);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_PSS_SHA1, 0);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_PSS_SHA256, 0);
+
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_ECDSA_SHA1);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_ECDSA);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_ECDSA_SHA224);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_ECDSA_SHA256);
+
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSADecryption(d->p11, d->slotid, d->thread_id, CKM_RSA_PKCS);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSADecryption(d->p11, d->slotid, d->thread_id, CKM_RSA_PKCS_OAEP);
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testRSADecryption(d->p11, d->slotid, d->thread_id, CKM_RSA_X_509);
+
+		if ((rc == CKR_OK) && (testsfailed == 0))
+			rc = testAES(d->p11, d->slotid, d->thread_id);
+
+		d->iterations--;
+
+		if (testsfailed > 0) {
+			rc = CKR_CANCEL;
+		}
+	}
+
+	d->iterations = 0;
+	return 0;
+}
+
+
+
+/*
+ * Encrypt and decrypt with CKM_SC_HSM_ENVELOPE_AES_GCM using the first AES key. The second encryption
+ * uses the cached data key and must produce the same cipher text. Envelope mechanisms must reject
+ * keys other than AES
+ */
+void testEnvelope(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
+{
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_OBJECT_CLASS classprk = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+	CK_ATTRIBUTE prktemplate[] = {
+			{ CKA_CLASS, &classprk, sizeof(classprk) }
+	};
+	CK_BYTE context[] = "Envelope test";
+	CK_BYTE iv[12];
+	CK_SC_HSM_ENVELOPE_PARAMS params = { context, sizeof(context) - 1, iv, sizeof(iv), NULL, 0, 0 };
+	CK_MECHANISM mech = { CKM_SC_HSM_ENVELOPE_AES_GCM, &params, sizeof(params) };
+	CK_OBJECT_HANDLE hnd;
+	CK_SESSION_HANDLE session;
+	CK_BYTE plain[1000], decrypted[1000];
+	CK_BYTE ciphertext[2][1016];
+	CK_ULONG len[2], plainlen;
+	int rc, i;
+
+	for (i = 0; i < sizeof(plain); i++) {
+		plain[i] = i & 0xFF;
+	}
+	memset(iv, 0x5A, sizeof(iv));
+
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session);
+
+	if (rc != CKR_OK) {
+		printf("C_OpenSession for envelope test failed\n");
+		return;
+	}
+
+	rc = p11->C_Login(session, CKU_USER, pin, pinlen);
+
+	if ((rc != CKR_OK) && (rc != CKR_USER_ALREADY_LOGGED_IN)) {
+		printf("C_Login for envelope test failed\n");
+		goto out;
+	}
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc != CKR_OK) {
+		printf("No AES key for envelope test\n");
+		goto out;
+	}
+
+	for (i = 0; i < 2; i++) {
+		rc = p11->C_EncryptInit(session, &mech, hnd);
+
+		if (rc == CKR_OK) {
+			len[i] = sizeof(ciphertext[i]);
+			rc = p11->C_Encrypt(session, plain, sizeof(plain), ciphertext[i], &len[i]);
+		}
+
+		printf("C_Encrypt with envelope #%d - %s : %s\n", i + 1, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		if (rc != CKR_OK) {
+			goto out;
+		}
+	}
+
+	printf("Cipher text with cached data key matches - %s\n", verdict((len[0] == len[1]) && !memcmp(ciphertext[0], ciphertext[1], len[0])));
+
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+
+	if (rc == CKR_OK) {
+		plainlen = sizeof(decrypted);
+		rc = p11->C_Decrypt(session, ciphertext[0], len[0], decrypted, &plainlen);
+	}
+
+	printf("C_Decrypt with envelope - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (plainlen == sizeof(plain)) && !memcmp(plain, decrypted, sizeof(plain))));
+
+	ciphertext[0][len[0] - 1] ^= 0x01;
+
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+
+	if (rc == CKR_OK) {
+		plainlen = sizeof(decrypted);
+		rc = p11->C_Decrypt(session, ciphertext[0], len[0], decrypted, &plainlen);
+	}
+
+	printf("C_Decrypt with modified tag - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_ENCRYPTED_DATA_INVALID));
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&prktemplate, sizeof(prktemplate) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc == CKR_OK) {
+		rc = p11->C_EncryptInit(session, &mech, hnd);
+		printf("C_EncryptInit with envelope and private key - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_KEY_TYPE_INCONSISTENT));
+
+		rc = p11->C_DecryptInit(session, &mech, hnd);
+		printf("C_DecryptInit with envelope and private key - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_KEY_TYPE_INCONSISTENT));
+	}
+
+out:
+	p11->C_CloseSession(session);
+}
+
+
+
+void testDualFunction(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
+{
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+	CK_BYTE iv[16];
+	CK_MECHANISM mech = { CKM_AES_CBC, iv, sizeof(iv) };
+	CK_MECHANISM digestmech = { CKM_SHA256, NULL, 0 };
+	CK_OBJECT_HANDLE hnd;
+	CK_SESSION_HANDLE session;
+	CK_BYTE plain[100], ciphertext[112], reference[112], decrypted[112];
+	CK_BYTE hash[32], dualhash[32];
+	CK_ULONG len, ofs, outlen, hashlen, reflen;
+	int rc, i;
+
+	for (i = 0; i < sizeof(plain); i++) {
+		plain[i] = i & 0xFF;
+	}
+	memset(iv, 0xA5, sizeof(iv));
+
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session);
+
+	if (rc != CKR_OK) {
+		printf("C_OpenSession for dual-function test failed\n");
+		return;
+	}
+
+	rc = p11->C_Login(session, CKU_USER, pin, pinlen);
+
+	if ((rc != CKR_OK) && (rc != CKR_USER_ALREADY_LOGGED_IN)) {
+		printf("C_Login for dual-function test failed\n");
+		goto out;
+	}
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc != CKR_OK) {
+		printf("No AES key for dual-function test\n");
+		goto out;
+	}
+
+	// Reference values from single-function operations on the 96 byte block aligned prefix
+	hashlen = sizeof(hash);
+	rc = p11->C_DigestInit(session, &digestmech);
+	if (rc == CKR_OK) {
+		rc = p11->C_Digest(session, plain, 96, hash, &hashlen);
+	}
+
+	reflen = sizeof(reference);
+	if (rc == CKR_OK) {
+		rc = p11->C_EncryptInit(session, &mech, hnd);
+	}
+	if (rc == CKR_OK) {
+		rc = p11->C_Encrypt(session, plain, 96, reference, &reflen);
+	}
+
+	if (rc != CKR_OK) {
+		printf("Reference digest or encryption for dual-function test failed - %s\n", id2name(p11CKRName, rc, 0, namebuf));
+		goto out;
+	}
+
+	rc = p11->C_DigestInit(session, &digestmech);
+	printf("C_DigestInit for C_DigestEncryptUpdate - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("C_EncryptInit for C_DigestEncryptUpdate - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	// A buffer that is too small must neither encrypt nor digest the part
+	outlen = 1;
+	rc = p11->C_DigestEncryptUpdate(session, plain, 40, ciphertext, &outlen);
+	printf("C_DigestEncryptUpdate with small buffer - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_BUFFER_TOO_SMALL) && (outlen == 32)));
+
+	ofs = 0;
+	for (len = 0; len < 96; len += 40) {
+		outlen = sizeof(ciphertext) - ofs;
+		rc = p11->C_DigestEncryptUpdate(session, plain + len, len + 40 > 96 ? 96 - len : 40, ciphertext + ofs, &outlen);
+		if (rc != CKR_OK) {
+			break;
+		}
+		ofs += outlen;
+	}
+	printf("C_DigestEncryptUpdate in three parts - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	outlen = sizeof(ciphertext) - ofs;
+	rc = p11->C_EncryptFinal(session, ciphertext + ofs, &outlen);
+	ofs += outlen;
+
+	hashlen = sizeof(dualhash);
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestFinal(session, dualhash, &hashlen);
+	}
+
+	printf("Dual-function cipher text and digest match - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (ofs == reflen) && !memcmp(ciphertext, reference, reflen) && !memcmp(hash, dualhash, sizeof(hash))));
+
+	rc = p11->C_DigestInit(session, &digestmech);
+	if (rc == CKR_OK) {
+		rc = p11->C_DecryptInit(session, &mech, hnd);
+	}
+
+	outlen = sizeof(decrypted);
+	if (rc == CKR_OK) {
+		rc = p11->C_DecryptDigestUpdate(session, reference, reflen, decrypted, &outlen);
+	}
+
+	ofs = outlen;
+	outlen = sizeof(decrypted) - ofs;
+	if (rc == CKR_OK) {
+		rc = p11->C_DecryptFinal(session, decrypted + ofs, &outlen);
+		ofs += outlen;
+	}
+
+	hashlen = sizeof(dualhash);
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestFinal(session, dualhash, &hashlen);
+	}
+
+	printf("C_DecryptDigestUpdate plain text and digest match - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (ofs == 96) && !memcmp(decrypted, plain, 96) && !memcmp(hash, dualhash, sizeof(hash))));
+
+	// Without an active digest the encryption must not advance either
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	outlen = sizeof(ciphertext);
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestEncryptUpdate(session, plain, 32, ciphertext, &outlen);
+	}
+	printf("C_DigestEncryptUpdate without digest operation - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OPERATION_NOT_INITIALIZED));
+
+	outlen = sizeof(ciphertext);
+	rc = p11->C_Encrypt(session, plain, 96, ciphertext, &outlen);
+	printf("C_Encrypt continues after rejected dual-function update - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (outlen == reflen) && !memcmp(ciphertext, reference, reflen)));
+
+out:
+	p11->C_CloseSession(session);
+}
+
+
+
+/*
+ * CRC-32 as used in the trailer of the operation state
+ */
+static unsigned long stateCRC32(unsigned char *p, size_t len)
+{
+	unsigned long crc = 0xFFFFFFFF;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return crc ^ 0xFFFFFFFF;
+}
+
+
+
+/*
+ * Patch a 32 bit big endian field in the operation state and update the CRC-32 trailer
+ */
+static void patchState(CK_BYTE_PTR state, CK_ULONG len, CK_ULONG ofs, CK_ULONG val)
+{
+	unsigned long crc;
+
+	state[ofs] = (CK_BYTE)(val >> 24);
+	state[ofs + 1] = (CK_BYTE)(val >> 16);
+	state[ofs + 2] = (CK_BYTE)(val >> 8);
+	state[ofs + 3] = (CK_BYTE)val;
+
+	crc = stateCRC32(state, len - 4);
+	state[len - 4] = (CK_BYTE)(crc >> 24);
+	state[len - 3] = (CK_BYTE)(crc >> 16);
+	state[len - 2] = (CK_BYTE)(crc >> 8);
+	state[len - 1] = (CK_BYTE)crc;
+}
+
+
+
+/*
+ * Offsets in the operation state: magic, version, token serial number and operation count
+ * precede the type, mechanism, key class and key identifier length of the first operation.
+ * A SHA-256 state at the end contains the mechanism, the hash value and the bit count
+ * before the pending input.
+ */
+#define STATE_OFS_TYPE		(4 + 4 + 16 + 4)
+#define STATE_OFS_MECHANISM	(STATE_OFS_TYPE + 4)
+#define STATE_OFS_IDLEN		(STATE_OFS_TYPE + 12)
+#define STATE_OP_VERIFY		3
+
+
+
+void testOperationState(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
+{
+	CK_OBJECT_CLASS class = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_ECDSA;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &class, sizeof(class) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) }
+	};
+	CK_OBJECT_CLASS classpuk = CKO_PUBLIC_KEY;
+	CK_BYTE keyid[256];
+	CK_ATTRIBUTE puktemplate[] = {
+			{ CKA_CLASS, &classpuk, sizeof(classpuk) },
+			{ CKA_ID, keyid, sizeof(keyid) }
+	};
+	CK_MECHANISM digestmech = { CKM_SHA256, NULL, 0 };
+	CK_MECHANISM rawmech = { CKM_ECDSA, NULL, 0 };
+	CK_MECHANISM hashmech = { CKM_SC_HSM_ECDSA_SHA256, NULL, 0 };
+	CK_SESSION_HANDLE session, session2;
+	CK_OBJECT_HANDLE hnd, pubhnd;
+	CK_BYTE *message = (CK_BYTE *)"The operation is continued in another session after saving the state";
+	CK_BYTE state[1024], modified[1024];
+	CK_BYTE hash[32], reference[32], signature[256];
+	CK_ULONG msglen, statelen, len, hashlen;
+	int rc;
+
+	msglen = (CK_ULONG)strlen((char *)message);
+
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session);
+
+	if (rc != CKR_OK) {
+		printf("C_OpenSession for operation state test failed\n");
+		return;
+	}
+
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session2);
+
+	if (rc != CKR_OK) {
+		printf("C_OpenSession for operation state test failed\n");
+		p11->C_CloseSession(session);
+		return;
+	}
+
+	rc = p11->C_Login(session, CKU_USER, pin, pinlen);
+
+	if ((rc != CKR_OK) && (rc != CKR_USER_ALREADY_LOGGED_IN)) {
+		printf("C_Login for operation state test failed\n");
+		goto out;
+	}
+
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+	if (rc == CKR_OK) {
+		rc = p11->C_GetAttributeValue(session, hnd, (CK_ATTRIBUTE_PTR)&puktemplate[1], 1);
+	}
+
+	if (rc == CKR_OK) {
+		rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&puktemplate, sizeof(puktemplate) / sizeof(CK_ATTRIBUTE), 0, &pubhnd);
+	}
+
+	if (rc != CKR_OK) {
+		printf("No EC key pair for operation state test\n");
+		goto out;
+	}
+
+	// Signature with the input buffered in the session, which can always be saved
+	memset(hash, 0x5A, sizeof(hash));
+
+	rc = p11->C_SignInit(session, &rawmech, hnd);
+	if (rc == CKR_OK) {
+		rc = p11->C_SignUpdate(session, hash, 12);
+	}
+
+	statelen = 0;
+	if (rc == CKR_OK) {
+		rc = p11->C_GetOperationState(session, NULL, &statelen);
+	}
+	printf("C_GetOperationState for C_SignUpdate - query size - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (statelen <= sizeof(state))));
+
+	if ((rc != CKR_OK) || (statelen > sizeof(state))) {
+		goto out;
+	}
+
+	len = statelen - 1;
+	rc = p11->C_GetOperationState(session, state, &len);
+	printf("C_GetOperationState with small buffer - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_BUFFER_TOO_SMALL) && (len == statelen)));
+
+	rc = p11->C_GetOperationState(session, state, &statelen);
+	printf("C_GetOperationState for C_SignUpdate - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	rc = p11->C_SetOperationState(session2, state, statelen, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	if (rc == CKR_OK) {
+		rc = p11->C_SignUpdate(session2, hash + 12, sizeof(hash) - 12);
+	}
+
+	len = sizeof(signature);
+	if (rc == CKR_OK) {
+		rc = p11->C_SignFinal(session2, signature, &len);
+	}
+	printf("C_SetOperationState and C_SignFinal in other session - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+#ifdef ENABLE_LIBCRYPTO
+	if (rc == CKR_OK) {
+		rc = p11->C_VerifyInit(session2, &rawmech, pubhnd);
+		if (rc == CKR_OK) {
+			rc = p11->C_Verify(session2, hash, sizeof(hash), signature, len);
+		}
+		printf("C_Verify for signature from restored state - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	}
+#endif
+
+	p11->C_SignFinal(session, NULL, &len);
+	p11->C_SignFinal(session, signature, &len);
+
+	// Corrupted, truncated and mismatched states must be rejected
+	memcpy(modified, state, statelen);
+	modified[statelen / 2] ^= 0x01;
+	rc = p11->C_SetOperationState(session2, modified, statelen, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	printf("C_SetOperationState with corrupted state - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SAVED_STATE_INVALID));
+
+	rc = p11->C_SetOperationState(session2, state, statelen - 1, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	printf("C_SetOperationState with truncated state - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SAVED_STATE_INVALID));
+
+	rc = p11->C_SetOperationState(session2, state, 3, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	printf("C_SetOperationState with short state - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SAVED_STATE_INVALID));
+
+	rc = p11->C_SetOperationState(session2, state, statelen, pubhnd, CK_INVALID_HANDLE);
+	printf("C_SetOperationState with unneeded encryption key - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_KEY_NOT_NEEDED));
+
+	memcpy(modified, state, statelen);
+	patchState(modified, statelen, STATE_OFS_IDLEN, 0x10000);
+	rc = p11->C_SetOperationState(session2, modified, statelen, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	printf("C_SetOperationState with inconsistent length - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SAVED_STATE_INVALID));
+
+	// Host side hash for digest and signature, which can only be saved with PKCS11_DIGEST_STATE=1
+	hashlen = sizeof(reference);
+	rc = p11->C_DigestInit(session, &digestmech);
+	if (rc == CKR_OK) {
+		rc = p11->C_Digest(session, message, msglen, reference, &hashlen);
+	}
+
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestInit(session, &digestmech);
+	}
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestUpdate(session, message, 30);
+	}
+
+	if (rc != CKR_OK) {
+		printf("C_DigestUpdate for operation state test failed - %s\n", id2name(p11CKRName, rc, 0, namebuf));
 		goto out;
+	}
 
-	while (1) {
-		rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), keyno, &hnd);
+	statelen = sizeof(state);
+	rc = p11->C_GetOperationState(session, state, &statelen);
 
-		if (rc != CKR_OK) {
-			rc = CKR_OK;
-			break;
-		}
+	if (!optDigestState) {
+		printf("C_GetOperationState for host side digest - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_STATE_UNSAVEABLE));
+		hashlen = sizeof(hash);
+		p11->C_DigestFinal(session, hash, &hashlen);
+		goto out;
+	}
 
-		memset(iv, 0xA5, sizeof(iv));
-		mech.mechanism = CKM_AES_CBC;
-		mech.pParameter = iv;
-		mech.ulParameterLen = sizeof(iv);
+	printf("C_GetOperationState for host side digest - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		printf("Calling C_EncryptInit()");
-		rc = p11->C_EncryptInit(session, &mech, hnd);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	if (rc != CKR_OK) {
+		goto out;
+	}
 
-		printf("Calling C_Encrypt() to query cipher size");
+	rc = p11->C_SetOperationState(session2, state, statelen, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestUpdate(session2, message + 30, msglen - 30);
+	}
 
-		len = 0;
-		rc = p11->C_Encrypt(session, plain, sizeof(plain), NULL, &len);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	hashlen = sizeof(hash);
+	if (rc == CKR_OK) {
+		rc = p11->C_DigestFinal(session2, hash, &hashlen);
+	}
+	printf("C_SetOperationState and C_DigestFinal in other session - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (hashlen == sizeof(reference)) && !memcmp(hash, reference, sizeof(reference))));
+
+	// The bit count of the hash state must match the 30 bytes of pending input
+	memcpy(modified, state, statelen);
+	patchState(modified, statelen, statelen - 4 - (4 + 32 + 8 + 30) + 4 + 32 + 4, 31 * 8);
+	rc = p11->C_SetOperationState(session2, modified, statelen, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	printf("C_SetOperationState with inconsistent hash state - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SAVED_STATE_INVALID));
+
+	// A digest state must not be accepted for an operation with a context of another type
+	memcpy(modified, state, statelen);
+	patchState(modified, statelen, STATE_OFS_TYPE, STATE_OP_VERIFY);
+	patchState(modified, statelen, STATE_OFS_MECHANISM, CKM_SC_HSM_ECDSA_SHA256);
+	rc = p11->C_SetOperationState(session2, modified, statelen, CK_INVALID_HANDLE, pubhnd);
+	printf("C_SetOperationState with digest state for verification - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_SAVED_STATE_INVALID));
+
+	hashlen = sizeof(hash);
+	p11->C_DigestFinal(session, hash, &hashlen);
+
+	// Signature with a hash calculated on the host
+	rc = p11->C_SignInit(session, &hashmech, hnd);
+	if (rc == CKR_OK) {
+		rc = p11->C_SignUpdate(session, message, 30);
+	}
 
-		printf("Ciphertext size = %lu : %s\n", len, verdict(len == sizeof(plain)));
+	statelen = sizeof(state);
+	if (rc == CKR_OK) {
+		rc = p11->C_GetOperationState(session, state, &statelen);
+	}
+	printf("C_GetOperationState for C_SignUpdate with host side hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		printf("Calling C_Encrypt()");
+	if (rc == CKR_OK) {
+		rc = p11->C_SetOperationState(session2, state, statelen, CK_INVALID_HANDLE, CK_INVALID_HANDLE);
+	}
+	if (rc == CKR_OK) {
+		rc = p11->C_SignUpdate(session2, message + 30, msglen - 30);
+	}
 
-		rc = p11->C_Encrypt(session, plain, sizeof(plain), ciphertext, &len);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	len = sizeof(signature);
+	if (rc == CKR_OK) {
+		rc = p11->C_SignFinal(session2, signature, &len);
+	}
+	printf("C_SetOperationState and C_SignFinal with host side hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		bin2str(scr, sizeof(scr), ciphertext, len);
-		printf("Ciphertext:\n%s\n", scr);
+	if (rc == CKR_OK) {
+		rc = p11->C_VerifyInit(session2, &hashmech, pubhnd);
+		if (rc == CKR_OK) {
+			rc = p11->C_Verify(session2, message, msglen, signature, len);
+		}
+		printf("C_Verify for signature from restored hash state - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	}
 
-		printf("Calling C_DecryptInit()");
+	p11->C_SignFinal(session, NULL, &len);
+	len = sizeof(signature);
+	p11->C_SignFinal(session, signature, &len);
 
-		rc = p11->C_DecryptInit(session, &mech, hnd);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+out:
+	p11->C_CloseSession(session2);
+	p11->C_CloseSession(session);
+}
 
-		printf("Calling C_Decrypt() to query plaintext size");
 
-		rc = p11->C_Decrypt(session, (CK_BYTE_PTR)ciphertext, len, NULL, &len);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		printf("Plaintext size = %lu : %s\n", len, verdict(len == sizeof(plain)));
+/**
+ * Sign a message larger than the on-card hash block in parts, while a second session
+ * calls C_GenerateRandom. Tokens that hash in a command chain on the card must terminate
+ * the chain and fail the signature rather than produce an invalid one.
+ */
+void testChainedHashInterleaved(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
+{
+	CK_SESSION_HANDLE session, session2;
+	CK_OBJECT_CLASS classprk = CKO_PRIVATE_KEY;
+	CK_OBJECT_CLASS classpuk = CKO_PUBLIC_KEY;
+	CK_KEY_TYPE keyType = CKK_RSA;
+	CK_BBOOL _true = CK_TRUE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &classprk, sizeof(classprk) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) },
+			{ CKA_SIGN, &_true, sizeof(_true) }
+	};
+	CK_BYTE keyid[256];
+	CK_ATTRIBUTE puktemplate[] = {
+			{ CKA_CLASS, &classpuk, sizeof(classpuk) },
+			{ CKA_ID, keyid, sizeof(keyid) }
+	};
+	CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, 0, 0 };
+	CK_OBJECT_HANDLE hnd, pubhnd;
+	CK_BYTE message[4000], rnd[32], signature[512];
+	CK_ULONG len;
+	int rc, i;
 
-		printf("Calling C_Decrypt()");
+	for (i = 0; i < (int)sizeof(message); i++) {
+		message[i] = (CK_BYTE)i;
+	}
 
-		rc = p11->C_Decrypt(session, (CK_BYTE_PTR)ciphertext, len, ciphertext, &len);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session);
+	printf("C_OpenSession for chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		bin2str(scr, sizeof(scr), ciphertext, len);
-		printf("Plain:\n%s\n", scr);
-		printf("Verify plaintext... %s\n", verdict(memcmp(ciphertext, plain, len) == 0));
+	if (rc != CKR_OK)
+		return;
 
-		mech.mechanism = CKM_AES_CMAC;
+	rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session2);
+	printf("C_OpenSession for interleaved C_GenerateRandom - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		printf("Calling C_SignInit()");
-		rc = p11->C_SignInit(session, &mech, hnd);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	if (rc != CKR_OK) {
+		p11->C_CloseSession(session);
+		return;
+	}
 
-		printf("Calling C_Sign()");
+	rc = p11->C_Login(session, CKU_USER, pin, pinlen);
+	printf("C_Login User - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK || rc == CKR_USER_ALREADY_LOGGED_IN));
 
-		len = 0;
-		rc = p11->C_Sign(session, (CK_BYTE_PTR)tbs, (CK_ULONG)strlen(tbs), NULL, &len);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
 
-		printf("Signature size = %lu\n", len);
+	if (rc != CKR_OK) {
+		printf("No RSA signing key found, skipping chained hash test\n");
+		goto out;
+	}
 
-		len = sizeof(signature);
-		rc = p11->C_Sign(session, (CK_BYTE_PTR)tbs, (CK_ULONG)strlen(tbs), signature, &len);
-		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	rc = p11->C_GetAttributeValue(session, hnd, (CK_ATTRIBUTE_PTR)&puktemplate[1], 1);
+	printf("C_GetAttributeValue - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		bin2str(scr, sizeof(scr), signature, len);
-		printf("Signature:\n%s\n", scr);
+	rc = findObject(p11, session, (CK_ATTRIBUTE_PTR)&puktemplate, sizeof(puktemplate) / sizeof(CK_ATTRIBUTE), 0, &pubhnd);
+	printf("C_FindObject for public key - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		keyno++;
-	}
+	if (rc != CKR_OK)
+		goto out;
 
-	out:
-		printf("Closing Session %ld\n", session);
-		p11->C_CloseSession(session);
+	// The first part exceeds the hash block and opens the chain, the random request breaks it
+	rc = p11->C_SignInit(session, &mech, hnd);
+	printf("C_SignInit for chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-	return rc;
-}
+	rc = p11->C_SignUpdate(session, message, 1500);
+	printf("C_SignUpdate with 1500 bytes - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
+	rc = p11->C_GenerateRandom(session2, rnd, sizeof(rnd));
+	printf("C_GenerateRandom in second session during chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
+	rc = p11->C_SignUpdate(session, message + 1500, sizeof(message) - 1500);
+	if (rc == CKR_OK) {
+		len = sizeof(signature);
+		rc = p11->C_SignFinal(session, signature, &len);
+	} else {
+		len = sizeof(signature);
+		p11->C_SignFinal(session, signature, &len);
+	}
+	printf("C_SignUpdate/C_SignFinal after interleaved C_GenerateRandom - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK || rc == CKR_FUNCTION_FAILED));
 
-#ifndef _WIN32
-void*
-#else
-DWORD WINAPI
+#ifdef ENABLE_LIBCRYPTO
+	if (rc == CKR_OK) {
+		// A driver that buffers the input must still produce a valid signature
+		rc = p11->C_VerifyInit(session, &mech, pubhnd);
+		if (rc == CKR_OK) {
+			rc = p11->C_Verify(session, message, sizeof(message), signature, len);
+		}
+		printf("C_Verify for signature with interleaved C_GenerateRandom - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	}
 #endif
-SignThread(void *arg) {
-
-	struct thread_data *d;
-	int rc;
-
-	d = (struct thread_data *) arg;
 
-	rc = CKR_OK;
-	while (d->iterations && rc == CKR_OK) {
+	// The random request before the chain is opened must not disturb the signature
+	rc = p11->C_SignInit(session, &mech, hnd);
+	printf("C_SignInit after terminated chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SHA1_RSA_PKCS, 0);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_RSA_PKCS, 20);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SHA256_RSA_PKCS_PSS, 0);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_PSS_SHA1, 0);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSASigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_PSS_SHA256, 0);
+	rc = p11->C_SignUpdate(session, message, 17);
+	printf("C_SignUpdate with 17 bytes - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_ECDSA_SHA1);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_ECDSA);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_ECDSA_SHA224);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testECSigning(d->p11, d->slotid, d->thread_id, CKM_SC_HSM_ECDSA_SHA256);
+	rc = p11->C_GenerateRandom(session2, rnd, sizeof(rnd));
+	printf("C_GenerateRandom in second session before chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSADecryption(d->p11, d->slotid, d->thread_id, CKM_RSA_PKCS);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSADecryption(d->p11, d->slotid, d->thread_id, CKM_RSA_PKCS_OAEP);
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testRSADecryption(d->p11, d->slotid, d->thread_id, CKM_RSA_X_509);
+	rc = p11->C_SignUpdate(session, message + 17, 1500);
+	printf("C_SignUpdate with 1500 bytes - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		if ((rc == CKR_OK) && (testsfailed == 0))
-			rc = testAES(d->p11, d->slotid, d->thread_id);
+	rc = p11->C_SignUpdate(session, message + 1517, sizeof(message) - 1517);
+	printf("C_SignUpdate with remaining bytes - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		d->iterations--;
+	len = sizeof(signature);
+	rc = p11->C_SignFinal(session, signature, &len);
+	printf("C_SignFinal for chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 
-		if (testsfailed > 0) {
-			rc = CKR_CANCEL;
+#ifdef ENABLE_LIBCRYPTO
+	if (rc == CKR_OK) {
+		rc = p11->C_VerifyInit(session, &mech, pubhnd);
+		if (rc == CKR_OK) {
+			rc = p11->C_Verify(session, message, sizeof(message), signature, len);
 		}
+		printf("C_Verify for signature from chained hash - %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
 	}
+#endif
 
-	d->iterations = 0;
-	return 0;
+out:
+	p11->C_CloseSession(session2);
+	p11->C_CloseSession(session);
 }
 
 
@@ -1401,6 +2275,79 @@ void testSigningMultiThreading(CK_FUNCTION_LIST_PTR p11)
 
 
 
+/*
+ * Sign the same hash repeatedly with CKM_RSA_PKCS from two sessions. With the signature cache enabled,
+ * repeated signatures are served from the cache and must match the signature of the token
+ */
+void testSignatureCache(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID slotid)
+{
+	CK_SESSION_HANDLE session[2];
+	CK_OBJECT_CLASS classprk = CKO_PRIVATE_KEY;
+	CK_KEY_TYPE keyType = CKK_RSA;
+	CK_BBOOL _true = CK_TRUE;
+	CK_ATTRIBUTE template[] = {
+			{ CKA_CLASS, &classprk, sizeof(classprk) },
+			{ CKA_KEY_TYPE, &keyType, sizeof(keyType) },
+			{ CKA_SIGN, &_true, sizeof(_true) }
+	};
+	CK_OBJECT_HANDLE hnd;
+	CK_MECHANISM mech = { CKM_RSA_PKCS, 0, 0 };
+	CK_BYTE hash[2][20];
+	CK_BYTE signature[3][512];
+	CK_ULONG len[3];
+	int rc, i;
+
+	memset(hash[0], 0x5A, sizeof(hash[0]));
+	memset(hash[1], 0xA5, sizeof(hash[1]));
+
+	for (i = 0; i < 2; i++) {
+		rc = p11->C_OpenSession(slotid, CKF_RW_SESSION | CKF_SERIAL_SESSION, NULL, NULL, &session[i]);
+		if (rc != CKR_OK) {
+			printf("C_OpenSession for signature cache test failed\n");
+			return;
+		}
+	}
+
+	rc = p11->C_Login(session[0], CKU_USER, pin, pinlen);
+
+	if ((rc != CKR_OK) && (rc != CKR_USER_ALREADY_LOGGED_IN)) {
+		printf("C_Login for signature cache test failed\n");
+		goto out;
+	}
+
+	for (i = 0; i < 3; i++) {
+		// Find the key again in each round, as each session has its own object handle
+		rc = findObject(p11, session[i & 1], (CK_ATTRIBUTE_PTR)&template, sizeof(template) / sizeof(CK_ATTRIBUTE), 0, &hnd);
+
+		if (rc != CKR_OK) {
+			printf("No RSA key for signature cache test\n");
+			goto out;
+		}
+
+		rc = p11->C_SignInit(session[i & 1], &mech, hnd);
+
+		if (rc == CKR_OK) {
+			len[i] = sizeof(signature[i]);
+			rc = p11->C_Sign(session[i & 1], hash[i == 2], sizeof(hash[0]), signature[i], &len[i]);
+		}
+
+		printf("C_Sign #%d in session %d - %s : %s\n", i + 1, (i & 1) + 1, id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		if (rc != CKR_OK) {
+			goto out;
+		}
+	}
+
+	printf("Repeated signature matches first signature - %s\n", verdict((len[0] == len[1]) && !memcmp(signature[0], signature[1], len[0])));
+	printf("Signature of other input differs - %s\n", verdict((len[0] != len[2]) || memcmp(signature[0], signature[2], len[0])));
+
+out:
+	p11->C_CloseSession(session[1]);
+	p11->C_CloseSession(session[0]);
+}
+
+
+
 void testRandom(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 {
 	int rc;
@@ -1935,12 +2882,14 @@ void testKeyDerivation(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 
 void testDigest(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_MECHANISM_TYPE mt)
 {
-	CK_BYTE hash1[64],hash2[64];
-	CK_ULONG hashlen1, hashlen2, msglen;
+	CK_BYTE hash1[64],hash2[64],hashes[3 * 64];
+	CK_ULONG hashlen1, hashlen2, hasheslen, msglen;
 	CK_BYTE *message = (CK_BYTE *)"Hello World, read this is a hash message";
+	CK_SC_HSM_DIGEST_REQUEST batch[3];
 	CK_MECHANISM mech;
 	CK_RV rc;
 	char scr[1024];
+	int i;
 
 	msglen = (CK_ULONG)strlen((char *)message);
 
@@ -1997,6 +2946,28 @@ void testDigest(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_MECHANIS
 
 	bin2str(scr, sizeof(scr), hash2, hashlen2);
 	printf("Plain:%s - %s\n", scr, verdict(!memcmp(hash1, hash2, hashlen1)));
+
+	if (p11DigestBatch == NULL) {
+		return;
+	}
+
+	for (i = 0; i < 3; i++) {
+		batch[i].pData = message;
+		batch[i].ulDataLen = msglen;
+	}
+
+	printf("Calling C_SC_HSM_DigestBatch - query size");
+	hasheslen = 0;
+	rc = p11DigestBatch(session, &mech, batch, 3, NULL, &hasheslen);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (hasheslen == 3 * hashlen1)));
+
+	printf("Calling C_SC_HSM_DigestBatch ");
+	rc = p11DigestBatch(session, &mech, batch, 3, hashes, &hasheslen);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	for (i = 0; (rc == CKR_OK) && (i < 3); i++) {
+		printf("Hash #%d - %s\n", i, verdict(!memcmp(hash1, hashes + i * hashlen1, hashlen1)));
+	}
 }
 
 
@@ -2611,6 +3582,8 @@ void usage()
 	printf("  --fail-fast                Abort at first failed test\n");
 	printf("  --invasive                 Enable tests that change keys on the device\n");
 	printf("  --unlock-pin               Unlock PIN without setting a new value\n");
+	printf("  --signature-cache          Enable the signature cache of the module with PKCS11_SIGNATURE_CACHE\n");
+	printf("  --digest-state             Enable saveable host side hashes of the module with PKCS11_DIGEST_STATE\n");
 }
 
 
@@ -2703,6 +3676,10 @@ void decodeArgs(int argc, char **argv)
 			optUnlockPIN = 1;
 		} else if (!strcmp(*argv, "--invasive")) {
 			optTestInvasive = 1;
+		} else if (!strcmp(*argv, "--signature-cache")) {
+			optSignatureCache = 1;
+		} else if (!strcmp(*argv, "--digest-state")) {
+			optDigestState = 1;
 		} else {
 			printf("Unknown argument %s\n", *argv);
 			usage();
@@ -2735,6 +3712,15 @@ int main(int argc, char *argv[])
 
 	printf("PKCS11 unit test running.\n");
 
+#ifndef _WIN32
+	if (optSignatureCache) {
+		setenv("PKCS11_SIGNATURE_CACHE", "16", 1);
+	}
+	if (optDigestState) {
+		setenv("PKCS11_DIGEST_STATE", "1", 1);
+	}
+#endif
+
 	dlhandle = dlopen(p11libname, RTLD_NOW);
 
 	if (!dlhandle) {
@@ -2743,6 +3729,9 @@ int main(int argc, char *argv[])
 	}
 
 	C_GetFunctionList = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetFunctionList");
+	p11VerifyBatch = (CK_C_SC_HSM_VerifyBatch)dlsym(dlhandle, "C_SC_HSM_VerifyBatch");
+	p11DigestBatch = (CK_C_SC_HSM_DigestBatch)dlsym(dlhandle, "C_SC_HSM_DigestBatch");
+	p11GetAttributeValueBatch = (CK_C_SC_HSM_GetAttributeValueBatch)dlsym(dlhandle, "C_SC_HSM_GetAttributeValueBatch");
 
 	printf("Calling C_GetFunctionList ");
 
@@ -2899,6 +3888,8 @@ int main(int argc, char *argv[])
 				memset(attr, 0, sizeof(attr));
 				listObjects(p11, session, attr, 0);
 
+				testAttributeBatch(p11, session);
+
 				testRandom(p11, session);
 
 				if (optTestInvasive && !strncmp("SmartCard-HSM", (char *)tokeninfo.label, 13)) {
@@ -2913,7 +3904,22 @@ int main(int argc, char *argv[])
 
 				testAES(p11, slotid, 0);
 
+#ifdef ENABLE_LIBCRYPTO
+				testEnvelope(p11, slotid);
+#endif
+
+				testDualFunction(p11, slotid);
+
+				if (!strncmp("SmartCard-HSM", (char *)tokeninfo.label, 13)) {
+					testOperationState(p11, slotid);
+				}
+
+				if (!strncmp("Giesecke & Devrient", (char *)tokeninfo.manufacturerID, 19)) {
+					testChainedHashInterleaved(p11, slotid);
+				}
+
 				testRSASigning(p11, slotid, 0, CKM_RSA_PKCS, 20);
+				testSignatureCache(p11, slotid);
 				if (strncmp("3.5ID ECC C1 DGN", (char *)tokeninfo.model, 16)) {
 					testRSASigning(p11, slotid, 0, CKM_RSA_PKCS_PSS, 32);
 				}
@@ -2951,6 +3957,10 @@ int main(int argc, char *argv[])
 				if (!strncmp("SmartCard-HSM", (char *)tokeninfo.label, 13)) {
 					testECSigning(p11, slotid, 0, CKM_SC_HSM_ECDSA_SHA224);
 					testECSigning(p11, slotid, 0, CKM_SC_HSM_ECDSA_SHA256);
+#ifdef ENABLE_LIBCRYPTO
+					testECSigning(p11, slotid, 0, CKM_ECDSA_SHA384);
+					testECSigning(p11, slotid, 0, CKM_ECDSA_SHA512);
+#endif
 				}
 
 				printf("Calling C_CloseSession ");